@@ -0,0 +1,399 @@
+//
+// Copyright (c) Microsoft Corporation.  All rights reserved.
+//
+//
+// Use of this sample source code is subject to the terms of the Microsoft
+// license agreement under which you licensed this sample source code. If
+// you did not accept the terms of the license agreement, you are not
+// authorized to use this sample source code. For the terms of the license,
+// please see the license agreement between you and Microsoft or, if applicable,
+// see the LICENSE.RTF on your install media or the root of your tools installation.
+// THE SAMPLE SOURCE CODE IS PROVIDED "AS IS", WITH NO WARRANTIES OR INDEMNITIES.
+//
+
+//
+// This module implements the asynchronous device power APIs.  Each request
+// carries its own copy of the device name and a PM-owned completion handle,
+// so nothing refers back into the caller once the request is queued.  Workers
+// run the synchronous APIs, which keeps the two paths from drifting apart.
+//
+
+#include <pmimpl.h>
+#include <msgqueue.h>
+#include "pmasync.h"
+
+typedef enum {
+    AsyncSetDevicePower,
+    AsyncDevicePowerNotify
+} ASYNC_REQUEST_TYPE;
+
+typedef struct _ASYNC_REQUEST {
+    struct _ASYNC_REQUEST *pNext;
+    ASYNC_REQUEST_TYPE type;
+    DWORD dwRequestId;
+    DWORD dwDeviceFlags;
+    CEDEVICE_POWER_STATE dx;
+    HANDLE hCompletion;                 // PM's own handle, or NULL
+    DWORD dwCompletionFlags;
+    BOOL fActive;                       // a worker is running it
+    LPTSTR pszDevice;                   // points past the structure
+} ASYNC_REQUEST, *PASYNC_REQUEST;
+
+static CRITICAL_SECTION gcsAsync;       // protects the request queue
+static BOOL gfAsyncInitialized = FALSE;
+static DWORD gdwAsyncThreads = 0;
+static HANDLE ghtAsync[PM_ASYNC_MAX_THREADS];
+static HANDLE ghsemAsyncWork;           // released once per queued request
+static PASYNC_REQUEST gpAsyncHead;      // oldest first
+static PASYNC_REQUEST gpAsyncTail;
+static LONG glAsyncRequestId;
+
+// This routine frees a request and the completion handle it owns.
+static VOID
+AsyncRequestDestroy(PASYNC_REQUEST par)
+{
+    if(par->hCompletion != NULL) {
+        if((par->dwCompletionFlags & PM_ASYNC_COMPLETE_MSGQUEUE) != 0) {
+            CloseMsgQueue(par->hCompletion);
+        } else {
+            CloseHandle(par->hCompletion);
+        }
+    }
+    PmFree(par);
+}
+
+// This routine takes the oldest queued request whose device doesn't already
+// have a request running, so that requests for one device never overtake
+// each other.  It returns NULL if every queued request is blocked that way.
+static PASYNC_REQUEST
+AsyncRequestTake(VOID)
+{
+    PASYNC_REQUEST par, parActive;
+
+    EnterCriticalSection(&gcsAsync);
+    for(par = gpAsyncHead; par != NULL; par = par->pNext) {
+        if(par->fActive) {
+            continue;
+        }
+        for(parActive = gpAsyncHead; parActive != par; parActive = parActive->pNext) {
+            if(_tcsicmp(parActive->pszDevice, par->pszDevice) == 0) {
+                break;
+            }
+        }
+        if(parActive == par) {
+            par->fActive = TRUE;
+            break;
+        }
+    }
+    LeaveCriticalSection(&gcsAsync);
+
+    return par;
+}
+
+// This routine unlinks a finished request.  If other requests for the same
+// device were waiting on it, a worker is woken to look at them again.
+static VOID
+AsyncRequestFinish(PASYNC_REQUEST par)
+{
+    PASYNC_REQUEST *ppar, parWaiting;
+    BOOL fWake = FALSE;
+
+    EnterCriticalSection(&gcsAsync);
+    for(ppar = &gpAsyncHead; *ppar != par; ppar = &(*ppar)->pNext) {
+        DEBUGCHK(*ppar != NULL);
+    }
+    *ppar = par->pNext;
+    if(gpAsyncTail == par) {
+        gpAsyncTail = (ppar == &gpAsyncHead) ? NULL : CONTAINING_RECORD(ppar, ASYNC_REQUEST, pNext);
+    }
+    for(parWaiting = par->pNext; parWaiting != NULL; parWaiting = parWaiting->pNext) {
+        if(_tcsicmp(parWaiting->pszDevice, par->pszDevice) == 0) {
+            fWake = TRUE;
+            break;
+        }
+    }
+    LeaveCriticalSection(&gcsAsync);
+
+    if(fWake) {
+        ReleaseSemaphore(ghsemAsyncWork, 1, NULL);
+    }
+}
+
+// This routine runs a request and tells its owner how it went.
+static VOID
+AsyncRequestRun(PASYNC_REQUEST par)
+{
+    PM_ASYNC_COMPLETION pac;
+    DWORD dwGetFlags = par->dwDeviceFlags & ~POWER_FORCE;
+    SETFNAME(_T("AsyncRequestRun"));
+
+    pac.dwRequestId = par->dwRequestId;
+    if(par->type == AsyncSetDevicePower) {
+        pac.dwStatus = PmSetDevicePower(par->pszDevice, par->dwDeviceFlags, par->dx);
+    } else {
+        pac.dwStatus = PmDevicePowerNotify(par->pszDevice, par->dx, par->dwDeviceFlags);
+    }
+    if(PmGetDevicePower(par->pszDevice, dwGetFlags, &pac.finalDx) != ERROR_SUCCESS) {
+        pac.finalDx = PwrDeviceUnspecified;
+    }
+
+    PMLOGMSG(ZONE_DEVICE, (_T("%s: request %u for '%s' finished, status %d, D%d\r\n"),
+        pszFname, par->dwRequestId, par->pszDevice, pac.dwStatus, pac.finalDx));
+
+    if((par->dwCompletionFlags & PM_ASYNC_COMPLETE_MSGQUEUE) != 0) {
+        if(!WriteMsgQueue(par->hCompletion, &pac, sizeof(pac), 0, 0)) {
+            PMLOGMSG(ZONE_WARN, (_T("%s: WriteMsgQueue() failed %d for request %u\r\n"),
+                pszFname, GetLastError(), par->dwRequestId));
+        }
+    } else if((par->dwCompletionFlags & PM_ASYNC_COMPLETE_EVENT) != 0) {
+        SetEvent(par->hCompletion);
+    }
+}
+
+// this thread carries out queued requests
+static DWORD WINAPI
+AsyncThreadProc(LPVOID lpvParam)
+{
+    HANDLE hEvents[2] = { ghevPmShutdown, ghsemAsyncWork };
+    SETFNAME(_T("AsyncThreadProc"));
+
+    UNREFERENCED_PARAMETER(lpvParam);
+
+    for(;;) {
+        DWORD dwStatus = WaitForMultipleObjects(_countof(hEvents), hEvents, FALSE, INFINITE);
+        if(dwStatus != (WAIT_OBJECT_0 + 1)) {
+            break;
+        }
+
+        PASYNC_REQUEST par = AsyncRequestTake();
+        if(par == NULL) {
+            // everything queued is waiting for a device that's busy; whoever
+            // finishes with that device will wake us up again
+            continue;
+        }
+        AsyncRequestRun(par);
+        AsyncRequestFinish(par);
+        AsyncRequestDestroy(par);
+    }
+
+    PMLOGMSG(ZONE_INIT, (_T("%s: thread 0x%08x exiting\r\n"), pszFname, GetCurrentThreadId()));
+    return 0;
+}
+
+// This routine validates and queues a request on behalf of a caller.
+static DWORD
+AsyncRequestQueue(ASYNC_REQUEST_TYPE type, PVOID pvDevice, DWORD dwDeviceFlags,
+                  CEDEVICE_POWER_STATE dx, HANDLE hCompletion, DWORD dwCompletionFlags,
+                  PDWORD pdwRequestId)
+{
+    DWORD dwStatus = ERROR_SUCCESS;
+    PASYNC_REQUEST par = NULL;
+    HANDLE hOwner = (HANDLE) GetCallerVMProcessId();
+    SETFNAME(_T("AsyncRequestQueue"));
+
+    if(!gfAsyncInitialized || gdwAsyncThreads == 0) {
+        dwStatus = ERROR_SERVICE_NOT_ACTIVE;
+    } else if(pvDevice == NULL 
+    || (dwDeviceFlags & POWER_NAME) == 0
+    || (dwCompletionFlags & ~(PM_ASYNC_COMPLETE_EVENT | PM_ASYNC_COMPLETE_MSGQUEUE)) != 0
+    || dwCompletionFlags == (PM_ASYNC_COMPLETE_EVENT | PM_ASYNC_COMPLETE_MSGQUEUE)
+    || (dwCompletionFlags != PM_ASYNC_COMPLETE_NONE && hCompletion == NULL)) {
+        dwStatus = ERROR_INVALID_PARAMETER;
+    }
+
+    // copy the device name so the caller's buffer can go away
+    if(dwStatus == ERROR_SUCCESS) {
+        __try {
+            DWORD dwChars = _tcslen((LPCTSTR) pvDevice) + 1;
+            par = (PASYNC_REQUEST) PmAlloc(sizeof(*par) + (dwChars * sizeof(TCHAR)));
+            if(par == NULL) {
+                dwStatus = ERROR_NOT_ENOUGH_MEMORY;
+            } else {
+                memset(par, 0, sizeof(*par));
+                par->pszDevice = (LPTSTR) ((LPBYTE) par + sizeof(*par));
+                VERIFY(SUCCEEDED(StringCchCopy(par->pszDevice, dwChars, (LPCTSTR) pvDevice)));
+            }
+        }
+        __except(EXCEPTION_EXECUTE_HANDLER) {
+            dwStatus = ERROR_INVALID_PARAMETER;
+        }
+    }
+
+    // get our own handle to the completion object
+    if(dwStatus == ERROR_SUCCESS && dwCompletionFlags == PM_ASYNC_COMPLETE_MSGQUEUE) {
+        MSGQUEUEOPTIONS msgopts;
+        memset(&msgopts, 0, sizeof(msgopts));
+        msgopts.dwSize = sizeof(msgopts);
+        msgopts.bReadAccess = FALSE;
+        par->hCompletion = OpenMsgQueue(hOwner, hCompletion, &msgopts);
+        if(par->hCompletion == NULL) {
+            dwStatus = ERROR_INVALID_HANDLE;
+        }
+    } else if(dwStatus == ERROR_SUCCESS && dwCompletionFlags == PM_ASYNC_COMPLETE_EVENT) {
+        HANDLE hProcess = OpenProcess(0, FALSE, (DWORD) hOwner);
+        if(hProcess == NULL
+        || !DuplicateHandle(hProcess, hCompletion, GetCurrentProcess(), &par->hCompletion,
+            0, FALSE, DUPLICATE_SAME_ACCESS)) {
+            par->hCompletion = NULL;
+            dwStatus = ERROR_INVALID_HANDLE;
+        }
+        if(hProcess != NULL) CloseHandle(hProcess);
+    }
+
+    if(dwStatus == ERROR_SUCCESS) {
+        par->type = type;
+        par->dwDeviceFlags = dwDeviceFlags;
+        par->dx = dx;
+        par->dwCompletionFlags = dwCompletionFlags;
+        par->dwRequestId = (DWORD) InterlockedIncrement(&glAsyncRequestId);
+        __try {
+            if(pdwRequestId != NULL) *pdwRequestId = par->dwRequestId;
+        }
+        __except(EXCEPTION_EXECUTE_HANDLER) {
+            dwStatus = ERROR_INVALID_PARAMETER;
+        }
+    }
+
+    if(dwStatus == ERROR_SUCCESS) {
+        EnterCriticalSection(&gcsAsync);
+        if(gpAsyncTail == NULL) {
+            gpAsyncHead = par;
+        } else {
+            gpAsyncTail->pNext = par;
+        }
+        gpAsyncTail = par;
+        LeaveCriticalSection(&gcsAsync);
+        ReleaseSemaphore(ghsemAsyncWork, 1, NULL);
+    } else if(par != NULL) {
+        AsyncRequestDestroy(par);
+    }
+
+    PMLOGMSG(dwStatus != ERROR_SUCCESS && ZONE_WARN, (_T("%s: returning %d\r\n"),
+        pszFname, dwStatus));
+    return dwStatus;
+}
+
+// This routine is an asynchronous version of PmSetDevicePower().  The device
+// must be named (POWER_NAME).  It returns ERROR_SUCCESS once the request is
+// queued; the outcome is reported through the completion handle.
+EXTERN_C DWORD WINAPI 
+PmSetDevicePowerAsync(PVOID pvDevice, DWORD dwDeviceFlags, CEDEVICE_POWER_STATE newDx,
+                      HANDLE hCompletion, DWORD dwCompletionFlags, PDWORD pdwRequestId)
+{
+    DWORD dwStatus;
+    SETFNAME(_T("PmSetDevicePowerAsync"));
+
+    PMLOGMSG(ZONE_API, (_T("+%s: new Dx %d, flags 0x%08x, completion 0x%08x/0x%x\r\n"),
+        pszFname, newDx, dwDeviceFlags, hCompletion, dwCompletionFlags));
+
+    if((newDx < D0 || newDx > D4) && newDx != PwrDeviceUnspecified) {
+        dwStatus = ERROR_INVALID_PARAMETER;
+    } else {
+        dwStatus = AsyncRequestQueue(AsyncSetDevicePower, pvDevice, dwDeviceFlags, newDx,
+            hCompletion, dwCompletionFlags, pdwRequestId);
+    }
+
+    PMLOGMSG(ZONE_API, (_T("-%s: returning %d\r\n"), pszFname, dwStatus));
+    return dwStatus;
+}
+
+// This routine is an asynchronous version of PmDevicePowerNotify().  The
+// device must be named (POWER_NAME).
+EXTERN_C DWORD WINAPI 
+PmDevicePowerNotifyAsync(PVOID pvDevice, CEDEVICE_POWER_STATE reqDx, DWORD dwDeviceFlags,
+                         HANDLE hCompletion, DWORD dwCompletionFlags, PDWORD pdwRequestId)
+{
+    DWORD dwStatus;
+    SETFNAME(_T("PmDevicePowerNotifyAsync"));
+
+    PMLOGMSG(ZONE_API, (_T("+%s: req Dx %d, flags 0x%08x, completion 0x%08x/0x%x\r\n"),
+        pszFname, reqDx, dwDeviceFlags, hCompletion, dwCompletionFlags));
+
+    if(reqDx < D0 || reqDx > D4) {
+        dwStatus = ERROR_INVALID_PARAMETER;
+    } else {
+        dwStatus = AsyncRequestQueue(AsyncDevicePowerNotify, pvDevice, dwDeviceFlags, reqDx,
+            hCompletion, dwCompletionFlags, pdwRequestId);
+    }
+
+    PMLOGMSG(ZONE_API, (_T("-%s: returning %d\r\n"), pszFname, dwStatus));
+    return dwStatus;
+}
+
+// This routine reads the pool size from the registry and starts the dispatch
+// threads.  If no threads can be started the async APIs fail with
+// ERROR_SERVICE_NOT_ACTIVE, but the PM still runs.
+BOOL
+DeviceAsyncInit(VOID)
+{
+    DWORD dwThreads = PM_ASYNC_DEFAULT_THREADS;
+    DWORD dwIndex;
+    HKEY hkPm;
+    SETFNAME(_T("DeviceAsyncInit"));
+
+    DEBUGCHK(!gfAsyncInitialized);
+
+    if(RegOpenKeyEx(HKEY_LOCAL_MACHINE, PWRMGR_REG_KEY, 0, 0, &hkPm) == ERROR_SUCCESS) {
+        DWORD dwValue;
+        DWORD dwSize = sizeof(dwValue);
+        if(RegQueryTypedValue(hkPm, PM_ASYNC_THREADS_VALUE, &dwValue, &dwSize, REG_DWORD) == ERROR_SUCCESS) {
+            dwThreads = dwValue;
+        }
+        RegCloseKey(hkPm);
+    }
+    if(dwThreads > PM_ASYNC_MAX_THREADS) {
+        dwThreads = PM_ASYNC_MAX_THREADS;
+    }
+
+    InitializeCriticalSection(&gcsAsync);
+    gpAsyncHead = gpAsyncTail = NULL;
+    gdwAsyncThreads = 0;
+    memset(ghtAsync, 0, sizeof(ghtAsync));
+
+    ghsemAsyncWork = CreateSemaphore(NULL, 0, MAXLONG, NULL);
+    if(ghsemAsyncWork == NULL) {
+        PMLOGMSG(ZONE_WARN, (_T("%s: couldn't create work semaphore\r\n"), pszFname));
+        dwThreads = 0;
+    }
+
+    for(dwIndex = 0; dwIndex < dwThreads; dwIndex++) {
+        ghtAsync[dwIndex] = CreateThread(NULL, 0, AsyncThreadProc, NULL, 0, NULL);
+        if(ghtAsync[dwIndex] == NULL) {
+            PMLOGMSG(ZONE_WARN, (_T("%s: CreateThread() failed %d\r\n"), pszFname,
+                GetLastError()));
+            break;
+        }
+        gdwAsyncThreads++;
+    }
+    gfAsyncInitialized = TRUE;
+
+    PMLOGMSG(ZONE_INIT, (_T("%s: %u dispatch threads\r\n"), pszFname, gdwAsyncThreads));
+    return TRUE;
+}
+
+// This routine waits for the dispatch threads to exit and discards any
+// requests they didn't get to.  The caller must have signaled ghevPmShutdown.
+VOID
+DeviceAsyncDeinit(VOID)
+{
+    DWORD dwIndex;
+
+    if(gfAsyncInitialized) {
+        for(dwIndex = 0; dwIndex < gdwAsyncThreads; dwIndex++) {
+            WaitForSingleObject(ghtAsync[dwIndex], INFINITE);
+            CloseHandle(ghtAsync[dwIndex]);
+            ghtAsync[dwIndex] = NULL;
+        }
+        gdwAsyncThreads = 0;
+        while(gpAsyncHead != NULL) {
+            PASYNC_REQUEST par = gpAsyncHead;
+            gpAsyncHead = par->pNext;
+            AsyncRequestDestroy(par);
+        }
+        gpAsyncTail = NULL;
+        if(ghsemAsyncWork != NULL) CloseHandle(ghsemAsyncWork);
+        ghsemAsyncWork = NULL;
+        DeleteCriticalSection(&gcsAsync);
+        gfAsyncInitialized = FALSE;
+    }
+}
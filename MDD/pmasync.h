@@ -0,0 +1,61 @@
+//
+// Copyright (c) Microsoft Corporation.  All rights reserved.
+//
+//
+// Use of this sample source code is subject to the terms of the Microsoft
+// license agreement under which you licensed this sample source code. If
+// you did not accept the terms of the license agreement, you are not
+// authorized to use this sample source code. For the terms of the license,
+// please see the license agreement between you and Microsoft or, if applicable,
+// see the LICENSE.RTF on your install media or the root of your tools installation.
+// THE SAMPLE SOURCE CODE IS PROVIDED "AS IS", WITH NO WARRANTIES OR INDEMNITIES.
+//
+
+//
+// This module declares asynchronous versions of PmSetDevicePower() and
+// PmDevicePowerNotify().  Requests are queued to a small pool of PM threads
+// and the caller returns at once; when the request finishes the PM signals
+// the caller's event or posts a PM_ASYNC_COMPLETION to the caller's message
+// queue.  Requests for the same device are carried out in the order they
+// were made.
+//
+
+#ifndef __PMASYNC_H
+#define __PMASYNC_H
+
+#include <pmimpl.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// registry value under PWRMGR_REG_KEY that sizes the dispatch pool
+#define PM_ASYNC_THREADS_VALUE      _T("AsyncThreads")
+#define PM_ASYNC_DEFAULT_THREADS    2
+#define PM_ASYNC_MAX_THREADS        8
+
+// how the caller wants to hear about completion
+#define PM_ASYNC_COMPLETE_NONE      0x00000000
+#define PM_ASYNC_COMPLETE_EVENT     0x00000001  // hCompletion is an event
+#define PM_ASYNC_COMPLETE_MSGQUEUE  0x00000002  // hCompletion is a message queue
+
+// posted to the caller's message queue when a request finishes
+typedef struct _PM_ASYNC_COMPLETION {
+    DWORD dwRequestId;                  // as returned when the request was queued
+    DWORD dwStatus;                     // what the synchronous API would have returned
+    CEDEVICE_POWER_STATE finalDx;       // device state afterwards, if known
+} PM_ASYNC_COMPLETION, *PPM_ASYNC_COMPLETION;
+
+BOOL DeviceAsyncInit(VOID);
+VOID DeviceAsyncDeinit(VOID);
+
+DWORD WINAPI PmSetDevicePowerAsync(PVOID pvDevice, DWORD dwDeviceFlags, CEDEVICE_POWER_STATE newDx,
+    HANDLE hCompletion, DWORD dwCompletionFlags, PDWORD pdwRequestId);
+DWORD WINAPI PmDevicePowerNotifyAsync(PVOID pvDevice, CEDEVICE_POWER_STATE reqDx, DWORD dwDeviceFlags,
+    HANDLE hCompletion, DWORD dwCompletionFlags, PDWORD pdwRequestId);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
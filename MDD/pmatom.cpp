@@ -0,0 +1,202 @@
+//
+// Copyright (c) Microsoft Corporation.  All rights reserved.
+//
+//
+// Use of this sample source code is subject to the terms of the Microsoft
+// license agreement under which you licensed this sample source code. If
+// you did not accept the terms of the license agreement, you are not
+// authorized to use this sample source code. For the terms of the license,
+// please see the license agreement between you and Microsoft or, if applicable,
+// see the LICENSE.RTF on your install media or the root of your tools installation.
+// THE SAMPLE SOURCE CODE IS PROVIDED "AS IS", WITH NO WARRANTIES OR INDEMNITIES.
+//
+
+//
+// This module contains the PM atom table.  Each atom is a reference counted,
+// immutable copy of a string.  Callers that want case insensitive matching
+// pass fLowerCase, which folds the string to lower case before it is hashed,
+// compared or stored.  The table is protected by the PM lock.
+//
+
+#include <pmimpl.h>
+#include "pmatom.h"
+
+#define ATOM_BUCKETS            64              // must be a power of two
+
+typedef struct _PM_ATOM {
+    struct _PM_ATOM *pNext;
+    DWORD dwHash;
+    DWORD dwRefCount;
+    TCHAR szString[1];                          // variable length
+} PM_ATOM, *PPM_ATOM;
+
+static PPM_ATOM gpAtoms[ATOM_BUCKETS];
+
+// FNV-1a hash of a string, optionally folded to lower case
+static DWORD
+AtomHash(LPCTSTR pszString, BOOL fLowerCase)
+{
+    DWORD dwHash = 2166136261;
+
+    while(*pszString != 0) {
+        TCHAR ch = *pszString++;
+        if(fLowerCase) {
+            ch = _totlower(ch);
+        }
+        dwHash ^= (DWORD) ch;
+        dwHash *= 16777619;
+    }
+    return dwHash;
+}
+
+// This routine compares a caller's string with an atom's string.
+static BOOL
+AtomMatches(PPM_ATOM pAtom, LPCTSTR pszString, BOOL fLowerCase)
+{
+    LPCTSTR pszAtom = pAtom->szString;
+
+    while(*pszString != 0) {
+        TCHAR ch = *pszString++;
+        if(fLowerCase) {
+            ch = _totlower(ch);
+        }
+        if(ch != *pszAtom++) {
+            return FALSE;
+        }
+    }
+    return *pszAtom == 0;
+}
+
+// This routine looks up a string's atom.  The caller must hold the PM lock.
+static PPM_ATOM
+AtomLookup(LPCTSTR pszString, BOOL fLowerCase, DWORD dwHash)
+{
+    PPM_ATOM pAtom;
+
+    for(pAtom = gpAtoms[dwHash & (ATOM_BUCKETS - 1)]; pAtom != NULL; pAtom = pAtom->pNext) {
+        if(pAtom->dwHash == dwHash && AtomMatches(pAtom, pszString, fLowerCase)) {
+            break;
+        }
+    }
+    return pAtom;
+}
+
+// This routine returns the atom for a string, creating it if necessary, and
+// adds a reference to it.  It returns NULL if it can't allocate memory or
+// if pszString is invalid.  Each successful call must be balanced by a call
+// to PmAtomRelease().
+LPCTSTR
+PmAtomAdd(LPCTSTR pszString, BOOL fLowerCase)
+{
+    PPM_ATOM pAtom = NULL;
+    SETFNAME(_T("PmAtomAdd"));
+
+    if(pszString == NULL) {
+        return NULL;
+    }
+
+    PMLOCK();
+
+    __try {
+        DWORD dwHash = AtomHash(pszString, fLowerCase);
+        pAtom = AtomLookup(pszString, fLowerCase, dwHash);
+        if(pAtom != NULL) {
+            pAtom->dwRefCount++;
+        } else {
+            DWORD cchString = _tcslen(pszString);
+            pAtom = (PPM_ATOM) PmAlloc(sizeof(*pAtom) + cchString * sizeof(pszString[0]));
+            if(pAtom != NULL) {
+                for(DWORD dwIndex = 0; dwIndex < cchString; dwIndex++) {
+                    pAtom->szString[dwIndex] = fLowerCase ? _totlower(pszString[dwIndex]) : pszString[dwIndex];
+                }
+                pAtom->szString[cchString] = 0;
+                pAtom->dwHash = dwHash;
+                pAtom->dwRefCount = 1;
+                pAtom->pNext = gpAtoms[dwHash & (ATOM_BUCKETS - 1)];
+                gpAtoms[dwHash & (ATOM_BUCKETS - 1)] = pAtom;
+            }
+        }
+    }
+    __except(EXCEPTION_EXECUTE_HANDLER) {
+        PMLOGMSG(ZONE_WARN, (_T("%s: exception accessing string 0x%08x\r\n"),
+            pszFname, pszString));
+        pAtom = NULL;
+    }
+
+    PMUNLOCK();
+
+    PMLOGMSG(pAtom == NULL && ZONE_WARN, (_T("%s: couldn't create atom\r\n"), pszFname));
+    return pAtom != NULL ? pAtom->szString : NULL;
+}
+
+// This routine returns the atom for a string without adding a reference, or
+// NULL if the string has never been interned.  A NULL return means that the
+// string can't be equal to any atom.  The returned pointer may only be used
+// for comparisons.
+LPCTSTR
+PmAtomFind(LPCTSTR pszString, BOOL fLowerCase)
+{
+    PPM_ATOM pAtom = NULL;
+    SETFNAME(_T("PmAtomFind"));
+
+    if(pszString == NULL) {
+        return NULL;
+    }
+
+    PMLOCK();
+
+    __try {
+        pAtom = AtomLookup(pszString, fLowerCase, AtomHash(pszString, fLowerCase));
+    }
+    __except(EXCEPTION_EXECUTE_HANDLER) {
+        PMLOGMSG(ZONE_WARN, (_T("%s: exception accessing string 0x%08x\r\n"),
+            pszFname, pszString));
+        pAtom = NULL;
+    }
+
+    PMUNLOCK();
+
+    return pAtom != NULL ? pAtom->szString : NULL;
+}
+
+// This routine releases a reference to an atom returned by PmAtomAdd() and
+// frees the atom when its last reference goes away.
+VOID
+PmAtomRelease(LPCTSTR pszAtom)
+{
+    PPM_ATOM pAtom, *ppAtom;
+    SETFNAME(_T("PmAtomRelease"));
+
+    if(pszAtom == NULL) {
+        return;
+    }
+
+    PMLOCK();
+
+    // atoms are stored exactly as they hash, so no folding is needed here
+    DWORD dwHash = AtomHash(pszAtom, FALSE);
+    for(ppAtom = &gpAtoms[dwHash & (ATOM_BUCKETS - 1)]; *ppAtom != NULL; ppAtom = &(*ppAtom)->pNext) {
+        if((*ppAtom)->szString == pszAtom) {
+            break;
+        }
+    }
+    pAtom = *ppAtom;
+    DEBUGCHK(pAtom != NULL);
+    if(pAtom != NULL) {
+        DEBUGCHK(pAtom->dwRefCount > 0);
+        pAtom->dwRefCount--;
+        if(pAtom->dwRefCount == 0) {
+            *ppAtom = pAtom->pNext;
+        } else {
+            pAtom = NULL;
+        }
+    } else {
+        PMLOGMSG(ZONE_WARN, (_T("%s: 0x%08x is not an atom\r\n"), pszFname, pszAtom));
+    }
+
+    PMUNLOCK();
+
+    if(pAtom != NULL) {
+        PmFree(pAtom);
+    }
+}
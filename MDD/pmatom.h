@@ -0,0 +1,38 @@
+//
+// Copyright (c) Microsoft Corporation.  All rights reserved.
+//
+//
+// Use of this sample source code is subject to the terms of the Microsoft
+// license agreement under which you licensed this sample source code. If
+// you did not accept the terms of the license agreement, you are not
+// authorized to use this sample source code. For the terms of the license,
+// please see the license agreement between you and Microsoft or, if applicable,
+// see the LICENSE.RTF on your install media or the root of your tools installation.
+// THE SAMPLE SOURCE CODE IS PROVIDED "AS IS", WITH NO WARRANTIES OR INDEMNITIES.
+//
+
+//
+// This module declares the PM atom table.  Strings that the PM compares
+// often, such as system power state names and the device names in power
+// restrictions, are interned once so that later comparisons are pointer
+// compares.  Two atoms are equal if and only if their pointers are equal.
+//
+
+#ifndef __PMATOM_H
+#define __PMATOM_H
+
+#include <pmimpl.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+LPCTSTR PmAtomAdd(LPCTSTR pszString, BOOL fLowerCase);
+LPCTSTR PmAtomFind(LPCTSTR pszString, BOOL fLowerCase);
+VOID PmAtomRelease(LPCTSTR pszAtom);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,70 @@
+//
+// Copyright (c) Microsoft Corporation.  All rights reserved.
+//
+//
+// Use of this sample source code is subject to the terms of the Microsoft
+// license agreement under which you licensed this sample source code. If
+// you did not accept the terms of the license agreement, you are not
+// authorized to use this sample source code. For the terms of the license,
+// please see the license agreement between you and Microsoft or, if applicable,
+// see the LICENSE.RTF on your install media or the root of your tools installation.
+// THE SAMPLE SOURCE CODE IS PROVIDED "AS IS", WITH NO WARRANTIES OR INDEMNITIES.
+//
+
+//
+// This module declares the batched IOCTL_POWER_SET protocol.  A parent
+// driver that sets POWER_CAP_BATCH in its POWER_CAPABILITIES flags accepts
+// IOCTL_POWER_SET_BATCH, which carries the target power state of several of
+// its children in one call.  The input buffer is a POWER_BATCH_SET header
+// followed by dwEntries POWER_BATCH_ENTRY structures; the output buffer is
+// an array of dwEntries POWER_BATCH_RESULT structures in the same order.
+// The driver may sequence the children however it likes.
+//
+// A child whose result isn't ERROR_SUCCESS with the requested state is
+// left alone, and the PM sends it an ordinary IOCTL_POWER_SET later in the
+// same update.  Parents without the flag never see the new control code.
+//
+
+#ifndef __PMBATCH_H
+#define __PMBATCH_H
+
+#include <pmimpl.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define POWER_CAP_BATCH             0x00010000
+#define IOCTL_POWER_SET_BATCH       CTL_CODE(FILE_DEVICE_POWER, 0x440, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define POWER_BATCH_VERSION         1
+#define POWER_BATCH_MAX_ENTRIES     64
+
+typedef struct _POWER_BATCH_ENTRY {
+    HANDLE hChild;                      // as in POWER_RELATIONSHIP
+    LPCWSTR pwsChild;
+    CEDEVICE_POWER_STATE reqDx;
+} POWER_BATCH_ENTRY, *PPOWER_BATCH_ENTRY;
+
+typedef struct _POWER_BATCH_SET {
+    DWORD dwVersion;                    // POWER_BATCH_VERSION
+    HANDLE hParent;
+    LPCWSTR pwsParent;
+    DWORD dwEntries;
+    POWER_BATCH_ENTRY Entries[1];
+} POWER_BATCH_SET, *PPOWER_BATCH_SET;
+
+typedef struct _POWER_BATCH_RESULT {
+    DWORD dwStatus;
+    CEDEVICE_POWER_STATE newDx;         // the state the child is now in
+} POWER_BATCH_RESULT, *PPOWER_BATCH_RESULT;
+
+#define POWER_BATCH_SET_SIZE(n)     (offsetof(POWER_BATCH_SET, Entries) + (n) * sizeof(POWER_BATCH_ENTRY))
+
+DWORD SetChildDevicesPower(PDEVICE_STATE pdsParent, PDEVICE_STATE *ppdsChildren, DWORD dwChildren);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
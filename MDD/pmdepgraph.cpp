@@ -0,0 +1,403 @@
+//
+// Copyright (c) Microsoft Corporation.  All rights reserved.
+//
+//
+// Use of this sample source code is subject to the terms of the Microsoft
+// license agreement under which you licensed this sample source code. If
+// you did not accept the terms of the license agreement, you are not
+// authorized to use this sample source code. For the terms of the license,
+// please see the license agreement between you and Microsoft or, if applicable,
+// see the LICENSE.RTF on your install media or the root of your tools installation.
+// THE SAMPLE SOURCE CODE IS PROVIDED "AS IS", WITH NO WARRANTIES OR INDEMNITIES.
+//
+
+//
+// This module builds device power dependency graphs.  Every device in a
+// batch becomes a node.  Devices are grouped by the rank of their class and
+// the groups are separated by barrier nodes, so a whole class rank finishes
+// before the next one starts.  Within a rank, a device depends on its
+// nearest ancestor of the same rank in the batch:  the ancestor goes first
+// when power is going up and last when power is going down.
+//
+
+#include <pmimpl.h>
+#include "pmdepgraph.h"
+#include "pmplan.h"
+#include "pmdxword.h"
+#include "pmdevindex.h"
+
+// limits how far we follow parent pointers when looking for a predecessor
+#define DEVGRAPH_MAX_DEPTH          32
+
+typedef struct _CLASS_RANK {
+    GUID guidClass;
+    DWORD dwRank;
+} CLASS_RANK, *PCLASS_RANK;
+
+// The class rank table is only written during PM initialization, before
+// any graphs are built, so it doesn't need a lock.
+static CLASS_RANK gClassRanks[DEVGRAPH_MAX_CLASS_RANKS];
+static DWORD gdwClassRanks = 0;
+static DWORD gdwGraphMark = 0;          // protected by the PM lock
+
+// This routine assigns a rank to a device class, replacing any rank it
+// already has.
+VOID
+DeviceGraphSetClassRank(LPCGUID pGuid, DWORD dwRank)
+{
+    DWORD dwIndex;
+    SETFNAME(_T("DeviceGraphSetClassRank"));
+
+    PREFAST_DEBUGCHK(pGuid != NULL);
+
+    for(dwIndex = 0; dwIndex < gdwClassRanks; dwIndex++) {
+        if(gClassRanks[dwIndex].guidClass == *pGuid) {
+            break;
+        }
+    }
+    if(dwIndex == gdwClassRanks) {
+        if(gdwClassRanks == _countof(gClassRanks)) {
+            PMLOGMSG(ZONE_WARN, (_T("%s: class rank table is full\r\n"), pszFname));
+            return;
+        }
+        gClassRanks[dwIndex].guidClass = *pGuid;
+        gdwClassRanks++;
+    }
+    gClassRanks[dwIndex].dwRank = dwRank;
+
+    PMLOGMSG(ZONE_INIT || ZONE_DEVICE,
+        (_T("%s: class %08x-%04x-%04x-%04x-%02x%02x%02x%02x%02x%02x has rank %u\r\n"),
+        pszFname, pGuid->Data1, pGuid->Data2, pGuid->Data3,
+        (pGuid->Data4[0] << 8) + pGuid->Data4[1], pGuid->Data4[2], pGuid->Data4[3],
+        pGuid->Data4[4], pGuid->Data4[5], pGuid->Data4[6], pGuid->Data4[7], dwRank));
+}
+
+// This routine returns the rank of a device class.
+DWORD
+DeviceGraphGetClassRank(LPCGUID pGuid)
+{
+    DWORD dwIndex;
+
+    PREFAST_DEBUGCHK(pGuid != NULL);
+
+    for(dwIndex = 0; dwIndex < gdwClassRanks; dwIndex++) {
+        if(gClassRanks[dwIndex].guidClass == *pGuid) {
+            return gClassRanks[dwIndex].dwRank;
+        }
+    }
+    return DEVGRAPH_DEFAULT_RANK;
+}
+
+// This routine reads OEM class ranks from the registry.  Registry settings
+// override any rules the platform has established, so it should be called
+// after the device lists have been initialized.
+BOOL
+DeviceGraphInit(VOID)
+{
+    HKEY hk;
+    TCHAR szBuf[MAX_PATH];
+    SETFNAME(_T("DeviceGraphInit"));
+
+    VERIFY(SUCCEEDED(StringCchPrintf(szBuf, _countof(szBuf), _T("%s\\%s"),
+        PWRMGR_REG_KEY, PM_CLASS_ORDER_KEY)));
+    if(RegOpenKeyEx(HKEY_LOCAL_MACHINE, szBuf, 0, 0, &hk) == ERROR_SUCCESS) {
+        DWORD dwIndex = 0;
+        DWORD dwStatus;
+        do {
+            DWORD cchValueName = _countof(szBuf), dwType, dwRank;
+            DWORD dwSize = sizeof(dwRank);
+            GUID idClass;
+
+            dwStatus = RegEnumValue(hk, dwIndex, szBuf, &cchValueName, NULL,
+                &dwType, (LPBYTE) &dwRank, &dwSize);
+            if(dwStatus == ERROR_SUCCESS) {
+                if(dwType != REG_DWORD) {
+                    PMLOGMSG(ZONE_WARN, (_T("%s: invalid type for value '%s'\r\n"),
+                        pszFname, szBuf));
+                } else if(!ConvertStringToGuid(szBuf, &idClass)) {
+                    PMLOGMSG(ZONE_WARN, (_T("%s: can't convert '%s' to GUID\r\n"),
+                        pszFname, szBuf));
+                } else {
+                    DeviceGraphSetClassRank(&idClass, dwRank);
+                }
+                dwIndex++;
+            }
+        } while(dwStatus == ERROR_SUCCESS);
+        RegCloseKey(hk);
+    }
+
+    return TRUE;
+}
+
+// adds an edge meaning "dwTo can't start until dwFrom is done"
+static VOID
+DeviceGraphAddEdge(PDEVICE_GRAPH pg, DWORD dwFrom, DWORD dwTo)
+{
+    DWORD dwEdge = pg->dwEdges++;
+
+    pg->pEdges[dwEdge].dwTo = dwTo;
+    pg->pEdges[dwEdge].dwNext = pg->pNodes[dwFrom].dwFirstEdge;
+    pg->pNodes[dwFrom].dwFirstEdge = dwEdge;
+    pg->pNodes[dwTo].dwPending++;
+}
+
+// This routine creates the edges of a graph whose nodes have been filled in.
+// Barrier N sits between rank groups N and N + 1.  If fParentEdges is set,
+// each device is also linked to its nearest ancestor in the graph that is in
+// the same group; ancestors in other groups are already ordered by the
+// barriers, which is only right if the ancestor's group is the lower one:
+// the barriers run lower groups first when power is going up and last when
+// it is going down.  An ancestor in a higher group is updated on the wrong
+// side of the device, and that is logged.  The caller must hold the PM lock.
+static VOID
+DeviceGraphLink(PDEVICE_GRAPH pg, DWORD dwRanks, BOOL fParentEdges)
+{
+    DWORD dwDevices = pg->dwDevices;
+    DWORD dwIndex, dwGroup;
+    SETFNAME(_T("DeviceGraphLink"));
+
+    pg->dwEdges = 0;
+    for(dwIndex = 0; dwIndex < pg->dwNodes; dwIndex++) {
+        pg->pNodes[dwIndex].dwPending = 0;
+        pg->pNodes[dwIndex].dwFirstEdge = DEVGRAPH_NO_EDGE;
+    }
+
+    for(dwIndex = 0; dwIndex < dwDevices; dwIndex++) {
+        dwGroup = pg->pNodes[dwIndex].dwRank;
+        if(pg->fPowerUp) {
+            if(dwGroup > 0) {
+                DeviceGraphAddEdge(pg, dwDevices + dwGroup - 1, dwIndex);
+            }
+            if(dwGroup + 1 < dwRanks) {
+                DeviceGraphAddEdge(pg, dwIndex, dwDevices + dwGroup);
+            }
+        } else {
+            if(dwGroup + 1 < dwRanks) {
+                DeviceGraphAddEdge(pg, dwDevices + dwGroup, dwIndex);
+            }
+            if(dwGroup > 0) {
+                DeviceGraphAddEdge(pg, dwIndex, dwDevices + dwGroup - 1);
+            }
+        }
+    }
+
+    for(dwIndex = 0; fParentEdges && dwIndex < dwDevices; dwIndex++) {
+        PDEVICE_GRAPH_NODE pNode = &pg->pNodes[dwIndex];
+        PDEVICE_STATE pdsAncestor = pNode->pds->pParent;
+        DWORD dwDepth, dwParent;
+        for(dwDepth = 0; pdsAncestor != NULL && dwDepth < DEVGRAPH_MAX_DEPTH;
+        pdsAncestor = pdsAncestor->pParent, dwDepth++) {
+            if(!DeviceIndexGetGraphNode(pdsAncestor, gdwGraphMark, &dwParent)) {
+                continue;
+            }
+            if(pg->pNodes[dwParent].dwRank == pNode->dwRank) {
+                if(pg->fPowerUp) {
+                    DeviceGraphAddEdge(pg, dwParent, dwIndex);
+                } else {
+                    DeviceGraphAddEdge(pg, dwIndex, dwParent);
+                }
+                break;
+            }
+            PMLOGMSG(ZONE_WARN && pg->pNodes[dwParent].dwRank > pNode->dwRank,
+                (_T("%s: class order ranks ancestor '%s' after '%s', so they are updated in the wrong order\r\n"),
+                pszFname, pdsAncestor->pszName, pNode->pds->pszName));
+        }
+    }
+    DEBUGCHK(pg->dwEdges <= 3 * dwDevices);
+}
+
+// This routine returns TRUE if every node in the graph can be scheduled.
+static BOOL
+DeviceGraphIsAcyclic(PDEVICE_GRAPH pg)
+{
+    PDWORD pdwPending, pdwQueue;
+    DWORD dwHead = 0, dwTail = 0, dwIndex;
+
+    if(pg->dwNodes == 0) {
+        return TRUE;
+    }
+
+    pdwPending = (PDWORD) PmAlloc(2 * pg->dwNodes * sizeof(DWORD));
+    if(pdwPending == NULL) {
+        return FALSE;
+    }
+    pdwQueue = pdwPending + pg->dwNodes;
+
+    for(dwIndex = 0; dwIndex < pg->dwNodes; dwIndex++) {
+        pdwPending[dwIndex] = pg->pNodes[dwIndex].dwPending;
+        if(pdwPending[dwIndex] == 0) {
+            pdwQueue[dwTail++] = dwIndex;
+        }
+    }
+    while(dwHead < dwTail) {
+        DWORD dwEdge;
+        for(dwEdge = pg->pNodes[pdwQueue[dwHead++]].dwFirstEdge; dwEdge != DEVGRAPH_NO_EDGE;
+        dwEdge = pg->pEdges[dwEdge].dwNext) {
+            if(--pdwPending[pg->pEdges[dwEdge].dwTo] == 0) {
+                pdwQueue[dwTail++] = pg->pEdges[dwEdge].dwTo;
+            }
+        }
+    }
+
+    PmFree(pdwPending);
+    return dwTail == pg->dwNodes;
+}
+
+// This routine logs the graph so that transition ordering can be inspected.
+static VOID
+DeviceGraphDump(PDEVICE_GRAPH pg)
+{
+    DWORD dwIndex, dwEdge;
+    SETFNAME(_T("DeviceGraphDump"));
+
+    PMLOGMSG(ZONE_DEVICE, (_T("%s: power %s, %u devices, %u nodes, %u edges\r\n"),
+        pszFname, pg->fPowerUp ? _T("up") : _T("down"), pg->dwDevices,
+        pg->dwNodes, pg->dwEdges));
+    for(dwIndex = 0; dwIndex < pg->dwNodes; dwIndex++) {
+        PDEVICE_GRAPH_NODE pNode = &pg->pNodes[dwIndex];
+        PMLOGMSG(ZONE_DEVICE, (_T("%s: node %u '%s' group %u waits for %u\r\n"),
+            pszFname, dwIndex, pNode->pds != NULL ? pNode->pds->pszName : _T("<barrier>"),
+            pNode->dwRank, pNode->dwPending));
+        for(dwEdge = pNode->dwFirstEdge; dwEdge != DEVGRAPH_NO_EDGE; dwEdge = pg->pEdges[dwEdge].dwNext) {
+            PMLOGMSG(ZONE_DEVICE, (_T("%s:     then node %u\r\n"), pszFname,
+                pg->pEdges[dwEdge].dwTo));
+        }
+    }
+}
+
+// This routine builds a dependency graph covering every device in the
+// selected classes.  If pGuidInclude is non-NULL only that class is used;
+// if pGuidExclude is non-NULL that class is skipped.  If pszFrom and pszTo
+// are non-NULL the graph is part of a transition between those system power
+// states, and devices that the transition's plan says won't change are left
+// out.  Each device in the graph has its reference count incremented until
+// DeviceGraphDestroy() is called.  Returns NULL if there isn't enough memory.
+PDEVICE_GRAPH
+DeviceGraphCreate(LPCGUID pGuidInclude, LPCGUID pGuidExclude, BOOL fPowerUp,
+                  LPCTSTR pszFrom, LPCTSTR pszTo)
+{
+    PTRANSITION_PLAN ptp = NULL;
+    PDEVICE_GRAPH pg = NULL;
+    PDEVICE_LIST pdl;
+    PDEVICE_STATE pds;
+    DWORD adwRanks[DEVGRAPH_MAX_CLASS_RANKS + 1];
+    DWORD dwRanks = 0, dwDevices = 0, dwNodes, dwMaxEdges;
+    DWORD dwIndex, dwGroup;
+    SETFNAME(_T("DeviceGraphCreate"));
+
+    PMLOCK();
+
+    if(pszFrom != NULL && pszTo != NULL) {
+        ptp = TransitionPlanGet(pszFrom, pszTo);
+    }
+    gdwGraphMark++;
+
+    // count the devices and collect the distinct ranks of their classes in
+    // ascending order
+    for(pdl = gpDeviceLists; pdl != NULL; pdl = pdl->pNext) {
+        DWORD dwMembers = 0;
+        if((pGuidInclude != NULL && *pdl->pGuid != *pGuidInclude)
+        || (pGuidExclude != NULL && *pdl->pGuid == *pGuidExclude)) {
+            continue;
+        }
+        for(pds = pdl->pList; pds != NULL; pds = pds->pNext) {
+            // remember the answer, since it may change before the second pass
+            if(TransitionPlanIncludes(ptp, pds)) {
+                ((PDEVICE_STATE_EX) pds)->dwGraphMark = gdwGraphMark;
+                dwMembers++;
+            }
+        }
+        if(dwMembers != 0) {
+            DWORD dwRank = DeviceGraphGetClassRank(pdl->pGuid);
+            for(dwGroup = 0; dwGroup < dwRanks && adwRanks[dwGroup] < dwRank; dwGroup++);
+            if((dwGroup == dwRanks || adwRanks[dwGroup] != dwRank) && dwRanks < _countof(adwRanks)) {
+                memmove(&adwRanks[dwGroup + 1], &adwRanks[dwGroup], (dwRanks - dwGroup) * sizeof(adwRanks[0]));
+                adwRanks[dwGroup] = dwRank;
+                dwRanks++;
+            }
+            dwDevices += dwMembers;
+        }
+    }
+
+    // allocate the graph in a single block:  one barrier between each pair
+    // of adjacent ranks, and at most one rank edge in, one rank edge out and
+    // one parent edge per device
+    dwNodes = dwDevices + (dwRanks != 0 ? dwRanks - 1 : 0);
+    dwMaxEdges = 3 * dwDevices;
+    pg = (PDEVICE_GRAPH) PmAlloc(sizeof(*pg) + dwNodes * sizeof(DEVICE_GRAPH_NODE)
+        + dwMaxEdges * sizeof(DEVICE_GRAPH_EDGE));
+    if(pg == NULL) {
+        PMLOGMSG(ZONE_WARN, (_T("%s: no memory for %u devices\r\n"), pszFname, dwDevices));
+        PMUNLOCK();
+        return NULL;
+    }
+    pg->fPowerUp = fPowerUp;
+    pg->dwDevices = dwDevices;
+    pg->dwNodes = dwNodes;
+    pg->dwEdges = 0;
+    pg->pNodes = (PDEVICE_GRAPH_NODE) ((LPBYTE) pg + sizeof(*pg));
+    pg->pEdges = (PDEVICE_GRAPH_EDGE) ((LPBYTE) pg->pNodes + dwNodes * sizeof(DEVICE_GRAPH_NODE));
+
+    // fill in the device nodes, then the barriers
+    dwIndex = 0;
+    for(pdl = gpDeviceLists; pdl != NULL; pdl = pdl->pNext) {
+        if((pGuidInclude != NULL && *pdl->pGuid != *pGuidInclude)
+        || (pGuidExclude != NULL && *pdl->pGuid == *pGuidExclude)) {
+            continue;
+        }
+        DWORD dwRank = DeviceGraphGetClassRank(pdl->pGuid);
+        for(dwGroup = 0; dwGroup + 1 < dwRanks && adwRanks[dwGroup] < dwRank; dwGroup++);
+        for(pds = pdl->pList; pds != NULL; pds = pds->pNext) {
+            if(((PDEVICE_STATE_EX) pds)->dwGraphMark != gdwGraphMark) {
+                continue;
+            }
+            DeviceStateAddRef(pds);
+            DeviceIndexSetGraphNode(pds, gdwGraphMark, dwIndex);
+            pg->pNodes[dwIndex].pds = pds;
+            pg->pNodes[dwIndex].dwRank = dwGroup;
+            pg->pNodes[dwIndex].dwPending = 0;
+            pg->pNodes[dwIndex].dwFirstEdge = DEVGRAPH_NO_EDGE;
+            pg->pNodes[dwIndex].dwFlags = 0;
+            dwIndex++;
+        }
+    }
+    DEBUGCHK(dwIndex == dwDevices);
+    for(; dwIndex < dwNodes; dwIndex++) {
+        pg->pNodes[dwIndex].pds = NULL;
+        pg->pNodes[dwIndex].dwRank = dwIndex - dwDevices;
+        pg->pNodes[dwIndex].dwPending = 0;
+        pg->pNodes[dwIndex].dwFirstEdge = DEVGRAPH_NO_EDGE;
+        pg->pNodes[dwIndex].dwFlags = 0;
+    }
+
+    // link the nodes, falling back to rank ordering alone if the parent
+    // pointers form a loop -- they never should, but if they did the batch
+    // would never finish
+    DeviceGraphLink(pg, dwRanks, TRUE);
+    if(!DeviceGraphIsAcyclic(pg)) {
+        PMLOGMSG(ZONE_WARN, (_T("%s: dependency cycle detected, ignoring parent relationships\r\n"),
+            pszFname));
+        DeviceGraphLink(pg, dwRanks, FALSE);
+    }
+
+    PMUNLOCK();
+
+    if(ZONE_DEVICE) {
+        DeviceGraphDump(pg);
+    }
+    return pg;
+}
+
+// This routine releases a graph and the device references it holds.
+VOID
+DeviceGraphDestroy(PDEVICE_GRAPH pg)
+{
+    DWORD dwIndex;
+
+    if(pg != NULL) {
+        for(dwIndex = 0; dwIndex < pg->dwDevices; dwIndex++) {
+            DeviceStateDecRef(pg->pNodes[dwIndex].pds);
+        }
+        PmFree(pg);
+    }
+}
@@ -0,0 +1,77 @@
+//
+// Copyright (c) Microsoft Corporation.  All rights reserved.
+//
+//
+// Use of this sample source code is subject to the terms of the Microsoft
+// license agreement under which you licensed this sample source code. If
+// you did not accept the terms of the license agreement, you are not
+// authorized to use this sample source code. For the terms of the license,
+// please see the license agreement between you and Microsoft or, if applicable,
+// see the LICENSE.RTF on your install media or the root of your tools installation.
+// THE SAMPLE SOURCE CODE IS PROVIDED "AS IS", WITH NO WARRANTIES OR INDEMNITIES.
+//
+
+//
+// This module declares the device power dependency graph.  A graph is built
+// for each batch of device updates from three kinds of ordering knowledge:
+// parent/child relationships registered with the PM, class ranks read from
+// the registry, and platform class rules such as "block devices last".
+//
+
+#ifndef __PMDEPGRAPH_H
+#define __PMDEPGRAPH_H
+
+#include <pmimpl.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Classes with lower ranks are powered up before, and powered down after,
+// classes with higher ranks.  OEMs can assign ranks to classes with DWORD
+// values named after the class GUID under PWRMGR_REG_KEY\ClassOrder.
+#define PM_CLASS_ORDER_KEY          _T("ClassOrder")
+#define DEVGRAPH_RANK_FIRST         0
+#define DEVGRAPH_DEFAULT_RANK       100
+#define DEVGRAPH_MAX_CLASS_RANKS    32
+
+#define DEVGRAPH_NO_EDGE            0xFFFFFFFF
+
+// A node is either a device or a barrier between two class ranks.
+typedef struct _DEVICE_GRAPH_NODE {
+    PDEVICE_STATE pds;          // NULL for rank barriers
+    DWORD dwRank;
+    DWORD dwPending;            // predecessors that haven't completed
+    DWORD dwFirstEdge;          // first outgoing edge or DEVGRAPH_NO_EDGE
+    DWORD dwFlags;              // DEVGRAPH_NODE_xxx, used by the fan-out engine
+} DEVICE_GRAPH_NODE, *PDEVICE_GRAPH_NODE;
+
+#define DEVGRAPH_NODE_STARTED       0x00000001
+#define DEVGRAPH_NODE_BATCHED       0x00000002      // sent to its parent in a batch
+
+typedef struct _DEVICE_GRAPH_EDGE {
+    DWORD dwTo;                 // node that waits for this edge's source
+    DWORD dwNext;               // next edge from the same source
+} DEVICE_GRAPH_EDGE, *PDEVICE_GRAPH_EDGE;
+
+typedef struct _DEVICE_GRAPH {
+    BOOL fPowerUp;
+    DWORD dwDevices;            // device nodes come first in pNodes
+    DWORD dwNodes;
+    DWORD dwEdges;
+    PDEVICE_GRAPH_NODE pNodes;
+    PDEVICE_GRAPH_EDGE pEdges;
+} DEVICE_GRAPH, *PDEVICE_GRAPH;
+
+BOOL DeviceGraphInit(VOID);
+VOID DeviceGraphSetClassRank(LPCGUID pGuid, DWORD dwRank);
+DWORD DeviceGraphGetClassRank(LPCGUID pGuid);
+PDEVICE_GRAPH DeviceGraphCreate(LPCGUID pGuidInclude, LPCGUID pGuidExclude, BOOL fPowerUp,
+    LPCTSTR pszFrom, LPCTSTR pszTo);
+VOID DeviceGraphDestroy(PDEVICE_GRAPH pg);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -18,9 +18,19 @@
 
 #include <pmimpl.h>
 #include <pmsqm.h>
+#include "pmfanout.h"
+#include "pmdevindex.h"
+#include "pmlocks.h"
+#include "pmdxword.h"
+#include "pmwatchdog.h"
+#include "pmlease.h"
+#include "pmbatch.h"
+#include "pmplan.h"
+#include "pmpreresume.h"
 
 static ULONGLONG gBacklightMs = 0;
 static DWORD gBacklightMsTotal = 0;
+static BOOL gfCoalesceNotify = FALSE;
 
 #include <pmexthdl.hpp>
 
@@ -51,6 +61,46 @@ MapDevicePowerState(CEDEVICE_POWER_STATE newDx, UCHAR ucSupportedDx)
 }
     
 
+// This routine records SQM backlight data after a successful set.
+// fOnToOther is set if the device left D0 and fOtherToOn if it entered D0;
+// at most one of them is set.
+static VOID
+DeviceRecordBacklightSqm(PDEVICE_STATE pds, BOOL fOnToOther, BOOL fOtherToOn)
+{
+    if ((fOnToOther) || (fOtherToOn))
+    {
+        // sqm for power - check to see if the backlight is being turned off/on
+        // backlight is statically named driver - use the first one to check for on/off 
+        if (!memcmp(pds->pszName,TEXT("bkl1"),sizeof(TCHAR)*4))
+        {
+            ULONGLONG u64Now;
+            DWORD dwDeltaMs;
+
+            CeGetRawTime(&u64Now);
+            dwDeltaMs = (DWORD) (u64Now - gBacklightMs);
+
+            // its the primary backlight driver we just changed the state of.
+            // so record the sqm information based on whether it's in D0 or not.
+            if (gBacklightMs != 0)
+            {
+                if (fOnToOther)
+                {
+                    /* backlight is being turned off (not D0) */
+                    gBacklightMsTotal += dwDeltaMs;
+                    PMSQM_Set(PMSQM_DATAID_POWER_BKL_TOTAL,gBacklightMsTotal);
+                    PMSQM_Set(PMSQM_DATAID_POWER_BKL_ON,dwDeltaMs);
+                }
+                else if (fOtherToOn)
+                {
+                    /* backlight is being turned on (D0) */
+                    PMSQM_Set(PMSQM_DATAID_POWER_BKL_OFF,dwDeltaMs);
+                }
+            }
+            gBacklightMs = u64Now;  // save last tick count.
+        }
+    }
+}
+
 // This routine actually tells a device to update its current power state.  It 
 // returns TRUE if successful, FALSE otherwise.  Note that devices don't always
 // update their power state to the level that the PM wants.  Some devices may
@@ -60,14 +110,13 @@ DWORD
 SetDevicePower(PDEVICE_STATE pds, CEDEVICE_POWER_STATE newDx, BOOL fForceSet = FALSE)
 {
     DWORD dwStatus = ERROR_SUCCESS;
-    static DWORD dwStaticRefCount = 0; 
-    DWORD dwCurRefCount = 0;
-    CEDEVICE_POWER_STATE reqDx;
+    LONG lDxWord;
+    CEDEVICE_POWER_STATE reqDx, sentDx;
     CEDEVICE_POWER_STATE oldActualDx = D0, oldCurDx = D0;
     POWER_RELATIONSHIP pr;
     PPOWER_RELATIONSHIP ppr = NULL;
     BOOL fDoSet;
-    BOOL fOpenDevice = FALSE;
+    DWORD dwLease;
     HANDLE hDevice = INVALID_HANDLE_VALUE;
     SETFNAME(_T("SetDevicePower"));
 
@@ -80,34 +129,36 @@ SetDevicePower(PDEVICE_STATE pds, CEDEVICE_POWER_STATE newDx, BOOL fForceSet = F
     PMLOGMSG(ZONE_DEVICE, (_T("%s: setting '%s' to D%d (mapped to D%d), fForceSet is %d\r\n"), 
         pszFname, pds->pszName, newDx, reqDx, fForceSet));
 
-    // make a last check to see if we really need to send the device an update
-    PMLOCK();
-    DEBUGCHK(pds->dwNumPending == 0 || pds->pendingDx != PwrDeviceUnspecified);
-    DEBUGCHK(pds->dwNumPending != 0 || pds->pendingDx == PwrDeviceUnspecified);
-    if(reqDx != pds->actualDx || pds->dwNumPending != 0 || fForceSet) {
-        fDoSet = TRUE;
-
-        // record what we're trying to set, visible to other threads
-        pds->pendingDx = reqDx;
-        pds->dwNumPending++;
-        // Re-Enter Checking Count.
-        dwStaticRefCount ++ ;
-        dwCurRefCount = dwStaticRefCount;
-        // remember what we're trying to set in this thread
-        oldCurDx = pds->curDx;
-        oldActualDx = pds->actualDx;
+    // leave the device alone if its driver has stopped answering
+    if(DeviceWatchdogShouldSkip(pds)) {
+        PMLOGMSG(ZONE_WARN, (_T("%s: '%s' is degraded, not setting D%d\r\n"), 
+            pszFname, pds->pszName, reqDx));
+        return ERROR_TIMEOUT;
+    }
 
-        // get a handle to the device to make the request
-        hDevice = pds->hDevice;
-        if(hDevice != INVALID_HANDLE_VALUE) {
-            fOpenDevice = FALSE;    // already have a handle
+    // Make a last check to see if we really need to send the device an update,
+    // and if so record what we're trying to set where other threads can see it.
+    // If another thread's set is still in flight we send our own anyway, since
+    // we can't know how that one will turn out.
+    do {
+        lDxWord = DxWordRead(pds);
+        DEBUGCHK(DxWordNumPending(lDxWord) == 0 || DxWordPendingDx(lDxWord) != PwrDeviceUnspecified);
+        DEBUGCHK(DxWordNumPending(lDxWord) != 0 || DxWordPendingDx(lDxWord) == PwrDeviceUnspecified);
+        if(fForceSet || DxWordNumPending(lDxWord) != 0 || reqDx != DxWordActualDx(lDxWord)) {
+            fDoSet = TRUE;
+            DEBUGCHK(DxWordNumPending(lDxWord) < DXWORD_MAX_PENDING);
         } else {
-            fOpenDevice = TRUE;     // need to open a handle
+            fDoSet = FALSE;
         }
-    } else {
-        fDoSet = FALSE;
+    } while(fDoSet && !DxWordUpdate(pds, lDxWord, DxWordCurDx(lDxWord), DxWordActualDx(lDxWord),
+        reqDx, DxWordNumPending(lDxWord) + 1));
+
+    if(fDoSet) {
+        // remember what we're trying to set in this thread
+        sentDx = reqDx;
+        oldCurDx = DxWordCurDx(lDxWord);
+        oldActualDx = DxWordActualDx(lDxWord);
     }
-    PMUNLOCK();
 
     // are we doing an update?
     if(!fDoSet) {
@@ -126,10 +177,7 @@ SetDevicePower(PDEVICE_STATE pds, CEDEVICE_POWER_STATE newDx, BOOL fForceSet = F
         }
         
         // get a handle to the device
-        if(fOpenDevice) {
-            DEBUGCHK(pds->pInterface->pfnOpenDevice != NULL);
-            hDevice = pds->pInterface->pfnOpenDevice(pds);
-        }
+        hDevice = DeviceLeaseAcquire(pds, &dwLease);
 
         // did we get a handle?
         if(hDevice == INVALID_HANDLE_VALUE) {
@@ -141,7 +189,8 @@ SetDevicePower(PDEVICE_STATE pds, CEDEVICE_POWER_STATE newDx, BOOL fForceSet = F
             DEBUGCHK(pds->pInterface->pfnRequestDevice != NULL);
             PMExt_PMBeforeNewDeviceState(pds->pszName,oldActualDx,reqDx);
     
-            BOOL fOk = pds->pInterface->pfnRequestDevice(hDevice, IOCTL_POWER_SET, ppr, 
+            // the watchdog returns the handle lease once the driver is done
+            BOOL fOk = DeviceWatchdogRequest(pds, hDevice, dwLease, IOCTL_POWER_SET, ppr, 
                 ppr == NULL ? 0 : sizeof(*ppr), &reqDx, sizeof(reqDx), 
                 &dwBytesReturned);
 
@@ -154,9 +203,26 @@ SetDevicePower(PDEVICE_STATE pds, CEDEVICE_POWER_STATE newDx, BOOL fForceSet = F
                 // Check for races to update the driver -- it is possible for the device to call
                 // DevicePowerNotify() when another thread is calling SetDevicePower(), 
                 // SetSystemPowerState(), or Set(/Release)PowerRequirement().
-                PMLOCK();
-                if(pds->pendingDx == reqDx) {
-                    if (pds->curDx==D0)
+                do {
+                    lDxWord = DxWordRead(pds);
+                    fOnToOther = fOtherToOn = FALSE;
+                    if(DxWordPendingDx(lDxWord) != sentDx) {
+                        // Another thread started a set while ours was in flight.  The
+                        // driver may have finished them in either order, so we can't
+                        // tell which state it's in; have the caller try again.
+                        PMLOGMSG(ZONE_DEVICE, (_T("%s: race detected on '%s', returning ERROR_RETRY\r\n"),
+                            pszFname, pds->pszName));
+                        dwStatus = ERROR_RETRY;
+                        break;
+                    }
+                    else if (reqDx != sentDx) { // This condition indicate no SetDevicePower called by others. It must be wrong value return from device driver
+                        RETAILMSG(1, (_T("%s: Wrong Return Value from '%s', returning ERROR_GEN_FAILURE\r\n"),
+                            pszFname, pds->pszName));
+                        ASSERT(FALSE);
+                        dwStatus = ERROR_GEN_FAILURE;
+                        break;
+                    }
+                    if (DxWordCurDx(lDxWord)==D0)
                     {
                         fOnToOther = TRUE;
                     }
@@ -165,55 +231,10 @@ SetDevicePower(PDEVICE_STATE pds, CEDEVICE_POWER_STATE newDx, BOOL fForceSet = F
                         fOtherToOn = TRUE;
                     }
                     // record the new values
-                    pds->curDx = newDx;
-                    pds->actualDx = reqDx;
-                } 
-                else if (dwCurRefCount != dwStaticRefCount || pds->dwNumPending > 1 ) {
-                    PMLOGMSG(ZONE_DEVICE, (_T("%s: race detected on '%s', returning ERROR_RETRY\r\n"),
-                        pszFname, pds->pszName));
-                    dwStatus = ERROR_RETRY;
-                }
-                else { // This condition indicate no SetDevicePower called by others. It must be wrong value return from device driver
-                    RETAILMSG(1, (_T("%s: Wrong Return Value from '%s', returning ERROR_GEN_FAILURE\r\n"),
-                        pszFname, pds->pszName));
-                    ASSERT(FALSE);
-                    dwStatus = ERROR_GEN_FAILURE;
-                }
-                dwStaticRefCount ++ ;
-                PMUNLOCK();
+                } while(!DxWordUpdate(pds, lDxWord, newDx, reqDx, DxWordPendingDx(lDxWord),
+                    DxWordNumPending(lDxWord)));
 
-                if ((fOnToOther) || (fOtherToOn))
-                {
-                    // sqm for power - check to see if the backlight is being turned off/on
-                    // backlight is statically named driver - use the first one to check for on/off 
-                    if (!memcmp(pds->pszName,TEXT("bkl1"),sizeof(TCHAR)*4))
-                    {
-                        ULONGLONG u64Now;
-                        DWORD dwDeltaMs;
-
-                        CeGetRawTime(&u64Now);
-                        dwDeltaMs = (DWORD) (u64Now - gBacklightMs);
-
-                        // its the primary backlight driver we just changed the state of.
-                        // so record the sqm information based on whether it's in D0 or not.
-                        if (gBacklightMs != 0)
-                        {
-                            if (fOnToOther)
-                            {
-                                /* backlight is being turned off (not D0) */
-                                gBacklightMsTotal += dwDeltaMs;
-                                PMSQM_Set(PMSQM_DATAID_POWER_BKL_TOTAL,gBacklightMsTotal);
-                                PMSQM_Set(PMSQM_DATAID_POWER_BKL_ON,dwDeltaMs);
-                            }
-                            else if (fOtherToOn)
-                            {
-                                /* backlight is being turned on (D0) */
-                                PMSQM_Set(PMSQM_DATAID_POWER_BKL_OFF,dwDeltaMs);
-                            }
-                        }
-                        gBacklightMs = u64Now;  // save last tick count.
-                    }
-                }
+                DeviceRecordBacklightSqm(pds, fOnToOther, fOtherToOn);
             } else {
                 dwStatus = GetLastError();
                 if(dwStatus == ERROR_SUCCESS) {
@@ -222,34 +243,27 @@ SetDevicePower(PDEVICE_STATE pds, CEDEVICE_POWER_STATE newDx, BOOL fForceSet = F
                 PMLOGMSG(ZONE_WARN, (_T("%s: '%s' failed IOCTL_POWER_SET D%d, status is %d\r\n"),
                     pszFname, pds->pszName, newDx, dwStatus));
                 
-                PMLOCK();
                 // the set operation failed -- if the device power state appears unchanged,
                 // restore our state variables.  In general, devices should never fail a
                 // set request.
                 if(reqDx == oldActualDx) {
-                    pds->curDx = oldCurDx;
-                    pds->actualDx = oldActualDx;
+                    do {
+                        lDxWord = DxWordRead(pds);
+                    } while(!DxWordUpdate(pds, lDxWord, oldCurDx, oldActualDx, 
+                        DxWordPendingDx(lDxWord), DxWordNumPending(lDxWord)));
                 }
-                PMUNLOCK();
             }
             PMExt_PMAfterNewDeviceState(pds->pszName,oldActualDx,reqDx);
-            
-            // close the device handle if we opened it in this routine
-            if(fOpenDevice) {
-                DEBUGCHK(pds->pInterface->pfnCloseDevice != NULL);
-                pds->pInterface->pfnCloseDevice(hDevice);
-            }
         }
 
         // update reference counts
-        PMLOCK();
-        DEBUGCHK(pds->dwNumPending != 0);
-        DEBUGCHK(pds->pendingDx != PwrDeviceUnspecified);
-        pds->dwNumPending--;
-        if(pds->dwNumPending == 0) {
-            pds->pendingDx = PwrDeviceUnspecified;
-        }
-        PMUNLOCK();
+        do {
+            lDxWord = DxWordRead(pds);
+            DEBUGCHK(DxWordNumPending(lDxWord) != 0);
+            DEBUGCHK(DxWordPendingDx(lDxWord) != PwrDeviceUnspecified);
+        } while(!DxWordUpdate(pds, lDxWord, DxWordCurDx(lDxWord), DxWordActualDx(lDxWord),
+            DxWordNumPending(lDxWord) == 1 ? PwrDeviceUnspecified : DxWordPendingDx(lDxWord),
+            DxWordNumPending(lDxWord) - 1));
     }
 
     return dwStatus;
@@ -264,7 +278,7 @@ GetDevicePower(PDEVICE_STATE pds, PCEDEVICE_POWER_STATE pCurDx)
     DWORD dwStatus = ERROR_GEN_FAILURE;
     POWER_RELATIONSHIP pr;
     PPOWER_RELATIONSHIP ppr = NULL;
-    BOOL fOpenDevice;
+    DWORD dwLease;
     HANDLE hDevice;
     SETFNAME(_T("GetDevicePower"));
 
@@ -285,14 +299,7 @@ GetDevicePower(PDEVICE_STATE pds, PCEDEVICE_POWER_STATE pCurDx)
     }
     
     // get a handle to the device
-    hDevice = pds->hDevice;
-    if(hDevice != INVALID_HANDLE_VALUE) {
-        fOpenDevice = FALSE;    // already have a handle
-    } else {
-        fOpenDevice = TRUE;     // need to open a handle
-        DEBUGCHK(pds->pInterface->pfnOpenDevice != NULL);
-        hDevice = pds->pInterface->pfnOpenDevice(pds);
-    }
+    hDevice = DeviceLeaseAcquire(pds, &dwLease);
 
     // did we get a handle?
     if(hDevice == INVALID_HANDLE_VALUE) {
@@ -302,7 +309,8 @@ GetDevicePower(PDEVICE_STATE pds, PCEDEVICE_POWER_STATE pCurDx)
         CEDEVICE_POWER_STATE tmpDx = PwrDeviceUnspecified;
         DWORD dwBytesReturned;
         DEBUGCHK(pds->pInterface->pfnRequestDevice != NULL);
-        BOOL fOk = pds->pInterface->pfnRequestDevice(hDevice, IOCTL_POWER_GET, ppr, 
+        // the watchdog returns the handle lease once the driver is done
+        BOOL fOk = DeviceWatchdogRequest(pds, hDevice, dwLease, IOCTL_POWER_GET, ppr, 
             ppr == NULL ? 0 : sizeof(*ppr), &tmpDx, sizeof(tmpDx), 
             &dwBytesReturned);
         
@@ -323,13 +331,7 @@ GetDevicePower(PDEVICE_STATE pds, PCEDEVICE_POWER_STATE pCurDx)
         
         PMLOGMSG(!fOk && ZONE_WARN, 
             (_T("%s: '%s' failed IOCTL_POWER_GET, status is %d\r\n"),
-            pszFname, pds->pszName, GetLastError()));
-        
-        // close the device handle if we opened it in this routine
-        if(fOpenDevice) {
-            DEBUGCHK(pds->pInterface->pfnCloseDevice != NULL);
-            pds->pInterface->pfnCloseDevice(hDevice);
-        }
+            pszFname, pds->pszName, dwStatus));
     }
 
     return dwStatus;
@@ -388,7 +390,9 @@ GetNewDeviceDx(CEDEVICE_POWER_STATE reqDx,
 // values for the device's current, floor, and ceiling power states are
 // passed back via pointers.  If the caller is not interested in the
 // new values for floor and ceiling power levels, it may pass in null
-// for these parameters.  The caller should hold the PM lock.
+// for these parameters.  The caller should hold the PM lock.  Results for
+// the current system power state and global restriction lists are cached
+// per device, so a full system transition resolves each device once.
 BOOL
 GetNewDeviceStateInfo(PCEDEVICE_POWER_STATE pNewFloorDx, 
                       PCEDEVICE_POWER_STATE pNewCeilingDx,
@@ -400,11 +404,19 @@ GetNewDeviceStateInfo(PCEDEVICE_POWER_STATE pNewFloorDx,
     DEVICEID devId;
     PDEVICE_POWER_RESTRICTION pdpr;
     CEDEVICE_POWER_STATE newFloorDx, newCeilingDx;
+    BOOL fCacheable;
 
     PREFAST_DEBUGCHK(psps != NULL);
     PREFAST_DEBUGCHK(pNewFloorDx != NULL);
     PREFAST_DEBUGCHK(pNewCeilingDx != NULL);
 
+    // can we use the device's cached restrictions?
+    fCacheable = (psps == gpSystemPowerState && pFloorDxList == gpFloorDx 
+        && pCeilingDxList == gpCeilingDx);
+    if(fCacheable && DeviceIndexGetRestrictions(pds, pNewFloorDx, pNewCeilingDx)) {
+        return fOk;
+    }
+
     // Assume the default ceiling state.  Since power ceilings are defined in
     // the registry, there should be at most one that matches the device's 
     // class and one that matches the device exactly.
@@ -494,6 +506,9 @@ GetNewDeviceStateInfo(PCEDEVICE_POWER_STATE pNewFloorDx,
     if(fOk) {
         *pNewCeilingDx = newCeilingDx;
         *pNewFloorDx = newFloorDx;
+        if(fCacheable) {
+            DeviceIndexSetRestrictions(pds, newFloorDx, newCeilingDx);
+        }
     }
 
     return fOk;
@@ -521,19 +536,22 @@ UpdateDeviceState(PDEVICE_STATE pds)
         fOk = GetNewDeviceStateInfo(&pds->floorDx, &pds->ceilingDx,
             pds, gpSystemPowerState, gpFloorDx, gpCeilingDx);
         if(fOk) {
+            LONG lDxWord = DxWordRead(pds);
+            DeviceLock(pds);
             // We have to monitor changes to pds->lastReqDx, since multiple threads can be 
             // in the PM at once calling DevicePowerNotify().
-            newDx = GetNewDeviceDx(pds->lastReqDx, pds->curDx, pds->setDx, pds->floorDx, pds->ceilingDx);
-            if(newDx == PwrDeviceUnspecified && (pds->dwNumPending != 0 || dwStatus == ERROR_RETRY)) {
+            newDx = GetNewDeviceDx(pds->lastReqDx, DxWordCurDx(lDxWord), pds->setDx, pds->floorDx, pds->ceilingDx);
+            if(newDx == PwrDeviceUnspecified && (DxWordNumPending(lDxWord) != 0 || dwStatus == ERROR_RETRY)) {
                 PMLOGMSG(ZONE_DEVICE, 
-                    (_T("%s: reentrant set for '%s', setting %d\r\n"), pszFname, pds->pszName, pds->curDx));
-                newDx = pds->curDx;
+                    (_T("%s: reentrant set for '%s', setting %d\r\n"), pszFname, pds->pszName, DxWordCurDx(lDxWord)));
+                newDx = DxWordCurDx(lDxWord);
                 fForce = TRUE;
             }
             PMLOGMSG(ZONE_DEVICE, 
                 (_T("%s: new state for '%s' is %d (current %d, req %d, set %d, floor %d, ceiling %d, actual %d)\r\n"),
-                pszFname, pds->pszName, newDx, pds->curDx, pds->lastReqDx, pds->setDx, pds->floorDx, pds->ceilingDx, pds->actualDx));
+                pszFname, pds->pszName, newDx, DxWordCurDx(lDxWord), pds->lastReqDx, pds->setDx, pds->floorDx, pds->ceilingDx, DxWordActualDx(lDxWord)));
             oldLastReqDx = pds->lastReqDx;
+            DeviceUnlock(pds);
             dwStatus = ERROR_SUCCESS;
         }
         PMUNLOCK();
@@ -543,7 +561,7 @@ UpdateDeviceState(PDEVICE_STATE pds)
             // yes, set its power state to the new value
             dwStatus = SetDevicePower(pds, newDx, fForce);
             if(dwStatus == ERROR_SUCCESS) {
-                PMLOCK();
+                DeviceLock(pds);
                 PMLOGMSG(ZONE_DEVICE, 
                     (_T("%s: updated state for '%s' is current %d, req %d, set %d, floor %d, ceiling %d, actual %d\r\n"),
                     pszFname, pds->pszName, pds->curDx, pds->lastReqDx, pds->setDx, pds->floorDx, pds->ceilingDx, pds->actualDx));
@@ -552,7 +570,7 @@ UpdateDeviceState(PDEVICE_STATE pds)
                         pszFname, pds->pszName));
                     dwStatus = ERROR_RETRY;
                 }
-                PMUNLOCK();
+                DeviceUnlock(pds);
             }
             
             if(dwStatus == ERROR_RETRY) {
@@ -562,6 +580,8 @@ UpdateDeviceState(PDEVICE_STATE pds)
             } else if(dwStatus != ERROR_SUCCESS) {
                 PMLOGMSG(ZONE_DEVICE, (_T("%s: SetDevicePower('%s', D%d) failed %d\r\n"), 
                     pszFname, pds->pszName, newDx, dwStatus));
+                // the device isn't where transition plans expect it to be
+                TransitionPlanTouchDevice(pds);
                 fOk = FALSE;
             }
         }
@@ -570,6 +590,198 @@ UpdateDeviceState(PDEVICE_STATE pds)
     return fOk;
 }
 
+// This routine sends a batch-capable parent one IOCTL_POWER_SET_BATCH
+// covering every child in ppdsChildren whose power state needs to change.
+// Children are committed only if the parent reports that they reached the
+// requested state; any others are left for UpdateDeviceState() to set one
+// at a time.  A parent that doesn't return a result for every entry is
+// treated as having failed the whole batch.  It returns ERROR_SUCCESS if the
+// parent accepted the batch, even if some entries failed.
+DWORD
+SetChildDevicesPower(PDEVICE_STATE pdsParent, PDEVICE_STATE *ppdsChildren, DWORD dwChildren)
+{
+    DWORD dwStatus = ERROR_SUCCESS;
+    PPOWER_BATCH_SET pbs = NULL;
+    PPOWER_BATCH_RESULT pbr = NULL;
+    PDEVICE_STATE *ppdsSent = NULL;
+    CEDEVICE_POWER_STATE *pNewDx = NULL;
+    DWORD dwIndex, dwEntries = 0, dwLease, dwBytesReturned;
+    HANDLE hDevice;
+    SETFNAME(_T("SetChildDevicesPower"));
+
+    PREFAST_DEBUGCHK(pdsParent != NULL);
+    PREFAST_DEBUGCHK(ppdsChildren != NULL);
+    DEBUGCHK((pdsParent->caps.Flags & POWER_CAP_BATCH) != 0);
+
+    if(dwChildren > POWER_BATCH_MAX_ENTRIES) {
+        dwChildren = POWER_BATCH_MAX_ENTRIES;
+    }
+    if(DeviceWatchdogShouldSkip(pdsParent)) {
+        return ERROR_TIMEOUT;
+    }
+
+    // allocate the request, the results and our own bookkeeping together
+    pbs = (PPOWER_BATCH_SET) PmAlloc(POWER_BATCH_SET_SIZE(dwChildren) 
+        + dwChildren * (sizeof(*pbr) + sizeof(*ppdsSent) + sizeof(*pNewDx)));
+    if(pbs == NULL) {
+        PMLOGMSG(ZONE_WARN, (_T("%s: couldn't allocate a batch of %u for '%s'\r\n"),
+            pszFname, dwChildren, pdsParent->pszName));
+        return ERROR_NOT_ENOUGH_MEMORY;
+    }
+    pbr = (PPOWER_BATCH_RESULT) ((LPBYTE) pbs + POWER_BATCH_SET_SIZE(dwChildren));
+    ppdsSent = (PDEVICE_STATE *) (pbr + dwChildren);
+    pNewDx = (CEDEVICE_POWER_STATE *) (ppdsSent + dwChildren);
+
+    // work out each child's new state and claim it in the child's Dx word,
+    // just as SetDevicePower() would
+    for(dwIndex = 0; dwIndex < dwChildren; dwIndex++) {
+        PDEVICE_STATE pds = ppdsChildren[dwIndex];
+        CEDEVICE_POWER_STATE newDx = PwrDeviceUnspecified, reqDx;
+        LONG lDxWord;
+        BOOL fDoSet;
+
+        DEBUGCHK(pds->pParent == pdsParent);
+        if(DeviceWatchdogShouldSkip(pds)) {
+            continue;
+        }
+
+        PMLOCK();
+        if(GetNewDeviceStateInfo(&pds->floorDx, &pds->ceilingDx,
+        pds, gpSystemPowerState, gpFloorDx, gpCeilingDx)) {
+            DeviceLock(pds);
+            newDx = GetNewDeviceDx(pds->lastReqDx, DxWordCurDx(DxWordRead(pds)), pds->setDx, 
+                pds->floorDx, pds->ceilingDx);
+            DeviceUnlock(pds);
+        }
+        PMUNLOCK();
+        if(newDx == PwrDeviceUnspecified) {
+            continue;
+        }
+
+        reqDx = MapDevicePowerState(newDx, pds->caps.DeviceDx);
+        do {
+            lDxWord = DxWordRead(pds);
+            fDoSet = (DxWordNumPending(lDxWord) == 0 && reqDx != DxWordActualDx(lDxWord));
+        } while(fDoSet && !DxWordUpdate(pds, lDxWord, DxWordCurDx(lDxWord), DxWordActualDx(lDxWord),
+            reqDx, 1));
+        if(fDoSet) {
+            pbs->Entries[dwEntries].hChild = (HANDLE) pds;
+            pbs->Entries[dwEntries].pwsChild = pds->pszName;
+            pbs->Entries[dwEntries].reqDx = reqDx;
+            pbr[dwEntries].dwStatus = ERROR_GEN_FAILURE;
+            pbr[dwEntries].newDx = PwrDeviceUnspecified;
+            ppdsSent[dwEntries] = pds;
+            pNewDx[dwEntries] = newDx;
+            dwEntries++;
+        }
+    }
+
+    if(dwEntries != 0) {
+        BOOL fOk = FALSE;
+
+        pbs->dwVersion = POWER_BATCH_VERSION;
+        pbs->hParent = (HANDLE) pdsParent;
+        pbs->pwsParent = pdsParent->pszName;
+        pbs->dwEntries = dwEntries;
+
+        hDevice = DeviceLeaseAcquire(pdsParent, &dwLease);
+        if(hDevice == INVALID_HANDLE_VALUE) {
+            PMLOGMSG(ZONE_WARN, (_T("%s: couldn't open '%s'\r\n"), pszFname,
+                pdsParent->pszName));
+            dwStatus = ERROR_INVALID_HANDLE;
+        } else {
+            for(dwIndex = 0; dwIndex < dwEntries; dwIndex++) {
+                PMExt_PMBeforeNewDeviceState(ppdsSent[dwIndex]->pszName, 
+                    DxWordActualDx(DxWordRead(ppdsSent[dwIndex])), pbs->Entries[dwIndex].reqDx);
+            }
+            fOk = DeviceWatchdogRequest(pdsParent, hDevice, dwLease, IOCTL_POWER_SET_BATCH,
+                pbs, POWER_BATCH_SET_SIZE(dwEntries), pbr, dwEntries * sizeof(*pbr), &dwBytesReturned);
+            if(!fOk) {
+                dwStatus = GetLastError();
+                if(dwStatus == ERROR_SUCCESS) {
+                    dwStatus = ERROR_GEN_FAILURE;
+                }
+                PMLOGMSG(ZONE_WARN, (_T("%s: '%s' failed IOCTL_POWER_SET_BATCH for %u children, status is %d\r\n"),
+                    pszFname, pdsParent->pszName, dwEntries, dwStatus));
+            } else if(dwBytesReturned < dwEntries * sizeof(*pbr)) {
+                // without a result for every entry we can't tell which children
+                // were set, so leave them all to be set one at a time
+                PMLOGMSG(ZONE_WARN, (_T("%s: '%s' returned %u bytes of results for %u children\r\n"),
+                    pszFname, pdsParent->pszName, dwBytesReturned, dwEntries));
+                dwStatus = ERROR_INVALID_DATA;
+                fOk = FALSE;
+            }
+        }
+        PMLOGMSG(ZONE_DEVICE, (_T("%s: sent '%s' a batch of %u, status is %d\r\n"), 
+            pszFname, pdsParent->pszName, dwEntries, dwStatus));
+
+        // record the results and release the children's Dx words
+        for(dwIndex = 0; dwIndex < dwEntries; dwIndex++) {
+            PDEVICE_STATE pds = ppdsSent[dwIndex];
+            CEDEVICE_POWER_STATE reqDx = pbs->Entries[dwIndex].reqDx;
+            BOOL fDone = (fOk && pbr[dwIndex].dwStatus == ERROR_SUCCESS && pbr[dwIndex].newDx == reqDx);
+            BOOL fCommit, fOnToOther, fOtherToOn;
+            LONG lDxWord;
+
+            PMLOGMSG(!fDone && fOk && ZONE_WARN, 
+                (_T("%s: '%s' didn't reach D%d in the batch (status %d, D%d), will set it alone\r\n"),
+                pszFname, pds->pszName, reqDx, pbr[dwIndex].dwStatus, pbr[dwIndex].newDx));
+            do {
+                lDxWord = DxWordRead(pds);
+                DEBUGCHK(DxWordNumPending(lDxWord) != 0);
+                fCommit = (fDone && DxWordPendingDx(lDxWord) == reqDx);
+                fOnToOther = (fCommit && DxWordCurDx(lDxWord) == D0);
+                fOtherToOn = (fCommit && !fOnToOther && pNewDx[dwIndex] == D0);
+            } while(!DxWordUpdate(pds, lDxWord, 
+                fCommit ? pNewDx[dwIndex] : DxWordCurDx(lDxWord),
+                fCommit ? reqDx : DxWordActualDx(lDxWord),
+                DxWordNumPending(lDxWord) == 1 ? PwrDeviceUnspecified : DxWordPendingDx(lDxWord),
+                DxWordNumPending(lDxWord) - 1));
+            DeviceRecordBacklightSqm(pds, fOnToOther, fOtherToOn);
+            if(hDevice != INVALID_HANDLE_VALUE) {
+                PMExt_PMAfterNewDeviceState(pds->pszName, DxWordActualDx(lDxWord), reqDx);
+            }
+        }
+    }
+
+    PmFree(pbs);
+    return dwStatus;
+}
+
+// This routine speculatively sets a device to the power state it would have
+// in system power state psps, whose ceiling list is pCeilingDx, ahead of the
+// transition that is expected to put it there.  The device's request,
+// application setting, floor and ceiling are applied just as
+// UpdateDeviceState() applies them.  If the guess turns out to be wrong the
+// next UpdateDeviceState() corrects it.
+DWORD
+PreResumeDevicePower(PDEVICE_STATE pds, PSYSTEM_POWER_STATE psps, PDEVICE_POWER_RESTRICTION pCeilingDx)
+{
+    CEDEVICE_POWER_STATE floorDx, ceilingDx;
+    CEDEVICE_POWER_STATE newDx = PwrDeviceUnspecified;
+    DWORD dwStatus = ERROR_SUCCESS;
+    SETFNAME(_T("PreResumeDevicePower"));
+
+    PMLOCK();
+    if(GetNewDeviceStateInfo(&floorDx, &ceilingDx, pds, psps, gpFloorDx, pCeilingDx)) {
+        DeviceLock(pds);
+        newDx = GetNewDeviceDx(pds->lastReqDx, DxWordCurDx(DxWordRead(pds)), pds->setDx, floorDx, ceilingDx);
+        DeviceUnlock(pds);
+    }
+    PMUNLOCK();
+
+    if(newDx != PwrDeviceUnspecified) {
+        PMLOGMSG(ZONE_RESUME || ZONE_DEVICE, (_T("%s: setting '%s' to D%d for '%s'\r\n"),
+            pszFname, pds->pszName, newDx, psps->pszName));
+        dwStatus = SetDevicePower(pds, newDx);
+        if(dwStatus == ERROR_SUCCESS) {
+            // the device moved outside of a transition
+            TransitionPlanTouchDevice(pds);
+        }
+    }
+    return dwStatus;
+}
+
 #ifdef PM_SUPPORTS_DEVICE_QUERIES
 
 // NOTE -- Devices are not required to implement IOCTL_POWER_QUERY, nor is the 
@@ -594,7 +806,7 @@ QueryDevicePowerUpdate(PDEVICE_STATE pds, CEDEVICE_POWER_STATE newDx)
     PPOWER_RELATIONSHIP ppr = NULL;
     CEDEVICE_POWER_STATE reqDx;
     BOOL fDoSet;
-    BOOL fOpenDevice = FALSE;
+    DWORD dwLease;
     HANDLE hDevice = INVALID_HANDLE_VALUE;
     SETFNAME(_T("QueryDevicePowerUpdate"));
     
@@ -607,19 +819,13 @@ QueryDevicePowerUpdate(PDEVICE_STATE pds, CEDEVICE_POWER_STATE newDx)
         pszFname, pds->pszName, newDx, reqDx));
 
     // make a last check to see if we really need to send the device an update
-    PMLOCK();
-    if(reqDx != pds->actualDx) {
+    DeviceLock(pds);
+    if(reqDx != DxWordActualDx(DxWordRead(pds))) {
         fDoSet = TRUE;
-        hDevice = pds->hDevice;
-        if(hDevice != INVALID_HANDLE_VALUE) {
-            fOpenDevice = FALSE;    // already have a handle
-        } else {
-            fOpenDevice = TRUE;     // need to open a handle
-        }
     } else {
         fDoSet = FALSE;
     }
-    PMUNLOCK();
+    DeviceUnlock(pds);
 
     // are we doing an update?
     if(!fDoSet) {
@@ -639,10 +845,7 @@ QueryDevicePowerUpdate(PDEVICE_STATE pds, CEDEVICE_POWER_STATE newDx)
         }
 
         // get a handle to the device
-        if(fOpenDevice) {
-            DEBUGCHK(pds->pInterface->pfnOpenDevice != NULL);
-            hDevice = pds->pInterface->pfnOpenDevice(pds);
-        }
+        hDevice = DeviceLeaseAcquire(pds, &dwLease);
 
         // do we have one?
         if(hDevice == INVALID_HANDLE_VALUE) {
@@ -662,11 +865,8 @@ QueryDevicePowerUpdate(PDEVICE_STATE pds, CEDEVICE_POWER_STATE newDx)
                     pszFname, pds->pszName, newDx, GetLastError()));
             }
             
-            // close the device handle if we opened it in this routine
-            if(fOpenDevice) {
-                DEBUGCHK(pds->pInterface->pfnCloseDevice != NULL);
-                pds->pInterface->pfnCloseDevice(hDevice);
-            }
+            // give the handle back
+            DeviceLeaseRelease(pds, hDevice, dwLease);
             
             // if the device permitted the ioctl, determine its response to the 
             // query.
@@ -703,10 +903,12 @@ QueryDeviceStateUpdate(PDEVICE_STATE pds, PSYSTEM_POWER_STATE psps,
     // device never makes any power requests on its own.
     fOk = GetNewDeviceStateInfo(&floorDx, &ceilingDx, pds, psps, pFloorDx, pCeilingDx);
     if(fOk) {
-        newDx = GetNewDeviceDx(pds->lastReqDx, pds->curDx, pds->setDx, floorDx, ceilingDx);
+        DeviceLock(pds);
+        newDx = GetNewDeviceDx(pds->lastReqDx, DxWordCurDx(DxWordRead(pds)), pds->setDx, floorDx, ceilingDx);
         PMLOGMSG(ZONE_DEVICE, 
             (_T("%s: new state for '%s' is %d (current %d, req %d, set %d, floor %d, ceiling %d, actual %d)\r\n"),
             pszFname, pds->pszName, newDx, pds->curDx, pds->lastReqDx, pds->setDx, pds->floorDx, pds->ceilingDx, pds->actualDx));
+        DeviceUnlock(pds);
     }
     PMUNLOCK();
 
@@ -801,7 +1003,8 @@ QueryAllDevices(PSYSTEM_POWER_STATE psps, PDEVICE_POWER_RESTRICTION pdprCeiling,
 
 // This routine updates state for all devices.  It should be called during
 // system power state transitions so that device power states can be
-// adjusted appropriately.
+// adjusted appropriately.  Devices are normally updated concurrently by the
+// fan-out engine; if it isn't available we walk the list one device at a time.
 VOID
 UpdateClassDeviceStates(PDEVICE_LIST pdl)
 {
@@ -811,6 +1014,10 @@ UpdateClassDeviceStates(PDEVICE_LIST pdl)
 
     PREFAST_DEBUGCHK(pdl != NULL);
 
+    if(DeviceFanoutUpdateClasses(pdl->pGuid, NULL)) {
+        return;
+    }
+
     PMLOCK();
 
     // Since it's possible that the device list may be modified
@@ -856,12 +1063,17 @@ UpdateClassDeviceStates(PDEVICE_LIST pdl)
 
 // This routine updates state for all devices of all classes.  It can be called during
 // system power state transitions so that device power states can be
-// adjusted appropriately.
+// adjusted appropriately.  All classes are normally scheduled as a single
+// dependency graph; if that isn't possible, each class is updated in turn.
 VOID
 UpdateAllDeviceStates(VOID)
 {
     PDEVICE_LIST pdl;
 
+    if(DeviceFanoutUpdateClasses(NULL, NULL)) {
+        return;
+    }
+
     // update all devices of all classes
     for(pdl = gpDeviceLists; pdl != NULL; pdl = pdl->pNext) {
         UpdateClassDeviceStates(pdl);
@@ -874,22 +1086,12 @@ UpdateAllDeviceStates(VOID)
 BOOL
 CheckDevicePointer(PDEVICE_STATE pds)
 {
-    PDEVICE_LIST pdl;
-    BOOL fFound = FALSE;
+    BOOL fFound;
 
     // look for a match
     DEBUGCHK(pds != NULL);
     PMLOCK();
-    for(pdl = gpDeviceLists; pdl != NULL && !fFound; pdl = pdl->pNext) {
-        PDEVICE_STATE pdsTraveller;
-        for(pdsTraveller = pdl->pList; pdsTraveller != NULL; 
-        pdsTraveller = pdsTraveller->pNext) {
-            if(pdsTraveller == pds) {
-                fFound = TRUE;
-                break;
-            }
-        }
-    }
+    fFound = DeviceIndexContains(pds);
 
     // did we find the device?
     if(fFound) {
@@ -1019,14 +1221,18 @@ AddDevice(LPCGUID guidDevClass, LPCTSTR pszName, PDEVICE_STATE pdsParent,
                         DeviceStateRemList(pds);
                     } else {
                         // See if the device supports multiple handles.  Power manageable devices
-                        // should allow multiple open handles, but if they don't we will have to open
-                        // one before each access.
+                        // should allow multiple open handles, but if they don't we keep the one
+                        // we have and lend it out to one thread at a time until the device is
+                        // removed.
                         HANDLE hDevice = pds->pInterface->pfnOpenDevice(pds);
                         if(hDevice == INVALID_HANDLE_VALUE) {
                             PMLOGMSG(ZONE_WARN, (_T("%s: WARNING: '%s' does not support multiple handles\r\n"),
                                 pszFname, pds->pszName));
-                            pds->pInterface->pfnCloseDevice(pds->hDevice);
-                            pds->hDevice = INVALID_HANDLE_VALUE;
+                            if(!DeviceLeaseSetExclusive(pds)) {
+                                // we will have to open one before each access
+                                pds->pInterface->pfnCloseDevice(pds->hDevice);
+                                pds->hDevice = INVALID_HANDLE_VALUE;
+                            }
                         } else {
                             // close the second handle, since we don't need it
                             pds->pInterface->pfnCloseDevice(hDevice);
@@ -1139,9 +1345,7 @@ PmGetDevicePower(PVOID pvDevice, DWORD dwDeviceFlags, PCEDEVICE_POWER_STATE pCur
                 // how are we supposed to obtain the data?
                 if((dwDeviceFlags & POWER_FORCE) == 0) {
                     // use our cached value
-                    PMLOCK();
-                    curDx = pds->curDx;
-                    PMUNLOCK();
+                    curDx = DxWordCurDx(DxWordRead(pds));
                     dwStatus = ERROR_SUCCESS;
                 } else {
                     // request the device's power status
@@ -1215,9 +1419,10 @@ PmSetDevicePower(PVOID pvDevice, DWORD dwDeviceFlags, CEDEVICE_POWER_STATE newDx
                 // are we imposing a set value or are we removing a set value?
                 if(newDx == PwrDeviceUnspecified) {
                     // remove the set value
-                    PMLOCK();
+                    DeviceLock(pds);
                     pds->setDx = PwrDeviceUnspecified;
-                    PMUNLOCK();
+                    DeviceUnlock(pds);
+                    TransitionPlanTouchDevice(pds);
                     
                     // let the device find its own power level
                     UpdateDeviceState(pds);
@@ -1226,14 +1431,15 @@ PmSetDevicePower(PVOID pvDevice, DWORD dwDeviceFlags, CEDEVICE_POWER_STATE newDx
                     dwStatus = ERROR_SUCCESS;
                 } else {
                     // found the device, now try to update it
-                    PMLOCK();
+                    DeviceLock(pds);
                     pds->setDx = newDx;
-                    PMUNLOCK();
+                    DeviceUnlock(pds);
+                    TransitionPlanTouchDevice(pds);
                     fOk = UpdateDeviceState(pds);
                     if(!fOk) {
-                        PMLOCK();
+                        DeviceLock(pds);
                         pds->setDx = PwrDeviceUnspecified;
-                        PMUNLOCK();
+                        DeviceUnlock(pds);
                         dwStatus = ERROR_WRITE_FAULT;
                     } else {
                         dwStatus = ERROR_SUCCESS;
@@ -1258,6 +1464,27 @@ PmSetDevicePower(PVOID pvDevice, DWORD dwDeviceFlags, CEDEVICE_POWER_STATE newDx
     return dwStatus;
 }
 
+// This routine reads whether the OEM wants bursts of DevicePowerNotify()
+// calls on a device coalesced.  It must be called before devices are added.
+VOID
+DeviceNotifyCoalesceInit(VOID)
+{
+    HKEY hkPm;
+    SETFNAME(_T("DeviceNotifyCoalesceInit"));
+
+    if(RegOpenKeyEx(HKEY_LOCAL_MACHINE, PWRMGR_REG_KEY, 0, 0, &hkPm) == ERROR_SUCCESS) {
+        DWORD dwValue;
+        DWORD dwSize = sizeof(dwValue);
+        if(RegQueryTypedValue(hkPm, PM_COALESCE_NOTIFY_VALUE, &dwValue, &dwSize, REG_DWORD) == ERROR_SUCCESS) {
+            gfCoalesceNotify = (dwValue != 0);
+        }
+        RegCloseKey(hkPm);
+    }
+
+    PMLOGMSG(ZONE_INIT, (_T("%s: DevicePowerNotify() coalescing is %s\r\n"), pszFname,
+        gfCoalesceNotify ? _T("on") : _T("off")));
+}
+
 // This routine is invoked when a device driver wants to have the power manager
 // adjust its power state.  Power manager will attempt to honor the request
 // within the constraints imposed on it by the current system power state,
@@ -1292,7 +1519,9 @@ PmDevicePowerNotify(PVOID pvDevice, CEDEVICE_POWER_STATE reqDx,
             if(pds == NULL) {
                 dwStatus = ERROR_FILE_NOT_FOUND;
             } else {
-                PMLOCK();
+                PDEVICE_STATE_EX pdsx = (PDEVICE_STATE_EX) pds;
+
+                DeviceLock(pds);
                 
                 PMLOGMSG(ZONE_DEVICE, 
                     (_T("%s: device '%s' request for D%d, curDx D%d, floorDx D%d, ceilingDx D%d, setDx %d\r\n"),
@@ -1301,10 +1530,30 @@ PmDevicePowerNotify(PVOID pvDevice, CEDEVICE_POWER_STATE reqDx,
                 // record this state change request
                 pds->lastReqDx = reqDx;
 
-                PMUNLOCK();
-
-                // change the device power state if necessary
-                fOk = UpdateDeviceState(pds);
+                DeviceUnlock(pds);
+                TransitionPlanTouchDevice(pds);
+
+                if(gfCoalesceNotify) {
+                    // Announce the request, then try to become the thread that applies
+                    // requests for this device.  If somebody else already is, they're
+                    // guaranteed to see our sequence number and pick up lastReqDx.
+                    // Keep going after a failure too, since callers that arrived
+                    // meanwhile have already returned; only the last pass counts.
+                    InterlockedIncrement(&pdsx->lNotifySeq);
+                    while(InterlockedCompareExchange(&pdsx->lNotifyBusy, 1, 0) == 0) {
+                        LONG lSeq = pdsx->lNotifySeq;
+                        fOk = UpdateDeviceState(pds);
+                        InterlockedExchange(&pdsx->lNotifyBusy, 0);
+                        if(pdsx->lNotifySeq == lSeq) {
+                            break;      // nothing arrived while we were busy
+                        }
+                        PMLOGMSG(ZONE_DEVICE, (_T("%s: applying coalesced requests for '%s'\r\n"),
+                            pszFname, pds->pszName));
+                    }
+                } else {
+                    // change the device power state if necessary
+                    fOk = UpdateDeviceState(pds);
+                }
                 if(!fOk) {
                     PMLOGMSG(ZONE_WARN, 
                         (_T("%s: SetDevicePower('%s') failed when requesting D%d\r\n"),
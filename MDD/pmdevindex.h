@@ -0,0 +1,45 @@
+//
+// Copyright (c) Microsoft Corporation.  All rights reserved.
+//
+//
+// Use of this sample source code is subject to the terms of the Microsoft
+// license agreement under which you licensed this sample source code. If
+// you did not accept the terms of the license agreement, you are not
+// authorized to use this sample source code. For the terms of the license,
+// please see the license agreement between you and Microsoft or, if applicable,
+// see the LICENSE.RTF on your install media or the root of your tools installation.
+// THE SAMPLE SOURCE CODE IS PROVIDED "AS IS", WITH NO WARRANTIES OR INDEMNITIES.
+//
+
+//
+// This module declares the device index.  The index shadows the class device
+// lists with hash chains keyed by (class, name), by name and by pointer.  It
+// is maintained by DeviceStateAddList() and DeviceStateRemList() and is
+// protected by the PM lock.  Index entries also cache each device's resolved
+// floor and ceiling for GetNewDeviceStateInfo() and its node in the graph
+// being built by DeviceGraphCreate().
+//
+
+#ifndef __PMDEVINDEX_H
+#define __PMDEVINDEX_H
+
+#include <pmimpl.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+BOOL DeviceIndexContains(PDEVICE_STATE pds);
+BOOL DeviceIndexGetRestrictions(PDEVICE_STATE pds, PCEDEVICE_POWER_STATE pFloorDx,
+                                PCEDEVICE_POWER_STATE pCeilingDx);
+VOID DeviceIndexSetRestrictions(PDEVICE_STATE pds, CEDEVICE_POWER_STATE floorDx,
+                                CEDEVICE_POWER_STATE ceilingDx);
+VOID DeviceIndexFlushRestrictions(VOID);
+VOID DeviceIndexSetGraphNode(PDEVICE_STATE pds, DWORD dwMark, DWORD dwNode);
+BOOL DeviceIndexGetGraphNode(PDEVICE_STATE pds, DWORD dwMark, PDWORD pdwNode);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
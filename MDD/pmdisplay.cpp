@@ -21,6 +21,12 @@
 
 #include <pmimpl.h>
 #include <wingdi.h>
+#include "pmdxword.h"
+
+// values for DEVICE_STATE_EX.lEscapeSupport
+#define ESCAPE_SUPPORT_UNKNOWN      0
+#define ESCAPE_SUPPORT_YES          1
+#define ESCAPE_SUPPORT_NO           2
 
 typedef HDC (WINAPI *PFN_CreateDCW)(LPCWSTR, LPCWSTR , LPCWSTR , CONST DEVMODEW *);
 typedef BOOL (WINAPI *PFN_DeleteDC)(HDC);
@@ -104,13 +110,19 @@ OpenDisplayDevice(PDEVICE_STATE pds)
         }
     }
 
-    if(gfGwesReady) {
+    // A driver's answer to QUERYESCSUPPORT doesn't change, so only ask once.
+    PDEVICE_STATE_EX pdsx = (PDEVICE_STATE_EX) pds;
+    if(pdsx->lEscapeSupport == ESCAPE_SUPPORT_NO) {
+        PMLOGMSG(ZONE_DEVICE || ZONE_IOCTL, (_T("%s: '%s' doesn't support all power manager control codes\r\n"),
+            pszFname, pds->pszName));
+        hRet = INVALID_HANDLE_VALUE;
+    } else if(gfGwesReady) {
         hRet = gpfnCreateDCW(pds->pszName, NULL, NULL, NULL);
         if(hRet == NULL) {
             PMLOGMSG(ZONE_WARN || ZONE_IOCTL, (_T("%s: CreateDC('%s') failed %d (0x%08x)\r\n"), pszFname,
                 pds->pszName, GetLastError(), GetLastError()));
             hRet = INVALID_HANDLE_VALUE;
-        } else {
+        } else if(pdsx->lEscapeSupport == ESCAPE_SUPPORT_UNKNOWN) {
             // determine whether the display driver really supports the PM IOCTLs
             DWORD dwIoctl[] = { IOCTL_POWER_CAPABILITIES, IOCTL_POWER_SET, IOCTL_POWER_GET };
             int i;
@@ -122,8 +134,11 @@ OpenDisplayDevice(PDEVICE_STATE pds)
             if(i < _countof(dwIoctl)) {
                 PMLOGMSG(ZONE_WARN, (_T("%s: '%s' doesn't support all power manager control codes\r\n"),
                     pszFname, pds->pszName));
+                pdsx->lEscapeSupport = ESCAPE_SUPPORT_NO;
                 gpfnDeleteDC((HDC) hRet);
                 hRet = INVALID_HANDLE_VALUE;
+            } else {
+                pdsx->lEscapeSupport = ESCAPE_SUPPORT_YES;
             }
         }
     }
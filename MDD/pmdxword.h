@@ -0,0 +1,117 @@
+//
+// Copyright (c) Microsoft Corporation.  All rights reserved.
+//
+//
+// Use of this sample source code is subject to the terms of the Microsoft
+// license agreement under which you licensed this sample source code. If
+// you did not accept the terms of the license agreement, you are not
+// authorized to use this sample source code. For the terms of the license,
+// please see the license agreement between you and Microsoft or, if applicable,
+// see the LICENSE.RTF on your install media or the root of your tools installation.
+// THE SAMPLE SOURCE CODE IS PROVIDED "AS IS", WITH NO WARRANTIES OR INDEMNITIES.
+//
+
+//
+// This module declares the packed device power state word.  Every device
+// state structure is allocated as a DEVICE_STATE_EX, whose Dx word holds
+// the device's current, actual and pending power states, the number of
+// set requests in flight, and a generation number that changes whenever
+// any of those do.  The word is only ever updated with a compare-and-swap,
+// so SetDevicePower() can detect interference from other threads without
+// taking a lock.
+//
+// The word is authoritative; curDx, actualDx, pendingDx and dwNumPending in
+// the DEVICE_STATE are copies kept for code that reads them directly.
+//
+// The extension also tracks DevicePowerNotify() coalescing.  When an OEM
+// turns it on, one caller at a time applies requests for a device; callers
+// that arrive meanwhile only record lastReqDx and return, and the applying
+// thread picks their requests up before it leaves.
+//
+
+#ifndef __PMDXWORD_H
+#define __PMDXWORD_H
+
+#include <pmimpl.h>
+
+typedef struct _DEVICE_STATE_EX {
+    DEVICE_STATE ds;                // must be first
+    volatile LONG lDxWord;
+    volatile LONG lNotifyBusy;      // nonzero while a caller applies requests
+    volatile LONG lNotifySeq;       // bumped by every DevicePowerNotify()
+    DWORD dwDeadlineMs;             // IOCTL deadline, 0 for none (pmwatchdog.h)
+    BOOL fDeadlineKnown;            // dwDeadlineMs has been looked up
+    volatile LONG lWatchdogStuck;   // IOCTLs abandoned but not yet returned
+    volatile LONG lWatchdogOverruns;
+    DWORD dwWatchdogTransition;     // transition of the last overrun
+    HANDLE hevLease;                // signaled while the only handle is free (pmlease.h)
+    DWORD dwLeaseOwner;             // thread holding the only handle
+    volatile LONG lEscapeSupport;   // display escape probe result (pmdisplay.cpp)
+    volatile LONG lPlanStamp;       // last change to the device's inputs (pmplan.h)
+    DWORD dwGraphMark;              // last graph that included the device (pmdepgraph.cpp)
+} DEVICE_STATE_EX, *PDEVICE_STATE_EX;
+
+// registry value under PWRMGR_REG_KEY that turns on DevicePowerNotify()
+// coalescing; it is off by default.
+#define PM_COALESCE_NOTIFY_VALUE    _T("CoalesceDeviceNotify")
+
+VOID DeviceNotifyCoalesceInit(VOID);
+
+// bits  0-3   curDx
+// bits  4-7   actualDx
+// bits  8-11  pendingDx
+// bits 12-15  number of set requests in flight
+// bits 16-31  generation
+#define DXWORD_UNSPECIFIED          0xF
+#define DXWORD_MAX_PENDING          0xF
+
+#define DXWORD_ENCODE_DX(dx)        ((dx) == PwrDeviceUnspecified ? DXWORD_UNSPECIFIED : ((DWORD) (dx) & 0xF))
+#define DXWORD_DECODE_DX(n)         ((n) == DXWORD_UNSPECIFIED ? PwrDeviceUnspecified : (CEDEVICE_POWER_STATE) (n))
+
+#define DxWordCurDx(lw)             DXWORD_DECODE_DX(((DWORD) (lw)) & 0xF)
+#define DxWordActualDx(lw)          DXWORD_DECODE_DX((((DWORD) (lw)) >> 4) & 0xF)
+#define DxWordPendingDx(lw)         DXWORD_DECODE_DX((((DWORD) (lw)) >> 8) & 0xF)
+#define DxWordNumPending(lw)        ((((DWORD) (lw)) >> 12) & 0xF)
+#define DxWordGeneration(lw)        (((DWORD) (lw)) >> 16)
+
+#define DxWordMake(curDx, actualDx, pendingDx, dwPending, dwGen) \
+    ((LONG) (DXWORD_ENCODE_DX(curDx) \
+    | (DXWORD_ENCODE_DX(actualDx) << 4) \
+    | (DXWORD_ENCODE_DX(pendingDx) << 8) \
+    | (((dwPending) & 0xF) << 12) \
+    | (((dwGen) & 0xFFFF) << 16)))
+
+// This routine returns a snapshot of a device's Dx word.
+__inline LONG
+DxWordRead(PDEVICE_STATE pds)
+{
+    return ((PDEVICE_STATE_EX) pds)->lDxWord;
+}
+
+// This routine replaces a device's Dx word if nobody has changed it since
+// lOld was read, bumping the generation.  It returns TRUE if it succeeded,
+// in which case the DEVICE_STATE copies are updated too.
+__inline BOOL
+DxWordUpdate(PDEVICE_STATE pds, LONG lOld, CEDEVICE_POWER_STATE curDx,
+             CEDEVICE_POWER_STATE actualDx, CEDEVICE_POWER_STATE pendingDx,
+             DWORD dwNumPending)
+{
+    PDEVICE_STATE_EX pdsx = (PDEVICE_STATE_EX) pds;
+    LONG lNew = DxWordMake(curDx, actualDx, pendingDx, dwNumPending,
+        DxWordGeneration(lOld) + 1);
+
+    DEBUGCHK(dwNumPending <= DXWORD_MAX_PENDING);
+    if(InterlockedCompareExchange(&pdsx->lDxWord, lNew, lOld) != lOld) {
+        return FALSE;
+    }
+
+    // These copies may briefly lag the word if two threads update it back
+    // to back, but they never disagree once the device is idle.
+    pds->curDx = curDx;
+    pds->actualDx = actualDx;
+    pds->pendingDx = pendingDx;
+    pds->dwNumPending = dwNumPending;
+    return TRUE;
+}
+
+#endif
@@ -0,0 +1,518 @@
+//
+// Copyright (c) Microsoft Corporation.  All rights reserved.
+//
+//
+// Use of this sample source code is subject to the terms of the Microsoft
+// license agreement under which you licensed this sample source code. If
+// you did not accept the terms of the license agreement, you are not
+// authorized to use this sample source code. For the terms of the license,
+// please see the license agreement between you and Microsoft or, if applicable,
+// see the LICENSE.RTF on your install media or the root of your tools installation.
+// THE SAMPLE SOURCE CODE IS PROVIDED "AS IS", WITH NO WARRANTIES OR INDEMNITIES.
+//
+
+//
+// This module contains the device update fan-out engine.  A batch of device
+// updates is described by a dependency graph (see pmdepgraph.cpp) and run
+// as a topological wavefront:  every device whose predecessors are done is
+// handed to a small pool of worker threads and the calling thread, so
+// unrelated drivers handle IOCTL_POWER_SET concurrently.
+//
+
+#include <pmimpl.h>
+#include "pmfanout.h"
+#include "pmdepgraph.h"
+#include "pmwatchdog.h"
+#include "pmbatch.h"
+#include "pmlocks.h"
+
+// the engine can only run one class update at a time
+static CRITICAL_SECTION gcsFanoutBatch;
+
+// protects the current graph and the transition statistics
+static CRITICAL_SECTION gcsFanout;
+
+static BOOL gfFanoutInitialized = FALSE;
+static BOOL gfFanoutInline = FALSE;
+static DWORD gdwFanoutThreads = 0;
+static INT giFanoutPriority = THREAD_PRIORITY_ERROR_RETURN;
+static HANDLE ghtFanout[PM_FANOUT_MAX_THREADS];
+static HANDLE ghsemFanoutWork;          // released once per item that workers may take
+static HANDLE ghevFanoutDone;           // set when the last node in a graph completes
+
+// the graph currently being processed and its queue of ready nodes
+static PDEVICE_GRAPH gpgRun;
+static PDWORD gpdwReady;
+static DWORD gdwReadyHead;
+static DWORD gdwReadyTail;
+static DWORD gdwRunOutstanding;
+static BOOL gfRunInline;
+static DWORD gdwRunThreadId;            // thread that owns the current graph
+static LONG glRunUpdateLend;            // the owner's update lock, lent to workers
+
+// per-transition statistics
+static BOOL gfTransitionPowerUp = TRUE;
+static DWORD gdwTransitionStart;
+static DWORD gdwTransitionDevices;
+static DWORD gdwTransitionSumMs;
+static DWORD gdwTransitionSlowestMs;
+static TCHAR gszTransitionState[MAX_PATH];
+static TCHAR gszTransitionFrom[MAX_PATH];  // empty if there's no plan to use
+static TCHAR gszTransitionSlowest[MAX_PATH];
+
+// This routine updates a single device on behalf of the engine and records
+// how long the update took.  Devices that were removed after the class
+// snapshot was taken are skipped.
+static VOID
+FanoutUpdateDevice(PDEVICE_STATE pds)
+{
+    BOOL fRemoved;
+    DWORD dwStart, dwElapsed;
+    SETFNAME(_T("FanoutUpdateDevice"));
+
+    PMLOCK();
+    fRemoved = (pds->pListHead == NULL);
+    PMUNLOCK();
+
+    if(fRemoved) {
+        PMLOGMSG(ZONE_WARN || ZONE_DEVICE,
+            (_T("%s: device '%s' removed before update\r\n"), pszFname,
+            pds->pszName));
+    } else {
+        dwStart = GetTickCount();
+        UpdateDeviceState(pds);
+        dwElapsed = GetTickCount() - dwStart;
+
+        EnterCriticalSection(&gcsFanout);
+        gdwTransitionDevices++;
+        gdwTransitionSumMs += dwElapsed;
+        if(dwElapsed >= gdwTransitionSlowestMs) {
+            gdwTransitionSlowestMs = dwElapsed;
+            VERIFY(SUCCEEDED(StringCchCopy(gszTransitionSlowest,
+                _countof(gszTransitionSlowest), pds->pszName)));
+        }
+        LeaveCriticalSection(&gcsFanout);
+
+        PMLOGMSG(ZONE_DEVICE, (_T("%s: '%s' updated in %u ms on thread 0x%08x\r\n"),
+            pszFname, pds->pszName, dwElapsed, GetCurrentThreadId()));
+    }
+}
+
+// This routine sends a batch-capable parent the new power states of a
+// node's ready siblings in one request.  Only siblings in the same rank
+// whose predecessors have all completed and that no thread has started on
+// are included, so the batch can't break the graph's ordering.  The
+// siblings still run through UpdateDeviceState() when their turn comes,
+// which costs nothing if the batch got them there and retries them one at
+// a time if it didn't.
+static VOID
+FanoutBatchSiblings(PDEVICE_GRAPH pg, DWORD dwNode)
+{
+    PDEVICE_STATE pdsParent = pg->pNodes[dwNode].pds->pParent;
+    PDEVICE_STATE *ppdsChildren;
+    DWORD dwIndex, dwChildren = 0;
+    SETFNAME(_T("FanoutBatchSiblings"));
+
+    ppdsChildren = (PDEVICE_STATE *) PmAlloc(min(pg->dwDevices, POWER_BATCH_MAX_ENTRIES) * sizeof(*ppdsChildren));
+    if(ppdsChildren == NULL) {
+        PMLOGMSG(ZONE_WARN, (_T("%s: couldn't allocate a batch for '%s'\r\n"), pszFname,
+            pdsParent->pszName));
+        return;
+    }
+
+    EnterCriticalSection(&gcsFanout);
+    for(dwIndex = 0; dwIndex < pg->dwDevices && dwChildren < POWER_BATCH_MAX_ENTRIES; dwIndex++) {
+        PDEVICE_GRAPH_NODE pgn = &pg->pNodes[dwIndex];
+        if(pgn->pds->pParent == pdsParent && pgn->dwRank == pg->pNodes[dwNode].dwRank
+        && (dwIndex == dwNode || (pgn->dwPending == 0 && (pgn->dwFlags & DEVGRAPH_NODE_STARTED) == 0))
+        && (pgn->dwFlags & DEVGRAPH_NODE_BATCHED) == 0) {
+            pgn->dwFlags |= DEVGRAPH_NODE_BATCHED;
+            ppdsChildren[dwChildren++] = pgn->pds;
+        }
+    }
+    LeaveCriticalSection(&gcsFanout);
+
+    // a batch of one is just an ordinary set
+    if(dwChildren > 1) {
+        SetChildDevicesPower(pdsParent, ppdsChildren, dwChildren);
+    }
+    PmFree(ppdsChildren);
+}
+
+// This routine takes the next ready node from the current graph and
+// processes it, then releases any nodes that were waiting only for it.  It
+// returns FALSE if there was no ready node to take.
+static BOOL
+FanoutRunNext(VOID)
+{
+    PDEVICE_GRAPH pg;
+    PDEVICE_STATE pds;
+    DWORD dwNode, dwEdge, dwReleased = 0;
+    LONG lLend, lPrevious;
+    BOOL fBatch, fInline;
+
+    EnterCriticalSection(&gcsFanout);
+    pg = gpgRun;
+    if(pg == NULL || gdwReadyHead == gdwReadyTail
+    || (gfRunInline && GetCurrentThreadId() != gdwRunThreadId)) {
+        LeaveCriticalSection(&gcsFanout);
+        return FALSE;
+    }
+    dwNode = gpdwReady[gdwReadyHead++];
+    pg->pNodes[dwNode].dwFlags |= DEVGRAPH_NODE_STARTED;
+    fBatch = (pg->pNodes[dwNode].dwFlags & DEVGRAPH_NODE_BATCHED) == 0;
+    lLend = glRunUpdateLend;
+    LeaveCriticalSection(&gcsFanout);
+
+    // the driver may call back into the PM, which must not wait for the
+    // update lock that the graph's owner is holding while it waits for us
+    pds = pg->pNodes[dwNode].pds;
+    if(pds != NULL) {
+        lPrevious = PmUpdateBorrow(lLend);
+        if(fBatch && pds->pParent != NULL && (pds->pParent->caps.Flags & POWER_CAP_BATCH) != 0) {
+            FanoutBatchSiblings(pg, dwNode);
+        }
+        FanoutUpdateDevice(pds);
+        PmUpdateBorrow(lPrevious);
+    }
+
+    EnterCriticalSection(&gcsFanout);
+    for(dwEdge = pg->pNodes[dwNode].dwFirstEdge; dwEdge != DEVGRAPH_NO_EDGE;
+    dwEdge = pg->pEdges[dwEdge].dwNext) {
+        DWORD dwTo = pg->pEdges[dwEdge].dwTo;
+        DEBUGCHK(pg->pNodes[dwTo].dwPending != 0);
+        if(--pg->pNodes[dwTo].dwPending == 0) {
+            gpdwReady[gdwReadyTail++] = dwTo;
+            dwReleased++;
+        }
+    }
+    DEBUGCHK(gdwRunOutstanding != 0);
+    gdwRunOutstanding--;
+    if(gdwRunOutstanding == 0) {
+        SetEvent(ghevFanoutDone);
+    }
+    fInline = gfRunInline;
+    LeaveCriticalSection(&gcsFanout);
+
+    // this thread will take one of the released nodes itself
+    if(dwReleased > 1 && !fInline) {
+        ReleaseSemaphore(ghsemFanoutWork, min(dwReleased - 1, gdwFanoutThreads), NULL);
+    }
+
+    return TRUE;
+}
+
+// Worker threads wait for work to be posted and drain the current graph
+// until the PM shuts down.
+static DWORD WINAPI
+FanoutThreadProc(LPVOID pvParam)
+{
+    HANDLE hEvents[] = { ghevPmShutdown, ghsemFanoutWork };
+    SETFNAME(_T("FanoutThreadProc"));
+
+    UNREFERENCED_PARAMETER(pvParam);
+
+    PMLOGMSG(ZONE_INIT, (_T("+%s: thread 0x%08x\r\n"), pszFname, GetCurrentThreadId()));
+    for(;;) {
+        DWORD dwStatus = WaitForMultipleObjects(_countof(hEvents), hEvents, FALSE, INFINITE);
+        if(dwStatus != (WAIT_OBJECT_0 + 1)) {
+            PMLOGMSG(dwStatus != WAIT_OBJECT_0 && ZONE_WARN,
+                (_T("%s: WaitForMultipleObjects() returned %d, status is %d\r\n"),
+                pszFname, dwStatus, GetLastError()));
+            break;
+        }
+        while(FanoutRunNext());
+    }
+    PMLOGMSG(ZONE_INIT, (_T("-%s: thread 0x%08x exiting\r\n"), pszFname, GetCurrentThreadId()));
+
+    return 0;
+}
+
+// This routine runs every node in a graph, honoring its edges.  The calling
+// thread participates in the work and does not return until the whole graph
+// has been processed.  In inline mode no worker threads are used, and nodes
+// are processed on this thread in a topological order.  If the caller holds
+// the update lock it is lent to the workers for the duration.
+static VOID
+FanoutRunGraph(PDEVICE_GRAPH pg, PDWORD pdwReady, BOOL fInline)
+{
+    HANDLE hEvents[2];
+    DWORD dwIndex, dwReady = 0;
+    LONG lLend = PmUpdateLend();
+
+    EnterCriticalSection(&gcsFanout);
+    gpgRun = pg;
+    gpdwReady = pdwReady;
+    gdwReadyHead = 0;
+    gdwReadyTail = 0;
+    gdwRunOutstanding = pg->dwNodes;
+    gfRunInline = fInline || gdwFanoutThreads == 0;
+    gdwRunThreadId = GetCurrentThreadId();
+    glRunUpdateLend = lLend;
+    for(dwIndex = 0; dwIndex < pg->dwNodes; dwIndex++) {
+        if(pg->pNodes[dwIndex].dwPending == 0) {
+            gpdwReady[gdwReadyTail++] = dwIndex;
+            dwReady++;
+        }
+    }
+    ResetEvent(ghevFanoutDone);
+    LeaveCriticalSection(&gcsFanout);
+
+    if(gfRunInline) {
+        while(FanoutRunNext());
+        DEBUGCHK(gdwRunOutstanding == 0);
+    } else {
+        // wake as many workers as can be useful, then keep helping until the
+        // graph drains
+        if(dwReady > 1) {
+            ReleaseSemaphore(ghsemFanoutWork, min(dwReady - 1, gdwFanoutThreads), NULL);
+        }
+        hEvents[0] = ghevFanoutDone;
+        hEvents[1] = ghsemFanoutWork;
+        while(FanoutRunNext() || WaitForMultipleObjects(_countof(hEvents), hEvents, FALSE, INFINITE) != WAIT_OBJECT_0);
+    }
+
+    EnterCriticalSection(&gcsFanout);
+    gpgRun = NULL;
+    gpdwReady = NULL;
+    gdwReadyHead = 0;
+    gdwReadyTail = 0;
+    glRunUpdateLend = 0;
+    LeaveCriticalSection(&gcsFanout);
+
+    PmUpdateRevoke(lLend);
+}
+
+// This routine reads the pool size from the registry and starts the worker
+// threads.  A failure here is not fatal -- class updates simply revert to
+// the serial walk in UpdateClassDeviceStates().
+BOOL
+DeviceFanoutInit(VOID)
+{
+    DWORD dwThreads = PM_FANOUT_DEFAULT_THREADS;
+    DWORD dwIndex;
+    HKEY hkPm;
+    SETFNAME(_T("DeviceFanoutInit"));
+
+    DEBUGCHK(!gfFanoutInitialized);
+
+    // see if the OEM wants a different pool size
+    if(RegOpenKeyEx(HKEY_LOCAL_MACHINE, PWRMGR_REG_KEY, 0, 0, &hkPm) == ERROR_SUCCESS) {
+        DWORD dwValue;
+        DWORD dwSize = sizeof(dwValue);
+        if(RegQueryTypedValue(hkPm, PM_FANOUT_THREADS_VALUE, &dwValue, &dwSize, REG_DWORD) == ERROR_SUCCESS) {
+            dwThreads = dwValue;
+        }
+        RegCloseKey(hkPm);
+    }
+    if(dwThreads > PM_FANOUT_MAX_THREADS) {
+        dwThreads = PM_FANOUT_MAX_THREADS;
+    }
+
+    // pick up OEM class ordering
+    DeviceGraphInit();
+
+    InitializeCriticalSection(&gcsFanoutBatch);
+    InitializeCriticalSection(&gcsFanout);
+    gpgRun = NULL;
+    gpdwReady = NULL;
+    gdwReadyHead = 0;
+    gdwReadyTail = 0;
+    gdwRunOutstanding = 0;
+    gdwFanoutThreads = 0;
+    memset(ghtFanout, 0, sizeof(ghtFanout));
+
+    ghsemFanoutWork = CreateSemaphore(NULL, 0, MAXLONG, NULL);
+    ghevFanoutDone = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if(ghsemFanoutWork == NULL || ghevFanoutDone == NULL) {
+        PMLOGMSG(ZONE_WARN, (_T("%s: couldn't create synchronization objects\r\n"), pszFname));
+        dwThreads = 0;
+    }
+
+    for(dwIndex = 0; dwIndex < dwThreads; dwIndex++) {
+        ghtFanout[dwIndex] = CreateThread(NULL, 0, FanoutThreadProc, NULL, 0, NULL);
+        if(ghtFanout[dwIndex] == NULL) {
+            PMLOGMSG(ZONE_WARN, (_T("%s: CreateThread() failed %d\r\n"), pszFname,
+                GetLastError()));
+            break;
+        }
+        gdwFanoutThreads++;
+    }
+    giFanoutPriority = THREAD_PRIORITY_ERROR_RETURN;
+    gfFanoutInitialized = TRUE;
+
+    PMLOGMSG(ZONE_INIT, (_T("%s: %u worker threads\r\n"), pszFname, gdwFanoutThreads));
+    return TRUE;
+}
+
+// This routine waits for the worker threads to exit.  The caller must have
+// signaled ghevPmShutdown.
+VOID
+DeviceFanoutDeinit(VOID)
+{
+    DWORD dwIndex;
+
+    if(gfFanoutInitialized) {
+        for(dwIndex = 0; dwIndex < gdwFanoutThreads; dwIndex++) {
+            WaitForSingleObject(ghtFanout[dwIndex], INFINITE);
+            CloseHandle(ghtFanout[dwIndex]);
+            ghtFanout[dwIndex] = NULL;
+        }
+        gdwFanoutThreads = 0;
+        if(ghsemFanoutWork != NULL) CloseHandle(ghsemFanoutWork);
+        if(ghevFanoutDone != NULL) CloseHandle(ghevFanoutDone);
+        ghsemFanoutWork = NULL;
+        ghevFanoutDone = NULL;
+        DeleteCriticalSection(&gcsFanout);
+        DeleteCriticalSection(&gcsFanoutBatch);
+        gfFanoutInitialized = FALSE;
+    }
+}
+
+// While inline mode is set, class updates run only on the calling thread.
+// The platform code sets it while file systems are unavailable during a
+// suspend or resume, since only the suspending thread may touch drivers
+// at that point.
+VOID
+DeviceFanoutSetInline(BOOL fInline)
+{
+    gfFanoutInline = fInline;
+}
+
+// This routine returns TRUE while inline mode is set.
+BOOL
+DeviceFanoutIsInline(VOID)
+{
+    return gfFanoutInline;
+}
+
+// This routine marks the start of a system power state transition.  It resets
+// the timing statistics and decides whether parents or children go first.
+VOID
+DeviceFanoutBeginTransition(PSYSTEM_POWER_STATE pspsOld, PSYSTEM_POWER_STATE pspsNew)
+{
+    BOOL fPowerUp = TRUE;
+
+    PREFAST_DEBUGCHK(pspsNew != NULL);
+
+    // power is going down if we are suspending or if the new state's default
+    // ceiling is lower than the old one's
+    if((pspsNew->dwFlags & (POWER_STATE_SUSPEND | POWER_STATE_OFF | POWER_STATE_CRITICAL | POWER_STATE_RESET)) != 0) {
+        fPowerUp = FALSE;
+    } else if(pspsOld != NULL && pspsNew->defaultCeilingDx > pspsOld->defaultCeilingDx) {
+        fPowerUp = FALSE;
+    }
+
+    if(gfFanoutInitialized) {
+        EnterCriticalSection(&gcsFanout);
+    }
+    gfTransitionPowerUp = fPowerUp;
+    gdwTransitionStart = GetTickCount();
+    gdwTransitionDevices = 0;
+    gdwTransitionSumMs = 0;
+    gdwTransitionSlowestMs = 0;
+    gszTransitionSlowest[0] = 0;
+    VERIFY(SUCCEEDED(StringCchCopy(gszTransitionState, _countof(gszTransitionState),
+        pspsNew->pszName)));
+    gszTransitionFrom[0] = 0;
+    if(pspsOld != NULL) {
+        VERIFY(SUCCEEDED(StringCchCopy(gszTransitionFrom, _countof(gszTransitionFrom),
+            pspsOld->pszName)));
+    }
+    if(gfFanoutInitialized) {
+        LeaveCriticalSection(&gcsFanout);
+    }
+    DeviceWatchdogBeginTransition();
+}
+
+// This routine reports the wall time of the transition started with
+// DeviceFanoutBeginTransition() along with the sum of the individual
+// device update times and the slowest device.
+VOID
+DeviceFanoutEndTransition(VOID)
+{
+    SETFNAME(_T("DeviceFanoutEndTransition"));
+
+    if(gfFanoutInitialized) {
+        EnterCriticalSection(&gcsFanout);
+    }
+    PMLOGMSG(ZONE_PLATFORM || ZONE_RESUME,
+        (_T("%s: transition to '%s' took %u ms: %u devices, %u ms total device time, slowest '%s' %u ms, %u workers\r\n"),
+        pszFname, gszTransitionState, GetTickCount() - gdwTransitionStart,
+        gdwTransitionDevices, gdwTransitionSumMs, gszTransitionSlowest,
+        gdwTransitionSlowestMs, gdwFanoutThreads));
+    gszTransitionFrom[0] = 0;
+    PMLOGMSG(ZONE_WARN && DeviceWatchdogGetOverruns() != 0,
+        (_T("%s: %u device IOCTLs have overrun their deadlines so far\r\n"),
+        pszFname, DeviceWatchdogGetOverruns()));
+    if(gfFanoutInitialized) {
+        LeaveCriticalSection(&gcsFanout);
+    }
+}
+
+// This routine updates every device in the selected classes using the worker
+// pool.  If pGuidInclude is non-NULL only that class is updated; if
+// pGuidExclude is non-NULL that class is skipped.  It returns FALSE without
+// updating anything if the engine isn't available or can't allocate its
+// working storage, in which case the caller should fall back to a serial
+// update.
+BOOL
+DeviceFanoutUpdateClasses(LPCGUID pGuidInclude, LPCGUID pGuidExclude)
+{
+    PDEVICE_GRAPH pg;
+    PDWORD pdwReady = NULL;
+    BOOL fPowerUp, fInline, fPlan;
+    TCHAR szFrom[MAX_PATH], szTo[MAX_PATH];
+    INT iPriority;
+    DWORD dwIndex;
+    SETFNAME(_T("DeviceFanoutUpdateClasses"));
+
+    if(!gfFanoutInitialized) {
+        return FALSE;
+    }
+
+    EnterCriticalSection(&gcsFanoutBatch);
+
+    EnterCriticalSection(&gcsFanout);
+    fPowerUp = gfTransitionPowerUp;
+    fInline = gfFanoutInline;
+    fPlan = (gszTransitionFrom[0] != 0);
+    if(fPlan) {
+        VERIFY(SUCCEEDED(StringCchCopy(szFrom, _countof(szFrom), gszTransitionFrom)));
+        VERIFY(SUCCEEDED(StringCchCopy(szTo, _countof(szTo), gszTransitionState)));
+    }
+    LeaveCriticalSection(&gcsFanout);
+
+    // describe the batch, leaving out devices that this transition won't change
+    pg = DeviceGraphCreate(pGuidInclude, pGuidExclude, fPowerUp, 
+        fPlan ? szFrom : NULL, fPlan ? szTo : NULL);
+    if(pg != NULL && pg->dwNodes != 0) {
+        pdwReady = (PDWORD) PmAlloc(pg->dwNodes * sizeof(DWORD));
+    }
+    if(pg == NULL || (pg->dwNodes != 0 && pdwReady == NULL)) {
+        PMLOGMSG(ZONE_WARN, (_T("%s: couldn't build update graph\r\n"), pszFname));
+        DeviceGraphDestroy(pg);
+        LeaveCriticalSection(&gcsFanoutBatch);
+        return FALSE;
+    }
+
+    // workers run at the caller's priority so a raised suspend priority
+    // carries over to the drivers we are calling
+    iPriority = CeGetThreadPriority(GetCurrentThread());
+    if(!fInline && iPriority != THREAD_PRIORITY_ERROR_RETURN && iPriority != giFanoutPriority) {
+        for(dwIndex = 0; dwIndex < gdwFanoutThreads; dwIndex++) {
+            CeSetThreadPriority(ghtFanout[dwIndex], iPriority);
+        }
+        giFanoutPriority = iPriority;
+    }
+
+    if(pg->dwNodes != 0) {
+        FanoutRunGraph(pg, pdwReady, fInline);
+        PmFree(pdwReady);
+    }
+    DeviceGraphDestroy(pg);
+
+    LeaveCriticalSection(&gcsFanoutBatch);
+
+    return TRUE;
+}
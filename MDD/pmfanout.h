@@ -0,0 +1,49 @@
+//
+// Copyright (c) Microsoft Corporation.  All rights reserved.
+//
+//
+// Use of this sample source code is subject to the terms of the Microsoft
+// license agreement under which you licensed this sample source code. If
+// you did not accept the terms of the license agreement, you are not
+// authorized to use this sample source code. For the terms of the license,
+// please see the license agreement between you and Microsoft or, if applicable,
+// see the LICENSE.RTF on your install media or the root of your tools installation.
+// THE SAMPLE SOURCE CODE IS PROVIDED "AS IS", WITH NO WARRANTIES OR INDEMNITIES.
+//
+
+//
+// This module declares the device update fan-out engine.  The engine runs
+// UpdateDeviceState() for a batch of devices on a bounded pool of worker
+// threads, in the order given by the batch's dependency graph, so that a
+// system power state transition costs roughly as much as its slowest
+// driver rather than the sum of all of them.
+//
+
+#ifndef __PMFANOUT_H
+#define __PMFANOUT_H
+
+#include <pmimpl.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// registry value under PWRMGR_REG_KEY that sizes the worker pool; zero
+// disables the pool and restores the original serial behavior.
+#define PM_FANOUT_THREADS_VALUE     _T("FanoutThreads")
+#define PM_FANOUT_DEFAULT_THREADS   4
+#define PM_FANOUT_MAX_THREADS       16
+
+BOOL DeviceFanoutInit(VOID);
+VOID DeviceFanoutDeinit(VOID);
+BOOL DeviceFanoutUpdateClasses(LPCGUID pGuidInclude, LPCGUID pGuidExclude);
+VOID DeviceFanoutSetInline(BOOL fInline);
+BOOL DeviceFanoutIsInline(VOID);
+VOID DeviceFanoutBeginTransition(PSYSTEM_POWER_STATE pspsOld, PSYSTEM_POWER_STATE pspsNew);
+VOID DeviceFanoutEndTransition(VOID);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -22,6 +22,17 @@
 #include <pmimpl.h>
 #include "PmSysReg.h"
 #include "pmexthdl.hpp"
+#include "pmfanout.h"
+#include "pmasync.h"
+#include "pmwatchdog.h"
+#include "pmplan.h"
+#include "pmpreresume.h"
+#include "pmnotify.h"
+#include "pmstatuspage.h"
+#include "pmsnapshot.h"
+#include "pmpool.h"
+#include "pmlocks.h"
+#include "pmdxword.h"
 // force C linkage to match external variable declarations
 extern "C" {
 
@@ -199,11 +210,15 @@ PmInit(VOID)
     // set up globals
     InitializeCriticalSection(&gcsPowerManager);
     InitializeCriticalSection(&gcsDeviceUpdateAPIs);
+    PmLocksInit();
+    DeviceNotifyCoalesceInit();
+    NotifySnapshotInit();
     gpFloorDx = NULL;
     gpCeilingDx = NULL;
     gpPowerNotifications = NULL;
     gpSystemPowerState = NULL;
     ghPmHeap = GetProcessHeap();
+    PmPoolInit();                       // falls back to ghPmHeap on failure
     gpDeviceLists = NULL;
     gppActivityTimers = NULL;
     ghevPowerManagerReady = NULL;
@@ -265,6 +280,15 @@ PmInit(VOID)
         }
     }
 
+    // Read the device IOCTL deadlines and start the device update workers
+    // before any thread can add devices or update them.
+    if(fOk) {
+        fOk = DeviceWatchdogInit();
+    }
+    if(fOk) {
+        fOk = DeviceFanoutInit();
+    }
+
     // start threads
     if(fOk) {
         ghtPnP = CreateThread(NULL, 0, PnpThreadProc, (LPVOID) hevPnPReady, 0, NULL);
@@ -314,6 +338,26 @@ PmInit(VOID)
         }
     }
 
+    // start the asynchronous request dispatchers
+    if(fOk) {
+        fOk = DeviceAsyncInit();
+    }
+
+    // see whether the speculative pre-resume pass is enabled
+    if(fOk) {
+        fOk = DevicePreResumeInit();
+    }
+
+    // start the notification dispatcher
+    if(fOk) {
+        fOk = NotifyDispatcherInit();
+    }
+
+    // create the shared power status page
+    if(fOk) {
+        fOk = PowerStatusPageInit();
+    }
+
     if (fOk) {
         fOk = PMExt_Init();
     }
@@ -369,6 +413,15 @@ PmInit(VOID)
             WaitForSingleObject(ghtActivityTimers, INFINITE);
             CloseHandle(ghtActivityTimers);
         }
+        DeviceFanoutDeinit();
+        DeviceAsyncDeinit();
+        DevicePreResumeDeinit();
+        NotifyDispatcherDeinit();
+        NotifySnapshotDeinit();
+        PowerStatusPageDeinit();
+        PowerSnapshotDeinit();
+        DeviceWatchdogDeinit();
+        TransitionPlanDeinit();
 
         PMLOGMSG(ZONE_ERROR, (_T("%s: closing handles\r\n"), pszFname));
         if(ghevPmShutdown != NULL) CloseHandle(ghevPmShutdown);
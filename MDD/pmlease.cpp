@@ -0,0 +1,120 @@
+//
+// Copyright (c) Microsoft Corporation.  All rights reserved.
+//
+//
+// Use of this sample source code is subject to the terms of the Microsoft
+// license agreement under which you licensed this sample source code. If
+// you did not accept the terms of the license agreement, you are not
+// authorized to use this sample source code. For the terms of the license,
+// please see the license agreement between you and Microsoft or, if applicable,
+// see the LICENSE.RTF on your install media or the root of your tools installation.
+// THE SAMPLE SOURCE CODE IS PROVIDED "AS IS", WITH NO WARRANTIES OR INDEMNITIES.
+//
+
+//
+// This module implements device handle leases.  An exclusive lease is
+// guarded by an auto-reset event rather than a critical section, because
+// the IOCTL watchdog may return a lease from a helper thread after the
+// thread that acquired it has given up on the driver.
+//
+
+#include <pmimpl.h>
+#include "pmlease.h"
+#include "pmdxword.h"
+
+// This routine marks a device's handle as one that must not be used by two
+// threads at once.  AddDevice() calls it for drivers that refuse a second
+// handle.  It returns FALSE if the lease can't be set up, in which case the
+// caller should close the handle and let each lease open its own.
+BOOL
+DeviceLeaseSetExclusive(PDEVICE_STATE pds)
+{
+    PDEVICE_STATE_EX pdsx = (PDEVICE_STATE_EX) pds;
+    SETFNAME(_T("DeviceLeaseSetExclusive"));
+
+    PREFAST_DEBUGCHK(pds != NULL);
+    DEBUGCHK(pds->hDevice != INVALID_HANDLE_VALUE);
+    DEBUGCHK(pdsx->hevLease == NULL);
+
+    pdsx->hevLease = CreateEvent(NULL, FALSE, TRUE, NULL);
+    if(pdsx->hevLease == NULL) {
+        PMLOGMSG(ZONE_WARN, (_T("%s: CreateEvent() failed %d for '%s'\r\n"),
+            pszFname, GetLastError(), pds->pszName));
+        return FALSE;
+    }
+
+    PMLOGMSG(ZONE_DEVICE, (_T("%s: keeping the only handle to '%s'\r\n"), pszFname,
+        pds->pszName));
+    return TRUE;
+}
+
+// This routine lends the caller a handle to a device and sets *pdwLease to
+// the kind of lease it got.  It returns INVALID_HANDLE_VALUE if no handle
+// is available.  A device whose handle is stuck in an IOCTL the watchdog
+// gave up on has nothing to lend.  A driver that calls back into the PM
+// from inside a request shares the lease its caller already holds.
+HANDLE
+DeviceLeaseAcquire(PDEVICE_STATE pds, PDWORD pdwLease)
+{
+    PDEVICE_STATE_EX pdsx = (PDEVICE_STATE_EX) pds;
+    HANDLE hDevice = pds->hDevice;
+    SETFNAME(_T("DeviceLeaseAcquire"));
+
+    PREFAST_DEBUGCHK(pds != NULL);
+    PREFAST_DEBUGCHK(pdwLease != NULL);
+
+    if(hDevice == INVALID_HANDLE_VALUE) {
+        DEBUGCHK(pds->pInterface->pfnOpenDevice != NULL);
+        *pdwLease = DEVICE_LEASE_OPENED;
+        hDevice = pds->pInterface->pfnOpenDevice(pds);
+    } else if(pdsx->hevLease == NULL) {
+        *pdwLease = DEVICE_LEASE_SHARED;
+    } else if(pdsx->dwLeaseOwner == GetCurrentThreadId()) {
+        *pdwLease = DEVICE_LEASE_SHARED;
+    } else {
+        *pdwLease = DEVICE_LEASE_EXCLUSIVE;
+        while(WaitForSingleObject(pdsx->hevLease, DEVICE_LEASE_POLL_MS) != WAIT_OBJECT_0) {
+            if(pdsx->lWatchdogStuck != 0) {
+                PMLOGMSG(ZONE_WARN, (_T("%s: the only handle to '%s' is stuck in its driver\r\n"),
+                    pszFname, pds->pszName));
+                hDevice = INVALID_HANDLE_VALUE;
+                break;
+            }
+        }
+        if(hDevice != INVALID_HANDLE_VALUE) {
+            pdsx->dwLeaseOwner = GetCurrentThreadId();
+        }
+    }
+
+    return hDevice;
+}
+
+// This routine returns a handle obtained with DeviceLeaseAcquire().  It
+// preserves the last error so that callers can release before reporting.
+VOID
+DeviceLeaseRelease(PDEVICE_STATE pds, HANDLE hDevice, DWORD dwLease)
+{
+    PDEVICE_STATE_EX pdsx = (PDEVICE_STATE_EX) pds;
+    DWORD dwStatus;
+
+    PREFAST_DEBUGCHK(pds != NULL);
+
+    if(hDevice != INVALID_HANDLE_VALUE) {
+        switch(dwLease) {
+        case DEVICE_LEASE_EXCLUSIVE:
+            DEBUGCHK(pdsx->hevLease != NULL);
+            pdsx->dwLeaseOwner = 0;
+            SetEvent(pdsx->hevLease);
+            break;
+        case DEVICE_LEASE_OPENED:
+            DEBUGCHK(pds->pInterface->pfnCloseDevice != NULL);
+            dwStatus = GetLastError();
+            pds->pInterface->pfnCloseDevice(hDevice);
+            SetLastError(dwStatus);
+            break;
+        default:
+            DEBUGCHK(dwLease == DEVICE_LEASE_SHARED);
+            break;
+        }
+    }
+}
@@ -0,0 +1,49 @@
+//
+// Copyright (c) Microsoft Corporation.  All rights reserved.
+//
+//
+// Use of this sample source code is subject to the terms of the Microsoft
+// license agreement under which you licensed this sample source code. If
+// you did not accept the terms of the license agreement, you are not
+// authorized to use this sample source code. For the terms of the license,
+// please see the license agreement between you and Microsoft or, if applicable,
+// see the LICENSE.RTF on your install media or the root of your tools installation.
+// THE SAMPLE SOURCE CODE IS PROVIDED "AS IS", WITH NO WARRANTIES OR INDEMNITIES.
+//
+
+//
+// This module declares device handle leases.  Code that needs to talk to a
+// driver borrows a handle with DeviceLeaseAcquire() and gives it back with
+// DeviceLeaseRelease().  Most drivers allow any number of handles, so the
+// handle opened by AddDevice() is shared by everybody.  Drivers that only
+// allow one handle keep theirs too, but only one caller at a time may hold
+// it.  If a device has no handle at all a fresh one is opened and closed
+// for each lease, as the PM always used to do.
+//
+
+#ifndef __PMLEASE_H
+#define __PMLEASE_H
+
+#include <pmimpl.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define DEVICE_LEASE_SHARED     0       // pds->hDevice, no serialization
+#define DEVICE_LEASE_EXCLUSIVE  1       // pds->hDevice, one holder at a time
+#define DEVICE_LEASE_OPENED     2       // opened for this lease, closed after
+
+// how often a thread waiting for an exclusive lease checks whether the
+// holder has been abandoned in its driver by the IOCTL watchdog
+#define DEVICE_LEASE_POLL_MS    100
+
+BOOL DeviceLeaseSetExclusive(PDEVICE_STATE pds);
+HANDLE DeviceLeaseAcquire(PDEVICE_STATE pds, PDWORD pdwLease);
+VOID DeviceLeaseRelease(PDEVICE_STATE pds, HANDLE hDevice, DWORD dwLease);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
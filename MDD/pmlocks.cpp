@@ -0,0 +1,311 @@
+//
+// Copyright (c) Microsoft Corporation.  All rights reserved.
+//
+//
+// Use of this sample source code is subject to the terms of the Microsoft
+// license agreement under which you licensed this sample source code. If
+// you did not accept the terms of the license agreement, you are not
+// authorized to use this sample source code. For the terms of the license,
+// please see the license agreement between you and Microsoft or, if applicable,
+// see the LICENSE.RTF on your install media or the root of your tools installation.
+// THE SAMPLE SOURCE CODE IS PROVIDED "AS IS", WITH NO WARRANTIES OR INDEMNITIES.
+//
+
+//
+// This module implements the finer grained PM locks and, in debug builds,
+// the checks that keep them in rank order.  See pmlocks.h for the ordering.
+//
+
+#include <pmimpl.h>
+#include "pmlocks.h"
+
+static CRITICAL_SECTION gcsDeviceStripes[PM_DEVICE_LOCK_STRIPES];
+static CRITICAL_SECTION gcsNotifications;
+static CRITICAL_SECTION gcsTimers;
+
+// The thread holding the update lock may lend it to threads that call
+// drivers on its behalf -- the fan-out workers and the watchdog helpers.  A
+// driver that calls a device update API from one of those threads passes
+// through PMENTERUPDATE(), just as it would have on the lending thread,
+// instead of waiting for a lock that won't be released until the driver
+// returns.  Only one lend is current at a time; the owner's fields are
+// protected by the update lock itself.
+static DWORD gdwUpdateOwner;                // thread holding the update lock
+static DWORD gdwUpdateDepth;                // the owner's recursion count
+static DWORD gdwUpdateLends;                // the owner's outstanding lends
+static volatile LONG glUpdateLend;          // current lend, 0 if none
+static volatile LONG glUpdateLendSeq;
+static DWORD gdwBorrowTlsIndex = TLS_OUT_OF_INDEXES;   // lend a thread works under
+static DWORD gdwPassTlsIndex = TLS_OUT_OF_INDEXES;     // its pass-through depth
+
+#ifdef DEBUG
+// Each thread keeps its lock depth for every rank in a TLS slot, four bits
+// per rank.  That's plenty: the PM lock is the only one that nests deeply.
+static DWORD gdwLockTlsIndex = TLS_OUT_OF_INDEXES;
+
+#define RANK_SHIFT(r)       ((r) * 4)
+#define RANK_DEPTH(dw, r)   (((dw) >> RANK_SHIFT(r)) & 0xF)
+#endif  // DEBUG
+
+// This routine initializes the lock hierarchy.  It must be called before
+// any PM thread is started.
+BOOL
+PmLocksInit(VOID)
+{
+    DWORD dwIndex;
+    SETFNAME(_T("PmLocksInit"));
+
+    for(dwIndex = 0; dwIndex < _countof(gcsDeviceStripes); dwIndex++) {
+        InitializeCriticalSection(&gcsDeviceStripes[dwIndex]);
+    }
+    InitializeCriticalSection(&gcsNotifications);
+    InitializeCriticalSection(&gcsTimers);
+
+    gdwBorrowTlsIndex = TlsAlloc();
+    gdwPassTlsIndex = TlsAlloc();
+    if(gdwBorrowTlsIndex == TLS_OUT_OF_INDEXES || gdwPassTlsIndex == TLS_OUT_OF_INDEXES) {
+        PMLOGMSG(ZONE_WARN, (_T("%s: TlsAlloc() failed, the update lock can't be lent\r\n"),
+            pszFname));
+        if(gdwBorrowTlsIndex != TLS_OUT_OF_INDEXES) TlsFree(gdwBorrowTlsIndex);
+        if(gdwPassTlsIndex != TLS_OUT_OF_INDEXES) TlsFree(gdwPassTlsIndex);
+        gdwBorrowTlsIndex = gdwPassTlsIndex = TLS_OUT_OF_INDEXES;
+    }
+
+#ifdef DEBUG
+    gdwLockTlsIndex = TlsAlloc();
+    PMLOGMSG(gdwLockTlsIndex == TLS_OUT_OF_INDEXES && ZONE_WARN,
+        (_T("%s: TlsAlloc() failed, lock ordering won't be checked\r\n"), pszFname));
+#endif  // DEBUG
+
+    return TRUE;
+}
+
+#ifdef DEBUG
+// This routine records that the calling thread is about to acquire a lock of
+// the given rank, and complains if that could deadlock against a thread that
+// follows the documented order.
+VOID
+PmLockNoteAcquire(DWORD dwRank)
+{
+    DWORD dwHeld, dwHigher;
+    SETFNAME(_T("PmLockNoteAcquire"));
+
+    DEBUGCHK(dwRank < PM_LOCK_RANKS);
+    if(gdwLockTlsIndex == TLS_OUT_OF_INDEXES) {
+        return;
+    }
+
+    dwHeld = (DWORD) TlsGetValue(gdwLockTlsIndex);
+
+    // re-entering an owned lock never blocks, except that two device locks
+    // may be different stripes
+    if(RANK_DEPTH(dwHeld, dwRank) == 0 || dwRank == PM_LOCK_RANK_DEVICE) {
+        dwHigher = dwHeld >> RANK_SHIFT(dwRank);
+        if(dwHigher != 0) {
+            PMLOGMSG(ZONE_ERROR, (_T("%s: rank %d acquired out of order, held 0x%08x\r\n"),
+                pszFname, dwRank, dwHeld));
+            DEBUGCHK(FALSE);
+        }
+    }
+
+    DEBUGCHK(RANK_DEPTH(dwHeld, dwRank) < 0xF);
+    dwHeld += 1 << RANK_SHIFT(dwRank);
+    TlsSetValue(gdwLockTlsIndex, (LPVOID) dwHeld);
+}
+
+// This routine records that the calling thread has released a lock.
+VOID
+PmLockNoteRelease(DWORD dwRank)
+{
+    DWORD dwHeld;
+
+    DEBUGCHK(dwRank < PM_LOCK_RANKS);
+    if(gdwLockTlsIndex == TLS_OUT_OF_INDEXES) {
+        return;
+    }
+
+    dwHeld = (DWORD) TlsGetValue(gdwLockTlsIndex);
+    DEBUGCHK(RANK_DEPTH(dwHeld, dwRank) != 0);
+    dwHeld -= 1 << RANK_SHIFT(dwRank);
+    TlsSetValue(gdwLockTlsIndex, (LPVOID) dwHeld);
+}
+#endif  // DEBUG
+
+// This routine maps a device to the lock protecting its Dx fields.  Device
+// state structures come from the pool allocator, so the low bits carry no
+// information.
+static __inline LPCRITICAL_SECTION
+DeviceLockFromState(PDEVICE_STATE pds)
+{
+    DWORD dwKey = (DWORD) pds;
+    dwKey ^= dwKey >> 11;
+    return &gcsDeviceStripes[(dwKey >> 5) % PM_DEVICE_LOCK_STRIPES];
+}
+
+// serialize access to a device's Dx fields
+VOID
+DeviceLock(PDEVICE_STATE pds)
+{
+    PREFAST_DEBUGCHK(pds != NULL);
+    PmLockNoteAcquire(PM_LOCK_RANK_DEVICE);
+    EnterCriticalSection(DeviceLockFromState(pds));
+}
+
+// release a lock obtained with DeviceLock()
+VOID
+DeviceUnlock(PDEVICE_STATE pds)
+{
+    LeaveCriticalSection(DeviceLockFromState(pds));
+    PmLockNoteRelease(PM_LOCK_RANK_DEVICE);
+}
+
+// serialize access to the power notification list
+VOID
+NotifyLock(VOID)
+{
+    PmLockNoteAcquire(PM_LOCK_RANK_NOTIFY);
+    EnterCriticalSection(&gcsNotifications);
+}
+
+// release a lock obtained with NotifyLock()
+VOID
+NotifyUnlock(VOID)
+{
+    LeaveCriticalSection(&gcsNotifications);
+    PmLockNoteRelease(PM_LOCK_RANK_NOTIFY);
+}
+
+// serialize access to the activity timer list
+VOID
+TimerLock(VOID)
+{
+    PmLockNoteAcquire(PM_LOCK_RANK_TIMER);
+    EnterCriticalSection(&gcsTimers);
+}
+
+// release a lock obtained with TimerLock()
+VOID
+TimerUnlock(VOID)
+{
+    LeaveCriticalSection(&gcsTimers);
+    PmLockNoteRelease(PM_LOCK_RANK_TIMER);
+}
+
+// PmEnterUpdate() calls this before taking the update lock.  It returns TRUE
+// if the calling thread is working under the current lend, or has already
+// passed through, and so must not take the lock.
+BOOL
+PmUpdatePassEnter(VOID)
+{
+    DWORD dwPass;
+    LONG lBorrowed;
+
+    if(gdwPassTlsIndex == TLS_OUT_OF_INDEXES) {
+        return FALSE;
+    }
+    dwPass = (DWORD) TlsGetValue(gdwPassTlsIndex);
+    if(dwPass == 0) {
+        lBorrowed = (LONG) TlsGetValue(gdwBorrowTlsIndex);
+        if(lBorrowed == 0 || lBorrowed != glUpdateLend) {
+            return FALSE;
+        }
+    }
+    TlsSetValue(gdwPassTlsIndex, (LPVOID) (dwPass + 1));
+    return TRUE;
+}
+
+// PmLeaveUpdate() calls this before releasing the update lock.  It returns
+// TRUE if the matching PmEnterUpdate() passed through.
+BOOL
+PmUpdatePassLeave(VOID)
+{
+    DWORD dwPass;
+
+    if(gdwPassTlsIndex == TLS_OUT_OF_INDEXES) {
+        return FALSE;
+    }
+    dwPass = (DWORD) TlsGetValue(gdwPassTlsIndex);
+    if(dwPass == 0) {
+        return FALSE;
+    }
+    TlsSetValue(gdwPassTlsIndex, (LPVOID) (dwPass - 1));
+    return TRUE;
+}
+
+// This routine records that the calling thread has taken the update lock.
+VOID
+PmUpdateNoteAcquired(VOID)
+{
+    if(gdwUpdateDepth++ == 0) {
+        gdwUpdateOwner = GetCurrentThreadId();
+    }
+}
+
+// This routine records that the calling thread is about to release the
+// update lock.
+VOID
+PmUpdateNoteReleased(VOID)
+{
+    DEBUGCHK(gdwUpdateDepth != 0 && gdwUpdateOwner == GetCurrentThreadId());
+    DEBUGCHK(gdwUpdateDepth > 1 || gdwUpdateLends == 0);
+    if(--gdwUpdateDepth == 0) {
+        gdwUpdateOwner = 0;
+    }
+}
+
+// This routine lends the update lock to threads about to call drivers for
+// the caller, and returns the lend for them to pass to PmUpdateBorrow().  A
+// thread that is itself working under the current lend passes that on.  It
+// returns 0 if the caller has nothing to lend.  Every call must be matched
+// by PmUpdateRevoke().
+LONG
+PmUpdateLend(VOID)
+{
+    LONG lBorrowed;
+
+    if(gdwUpdateOwner == GetCurrentThreadId()) {
+        if(gdwUpdateLends++ == 0) {
+            LONG lLend;
+            do {
+                lLend = InterlockedIncrement(&glUpdateLendSeq);
+            } while(lLend == 0);
+            glUpdateLend = lLend;
+        }
+        return glUpdateLend;
+    }
+    if(gdwBorrowTlsIndex != TLS_OUT_OF_INDEXES) {
+        lBorrowed = (LONG) TlsGetValue(gdwBorrowTlsIndex);
+        if(lBorrowed != 0 && lBorrowed == glUpdateLend) {
+            return lBorrowed;
+        }
+    }
+    return 0;
+}
+
+// This routine ends a lend made with PmUpdateLend().  A thread that is still
+// inside a driver keeps the access it already has, but its next device
+// update API call waits for the lock as usual.
+VOID
+PmUpdateRevoke(LONG lLend)
+{
+    if(lLend != 0 && gdwUpdateOwner == GetCurrentThreadId()) {
+        DEBUGCHK(gdwUpdateLends != 0 && glUpdateLend == lLend);
+        if(--gdwUpdateLends == 0) {
+            glUpdateLend = 0;
+        }
+    }
+}
+
+// This routine sets the lend the calling thread works under, 0 for none,
+// and returns the previous one.
+LONG
+PmUpdateBorrow(LONG lLend)
+{
+    LONG lPrevious = 0;
+
+    if(gdwBorrowTlsIndex != TLS_OUT_OF_INDEXES) {
+        lPrevious = (LONG) TlsGetValue(gdwBorrowTlsIndex);
+        TlsSetValue(gdwBorrowTlsIndex, (LPVOID) lLend);
+    }
+    return lPrevious;
+}
@@ -0,0 +1,85 @@
+//
+// Copyright (c) Microsoft Corporation.  All rights reserved.
+//
+//
+// Use of this sample source code is subject to the terms of the Microsoft
+// license agreement under which you licensed this sample source code. If
+// you did not accept the terms of the license agreement, you are not
+// authorized to use this sample source code. For the terms of the license,
+// please see the license agreement between you and Microsoft or, if applicable,
+// see the LICENSE.RTF on your install media or the root of your tools installation.
+// THE SAMPLE SOURCE CODE IS PROVIDED "AS IS", WITH NO WARRANTIES OR INDEMNITIES.
+//
+
+//
+// This module declares the PM lock hierarchy.  Locks must be acquired in
+// increasing rank order; a thread may re-enter a lock it already owns, but
+// may not take a lower ranked lock while holding a higher ranked one.  Debug
+// builds check this on every acquisition.
+//
+//      PM_LOCK_RANK_UPDATE     PMENTERUPDATE(), serializes device update APIs
+//      PM_LOCK_RANK_GLOBAL     PMLOCK(), device lists, restrictions, states
+//      PM_LOCK_RANK_NOTIFY     the power notification list
+//      PM_LOCK_RANK_TIMER      the activity timer list and timer counters
+//      PM_LOCK_RANK_DEVICE     a device's Dx fields (leaf, never nested)
+//
+// The device lock covers lastReqDx and setDx; a device's current, actual
+// and pending states are kept in its Dx word (pmdxword.h), which needs no
+// lock.  floorDx and ceilingDx are derived from the restriction lists and
+// stay under the PM lock.  Code holding a NOTIFY, TIMER or DEVICE lock
+// must not call anything that takes the PM lock.
+//
+// The update lock can be lent to worker threads that call drivers for its
+// owner (see PmUpdateLend()), so that drivers calling back into the PM from
+// those threads behave as they would on the owner's thread.
+//
+
+#ifndef __PMLOCKS_H
+#define __PMLOCKS_H
+
+#include <pmimpl.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PM_LOCK_RANK_UPDATE     0
+#define PM_LOCK_RANK_GLOBAL     1
+#define PM_LOCK_RANK_NOTIFY     2
+#define PM_LOCK_RANK_TIMER      3
+#define PM_LOCK_RANK_DEVICE     4
+#define PM_LOCK_RANKS           5
+
+// number of locks that device Dx fields are spread across
+#define PM_DEVICE_LOCK_STRIPES  32
+
+BOOL PmLocksInit(VOID);
+
+#ifdef DEBUG
+VOID PmLockNoteAcquire(DWORD dwRank);
+VOID PmLockNoteRelease(DWORD dwRank);
+#else
+#define PmLockNoteAcquire(dwRank)   ((VOID) 0)
+#define PmLockNoteRelease(dwRank)   ((VOID) 0)
+#endif
+
+VOID DeviceLock(PDEVICE_STATE pds);
+VOID DeviceUnlock(PDEVICE_STATE pds);
+VOID NotifyLock(VOID);
+VOID NotifyUnlock(VOID);
+VOID TimerLock(VOID);
+VOID TimerUnlock(VOID);
+
+BOOL PmUpdatePassEnter(VOID);
+BOOL PmUpdatePassLeave(VOID);
+VOID PmUpdateNoteAcquired(VOID);
+VOID PmUpdateNoteReleased(VOID);
+LONG PmUpdateLend(VOID);
+VOID PmUpdateRevoke(LONG lLend);
+LONG PmUpdateBorrow(LONG lLend);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
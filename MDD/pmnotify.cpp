@@ -14,34 +14,693 @@
 //
 // This routine keeps track of notification requests from applications.
 //
+// Each registration has a subscriber record with its own write handle to the
+// client's queue.  Broadcasts go out from a snapshot that holds a reference
+// on every subscriber in it, so a client that deregisters while a broadcast
+// is in progress keeps its handle until the broadcast is done with it.
+//
 
 #include <pmimpl.h>
 #include <msgqueue.h>
 #include <pkfuncs.h>
+#include "pmlocks.h"
+#include "pmnotify.h"
+#include "pmstatuspage.h"
+
+// a broadcast waiting for delivery, shared by every subscriber it's queued for
+typedef struct _NOTIFY_MESSAGE {
+    volatile LONG lRefCount;
+    DWORD dwMessage;
+    DWORD dwLen;                        // bytes of POWER_BROADCAST that follow
+} NOTIFY_MESSAGE, *PNOTIFY_MESSAGE;
+
+typedef struct _NOTIFY_SUBSCRIBER {
+    struct _NOTIFY_SUBSCRIBER *pNext;   // registered subscribers, under NotifyLock()
+    volatile LONG lRefCount;            // one for the registration, one per snapshot
+    PPOWER_NOTIFICATION ppn;            // registration it belongs to; only a key once removed
+    HANDLE hMsgQ;                       // our own write handle to the client's queue
+    DWORD dwFlags;
+    // the rest is protected by gcsNotifyQueues
+    PNOTIFY_MESSAGE *ppnmPending;       // oldest first
+    DWORD dwQueueSize;                  // entries allocated at ppnmPending
+    DWORD dwPending;
+    BOOL fSending;                      // the dispatcher is writing ppnmPending[0]
+    DWORD dwSent;
+    DWORD dwDropped;
+    DWORD dwCoalesced;
+    DWORD dwSkipped;                    // transitions held back and superseded
+    BOOL fSettledOnly;                  // PM_NOTIFY_OPTION_SETTLED
+} NOTIFY_SUBSCRIBER, *PNOTIFY_SUBSCRIBER;
+
+typedef struct _NOTIFY_SNAPSHOT {
+    volatile LONG lRefCount;            // one while published, one per broadcast
+    DWORD dwSubscribers;
+    PNOTIFY_SUBSCRIBER *ppSubscribers;  // each subscriber once
+    PNOTIFY_SUBSCRIBER *ppBucket[NOTIFY_BUCKETS];
+    DWORD dwBucketSize[NOTIFY_BUCKETS];
+} NOTIFY_SNAPSHOT, *PNOTIFY_SNAPSHOT;
+
+static PNOTIFY_SUBSCRIBER gpNotifySubscribers;
+static PNOTIFY_SNAPSHOT gpNotifySnapshot;
+static CRITICAL_SECTION gcsNotifySnapshot;  // guards taking a snapshot reference only
+static CRITICAL_SECTION gcsNotifyQueues;    // guards subscriber queues and counters
+static BOOL gfNotifyDispatcher = FALSE;
+static HANDLE ghtNotifyDispatcher;
+static HANDLE ghevNotifyWork;               // set when a broadcast is queued
+static HANDLE ghevNotifyPassDone;           // set after each dispatcher pass
+static volatile LONG glNotifyQueuedSeq;     // broadcasts queued so far
+static volatile LONG glNotifyDoneSeq;       // broadcasts the dispatcher has tried
+static LONG glNotifyChainDepth;             // transition chains in progress
+static PNOTIFY_MESSAGE gpnmHeldTransition;  // last PBT_TRANSITION of the chain
+static DWORD gdwHeldTransitions;            // PBT_TRANSITIONs held during the chain
+
+// who a broadcast goes to
+#define NOTIFY_AUDIENCE_ALL         0
+#define NOTIFY_AUDIENCE_UNSETTLED   1   // everybody but settled-state subscribers
+#define NOTIFY_AUDIENCE_SETTLED     2   // only settled-state subscribers
+
+#define NOTIFY_SUSPEND_FLAGS (POWER_STATE_SUSPEND | POWER_STATE_OFF | POWER_STATE_CRITICAL | POWER_STATE_RESET)
+
+// This routine drops a reference on a queued broadcast.
+static VOID
+NotifyMessageRelease(PNOTIFY_MESSAGE pnm)
+{
+    if(InterlockedDecrement(&pnm->lRefCount) == 0) {
+        PmFree(pnm);
+    }
+}
+
+// This routine drops a reference on a subscriber, closing its queue handle
+// when the last one goes.
+static VOID
+NotifySubscriberRelease(PNOTIFY_SUBSCRIBER pns)
+{
+    if(InterlockedDecrement(&pns->lRefCount) == 0) {
+        while(pns->dwPending != 0) {
+            NotifyMessageRelease(pns->ppnmPending[--pns->dwPending]);
+        }
+        CloseMsgQueue(pns->hMsgQ);
+        PmFree(pns->ppnmPending);
+        PmFree(pns);
+    }
+}
+
+// This routine drops a reference on a snapshot, releasing its subscribers
+// when the last one goes.
+static VOID
+NotifySnapshotRelease(PNOTIFY_SNAPSHOT pnss)
+{
+    if(InterlockedDecrement(&pnss->lRefCount) == 0) {
+        DWORD dwIndex;
+        for(dwIndex = 0; dwIndex < pnss->dwSubscribers; dwIndex++) {
+            NotifySubscriberRelease(pnss->ppSubscribers[dwIndex]);
+        }
+        PmFree(pnss);
+    }
+}
+
+// This routine returns a reference on the current snapshot, or NULL if
+// nobody has registered yet.
+static PNOTIFY_SNAPSHOT
+NotifySnapshotAcquire(VOID)
+{
+    PNOTIFY_SNAPSHOT pnss;
+
+    EnterCriticalSection(&gcsNotifySnapshot);
+    pnss = gpNotifySnapshot;
+    if(pnss != NULL) {
+        InterlockedIncrement(&pnss->lRefCount);
+    }
+    LeaveCriticalSection(&gcsNotifySnapshot);
+
+    return pnss;
+}
+
+// This routine builds a snapshot of the registered subscribers and
+// publishes it.  The caller must hold the notification lock.  If there's no
+// memory the old snapshot stays published; that's safe, since it holds its
+// own references, but new clients won't hear anything until the next
+// rebuild.
+static VOID
+NotifySnapshotRebuild(VOID)
+{
+    PNOTIFY_SNAPSHOT pnss, pnssOld;
+    PNOTIFY_SUBSCRIBER pns;
+    PNOTIFY_SUBSCRIBER *ppEntry;
+    DWORD dwSubscribers = 0, dwEntries = 0;
+    DWORD dwBit;
+    SETFNAME(_T("NotifySnapshotRebuild"));
+
+    for(pns = gpNotifySubscribers; pns != NULL; pns = pns->pNext) {
+        dwSubscribers++;
+        for(dwBit = 0; dwBit < NOTIFY_BUCKETS; dwBit++) {
+            if((pns->dwFlags & ((DWORD) 1 << dwBit)) != 0) dwEntries++;
+        }
+    }
+
+    pnss = (PNOTIFY_SNAPSHOT) PmAlloc(sizeof(*pnss) 
+        + (dwSubscribers + dwEntries) * sizeof(PNOTIFY_SUBSCRIBER));
+    if(pnss == NULL) {
+        PMLOGMSG(ZONE_WARN, (_T("%s: couldn't allocate a snapshot of %u subscribers\r\n"),
+            pszFname, dwSubscribers));
+        return;
+    }
+    memset(pnss, 0, sizeof(*pnss));
+    pnss->lRefCount = 1;
+    pnss->ppSubscribers = (PNOTIFY_SUBSCRIBER *) (pnss + 1);
+    for(pns = gpNotifySubscribers; pns != NULL; pns = pns->pNext) {
+        InterlockedIncrement(&pns->lRefCount);
+        pnss->ppSubscribers[pnss->dwSubscribers++] = pns;
+    }
+
+    // lay the buckets out back to back after the subscriber list
+    ppEntry = pnss->ppSubscribers + dwSubscribers;
+    for(dwBit = 0; dwBit < NOTIFY_BUCKETS; dwBit++) {
+        DWORD dwIndex;
+        pnss->ppBucket[dwBit] = ppEntry;
+        for(dwIndex = 0; dwIndex < dwSubscribers; dwIndex++) {
+            if((pnss->ppSubscribers[dwIndex]->dwFlags & ((DWORD) 1 << dwBit)) != 0) {
+                *ppEntry++ = pnss->ppSubscribers[dwIndex];
+            }
+        }
+        pnss->dwBucketSize[dwBit] = ppEntry - pnss->ppBucket[dwBit];
+    }
+    DEBUGCHK(ppEntry == pnss->ppSubscribers + dwSubscribers + dwEntries);
+
+    EnterCriticalSection(&gcsNotifySnapshot);
+    pnssOld = gpNotifySnapshot;
+    gpNotifySnapshot = pnss;
+    LeaveCriticalSection(&gcsNotifySnapshot);
+
+    // broadcasts in progress keep the old one alive until they're done
+    if(pnssOld != NULL) {
+        NotifySnapshotRelease(pnssOld);
+    }
+}
+
+// This routine creates a subscriber for a new registration.  The caller must
+// hold the notification lock and should rebuild the snapshot afterwards.
+static BOOL
+NotifySubscriberAdd(PPOWER_NOTIFICATION ppn)
+{
+    PNOTIFY_SUBSCRIBER pns;
+    MSGQUEUEOPTIONS msgopts;
+    SETFNAME(_T("NotifySubscriberAdd"));
+
+    pns = (PNOTIFY_SUBSCRIBER) PmAlloc(sizeof(*pns));
+    if(pns == NULL) {
+        PMLOGMSG(ZONE_WARN, (_T("%s: couldn't allocate subscriber\r\n"), pszFname));
+        return FALSE;
+    }
+    memset(pns, 0, sizeof(*pns));
+    pns->ppnmPending = (PNOTIFY_MESSAGE *) PmAlloc(NOTIFY_QUEUE_DEPTH * sizeof(pns->ppnmPending[0]));
+    if(pns->ppnmPending == NULL) {
+        PMLOGMSG(ZONE_WARN, (_T("%s: couldn't allocate subscriber queue\r\n"), pszFname));
+        PmFree(pns);
+        return FALSE;
+    }
+    pns->dwQueueSize = NOTIFY_QUEUE_DEPTH;
+
+    memset(&msgopts, 0, sizeof(msgopts));
+    msgopts.dwSize = sizeof(MSGQUEUEOPTIONS);
+    msgopts.bReadAccess = FALSE;
+    pns->hMsgQ = OpenMsgQueue(GetCurrentProcess(), ppn->hMsgQ, &msgopts);
+    if(pns->hMsgQ == NULL) {
+        PMLOGMSG(ZONE_WARN, (_T("%s: OpenMsgQueue() failed %d\r\n"), pszFname, GetLastError()));
+        PmFree(pns->ppnmPending);
+        PmFree(pns);
+        return FALSE;
+    }
+    pns->lRefCount = 1;
+    pns->ppn = ppn;
+    pns->dwFlags = ppn->dwFlags;
+    pns->pNext = gpNotifySubscribers;
+    gpNotifySubscribers = pns;
+    return TRUE;
+}
+
+// This routine removes the subscriber for a registration.  The caller must
+// hold the notification lock and should rebuild the snapshot afterwards.
+static VOID
+NotifySubscriberRemove(PPOWER_NOTIFICATION ppn)
+{
+    PNOTIFY_SUBSCRIBER *ppns;
+
+    for(ppns = &gpNotifySubscribers; *ppns != NULL; ppns = &(*ppns)->pNext) {
+        if((*ppns)->ppn == ppn) {
+            PNOTIFY_SUBSCRIBER pns = *ppns;
+            *ppns = pns->pNext;
+            NotifySubscriberRelease(pns);
+            break;
+        }
+    }
+}
+
+// This routine returns the subscriber for a registration, or NULL if it
+// doesn't have one.  The caller must hold the notification lock.
+static PNOTIFY_SUBSCRIBER
+NotifySubscriberFind(PPOWER_NOTIFICATION ppn)
+{
+    PNOTIFY_SUBSCRIBER pns;
+
+    for(pns = gpNotifySubscribers; pns != NULL; pns = pns->pNext) {
+        if(pns->ppn == ppn) {
+            break;
+        }
+    }
+    return pns;
+}
+
+// This routine sends a notification to one subscriber from a snapshot.
+static VOID
+NotifySubscriberSend(PNOTIFY_SUBSCRIBER pns, PPOWER_BROADCAST ppb, DWORD dwLen)
+{
+    SETFNAME(_T("NotifySubscriberSend"));
+
+    PMLOGMSG(ZONE_NOTIFY, 
+        (_T("%s: sending notification to 0x%08x\r\n"), pszFname, pns->ppn));
+    if(!WriteMsgQueue(pns->hMsgQ, ppb, dwLen, 0, 0)) {
+        PMLOGMSG(ZONE_WARN, (_T("%s: WriteMsgQueue(0x%08x, 0x%08x, 0x%x) failed %d\r\n"),
+            pszFname, pns->hMsgQ, ppb, dwLen, GetLastError()));
+    }        
+}
+
+// This routine doubles the size of a subscriber's queue, up to
+// NOTIFY_QUEUE_MAX.  It returns FALSE if the queue is as big as it may get
+// or there's no memory.  The caller must hold gcsNotifyQueues.
+static BOOL
+NotifySubscriberGrow(PNOTIFY_SUBSCRIBER pns)
+{
+    PNOTIFY_MESSAGE *ppnmPending;
+    DWORD dwQueueSize = min(pns->dwQueueSize * 2, NOTIFY_QUEUE_MAX);
+
+    if(dwQueueSize <= pns->dwQueueSize) {
+        return FALSE;
+    }
+    ppnmPending = (PNOTIFY_MESSAGE *) PmAlloc(dwQueueSize * sizeof(ppnmPending[0]));
+    if(ppnmPending == NULL) {
+        return FALSE;
+    }
+    memcpy(ppnmPending, pns->ppnmPending, pns->dwPending * sizeof(ppnmPending[0]));
+    PmFree(pns->ppnmPending);
+    pns->ppnmPending = ppnmPending;
+    pns->dwQueueSize = dwQueueSize;
+    return TRUE;
+}
+
+// This routine queues a broadcast for a subscriber.  A PBT_POWERINFOCHANGE
+// replaces one that is still waiting at the end of the queue, since only the
+// latest battery information matters.  If the queue is full the oldest
+// PBT_POWERINFOCHANGE that isn't being written is dropped to make room.
+// If there's no battery update to throw away the queue grows instead, and
+// once it has reached NOTIFY_QUEUE_MAX the oldest broadcast that isn't being
+// written is dropped.  A new PBT_POWERINFOCHANGE is dropped rather than
+// displacing anything else.
+static VOID
+NotifySubscriberQueue(PNOTIFY_SUBSCRIBER pns, PNOTIFY_MESSAGE pnm)
+{
+    PNOTIFY_MESSAGE pnmOld = NULL;
+    DWORD dwFirst, dwIndex;
+    BOOL fLost = FALSE;
+    SETFNAME(_T("NotifySubscriberQueue"));
+
+    InterlockedIncrement(&pnm->lRefCount);
+
+    EnterCriticalSection(&gcsNotifyQueues);
+    dwFirst = pns->fSending ? 1 : 0;
+    if(pnm->dwMessage == PBT_POWERINFOCHANGE && pns->dwPending > dwFirst
+    && pns->ppnmPending[pns->dwPending - 1]->dwMessage == PBT_POWERINFOCHANGE) {
+        pnmOld = pns->ppnmPending[pns->dwPending - 1];
+        pns->ppnmPending[pns->dwPending - 1] = pnm;
+        pns->dwCoalesced++;
+    } else {
+        if(pns->dwPending == pns->dwQueueSize) {
+            for(dwIndex = dwFirst; dwIndex < pns->dwPending; dwIndex++) {
+                if(pns->ppnmPending[dwIndex]->dwMessage == PBT_POWERINFOCHANGE) {
+                    break;
+                }
+            }
+            if(dwIndex == pns->dwPending && pnm->dwMessage != PBT_POWERINFOCHANGE
+            && !NotifySubscriberGrow(pns)) {
+                // the client isn't keeping up; lose its oldest broadcast
+                fLost = TRUE;
+                dwIndex = dwFirst;
+            }
+            if(dwIndex < pns->dwPending) {
+                pnmOld = pns->ppnmPending[dwIndex];
+                memmove(&pns->ppnmPending[dwIndex], &pns->ppnmPending[dwIndex + 1],
+                    (pns->dwPending - dwIndex - 1) * sizeof(pns->ppnmPending[0]));
+                pns->dwPending--;
+                pns->dwDropped++;
+            } else if(pnm->dwMessage == PBT_POWERINFOCHANGE) {
+                // nothing may go to make room, so this broadcast is lost
+                pnmOld = pnm;
+                pnm = NULL;
+                pns->dwDropped++;
+            }
+        }
+        if(pnm != NULL) {
+            pns->ppnmPending[pns->dwPending++] = pnm;
+        }
+    }
+    LeaveCriticalSection(&gcsNotifyQueues);
+
+    PMLOGMSG(fLost && ZONE_WARN, (_T("%s: queue for 0x%08x is full, dropped message 0x%08x\r\n"),
+        pszFname, pns->ppn, pnmOld->dwMessage));
+    if(pnmOld != NULL) {
+        NotifyMessageRelease(pnmOld);
+    }
+}
+
+// This routine writes a subscriber's queued broadcasts to its message queue
+// until it runs out of them or the client's queue is full.  It returns TRUE
+// if broadcasts are left over.  Only the dispatcher thread calls it.
+static BOOL
+NotifySubscriberDrain(PNOTIFY_SUBSCRIBER pns)
+{
+    PNOTIFY_MESSAGE pnm;
+    BOOL fOk;
+    DWORD dwStatus;
+    SETFNAME(_T("NotifySubscriberDrain"));
+
+    for(;;) {
+        EnterCriticalSection(&gcsNotifyQueues);
+        if(pns->dwPending == 0) {
+            LeaveCriticalSection(&gcsNotifyQueues);
+            return FALSE;
+        }
+        pnm = pns->ppnmPending[0];
+        pns->fSending = TRUE;
+        LeaveCriticalSection(&gcsNotifyQueues);
+
+        PMLOGMSG(ZONE_NOTIFY, 
+            (_T("%s: sending notification to 0x%08x\r\n"), pszFname, pns->ppn));
+        fOk = WriteMsgQueue(pns->hMsgQ, pnm + 1, pnm->dwLen, 0, 0);
+        dwStatus = fOk ? ERROR_SUCCESS : GetLastError();
+
+        EnterCriticalSection(&gcsNotifyQueues);
+        pns->fSending = FALSE;
+        if(dwStatus == ERROR_TIMEOUT) {
+            // the client is behind; leave it be until the next pass
+            LeaveCriticalSection(&gcsNotifyQueues);
+            return TRUE;
+        }
+        DEBUGCHK(pns->ppnmPending[0] == pnm);
+        pns->dwPending--;
+        memmove(&pns->ppnmPending[0], &pns->ppnmPending[1], 
+            pns->dwPending * sizeof(pns->ppnmPending[0]));
+        if(fOk) {
+            pns->dwSent++;
+        } else {
+            pns->dwDropped++;
+        }
+        LeaveCriticalSection(&gcsNotifyQueues);
+
+        PMLOGMSG(!fOk && ZONE_WARN, (_T("%s: WriteMsgQueue(0x%08x, 0x%x) failed %d\r\n"),
+            pszFname, pns->hMsgQ, pnm->dwLen, dwStatus));
+        NotifyMessageRelease(pnm);
+    }
+}
+
+// This thread writes queued broadcasts to subscribers' message queues.
+static DWORD WINAPI
+NotifyDispatcherThreadProc(LPVOID lpvParam)
+{
+    HANDLE hEvents[2];
+    DWORD dwTimeout = INFINITE;
+    BOOL fDone = FALSE;
+    INT iPriority;
+    SETFNAME(_T("NotifyDispatcherThreadProc"));
+
+    UNREFERENCED_PARAMETER(lpvParam);
+
+    if(!GetPMThreadPriority(_T("NotifyPriority256"), &iPriority)) {
+        iPriority = DEF_SYSTEM_THREAD_PRIORITY;
+    }
+    CeSetThreadPriority(GetCurrentThread(), iPriority);
+
+    hEvents[0] = ghevNotifyWork;
+    hEvents[1] = ghevPmShutdown;
+    while(!fDone) {
+        DWORD dwStatus = WaitForMultipleObjects(_countof(hEvents), hEvents, FALSE, dwTimeout);
+        switch(dwStatus) {
+        case WAIT_TIMEOUT:
+        case (WAIT_OBJECT_0 + 0): {
+            LONG lSeq = glNotifyQueuedSeq;
+            PNOTIFY_SNAPSHOT pnss = NotifySnapshotAcquire();
+            BOOL fBacklog = FALSE;
+            if(pnss != NULL) {
+                DWORD dwIndex;
+                for(dwIndex = 0; dwIndex < pnss->dwSubscribers; dwIndex++) {
+                    if(NotifySubscriberDrain(pnss->ppSubscribers[dwIndex])) {
+                        fBacklog = TRUE;
+                    }
+                }
+                NotifySnapshotRelease(pnss);
+            }
+            dwTimeout = fBacklog ? NOTIFY_RETRY_MS : INFINITE;
+            InterlockedExchange(&glNotifyDoneSeq, lSeq);
+            SetEvent(ghevNotifyPassDone);
+            break;
+        }
+        case (WAIT_OBJECT_0 + 1):
+            fDone = TRUE;
+            break;
+        default:
+            PMLOGMSG(ZONE_WARN, (_T("%s: WaitForMultipleObjects() returned %d, status is %d\r\n"),
+                pszFname, dwStatus, GetLastError()));
+            fDone = TRUE;
+            break;
+        }
+    }
+
+    return 0;
+}
+
+// This routine waits up to dwTimeout ms for the dispatcher to try every
+// broadcast queued up to lSeq.  Only one thread may wait at a time.
+static VOID
+NotifyDispatcherFlush(LONG lSeq, DWORD dwTimeout)
+{
+    DWORD dwStart = GetTickCount();
+    SETFNAME(_T("NotifyDispatcherFlush"));
+
+    while((LONG) (glNotifyDoneSeq - lSeq) < 0) {
+        DWORD dwElapsed = GetTickCount() - dwStart;
+        if(dwElapsed >= dwTimeout) {
+            PMLOGMSG(ZONE_WARN, (_T("%s: broadcasts not delivered after %u ms\r\n"),
+                pszFname, dwElapsed));
+            break;
+        }
+        WaitForSingleObject(ghevNotifyPassDone, dwTimeout - dwElapsed);
+    }
+}
+
+// This routine copies a broadcast so it can outlive the caller's buffer.
+static PNOTIFY_MESSAGE
+NotifyMessageCreate(PPOWER_BROADCAST ppb, DWORD dwLen)
+{
+    PNOTIFY_MESSAGE pnm = (PNOTIFY_MESSAGE) PmAlloc(sizeof(*pnm) + dwLen);
+    if(pnm != NULL) {
+        pnm->lRefCount = 1;
+        pnm->dwMessage = ppb->Message;
+        pnm->dwLen = dwLen;
+        memcpy(pnm + 1, ppb, dwLen);
+    }
+    return pnm;
+}
 
 // This routine sends a notification to a specific listener.  The caller
-// of this routine must hold the PM lock. The dwLen parameter is the total
-// size, in bytes, of the message being sent.
+// of this routine must hold the notification lock. The dwLen parameter is the total
+// size, in bytes, of the message being sent.  If the listener has a subscriber
+// and the dispatcher is running, the notification is queued behind any
+// broadcasts the listener hasn't received yet so that it sees them in order.
 VOID
 SendNotification(PPOWER_NOTIFICATION ppn, PPOWER_BROADCAST ppb, DWORD dwLen)
 {
+    PNOTIFY_SUBSCRIBER pns = NULL;
+    PNOTIFY_MESSAGE pnm = NULL;
     SETFNAME(_T("SendNotification"));
 
-    PMLOGMSG(ZONE_NOTIFY, 
-        (_T("%s: sending notification to 0x%08x (owner 0x%08x)\r\n"),
-        pszFname, ppn, ppn->hOwner));
-    if(!WriteMsgQueue(ppn->hMsgQ, ppb, dwLen, 0, 0)) {
-        PMLOGMSG(ZONE_WARN, (_T("%s: WriteMsgQueue(0x%08x, 0x%08x, 0x%x) failed %d\r\n"),
-            pszFname, ppn->hMsgQ, ppb, dwLen, GetLastError()));
-    }        
+    if(gfNotifyDispatcher) {
+        pns = NotifySubscriberFind(ppn);
+        if(pns != NULL) {
+            pnm = NotifyMessageCreate(ppb, dwLen);
+        }
+    }
+    if(pnm != NULL) {
+        PMLOGMSG(ZONE_NOTIFY, 
+            (_T("%s: queueing notification for 0x%08x (owner 0x%08x)\r\n"),
+            pszFname, ppn, ppn->hOwner));
+        NotifySubscriberQueue(pns, pnm);
+        NotifyMessageRelease(pnm);
+        InterlockedIncrement(&glNotifyQueuedSeq);
+        SetEvent(ghevNotifyWork);
+    } else {
+        PMLOGMSG(ZONE_NOTIFY, 
+            (_T("%s: sending notification to 0x%08x (owner 0x%08x)\r\n"),
+            pszFname, ppn, ppn->hOwner));
+        if(!WriteMsgQueue(ppn->hMsgQ, ppb, dwLen, 0, 0)) {
+            PMLOGMSG(ZONE_WARN, (_T("%s: WriteMsgQueue(0x%08x, 0x%08x, 0x%x) failed %d\r\n"),
+                pszFname, ppn->hMsgQ, ppb, dwLen, GetLastError()));
+        }
+    }
+}
+
+// This routine returns TRUE if a subscriber is in a broadcast's audience.
+static __inline BOOL
+NotifyAudienceIncludes(PNOTIFY_SUBSCRIBER pns, DWORD dwAudience)
+{
+    switch(dwAudience) {
+    case NOTIFY_AUDIENCE_UNSETTLED:
+        return !pns->fSettledOnly;
+    case NOTIFY_AUDIENCE_SETTLED:
+        return pns->fSettledOnly;
+    default:
+        return TRUE;
+    }
+}
+
+// This routine sends a broadcast to the subscribers in dwAudience that have
+// registered for its message type.
+static VOID
+NotifyBroadcast(PPOWER_BROADCAST ppb, DWORD dwLen, DWORD dwAudience)
+{
+    PNOTIFY_SNAPSHOT pnss;
+    PNOTIFY_MESSAGE pnm = NULL;
+
+    // Listeners are called from a snapshot with no locks held, so a slow
+    // message queue doesn't hold up device updates or registrations.
+    pnss = NotifySnapshotAcquire();
+    if(pnss != NULL) {
+        DWORD dwMessage = ppb->Message;
+        DWORD dwIndex, dwBit;
+        PNOTIFY_SUBSCRIBER pns;
+
+        // Hand the broadcast to the dispatcher if it's running.  If it isn't,
+        // or there's no memory for a copy, write to the clients ourselves.
+        if(gfNotifyDispatcher) {
+            pnm = NotifyMessageCreate(ppb, dwLen);
+        }
+
+        if(dwMessage != 0 && (dwMessage & (dwMessage - 1)) == 0) {
+            // the usual case: one message bit, so only visit its bucket
+            for(dwBit = 0; (dwMessage & ((DWORD) 1 << dwBit)) == 0; dwBit++)
+                ;
+            for(dwIndex = 0; dwIndex < pnss->dwBucketSize[dwBit]; dwIndex++) {
+                pns = pnss->ppBucket[dwBit][dwIndex];
+                if(!NotifyAudienceIncludes(pns, dwAudience)) {
+                    continue;
+                }
+                if(pnm != NULL) {
+                    NotifySubscriberQueue(pns, pnm);
+                } else {
+                    NotifySubscriberSend(pns, ppb, dwLen);
+                }
+            }
+        } else {
+            // send once to each client that registered for any of the bits
+            for(dwIndex = 0; dwIndex < pnss->dwSubscribers; dwIndex++) {
+                pns = pnss->ppSubscribers[dwIndex];
+                if((pns->dwFlags & dwMessage) == 0 || !NotifyAudienceIncludes(pns, dwAudience)) {
+                    continue;
+                }
+                if(pnm != NULL) {
+                    NotifySubscriberQueue(pns, pnm);
+                } else {
+                    NotifySubscriberSend(pns, ppb, dwLen);
+                }
+            }
+        }
+        NotifySnapshotRelease(pnss);
+
+        if(pnm != NULL) {
+            LONG lSeq = InterlockedIncrement(&glNotifyQueuedSeq);
+            NotifyMessageRelease(pnm);
+            SetEvent(ghevNotifyWork);
+
+            // clients must hear about a suspend before it happens
+            if(ppb->Message == PBT_TRANSITION && (ppb->Flags & NOTIFY_SUSPEND_FLAGS) != 0) {
+                NotifyDispatcherFlush(lSeq, NOTIFY_FLUSH_MS);
+            }
+        }
+    }
+}
+
+// This routine adds to the count of transitions that settled-state
+// subscribers didn't hear about.
+static VOID
+NotifyCountSkipped(DWORD dwSkipped)
+{
+    PNOTIFY_SNAPSHOT pnss = NotifySnapshotAcquire();
+    if(pnss != NULL) {
+        DWORD dwIndex;
+        EnterCriticalSection(&gcsNotifyQueues);
+        for(dwIndex = 0; dwIndex < pnss->dwSubscribers; dwIndex++) {
+            if(pnss->ppSubscribers[dwIndex]->fSettledOnly) {
+                pnss->ppSubscribers[dwIndex]->dwSkipped += dwSkipped;
+            }
+        }
+        LeaveCriticalSection(&gcsNotifyQueues);
+        NotifySnapshotRelease(pnss);
+    }
+}
+
+// This routine decides who hears about a PBT_TRANSITION right away.  Inside
+// a transition chain it keeps a copy of the broadcast for settled-state
+// subscribers, replacing any it held before, and returns the audience that
+// excludes them.  A suspend is always sent to everybody, since nothing more
+// happens until the system wakes up.
+static DWORD
+NotifyHoldTransition(PPOWER_BROADCAST ppb, DWORD dwLen)
+{
+    PNOTIFY_MESSAGE pnm = NULL, pnmOld;
+    DWORD dwAudience = NOTIFY_AUDIENCE_ALL;
+    DWORD dwSkipped = 0;
+
+    if(glNotifyChainDepth == 0) {
+        return NOTIFY_AUDIENCE_ALL;
+    }
+    if((ppb->Flags & NOTIFY_SUSPEND_FLAGS) == 0) {
+        pnm = NotifyMessageCreate(ppb, dwLen);
+    }
+
+    EnterCriticalSection(&gcsNotifyQueues);
+    pnmOld = gpnmHeldTransition;
+    if(glNotifyChainDepth == 0) {
+        // the chain ended while we were copying
+        DEBUGCHK(pnmOld == NULL);
+    } else if(pnm == NULL) {
+        // a suspend (or no memory to hold it): the broadcast settles the chain
+        dwSkipped = gdwHeldTransitions;
+        gpnmHeldTransition = NULL;
+        gdwHeldTransitions = 0;
+    } else {
+        gpnmHeldTransition = pnm;
+        gdwHeldTransitions++;
+        pnm = NULL;
+        dwAudience = NOTIFY_AUDIENCE_UNSETTLED;
+    }
+    LeaveCriticalSection(&gcsNotifyQueues);
+
+    if(pnm != NULL) {
+        NotifyMessageRelease(pnm);
+    }
+    if(pnmOld != NULL) {
+        NotifyMessageRelease(pnmOld);
+    }
+    if(dwSkipped != 0) {
+        NotifyCountSkipped(dwSkipped);
+    }
+    return dwAudience;
 }
 
 // This routine sends a notification to all interested listeners.
 VOID
 GenerateNotifications(PPOWER_BROADCAST ppb) 
 {
-    PPOWER_NOTIFICATION ppn;
     DWORD dwLen;
+    DWORD dwAudience = NOTIFY_AUDIENCE_ALL;
     SETFNAME(_T("GenerateNotifications"));
 
     PREFAST_DEBUGCHK(ppb != NULL);
@@ -65,29 +724,72 @@ GenerateNotifications(PPOWER_BROADCAST ppb)
     {
         KLibSetDeviceStateToIdle();
     }
-#endif    PMLOCK();
-    for(ppn = gpPowerNotifications; ppn != NULL; ppn = ppn->pNext) {
-        // is this a message type for which the client has registered?
-        if((ppn->dwFlags & ppb->Message) != 0) {
-            // yes, send the message
-            SendNotification(ppn, ppb, dwLen);
-        }
+#endif
+
+    if(ppb->Message == PBT_TRANSITION) {
+        dwAudience = NotifyHoldTransition(ppb, dwLen);
+    } else if(ppb->Message == PBT_POWERINFOCHANGE 
+    && ppb->Length >= sizeof(POWER_BROADCAST_POWER_INFO)) {
+        // keep the status page's battery information current
+        PowerStatusPageSetPowerInfo((PPOWER_BROADCAST_POWER_INFO) ppb->SystemPowerState);
     }
-    PMUNLOCK();
+    NotifyBroadcast(ppb, dwLen, dwAudience);
 
     PMLOGMSG(ZONE_NOTIFY, (_T("%s: done sending type %d notifications\r\n"),
         pszFname, ppb->Message));
 }
 
+// This routine marks the start of a chain of system power state transitions
+// that the caller expects to run back to back.  Chains may nest.
+VOID
+NotifyTransitionChainBegin(VOID)
+{
+    EnterCriticalSection(&gcsNotifyQueues);
+    glNotifyChainDepth++;
+    LeaveCriticalSection(&gcsNotifyQueues);
+}
+
+// This routine ends a chain started with NotifyTransitionChainBegin().  When
+// the outermost chain ends, settled-state subscribers get the last
+// PBT_TRANSITION that was held for them.
+VOID
+NotifyTransitionChainEnd(VOID)
+{
+    PNOTIFY_MESSAGE pnm = NULL;
+    DWORD dwHeld = 0;
+    SETFNAME(_T("NotifyTransitionChainEnd"));
+
+    EnterCriticalSection(&gcsNotifyQueues);
+    DEBUGCHK(glNotifyChainDepth > 0);
+    if(--glNotifyChainDepth == 0) {
+        pnm = gpnmHeldTransition;
+        dwHeld = gdwHeldTransitions;
+        gpnmHeldTransition = NULL;
+        gdwHeldTransitions = 0;
+    }
+    LeaveCriticalSection(&gcsNotifyQueues);
+
+    if(pnm != NULL) {
+        PMLOGMSG(ZONE_NOTIFY, (_T("%s: chain settled after %u transitions\r\n"),
+            pszFname, dwHeld));
+        if(dwHeld > 1) {
+            NotifyCountSkipped(dwHeld - 1);
+        }
+        NotifyBroadcast((PPOWER_BROADCAST) (pnm + 1), pnm->dwLen, NOTIFY_AUDIENCE_SETTLED);
+        NotifyMessageRelease(pnm);
+    }
+}
+
 // This routine deletes all notification structures associated with a
 // particular process.  It should be called when the process exits.
 VOID
 DeleteProcessNotifications(HANDLE hProcess)
 {
     BOOL fDone = FALSE;
+    BOOL fRemoved = FALSE;
     SETFNAME(_T("DeleteProcessNotifications"));
 
-    PMLOCK();
+    NotifyLock();
 
     // remove all notifications belonging to this process.  If we
     // remove one from the list, start again -- we will eventually run
@@ -98,7 +800,9 @@ DeleteProcessNotifications(HANDLE hProcess)
             if(ppn->hOwner == hProcess) {
                 PMLOGMSG(ZONE_NOTIFY, (_T("%s: deleting notification 0x%08x\r\n"),
                     pszFname, ppn));
+                NotifySubscriberRemove(ppn);
                 PowerNotificationRemList(&gpPowerNotifications, ppn);
+                fRemoved = TRUE;
                 break;
             }
         }
@@ -109,8 +813,11 @@ DeleteProcessNotifications(HANDLE hProcess)
             fDone = TRUE;
         }
     }
+    if(fRemoved) {
+        NotifySnapshotRebuild();
+    }
 
-    PMUNLOCK();
+    NotifyUnlock();
 }
 
 // Applications can call this routine to get various kinds of notifications.
@@ -143,13 +850,32 @@ PmRequestPowerNotifications(HANDLE hMsgQ, DWORD dwFlags)
         if(ppn != NULL) {
             ppn->dwFlags = dwFlags;
 
+            // the platform may look at PM state to build the initial
+            // notifications, so take the PM lock first
             PMLOCK();
+            NotifyLock();
             // add the notification structure to the list
             PowerNotificationAddList(&gpPowerNotifications, ppn);
 
-            // if the notification requires any platform-specific action,
-            // the platform can do it now
-            PlatformSendInitialNotifications(ppn, dwFlags);
+            if(NotifySubscriberAdd(ppn)) {
+                // if the notification requires any platform-specific action,
+                // the platform can do it now.  The subscriber isn't in the
+                // snapshot yet, so whatever it sends is queued ahead of every
+                // broadcast the client will get.
+                PlatformSendInitialNotifications(ppn, dwFlags);
+
+                // include it in future broadcasts, and make sure the
+                // dispatcher sees anything that was queued above
+                NotifySnapshotRebuild();
+                if(gfNotifyDispatcher) {
+                    SetEvent(ghevNotifyWork);
+                }
+            } else {
+                PowerNotificationRemList(&gpPowerNotifications, ppn);
+                ppn = NULL;
+                dwStatus = ERROR_NOT_ENOUGH_MEMORY;
+            }
+            NotifyUnlock();
             PMUNLOCK();
         } else {
             dwStatus = GetLastError();  // set by whatever failed in PowerNotificationCreate()
@@ -178,14 +904,16 @@ PmStopPowerNotifications(HANDLE h)
 
     PMLOGMSG(ZONE_NOTIFY || ZONE_API, (_T("%s: handle is 0x%08x\r\n"), pszFname, h));
     if(ppn != NULL) {
-        PMLOCK();
+        NotifyLock();
         BOOL fFound = PowerNotificationRemList(&gpPowerNotifications, ppn);
         if(fFound) {
+            NotifySubscriberRemove(ppn);
+            NotifySnapshotRebuild();
             dwStatus = ERROR_SUCCESS;
         } else {
             dwStatus = ERROR_FILE_NOT_FOUND;
         }
-        PMUNLOCK();
+        NotifyUnlock();
     }
 
     PMLOGMSG(ZONE_NOTIFY || ZONE_API || (dwStatus != ERROR_SUCCESS && ZONE_WARN),
@@ -194,3 +922,159 @@ PmStopPowerNotifications(HANDLE h)
 }
 
 
+
+// This routine sets up the broadcast snapshot.
+BOOL
+NotifySnapshotInit(VOID)
+{
+    InitializeCriticalSection(&gcsNotifySnapshot);
+    InitializeCriticalSection(&gcsNotifyQueues);
+    gpNotifySubscribers = NULL;
+    gpNotifySnapshot = NULL;
+    return TRUE;
+}
+
+// This routine frees the broadcast snapshot and any subscribers that are
+// still registered.  Nothing may be broadcasting.
+VOID
+NotifySnapshotDeinit(VOID)
+{
+    NotifyLock();
+    while(gpNotifySubscribers != NULL) {
+        NotifySubscriberRemove(gpNotifySubscribers->ppn);
+    }
+    if(gpNotifySnapshot != NULL) {
+        NotifySnapshotRelease(gpNotifySnapshot);
+        gpNotifySnapshot = NULL;
+    }
+    if(gpnmHeldTransition != NULL) {
+        NotifyMessageRelease(gpnmHeldTransition);
+        gpnmHeldTransition = NULL;
+    }
+    NotifyUnlock();
+    DeleteCriticalSection(&gcsNotifyQueues);
+    DeleteCriticalSection(&gcsNotifySnapshot);
+}
+
+// This routine starts the dispatcher thread.  A failure here is not fatal --
+// broadcasts are simply written by the thread that generates them.
+BOOL
+NotifyDispatcherInit(VOID)
+{
+    SETFNAME(_T("NotifyDispatcherInit"));
+
+    DEBUGCHK(!gfNotifyDispatcher);
+
+    glNotifyQueuedSeq = glNotifyDoneSeq = 0;
+    ghevNotifyWork = CreateEvent(NULL, FALSE, FALSE, NULL);
+    ghevNotifyPassDone = CreateEvent(NULL, FALSE, FALSE, NULL);
+    if(ghevNotifyWork != NULL && ghevNotifyPassDone != NULL) {
+        ghtNotifyDispatcher = CreateThread(NULL, 0, NotifyDispatcherThreadProc, NULL, 0, NULL);
+    }
+    if(ghtNotifyDispatcher == NULL) {
+        PMLOGMSG(ZONE_WARN, (_T("%s: couldn't start the dispatcher thread\r\n"), pszFname));
+        if(ghevNotifyWork != NULL) CloseHandle(ghevNotifyWork);
+        if(ghevNotifyPassDone != NULL) CloseHandle(ghevNotifyPassDone);
+        ghevNotifyWork = ghevNotifyPassDone = NULL;
+        return TRUE;
+    }
+    gfNotifyDispatcher = TRUE;
+    return TRUE;
+}
+
+// This routine waits for the dispatcher thread to exit.  The caller must
+// have signaled ghevPmShutdown.  Undelivered broadcasts are freed along with
+// their subscribers.
+VOID
+NotifyDispatcherDeinit(VOID)
+{
+    if(gfNotifyDispatcher) {
+        gfNotifyDispatcher = FALSE;
+        WaitForSingleObject(ghtNotifyDispatcher, INFINITE);
+        CloseHandle(ghtNotifyDispatcher);
+        CloseHandle(ghevNotifyWork);
+        CloseHandle(ghevNotifyPassDone);
+        ghtNotifyDispatcher = ghevNotifyWork = ghevNotifyPassDone = NULL;
+    }
+}
+
+// Applications can call this routine to find out how broadcasts to one of
+// their notification requests are faring.  It returns:
+//      ERROR_SUCCESS - pStats filled in
+//      ERROR_INVALID_PARAMETER - bad handle or pointer
+//      ERROR_FILE_NOT_FOUND - handle doesn't exist
+EXTERN_C DWORD WINAPI
+PmGetPowerNotificationStats(HANDLE h, PPM_NOTIFY_STATS pStats)
+{
+    DWORD dwStatus = ERROR_INVALID_PARAMETER;
+    PNOTIFY_SUBSCRIBER pns;
+    PM_NOTIFY_STATS pnsStats;
+    SETFNAME(_T("PmGetPowerNotificationStats"));
+
+    if(h != NULL && pStats != NULL) {
+        dwStatus = ERROR_FILE_NOT_FOUND;
+        NotifyLock();
+        for(pns = gpNotifySubscribers; pns != NULL; pns = pns->pNext) {
+            if(pns->ppn == (PPOWER_NOTIFICATION) h) {
+                EnterCriticalSection(&gcsNotifyQueues);
+                pnsStats.dwSent = pns->dwSent;
+                pnsStats.dwDropped = pns->dwDropped;
+                pnsStats.dwCoalesced = pns->dwCoalesced;
+                pnsStats.dwPending = pns->dwPending;
+                pnsStats.dwSkippedTransitions = pns->dwSkipped;
+                LeaveCriticalSection(&gcsNotifyQueues);
+                dwStatus = ERROR_SUCCESS;
+                break;
+            }
+        }
+        NotifyUnlock();
+
+        // copy out with no locks held, the caller's buffer may be bad
+        if(dwStatus == ERROR_SUCCESS) {
+            __try {
+                *pStats = pnsStats;
+            }
+            __except(EXCEPTION_EXECUTE_HANDLER) {
+                PMLOGMSG(ZONE_WARN, (_T("%s: exception writing stats\r\n"), pszFname));
+                dwStatus = ERROR_INVALID_PARAMETER;
+            }
+        }
+    }
+
+    PMLOGMSG(ZONE_NOTIFY || ZONE_API || (dwStatus != ERROR_SUCCESS && ZONE_WARN),
+        (_T("%s: handle 0x%08x, returning status %d\r\n"), pszFname, h, dwStatus));
+    return dwStatus;
+}
+
+// Applications can call this routine to change how a notification request
+// created with PmRequestPowerNotifications() is delivered.  Requests with
+// PM_NOTIFY_OPTION_SETTLED only get the last PBT_TRANSITION of a chain of
+// transitions that the PM runs back to back.  It returns:
+//      ERROR_SUCCESS - options changed
+//      ERROR_INVALID_PARAMETER - bad handle or options
+//      ERROR_FILE_NOT_FOUND - handle doesn't exist
+EXTERN_C DWORD WINAPI
+PmSetPowerNotificationOptions(HANDLE h, DWORD dwOptions)
+{
+    DWORD dwStatus = ERROR_INVALID_PARAMETER;
+    PNOTIFY_SUBSCRIBER pns;
+    SETFNAME(_T("PmSetPowerNotificationOptions"));
+
+    if(h != NULL && (dwOptions & ~PM_NOTIFY_OPTION_SETTLED) == 0) {
+        dwStatus = ERROR_FILE_NOT_FOUND;
+        NotifyLock();
+        for(pns = gpNotifySubscribers; pns != NULL; pns = pns->pNext) {
+            if(pns->ppn == (PPOWER_NOTIFICATION) h) {
+                pns->fSettledOnly = ((dwOptions & PM_NOTIFY_OPTION_SETTLED) != 0);
+                dwStatus = ERROR_SUCCESS;
+                break;
+            }
+        }
+        NotifyUnlock();
+    }
+
+    PMLOGMSG(ZONE_NOTIFY || ZONE_API || (dwStatus != ERROR_SUCCESS && ZONE_WARN),
+        (_T("%s: handle 0x%08x, options 0x%x, returning status %d\r\n"), pszFname, 
+        h, dwOptions, dwStatus));
+    return dwStatus;
+}
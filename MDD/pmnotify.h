@@ -0,0 +1,81 @@
+//
+// Copyright (c) Microsoft Corporation.  All rights reserved.
+//
+//
+// Use of this sample source code is subject to the terms of the Microsoft
+// license agreement under which you licensed this sample source code. If
+// you did not accept the terms of the license agreement, you are not
+// authorized to use this sample source code. For the terms of the license,
+// please see the license agreement between you and Microsoft or, if applicable,
+// see the LICENSE.RTF on your install media or the root of your tools installation.
+// THE SAMPLE SOURCE CODE IS PROVIDED "AS IS", WITH NO WARRANTIES OR INDEMNITIES.
+//
+
+
+//
+// This module declares the notification subscriber snapshot.  Broadcasts
+// are sent from an immutable, reference counted copy of the subscriber list
+// that is bucketed by message bit, so a broadcast only visits the clients
+// that asked for it and never holds a PM lock while writing to their queues.
+// The snapshot is rebuilt whenever a client registers or goes away.
+//
+
+#ifndef __PMNOTIFY_H
+#define __PMNOTIFY_H
+
+#include <pmimpl.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// one bucket per bit in POWER_BROADCAST.Message
+#define NOTIFY_BUCKETS      32
+
+// Broadcasts are queued for each subscriber and written by a dispatcher
+// thread, so a client that falls behind only delays itself.  A subscriber's
+// queue starts out NOTIFY_QUEUE_DEPTH broadcasts deep.  A PBT_POWERINFOCHANGE
+// replaces one that is still waiting, and when the queue is full the oldest
+// PBT_POWERINFOCHANGE is dropped.  Otherwise the queue grows, up to
+// NOTIFY_QUEUE_MAX broadcasts; past that the oldest waiting broadcast is
+// dropped, so a client that never reads its queue can't use up PM memory.
+// Dropped broadcasts are counted in dwDropped.  Initial notifications are
+// queued the same way.
+// Clients whose queues are full are retried every NOTIFY_RETRY_MS.
+// Broadcasts of a suspend wait up to NOTIFY_FLUSH_MS for delivery so that
+// clients hear about it before the system goes down.
+#define NOTIFY_QUEUE_DEPTH  16
+#define NOTIFY_QUEUE_MAX    (4 * NOTIFY_QUEUE_DEPTH)
+#define NOTIFY_RETRY_MS     50
+#define NOTIFY_FLUSH_MS     250
+
+// what PmGetPowerNotificationStats() reports for a registration
+typedef struct _PM_NOTIFY_STATS {
+    DWORD dwSent;           // broadcasts written to the client's queue
+    DWORD dwDropped;        // broadcasts thrown away undelivered
+    DWORD dwCoalesced;      // PBT_POWERINFOCHANGEs replaced by a newer one
+    DWORD dwPending;        // broadcasts waiting to be written
+    DWORD dwSkippedTransitions; // PBT_TRANSITIONs summarized by a later one
+} PM_NOTIFY_STATS, *PPM_NOTIFY_STATS;
+
+// PmSetPowerNotificationOptions() flag: while the PM runs a chain of system
+// power state transitions back to back (for example UserIdle, ScreenOff,
+// Suspend), only send the state the chain settles in.  The transitions
+// skipped are counted in dwSkippedTransitions.  A suspend is always sent.
+#define PM_NOTIFY_OPTION_SETTLED    0x00000001
+
+BOOL NotifySnapshotInit(VOID);
+VOID NotifySnapshotDeinit(VOID);
+BOOL NotifyDispatcherInit(VOID);
+VOID NotifyDispatcherDeinit(VOID);
+VOID NotifyTransitionChainBegin(VOID);
+VOID NotifyTransitionChainEnd(VOID);
+
+DWORD WINAPI PmGetPowerNotificationStats(HANDLE h, PPM_NOTIFY_STATS pStats);
+DWORD WINAPI PmSetPowerNotificationOptions(HANDLE h, DWORD dwOptions);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
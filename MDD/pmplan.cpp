@@ -0,0 +1,323 @@
+//
+// Copyright (c) Microsoft Corporation.  All rights reserved.
+//
+//
+// Use of this sample source code is subject to the terms of the Microsoft
+// license agreement under which you licensed this sample source code. If
+// you did not accept the terms of the license agreement, you are not
+// authorized to use this sample source code. For the terms of the license,
+// please see the license agreement between you and Microsoft or, if applicable,
+// see the LICENSE.RTF on your install media or the root of your tools installation.
+// THE SAMPLE SOURCE CODE IS PROVIDED "AS IS", WITH NO WARRANTIES OR INDEMNITIES.
+//
+
+//
+// This module implements transition plans.  Plans are kept most recently
+// used first and are protected by the PM lock.  Invalidation only bumps an
+// epoch, so it may be done from anywhere; stale plans are freed the next
+// time somebody looks for a plan.  Plans for critical suspends are built
+// ahead of time, since a critical suspend can't afford to build one.
+//
+
+#include <pmimpl.h>
+#include "pmplan.h"
+#include "pmatom.h"
+#include "pmdxword.h"
+#include "pmlocks.h"
+#include "pmsysstate.h"
+
+typedef struct _TRANSITION_PLAN {
+    struct _TRANSITION_PLAN *pNext;
+    LPCTSTR pszFrom;                    // atoms
+    LPCTSTR pszTo;
+    DWORD dwEpoch;                      // glPlanEpoch when the plan was built
+    LONG lClock;                        // glPlanClock when the plan was built
+    DWORD dwDevices;                    // devices considered
+    DWORD dwDelta;                      // devices that change, sorted
+    PDEVICE_STATE *ppdsDelta;           // points past the structure
+} TRANSITION_PLAN;
+
+static PTRANSITION_PLAN gpPlans;
+static volatile LONG glPlanEpoch = 1;
+static volatile LONG glPlanClock = 0;
+
+// This routine frees a plan.
+static VOID
+TransitionPlanDestroy(PTRANSITION_PLAN ptp)
+{
+    PmAtomRelease(ptp->pszFrom);
+    PmAtomRelease(ptp->pszTo);
+    PmFree(ptp);
+}
+
+static int __cdecl
+TransitionPlanCompare(const void *pv1, const void *pv2)
+{
+    DWORD dw1 = (DWORD) *(PDEVICE_STATE *) pv1;
+    DWORD dw2 = (DWORD) *(PDEVICE_STATE *) pv2;
+
+    return dw1 < dw2 ? -1 : dw1 > dw2 ? 1 : 0;
+}
+
+// This routine returns TRUE if a device would be sent a new power state if
+// the system moved to psps, whose ceiling list is pCeilingDx, now.  The
+// caller must hold the PM lock.
+static BOOL
+TransitionPlanDeviceChanges(PDEVICE_STATE pds, PSYSTEM_POWER_STATE psps,
+                            PDEVICE_POWER_RESTRICTION pCeilingDx)
+{
+    CEDEVICE_POWER_STATE floorDx, ceilingDx, newDx = PwrDeviceUnspecified;
+    LONG lDxWord = DxWordRead(pds);
+
+    if(DxWordNumPending(lDxWord) != 0) {
+        return TRUE;
+    }
+    if(!GetNewDeviceStateInfo(&floorDx, &ceilingDx, pds, psps, gpFloorDx, pCeilingDx)) {
+        return TRUE;
+    }
+    DeviceLock(pds);
+    newDx = GetNewDeviceDx(pds->lastReqDx, DxWordCurDx(lDxWord), pds->setDx, floorDx, ceilingDx);
+    DeviceUnlock(pds);
+
+    return newDx != PwrDeviceUnspecified;
+}
+
+// This routine works out which devices change in a transition from pszFrom
+// to psps, whose ceiling list is pCeilingDx.  It returns NULL if it can't
+// allocate the plan.  The caller must hold the PM lock.
+static PTRANSITION_PLAN
+TransitionPlanBuild(LPCTSTR pszFrom, PSYSTEM_POWER_STATE psps, 
+                    PDEVICE_POWER_RESTRICTION pCeilingDx)
+{
+    LPCTSTR pszTo = psps->pszName;
+    PTRANSITION_PLAN ptp;
+    PDEVICE_LIST pdl;
+    PDEVICE_STATE pds;
+    DWORD dwDevices = 0;
+    SETFNAME(_T("TransitionPlanBuild"));
+
+    for(pdl = gpDeviceLists; pdl != NULL; pdl = pdl->pNext) {
+        for(pds = pdl->pList; pds != NULL; pds = pds->pNext) {
+            dwDevices++;
+        }
+    }
+
+    ptp = (PTRANSITION_PLAN) PmAlloc(sizeof(*ptp) + dwDevices * sizeof(PDEVICE_STATE));
+    if(ptp == NULL) {
+        PMLOGMSG(ZONE_WARN, (_T("%s: no memory for a plan of %u devices\r\n"), pszFname,
+            dwDevices));
+        return NULL;
+    }
+    ptp->pszFrom = PmAtomAdd(pszFrom, TRUE);
+    ptp->pszTo = PmAtomAdd(pszTo, TRUE);
+    if(ptp->pszFrom == NULL || ptp->pszTo == NULL) {
+        if(ptp->pszFrom != NULL) PmAtomRelease(ptp->pszFrom);
+        if(ptp->pszTo != NULL) PmAtomRelease(ptp->pszTo);
+        PmFree(ptp);
+        return NULL;
+    }
+
+    // stamp the plan before looking at the devices, so that anything that
+    // changes while we look is picked up as a touched device
+    ptp->dwEpoch = (DWORD) glPlanEpoch;
+    ptp->lClock = glPlanClock;
+    ptp->dwDevices = dwDevices;
+    ptp->dwDelta = 0;
+    ptp->ppdsDelta = (PDEVICE_STATE *) (ptp + 1);
+    for(pdl = gpDeviceLists; pdl != NULL; pdl = pdl->pNext) {
+        for(pds = pdl->pList; pds != NULL; pds = pds->pNext) {
+            if(TransitionPlanDeviceChanges(pds, psps, pCeilingDx)) {
+                ptp->ppdsDelta[ptp->dwDelta++] = pds;
+            }
+        }
+    }
+    qsort(ptp->ppdsDelta, ptp->dwDelta, sizeof(ptp->ppdsDelta[0]), TransitionPlanCompare);
+
+    PMLOGMSG(ZONE_PLATFORM, (_T("%s: '%s' -> '%s' changes %u of %u devices\r\n"), pszFname,
+        pszFrom, pszTo, ptp->dwDelta, dwDevices));
+    return ptp;
+}
+
+// This routine returns the plan for a transition from pszFrom to psps,
+// building one if necessary.  It returns NULL if no plan is available.  The
+// caller must hold the PM lock.
+static PTRANSITION_PLAN
+TransitionPlanFind(LPCTSTR pszFrom, PSYSTEM_POWER_STATE psps,
+                   PDEVICE_POWER_RESTRICTION pCeilingDx)
+{
+    PTRANSITION_PLAN ptp, *pptp;
+    LPCTSTR pszFromAtom, pszToAtom;
+    DWORD dwPlans = 0;
+
+    // atoms are only present if some plan is still using them
+    pszFromAtom = PmAtomFind(pszFrom, TRUE);
+    pszToAtom = PmAtomFind(psps->pszName, TRUE);
+
+    // drop stale plans and look for ours
+    pptp = &gpPlans;
+    while((ptp = *pptp) != NULL) {
+        if(ptp->dwEpoch != (DWORD) glPlanEpoch) {
+            *pptp = ptp->pNext;
+            TransitionPlanDestroy(ptp);
+        } else if(ptp->pszFrom == pszFromAtom && ptp->pszTo == pszToAtom) {
+            // move it to the front
+            *pptp = ptp->pNext;
+            ptp->pNext = gpPlans;
+            gpPlans = ptp;
+            break;
+        } else {
+            dwPlans++;
+            pptp = &ptp->pNext;
+        }
+    }
+
+    if(ptp == NULL) {
+        ptp = TransitionPlanBuild(pszFrom, psps, pCeilingDx);
+        if(ptp != NULL) {
+            ptp->pNext = gpPlans;
+            gpPlans = ptp;
+
+            // forget the least recently used plan if there are too many
+            if(dwPlans >= PM_TRANSITION_PLAN_MAX) {
+                for(pptp = &gpPlans; (*pptp)->pNext != NULL; pptp = &(*pptp)->pNext);
+                TransitionPlanDestroy(*pptp);
+                *pptp = NULL;
+            }
+        }
+    }
+
+    if(pszFromAtom != NULL) PmAtomRelease(pszFromAtom);
+    if(pszToAtom != NULL) PmAtomRelease(pszToAtom);
+    return ptp;
+}
+
+// This routine returns the plan for a transition from pszFrom to pszTo,
+// building one if necessary.  pszTo must be the current system power state.
+// It returns NULL if no plan is available, in which case every device
+// should be updated.  The plan remains valid while the caller holds the PM
+// lock.
+PTRANSITION_PLAN
+TransitionPlanGet(LPCTSTR pszFrom, LPCTSTR pszTo)
+{
+    PTRANSITION_PLAN ptp = NULL;
+
+    PREFAST_DEBUGCHK(pszFrom != NULL && pszTo != NULL);
+
+    PMLOCK();
+    if(gpSystemPowerState != NULL && _tcsicmp(gpSystemPowerState->pszName, pszTo) == 0) {
+        ptp = TransitionPlanFind(pszFrom, gpSystemPowerState, gpCeilingDx);
+    }
+    PMUNLOCK();
+
+    return ptp;
+}
+
+// This routine builds the plans for moving from the current system power
+// state to each state flagged POWER_STATE_CRITICAL, so that a critical
+// suspend finds its plan ready instead of looking at every device while
+// its budget runs.  The state definitions are re-read from the registry
+// cache each time, so plans made stale by a registry change are rebuilt
+// here too.  It should be called by the thread that changes the system
+// power state, after a transition that didn't suspend, and must not be
+// called with the PM lock held.
+VOID
+TransitionPlanPrepareCritical(VOID)
+{
+    TCHAR aszCritical[PM_TRANSITION_PLAN_CRITICAL][MAX_PATH];
+    TCHAR szName[MAX_PATH];
+    DWORD dwCritical = 0, dwIndex, dwFlags, dwStatus;
+    SETFNAME(_T("TransitionPlanPrepareCritical"));
+
+    // find the critical states
+    for(dwIndex = 0; ; dwIndex++) {
+        dwStatus = SystemPowerStateEnum(dwIndex, szName, _countof(szName), &dwFlags);
+        if(dwStatus == ERROR_NO_MORE_ITEMS) {
+            break;
+        }
+        if(dwStatus != ERROR_SUCCESS || (dwFlags & POWER_STATE_CRITICAL) == 0) {
+            continue;
+        }
+        if(dwCritical == _countof(aszCritical)) {
+            PMLOGMSG(ZONE_WARN, (_T("%s: no room to prepare for critical state '%s'\r\n"),
+                pszFname, szName));
+            continue;
+        }
+        VERIFY(SUCCEEDED(StringCchCopy(aszCritical[dwCritical], _countof(aszCritical[0]), szName)));
+        dwCritical++;
+    }
+
+    // make sure each one has a plan from where we are now
+    for(dwIndex = 0; dwIndex < dwCritical; dwIndex++) {
+        PSYSTEM_POWER_STATE psps = NULL;
+        PDEVICE_POWER_RESTRICTION pCeilingDx = NULL;
+
+        // this re-reads the state if its key has changed, which makes the
+        // existing plans stale
+        dwStatus = SystemPowerStateAcquire(aszCritical[dwIndex], &psps, &pCeilingDx);
+        if(dwStatus != ERROR_SUCCESS) {
+            PMLOGMSG(ZONE_WARN, (_T("%s: can't read critical state '%s', status is %d\r\n"),
+                pszFname, aszCritical[dwIndex], dwStatus));
+            continue;
+        }
+
+        PMLOCK();
+        if(gpSystemPowerState != NULL && (gpSystemPowerState->dwFlags 
+        & (POWER_STATE_SUSPEND | POWER_STATE_OFF | POWER_STATE_CRITICAL)) == 0) {
+            TransitionPlanFind(gpSystemPowerState->pszName, psps, pCeilingDx);
+        }
+        PMUNLOCK();
+
+        SystemPowerStateRelease(psps);
+    }
+}
+
+// This routine returns TRUE if a transition following a plan needs to
+// update a device: the device is in the plan's delta, it has been touched
+// since the plan was built, or it is in the middle of a set.  The caller
+// must hold the PM lock.
+BOOL
+TransitionPlanIncludes(PTRANSITION_PLAN ptp, PDEVICE_STATE pds)
+{
+    PDEVICE_STATE_EX pdsx = (PDEVICE_STATE_EX) pds;
+
+    if(ptp == NULL || ptp->dwEpoch != (DWORD) glPlanEpoch) {
+        return TRUE;
+    }
+    if((LONG) (pdsx->lPlanStamp - ptp->lClock) > 0) {
+        return TRUE;
+    }
+    if(DxWordNumPending(DxWordRead(pds)) != 0) {
+        return TRUE;
+    }
+    return bsearch(&pds, ptp->ppdsDelta, ptp->dwDelta, sizeof(ptp->ppdsDelta[0]), 
+        TransitionPlanCompare) != NULL;
+}
+
+// This routine makes every plan stale.
+VOID
+TransitionPlanInvalidate(VOID)
+{
+    InterlockedIncrement(&glPlanEpoch);
+}
+
+// This routine records that something that decides a device's power state
+// has changed, so that plans built before now will include the device.
+VOID
+TransitionPlanTouchDevice(PDEVICE_STATE pds)
+{
+    PREFAST_DEBUGCHK(pds != NULL);
+    ((PDEVICE_STATE_EX) pds)->lPlanStamp = InterlockedIncrement(&glPlanClock);
+}
+
+// This routine frees every plan.
+VOID
+TransitionPlanDeinit(VOID)
+{
+    PMLOCK();
+    while(gpPlans != NULL) {
+        PTRANSITION_PLAN ptp = gpPlans;
+        gpPlans = ptp->pNext;
+        TransitionPlanDestroy(ptp);
+    }
+    PMUNLOCK();
+}
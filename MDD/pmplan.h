@@ -0,0 +1,59 @@
+//
+// Copyright (c) Microsoft Corporation.  All rights reserved.
+//
+//
+// Use of this sample source code is subject to the terms of the Microsoft
+// license agreement under which you licensed this sample source code. If
+// you did not accept the terms of the license agreement, you are not
+// authorized to use this sample source code. For the terms of the license,
+// please see the license agreement between you and Microsoft or, if applicable,
+// see the LICENSE.RTF on your install media or the root of your tools installation.
+// THE SAMPLE SOURCE CODE IS PROVIDED "AS IS", WITH NO WARRANTIES OR INDEMNITIES.
+//
+
+//
+// This module declares transition plans.  A plan lists the devices whose
+// power state changes when the system moves from one power state to
+// another.  It is built the first time the pair of states is seen and
+// reused after that, so that a transition only schedules the devices that
+// will actually be touched.  Plans into POWER_STATE_CRITICAL states are
+// built after every ordinary transition rather than when they are needed.
+//
+// A plan goes stale as a whole only when a system power state is redefined
+// or a restriction can't be tied to particular devices.  Other changes --
+// DevicePowerNotify(), SetDevicePower(), a restriction on a device or its
+// class, a new device, a failed update -- only stamp the devices they
+// affect, and stamped devices are added to the plan's delta when it's used.
+// Removed devices need no attention; a new device that reuses the memory
+// of an old one is stamped when it is added.
+//
+
+#ifndef __PMPLAN_H
+#define __PMPLAN_H
+
+#include <pmimpl.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// number of (from, to) pairs to remember
+#define PM_TRANSITION_PLAN_MAX      8
+
+// number of critical states to keep plans ready for
+#define PM_TRANSITION_PLAN_CRITICAL 2
+
+typedef struct _TRANSITION_PLAN *PTRANSITION_PLAN;
+
+PTRANSITION_PLAN TransitionPlanGet(LPCTSTR pszFrom, LPCTSTR pszTo);
+BOOL TransitionPlanIncludes(PTRANSITION_PLAN ptp, PDEVICE_STATE pds);
+VOID TransitionPlanInvalidate(VOID);
+VOID TransitionPlanTouchDevice(PDEVICE_STATE pds);
+VOID TransitionPlanPrepareCritical(VOID);
+VOID TransitionPlanDeinit(VOID);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
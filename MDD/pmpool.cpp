@@ -0,0 +1,239 @@
+//
+// Copyright (c) Microsoft Corporation.  All rights reserved.
+//
+//
+// Use of this sample source code is subject to the terms of the Microsoft
+// license agreement under which you licensed this sample source code. If
+// you did not accept the terms of the license agreement, you are not
+// authorized to use this sample source code. For the terms of the license,
+// please see the license agreement between you and Microsoft or, if applicable,
+// see the LICENSE.RTF on your install media or the root of your tools installation.
+// THE SAMPLE SOURCE CODE IS PROVIDED "AS IS", WITH NO WARRANTIES OR INDEMNITIES.
+//
+
+//
+// This module contains the PM memory pools.  Every block carries a small
+// header that records which pool it came from, so PmPoolFree() can return
+// it without searching.  Blocks are carved from slabs that are never given
+// back to the heap; once a pool has grown to its high-water mark, allocation
+// and free are a free list pop and push.  Requests that don't fit in the
+// largest block size go straight to the PM heap.
+//
+// Each pool has its own critical section rather than a CAS-based free list:
+// without a double-width compare-and-swap on our 32-bit targets a lock-free
+// LIFO is exposed to ABA, and an uncontended critical section doesn't enter
+// the kernel.
+//
+
+#include <pmimpl.h>
+#include "pmpool.h"
+
+#define POOL_SLAB_SIZE          4096
+#define POOL_HEAP_BLOCK         0xFFFFFFFF      // header tag for heap blocks
+
+typedef struct _POOL_HEADER {
+    DWORD dwPool;               // pool index or POOL_HEAP_BLOCK
+    DWORD dwReserved;           // keeps the caller's buffer 8-byte aligned
+} POOL_HEADER, *PPOOL_HEADER;
+
+typedef struct _POOL_BLOCK {
+    struct _POOL_BLOCK *pNext;
+} POOL_BLOCK, *PPOOL_BLOCK;
+
+typedef struct _PM_POOL {
+    CRITICAL_SECTION cs;
+    PPOOL_BLOCK pFree;          // freed blocks
+    LPBYTE pbSlabNext;          // next uncarved block in the current slab
+    LPBYTE pbSlabEnd;
+    PM_POOL_STATS stats;
+} PM_POOL, *PPM_POOL;
+
+// block sizes, including the header
+static const DWORD gdwPoolBlockSizes[PM_POOL_COUNT] = {
+    32, 48, 64, 96, 128, 192, 256, 384
+};
+
+static PM_POOL gPools[PM_POOL_COUNT + 1];      // the last entry tracks heap blocks
+static HANDLE ghPoolHeap;
+static BOOL gfPoolsInitialized;
+
+// This routine updates a pool's statistics for a new allocation.  The caller
+// must hold the pool's critical section.
+static VOID
+PoolCountAlloc(PPM_POOL pPool, BOOL fHit)
+{
+    pPool->stats.dwAllocs++;
+    if(fHit) {
+        pPool->stats.dwHits++;
+    }
+    pPool->stats.dwInUse++;
+    if(pPool->stats.dwInUse > pPool->stats.dwHighWater) {
+        pPool->stats.dwHighWater = pPool->stats.dwInUse;
+    }
+}
+
+// This routine creates the private heap and the pools.  It must be called
+// before the first call to PmAlloc().  If it fails, all allocations go to
+// the PM heap.
+BOOL
+PmPoolInit(VOID)
+{
+    DWORD dwPool;
+    SETFNAME(_T("PmPoolInit"));
+
+    for(dwPool = 0; dwPool <= PM_POOL_COUNT; dwPool++) {
+        InitializeCriticalSection(&gPools[dwPool].cs);
+        gPools[dwPool].pFree = NULL;
+        gPools[dwPool].pbSlabNext = NULL;
+        gPools[dwPool].pbSlabEnd = NULL;
+        memset(&gPools[dwPool].stats, 0, sizeof(gPools[dwPool].stats));
+        gPools[dwPool].stats.dwBlockSize = dwPool < PM_POOL_COUNT ? gdwPoolBlockSizes[dwPool] : 0;
+    }
+
+    ghPoolHeap = HeapCreate(0, POOL_SLAB_SIZE, 0);
+    if(ghPoolHeap == NULL) {
+        PMLOGMSG(ZONE_WARN, (_T("%s: HeapCreate() failed %d, pools disabled\r\n"), 
+            pszFname, GetLastError()));
+        gfPoolsInitialized = FALSE;
+    } else {
+        gfPoolsInitialized = TRUE;
+    }
+
+    return gfPoolsInitialized;
+}
+
+// This routine allocates dwSize bytes from the smallest pool that can hold
+// them, or from the PM heap.  It returns NULL if there's no memory.
+PVOID
+PmPoolAlloc(DWORD dwSize)
+{
+    PPOOL_HEADER pph = NULL;
+    DWORD dwPool = PM_POOL_COUNT;
+
+    // find the smallest block size that fits
+    if(gfPoolsInitialized && dwSize <= gdwPoolBlockSizes[PM_POOL_COUNT - 1] - sizeof(*pph)) {
+        for(dwPool = 0; gdwPoolBlockSizes[dwPool] - sizeof(*pph) < dwSize; dwPool++)
+            ;
+    }
+
+    PPM_POOL pPool = &gPools[dwPool];
+    if(dwPool == PM_POOL_COUNT) {
+        pph = (PPOOL_HEADER) HeapAlloc(ghPmHeap, 0, dwSize + sizeof(*pph));
+        if(pph != NULL) {
+            pph->dwPool = POOL_HEAP_BLOCK;
+            EnterCriticalSection(&pPool->cs);
+            PoolCountAlloc(pPool, FALSE);
+            LeaveCriticalSection(&pPool->cs);
+        }
+    } else {
+        DWORD dwBlockSize = gdwPoolBlockSizes[dwPool];
+
+        EnterCriticalSection(&pPool->cs);
+        if(pPool->pFree != NULL) {
+            // reuse a freed block
+            pph = (PPOOL_HEADER) pPool->pFree;
+            pPool->pFree = pPool->pFree->pNext;
+            PoolCountAlloc(pPool, TRUE);
+        } else {
+            // carve a new block, starting a new slab if necessary
+            if(pPool->pbSlabNext == NULL || pPool->pbSlabNext + dwBlockSize > pPool->pbSlabEnd) {
+                LPBYTE pbSlab = (LPBYTE) HeapAlloc(ghPoolHeap, 0, POOL_SLAB_SIZE);
+                if(pbSlab != NULL) {
+                    pPool->pbSlabNext = pbSlab;
+                    pPool->pbSlabEnd = pbSlab + POOL_SLAB_SIZE;
+                    pPool->stats.dwSlabs++;
+                }
+            }
+            if(pPool->pbSlabNext != NULL && pPool->pbSlabNext + dwBlockSize <= pPool->pbSlabEnd) {
+                pph = (PPOOL_HEADER) pPool->pbSlabNext;
+                pPool->pbSlabNext += dwBlockSize;
+                PoolCountAlloc(pPool, FALSE);
+            }
+        }
+        LeaveCriticalSection(&pPool->cs);
+
+        if(pph != NULL) {
+            pph->dwPool = dwPool;
+        }
+    }
+
+    return pph != NULL ? (PVOID) (pph + 1) : NULL;
+}
+
+// This routine returns memory obtained from PmPoolAlloc() to its pool.  It
+// returns TRUE if successful, FALSE otherwise.
+BOOL
+PmPoolFree(PVOID pvMemory)
+{
+    BOOL fOk = TRUE;
+    PPOOL_HEADER pph;
+    DWORD dwPool;
+    PPM_POOL pPool;
+    SETFNAME(_T("PmPoolFree"));
+
+    if(pvMemory == NULL) {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+    pph = ((PPOOL_HEADER) pvMemory) - 1;
+    dwPool = pph->dwPool;
+
+    if(dwPool == POOL_HEAP_BLOCK) {
+        pPool = &gPools[PM_POOL_COUNT];
+        fOk = HeapFree(ghPmHeap, 0, pph);
+        if(fOk) {
+            EnterCriticalSection(&pPool->cs);
+            pPool->stats.dwInUse--;
+            LeaveCriticalSection(&pPool->cs);
+        }
+    } else if(dwPool < PM_POOL_COUNT) {
+        PPOOL_BLOCK pBlock = (PPOOL_BLOCK) pph;
+        pPool = &gPools[dwPool];
+        EnterCriticalSection(&pPool->cs);
+        pBlock->pNext = pPool->pFree;
+        pPool->pFree = pBlock;
+        pPool->stats.dwInUse--;
+        LeaveCriticalSection(&pPool->cs);
+    } else {
+        PMLOGMSG(ZONE_WARN, (_T("%s: bad pool index %u for 0x%08x\r\n"), 
+            pszFname, dwPool, pvMemory));
+        DEBUGCHK(FALSE);
+        SetLastError(ERROR_INVALID_PARAMETER);
+        fOk = FALSE;
+    }
+
+    return fOk;
+}
+
+// This routine copies a pool's statistics.  Index PM_POOL_LARGE returns the
+// statistics for allocations that went to the heap.
+BOOL
+PmPoolGetStats(DWORD dwPool, PPM_POOL_STATS pStats)
+{
+    if(dwPool > PM_POOL_LARGE || pStats == NULL) {
+        return FALSE;
+    }
+
+    EnterCriticalSection(&gPools[dwPool].cs);
+    *pStats = gPools[dwPool].stats;
+    LeaveCriticalSection(&gPools[dwPool].cs);
+
+    return TRUE;
+}
+
+// This routine logs the statistics for every pool.
+VOID
+PmPoolLogStats(VOID)
+{
+    SETFNAME(_T("PmPoolLogStats"));
+
+    for(DWORD dwPool = 0; dwPool <= PM_POOL_LARGE; dwPool++) {
+        PM_POOL_STATS stats;
+        if(PmPoolGetStats(dwPool, &stats)) {
+            PMLOGMSG(ZONE_ALLOC, (_T("%s: pool %u (%u bytes): %u in use, high water %u, %u allocs, %u%% hits, %u slabs\r\n"),
+                pszFname, dwPool, stats.dwBlockSize, stats.dwInUse, stats.dwHighWater,
+                stats.dwAllocs, stats.dwAllocs != 0 ? (stats.dwHits * 100) / stats.dwAllocs : 0,
+                stats.dwSlabs));
+        }
+    }
+}
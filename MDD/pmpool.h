@@ -0,0 +1,52 @@
+//
+// Copyright (c) Microsoft Corporation.  All rights reserved.
+//
+//
+// Use of this sample source code is subject to the terms of the Microsoft
+// license agreement under which you licensed this sample source code. If
+// you did not accept the terms of the license agreement, you are not
+// authorized to use this sample source code. For the terms of the license,
+// please see the license agreement between you and Microsoft or, if applicable,
+// see the LICENSE.RTF on your install media or the root of your tools installation.
+// THE SAMPLE SOURCE CODE IS PROVIDED "AS IS", WITH NO WARRANTIES OR INDEMNITIES.
+//
+
+//
+// This module declares the PM memory pools that back PmAlloc() and PmFree().
+// Small allocations are served from fixed-size block pools carved out of
+// slabs on a private heap, so creating and destroying PM objects during a
+// system power state transition doesn't contend with other heap users.
+//
+
+#ifndef __PMPOOL_H
+#define __PMPOOL_H
+
+#include <pmimpl.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PM_POOL_COUNT           8           // fixed-size block pools
+#define PM_POOL_LARGE           PM_POOL_COUNT   // statistics index for heap allocations
+
+typedef struct _PM_POOL_STATS {
+    DWORD dwBlockSize;          // block size including header, 0 for the heap
+    DWORD dwInUse;              // blocks currently allocated
+    DWORD dwHighWater;          // most blocks ever allocated at once
+    DWORD dwAllocs;             // total allocations
+    DWORD dwHits;               // allocations satisfied from the free list
+    DWORD dwSlabs;              // slabs obtained from the private heap
+} PM_POOL_STATS, *PPM_POOL_STATS;
+
+BOOL PmPoolInit(VOID);
+PVOID PmPoolAlloc(DWORD dwSize);
+BOOL PmPoolFree(PVOID pvMemory);
+BOOL PmPoolGetStats(DWORD dwPool, PPM_POOL_STATS pStats);
+VOID PmPoolLogStats(VOID);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
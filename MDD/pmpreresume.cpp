@@ -0,0 +1,109 @@
+//
+// Copyright (c) Microsoft Corporation.  All rights reserved.
+//
+//
+// Use of this sample source code is subject to the terms of the Microsoft
+// license agreement under which you licensed this sample source code. If
+// you did not accept the terms of the license agreement, you are not
+// authorized to use this sample source code. For the terms of the license,
+// please see the license agreement between you and Microsoft or, if applicable,
+// see the LICENSE.RTF on your install media or the root of your tools installation.
+// THE SAMPLE SOURCE CODE IS PROVIDED "AS IS", WITH NO WARRANTIES OR INDEMNITIES.
+//
+
+//
+// This module implements the speculative pre-resume pass.  The platform code
+// calls DevicePreResumeWake() on the suspending thread right after
+// PowerOffSystem() returns, passing the block device list and the system
+// power state it suspended from.  Each device is set with
+// PreResumeDevicePower(), which honors the same floors, ceilings and
+// application settings as a normal update.
+//
+
+#include <pmimpl.h>
+#include "pmpreresume.h"
+
+static BOOL gfPreResumeEnabled = FALSE;
+
+// This routine wakes every device on pdl.  Devices are kept alive across
+// the driver calls the same way UpdateClassDeviceStates() does it.
+static VOID
+PreResumeDevices(PDEVICE_LIST pdl, PSYSTEM_POWER_STATE psps, PDEVICE_POWER_RESTRICTION pCeilingDx)
+{
+    BOOL fDeviceRemoved;
+    PDEVICE_STATE pds;
+    DWORD dwStart = GetTickCount();
+    DWORD dwDevices = 0;
+    SETFNAME(_T("PreResumeDevices"));
+
+    PMLOCK();
+    do {
+        fDeviceRemoved = FALSE;
+        pds = pdl->pList;
+        while(!fDeviceRemoved && pds != NULL) {
+            PDEVICE_STATE pdsNext = NULL;
+            DeviceStateAddRef(pds);
+
+            PMUNLOCK();
+            if(PreResumeDevicePower(pds, psps, pCeilingDx) == ERROR_SUCCESS) {
+                dwDevices++;
+            }
+            PMLOCK();
+
+            if(pds->pListHead == NULL) {
+                fDeviceRemoved = TRUE;
+            } else {
+                pdsNext = pds->pNext;
+            }
+            DeviceStateDecRef(pds);
+            if(!fDeviceRemoved) pds = pdsNext;
+        }
+    } while(fDeviceRemoved || pds != NULL);
+    PMUNLOCK();
+
+    PMLOGMSG(ZONE_RESUME, (_T("%s: updated %u devices for '%s' in %u ms\r\n"), pszFname,
+        dwDevices, psps->pszName, GetTickCount() - dwStart));
+}
+
+// This routine runs the pre-resume pass for the devices on pdl, if it's
+// enabled.  psps is the system power state the system suspended from and
+// pCeilingDx is its ceiling list.  Only the thread that suspended the
+// system may call it, before it releases the update lock, since file
+// systems are still off.
+VOID
+DevicePreResumeWake(PDEVICE_LIST pdl, PSYSTEM_POWER_STATE psps, PDEVICE_POWER_RESTRICTION pCeilingDx)
+{
+    if(gfPreResumeEnabled && pdl != NULL && psps != NULL
+    && (psps->dwFlags & (POWER_STATE_SUSPEND | POWER_STATE_OFF | POWER_STATE_CRITICAL | POWER_STATE_RESET)) == 0) {
+        PreResumeDevices(pdl, psps, pCeilingDx);
+    }
+}
+
+// This routine reads whether the OEM has enabled the pre-resume pass.  It
+// can't fail.
+BOOL
+DevicePreResumeInit(VOID)
+{
+    HKEY hkPm;
+    SETFNAME(_T("DevicePreResumeInit"));
+
+    gfPreResumeEnabled = FALSE;
+    if(RegOpenKeyEx(HKEY_LOCAL_MACHINE, PWRMGR_REG_KEY, 0, 0, &hkPm) == ERROR_SUCCESS) {
+        DWORD dwValue;
+        DWORD dwSize = sizeof(dwValue);
+        if(RegQueryTypedValue(hkPm, PM_FAST_RESUME_VALUE, &dwValue, &dwSize, REG_DWORD) == ERROR_SUCCESS) {
+            gfPreResumeEnabled = (dwValue != 0);
+        }
+        RegCloseKey(hkPm);
+    }
+
+    PMLOGMSG(ZONE_INIT && gfPreResumeEnabled, (_T("%s: pre-resume enabled\r\n"), pszFname));
+    return TRUE;
+}
+
+// This routine disables the pre-resume pass.
+VOID
+DevicePreResumeDeinit(VOID)
+{
+    gfPreResumeEnabled = FALSE;
+}
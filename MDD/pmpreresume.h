@@ -0,0 +1,49 @@
+//
+// Copyright (c) Microsoft Corporation.  All rights reserved.
+//
+//
+// Use of this sample source code is subject to the terms of the Microsoft
+// license agreement under which you licensed this sample source code. If
+// you did not accept the terms of the license agreement, you are not
+// authorized to use this sample source code. For the terms of the license,
+// please see the license agreement between you and Microsoft or, if applicable,
+// see the LICENSE.RTF on your install media or the root of your tools installation.
+// THE SAMPLE SOURCE CODE IS PROVIDED "AS IS", WITH NO WARRANTIES OR INDEMNITIES.
+//
+
+
+//
+// This module declares the speculative pre-resume pass.  When it's enabled
+// the thread that suspended the system starts powering block devices back
+// up as soon as PowerOffSystem() returns, instead of leaving them for the
+// resume transition.  That thread is still the only one that may call
+// drivers while file systems are off, and it still holds the update lock,
+// so the pass never overlaps the resume transition.  Each device is sent the
+// power state it would get in the system power state the system suspended
+// from, so by the time the resume transition reaches its block device update
+// most drivers are already where it wants them.
+//
+
+#ifndef __PMPRERESUME_H
+#define __PMPRERESUME_H
+
+#include <pmimpl.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// registry value under PWRMGR_REG_KEY that enables the pre-resume pass;
+// it's off by default.
+#define PM_FAST_RESUME_VALUE        _T("FastResume")
+
+BOOL DevicePreResumeInit(VOID);
+VOID DevicePreResumeDeinit(VOID);
+VOID DevicePreResumeWake(PDEVICE_LIST pdl, PSYSTEM_POWER_STATE psps, PDEVICE_POWER_RESTRICTION pCeilingDx);
+DWORD PreResumeDevicePower(PDEVICE_STATE pds, PSYSTEM_POWER_STATE psps, PDEVICE_POWER_RESTRICTION pCeilingDx);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -268,9 +268,10 @@ PmSetPowerRequirement(PVOID pvDevice, CEDEVICE_POWER_STATE reqDx,
         }
         hRequirement = (HANDLE) pdpr;
         
-        // should we update the device's power state?
+        // should we update the device's power state?  Both state names are
+        // atoms, so they match only if the pointers are equal.
         if(pdpr !=NULL && 
-                (pdpr->pszSystemState == NULL || _tcscmp(pdpr->pszSystemState, gpSystemPowerState->pszName) == 0)) {
+                (pdpr->pszSystemState == NULL || pdpr->pszSystemState == gpSystemPowerState->pszName)) {
             fUpdate = TRUE;
         }
         
@@ -0,0 +1,154 @@
+//
+// Copyright (c) Microsoft Corporation.  All rights reserved.
+//
+//
+// Use of this sample source code is subject to the terms of the Microsoft
+// license agreement under which you licensed this sample source code. If
+// you did not accept the terms of the license agreement, you are not
+// authorized to use this sample source code. For the terms of the license,
+// please see the license agreement between you and Microsoft or, if applicable,
+// see the LICENSE.RTF on your install media or the root of your tools installation.
+// THE SAMPLE SOURCE CODE IS PROVIDED "AS IS", WITH NO WARRANTIES OR INDEMNITIES.
+//
+
+//
+// This module publishes the current system power state and ceiling list as
+// an immutable snapshot.  Readers announce themselves on one of two counters,
+// chosen by the low bit of the epoch; the publisher swaps the snapshot
+// pointer, flips the epoch, and frees the old snapshot once the old epoch's
+// counter drains.  Snapshots that still have readers go on a retired list
+// that later publications sweep, so a transition never waits for them.
+//
+
+#include <pmimpl.h>
+#include "pmsnapshot.h"
+#include "pmsysstate.h"
+
+// what readers see before the first transition
+static POWER_SNAPSHOT gpsBoot = { NULL, NULL, 0, NULL };
+
+static PPOWER_SNAPSHOT volatile gppsCurrent = &gpsBoot;
+static volatile LONG glSnapshotEpoch;
+static volatile LONG glSnapshotReaders[2];
+static PPOWER_SNAPSHOT gppsRetired;          // waiting for their epochs to drain
+
+// This routine frees a retired snapshot and drops its state reference.
+static VOID
+SnapshotDestroy(PPOWER_SNAPSHOT pps)
+{
+    if(pps != &gpsBoot) {
+        SystemPowerStateRelease(pps->psps);
+        PmFree(pps);
+    }
+}
+
+// This routine frees retired snapshots whose epoch's readers have all left,
+// or all of them if fForce is set.  Callers must be serialized with
+// PowerSnapshotPublish().
+static VOID
+SnapshotSweep(BOOL fForce)
+{
+    PPOWER_SNAPSHOT *ppps = &gppsRetired;
+
+    while(*ppps != NULL) {
+        PPOWER_SNAPSHOT pps = *ppps;
+        if(fForce || glSnapshotReaders[pps->lRetiredEpoch & 1] == 0) {
+            *ppps = pps->pNextRetired;
+            SnapshotDestroy(pps);
+        } else {
+            ppps = &pps->pNextRetired;
+        }
+    }
+}
+
+// This routine enters a read-side section and returns the current snapshot,
+// which stays valid until PowerSnapshotLeave() is called with the token
+// passed back here.  It never returns NULL, but the snapshot's state is
+// NULL until the first transition has been published.
+PPOWER_SNAPSHOT
+PowerSnapshotEnter(PDWORD pdwToken)
+{
+    LONG lEpoch;
+
+    PREFAST_DEBUGCHK(pdwToken != NULL);
+
+    // register on the current epoch's counter; retry if the publisher
+    // flipped the epoch before we were counted
+    for(;;) {
+        lEpoch = glSnapshotEpoch;
+        InterlockedIncrement((PLONG) &glSnapshotReaders[lEpoch & 1]);
+        if(glSnapshotEpoch == lEpoch) {
+            break;
+        }
+        InterlockedDecrement((PLONG) &glSnapshotReaders[lEpoch & 1]);
+    }
+
+    *pdwToken = (DWORD) (lEpoch & 1);
+    return gppsCurrent;
+}
+
+// This routine leaves a read-side section entered with PowerSnapshotEnter().
+VOID
+PowerSnapshotLeave(DWORD dwToken)
+{
+    DEBUGCHK(dwToken < 2);
+    DEBUGCHK(glSnapshotReaders[dwToken] > 0);
+    InterlockedDecrement((PLONG) &glSnapshotReaders[dwToken & 1]);
+}
+
+// This routine publishes a new snapshot of the system power state and its
+// ceiling list, taking a reference on the state.  Publishers must be
+// serialized by the caller; PlatformSetSystemPowerState() does this.  It
+// returns FALSE if there's no memory, in which case the old snapshot stays
+// published.
+BOOL
+PowerSnapshotPublish(PSYSTEM_POWER_STATE psps, PDEVICE_POWER_RESTRICTION pCeilingDx)
+{
+    PPOWER_SNAPSHOT pps, ppsOld;
+    SETFNAME(_T("PowerSnapshotPublish"));
+
+    PREFAST_DEBUGCHK(psps != NULL);
+
+    pps = (PPOWER_SNAPSHOT) PmAlloc(sizeof(*pps));
+    if(pps == NULL) {
+        PMLOGMSG(ZONE_WARN, (_T("%s: couldn't allocate snapshot for '%s'\r\n"),
+            pszFname, psps->pszName));
+        return FALSE;
+    }
+    SystemPowerStateAddRef(psps);
+    pps->psps = psps;
+    pps->pCeilingDx = pCeilingDx;
+    pps->lRetiredEpoch = 0;
+    pps->pNextRetired = NULL;
+
+    // Free retirees whose epoch has drained.  A counter is shared by every
+    // other epoch, so a zero count also covers readers from older epochs;
+    // a busy one just keeps its retirees until a later publication.
+    SnapshotSweep(FALSE);
+
+    // publish, then start a new epoch so that we can tell when everybody
+    // who might have seen the old snapshot is gone
+    ppsOld = (PPOWER_SNAPSHOT) InterlockedExchangePointer((PVOID *) &gppsCurrent, pps);
+    LONG lOldEpoch = glSnapshotEpoch;
+    InterlockedIncrement((PLONG) &glSnapshotEpoch);
+
+    if(glSnapshotReaders[lOldEpoch & 1] == 0) {
+        SnapshotDestroy(ppsOld);
+    } else {
+        ppsOld->lRetiredEpoch = lOldEpoch;
+        ppsOld->pNextRetired = gppsRetired;
+        gppsRetired = ppsOld;
+    }
+
+    return TRUE;
+}
+
+// This routine frees any snapshots still waiting for their readers.  It is
+// called during PM shutdown, after the threads that read snapshots have
+// exited.
+VOID
+PowerSnapshotDeinit(VOID)
+{
+    SnapshotSweep(TRUE);
+    DEBUGCHK(gppsRetired == NULL);
+}
@@ -0,0 +1,47 @@
+//
+// Copyright (c) Microsoft Corporation.  All rights reserved.
+//
+//
+// Use of this sample source code is subject to the terms of the Microsoft
+// license agreement under which you licensed this sample source code. If
+// you did not accept the terms of the license agreement, you are not
+// authorized to use this sample source code. For the terms of the license,
+// please see the license agreement between you and Microsoft or, if applicable,
+// see the LICENSE.RTF on your install media or the root of your tools installation.
+// THE SAMPLE SOURCE CODE IS PROVIDED "AS IS", WITH NO WARRANTIES OR INDEMNITIES.
+//
+
+//
+// This module declares the published power state snapshot.  A snapshot pairs
+// the current system power state with its ceiling list.  Readers that only
+// need those can use PowerSnapshotEnter() and PowerSnapshotLeave() instead of
+// the PM lock, and never wait for a transition in progress.  Readers must
+// not block or take the PM lock between Enter and Leave.
+//
+
+#ifndef __PMSNAPSHOT_H
+#define __PMSNAPSHOT_H
+
+#include <pmimpl.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct _POWER_SNAPSHOT {
+    PSYSTEM_POWER_STATE psps;               // holds a state cache reference
+    PDEVICE_POWER_RESTRICTION pCeilingDx;   // owned by psps's descriptor
+    LONG lRetiredEpoch;                     // publisher only: epoch it was retired from
+    struct _POWER_SNAPSHOT *pNextRetired;   // publisher only: retired list link
+} POWER_SNAPSHOT, *PPOWER_SNAPSHOT;
+
+PPOWER_SNAPSHOT PowerSnapshotEnter(PDWORD pdwToken);
+VOID PowerSnapshotLeave(DWORD dwToken);
+BOOL PowerSnapshotPublish(PSYSTEM_POWER_STATE psps, PDEVICE_POWER_RESTRICTION pCeilingDx);
+VOID PowerSnapshotDeinit(VOID);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,165 @@
+//
+// Copyright (c) Microsoft Corporation.  All rights reserved.
+//
+//
+// Use of this sample source code is subject to the terms of the Microsoft
+// license agreement under which you licensed this sample source code. If
+// you did not accept the terms of the license agreement, you are not
+// authorized to use this sample source code. For the terms of the license,
+// please see the license agreement between you and Microsoft or, if applicable,
+// see the LICENSE.RTF on your install media or the root of your tools installation.
+// THE SAMPLE SOURCE CODE IS PROVIDED "AS IS", WITH NO WARRANTIES OR INDEMNITIES.
+//
+
+
+//
+// This module maintains the power status page.  Writers are serialized by a
+// critical section of their own and bump the sequence number before and
+// after each update; the interlocked operations order the writes for
+// readers.
+//
+
+#include <pmimpl.h>
+#include "pmstatuspage.h"
+#include "pmdxword.h"
+
+static CRITICAL_SECTION gcsStatusPage;
+static HANDLE ghStatusPage;
+static PPM_STATUS_PAGE gpStatusPage;    // NULL if the page couldn't be created
+
+// This routine builds the device class summaries in aClasses and returns
+// how many there are.  It's called before taking the page's writer lock,
+// which ranks below the PM lock.
+static DWORD
+StatusPageGetClasses(PM_STATUS_CLASS aClasses[PM_STATUS_MAX_CLASSES])
+{
+    PDEVICE_LIST pdl;
+    PDEVICE_STATE pds;
+    DWORD dwClasses = 0;
+
+    PMLOCK();
+    for(pdl = gpDeviceLists; pdl != NULL && dwClasses < PM_STATUS_MAX_CLASSES; pdl = pdl->pNext) {
+        PPM_STATUS_CLASS psc = &aClasses[dwClasses++];
+        psc->guidClass = *pdl->pGuid;
+        psc->dwDevices = 0;
+        psc->summaryDx = PwrDeviceUnspecified;
+        for(pds = pdl->pList; pds != NULL; pds = pds->pNext) {
+            CEDEVICE_POWER_STATE dx = DxWordActualDx(DxWordRead(pds));
+            psc->dwDevices++;
+            if(dx != PwrDeviceUnspecified 
+            && (psc->summaryDx == PwrDeviceUnspecified || dx < psc->summaryDx)) {
+                psc->summaryDx = dx;
+            }
+        }
+    }
+    PMUNLOCK();
+
+    return dwClasses;
+}
+
+// This routine publishes a new system power state and, if ppi isn't NULL,
+// AC/battery status.  It's called when a transition publishes its power
+// state snapshot, so the page and the snapshot change together.
+VOID
+PowerStatusPagePublish(LPCTSTR pszState, DWORD dwStateFlags, PPOWER_BROADCAST_POWER_INFO ppi)
+{
+    PPM_STATUS_PAGE pPage = gpStatusPage;
+
+    PREFAST_DEBUGCHK(pszState != NULL);
+
+    if(pPage != NULL) {
+        EnterCriticalSection(&gcsStatusPage);
+        InterlockedIncrement(&pPage->lSequence);
+        pPage->dwTransitions++;
+        pPage->dwStateFlags = dwStateFlags;
+        StringCchCopy(pPage->szStateName, _countof(pPage->szStateName), pszState);
+        if(ppi != NULL) {
+            pPage->powerInfo = *ppi;
+        }
+        InterlockedIncrement(&pPage->lSequence);
+        LeaveCriticalSection(&gcsStatusPage);
+    }
+}
+
+// This routine publishes fresh device class summaries.  It's called at the
+// end of each system power state transition, once the devices have been
+// updated.
+VOID
+PowerStatusPageUpdateClasses(VOID)
+{
+    PPM_STATUS_PAGE pPage = gpStatusPage;
+
+    if(pPage != NULL) {
+        PM_STATUS_CLASS aClasses[PM_STATUS_MAX_CLASSES];
+        DWORD dwClasses = StatusPageGetClasses(aClasses);
+
+        EnterCriticalSection(&gcsStatusPage);
+        InterlockedIncrement(&pPage->lSequence);
+        pPage->dwClasses = dwClasses;
+        memcpy(pPage->aClasses, aClasses, dwClasses * sizeof(aClasses[0]));
+        InterlockedIncrement(&pPage->lSequence);
+        LeaveCriticalSection(&gcsStatusPage);
+    }
+}
+
+// This routine publishes new AC/battery status.
+VOID
+PowerStatusPageSetPowerInfo(PPOWER_BROADCAST_POWER_INFO ppi)
+{
+    PPM_STATUS_PAGE pPage = gpStatusPage;
+
+    PREFAST_DEBUGCHK(ppi != NULL);
+
+    if(pPage != NULL) {
+        EnterCriticalSection(&gcsStatusPage);
+        InterlockedIncrement(&pPage->lSequence);
+        pPage->powerInfo = *ppi;
+        InterlockedIncrement(&pPage->lSequence);
+        LeaveCriticalSection(&gcsStatusPage);
+    }
+}
+
+// This routine creates the page.  A failure here is not fatal -- readers
+// that can't find the page fall back on GetSystemPowerState().  The PM only
+// ever writes the page; any process can map it for writing, so nothing in
+// the PM may base a decision on what it contains.
+BOOL
+PowerStatusPageInit(VOID)
+{
+    SETFNAME(_T("PowerStatusPageInit"));
+
+    InitializeCriticalSection(&gcsStatusPage);
+    gpStatusPage = NULL;
+    ghStatusPage = CreateFileMapping(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0,
+        sizeof(PM_STATUS_PAGE), PM_STATUS_PAGE_NAME);
+    if(ghStatusPage != NULL) {
+        PPM_STATUS_PAGE pPage = (PPM_STATUS_PAGE) MapViewOfFile(ghStatusPage, FILE_MAP_WRITE, 0, 0, 0);
+        if(pPage != NULL) {
+            memset(pPage, 0, sizeof(*pPage));
+            pPage->dwVersion = PM_STATUS_PAGE_VERSION;
+            gpStatusPage = pPage;
+        } else {
+            CloseHandle(ghStatusPage);
+            ghStatusPage = NULL;
+        }
+    }
+
+    PMLOGMSG(gpStatusPage == NULL && ZONE_WARN, (_T("%s: couldn't create '%s', error %d\r\n"),
+        pszFname, PM_STATUS_PAGE_NAME, GetLastError()));
+    return TRUE;
+}
+
+// This routine removes the page.
+VOID
+PowerStatusPageDeinit(VOID)
+{
+    if(gpStatusPage != NULL) {
+        UnmapViewOfFile(gpStatusPage);
+        gpStatusPage = NULL;
+    }
+    if(ghStatusPage != NULL) {
+        CloseHandle(ghStatusPage);
+        ghStatusPage = NULL;
+    }
+    DeleteCriticalSection(&gcsStatusPage);
+}
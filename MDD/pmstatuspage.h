@@ -0,0 +1,98 @@
+//
+// Copyright (c) Microsoft Corporation.  All rights reserved.
+//
+//
+// Use of this sample source code is subject to the terms of the Microsoft
+// license agreement under which you licensed this sample source code. If
+// you did not accept the terms of the license agreement, you are not
+// authorized to use this sample source code. For the terms of the license,
+// please see the license agreement between you and Microsoft or, if applicable,
+// see the LICENSE.RTF on your install media or the root of your tools installation.
+// THE SAMPLE SOURCE CODE IS PROVIDED "AS IS", WITH NO WARRANTIES OR INDEMNITIES.
+//
+
+
+//
+// This module declares the power status page.  The PM keeps a copy of the
+// current system power state, a power summary for each device class, and
+// the AC/battery status in a named shared memory page, so that applications
+// can check them without calling into the PM at all.
+//
+// To read the page, open the mapping named PM_STATUS_PAGE_NAME with
+// CreateFileMapping() (it will already exist), map it with FILE_MAP_READ,
+// and copy it out with PmStatusPageRead().  The page is a seqlock: lSequence
+// is odd while the PM is updating it, and readers retry if it changed while
+// they were copying.  Readers must never write to the page.
+//
+// The page is for readers outside the PM.  Windows CE can't stop another
+// process from mapping it for writing, so it isn't authoritative:  code in
+// the PM's process uses the PM's own state (see pmsnapshot.h) instead.
+//
+// This header doesn't need any PM internals so that applications can use it.
+//
+
+#ifndef __PMSTATUSPAGE_H
+#define __PMSTATUSPAGE_H
+
+#include <windows.h>
+#include <pm.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PM_STATUS_PAGE_NAME         _T("SYSTEM/PowerManagerStatus")
+#define PM_STATUS_PAGE_VERSION      1
+#define PM_STATUS_MAX_CLASSES       8
+#define PM_STATUS_MAX_NAME          32      // characters, including the terminator
+
+typedef struct _PM_STATUS_CLASS {
+    GUID guidClass;
+    DWORD dwDevices;
+    CEDEVICE_POWER_STATE summaryDx;     // the most powered-up device, or PwrDeviceUnspecified
+} PM_STATUS_CLASS, *PPM_STATUS_CLASS;
+
+typedef struct _PM_STATUS_PAGE {
+    volatile LONG lSequence;            // odd while the PM is writing
+    DWORD dwVersion;                    // PM_STATUS_PAGE_VERSION
+    DWORD dwTransitions;                // system power state transitions so far
+    DWORD dwStateFlags;                 // POWER_STATE_xxx flags of the current state
+    WCHAR szStateName[PM_STATUS_MAX_NAME];  // truncated if it doesn't fit
+    POWER_BROADCAST_POWER_INFO powerInfo;   // as of the last PBT_POWERINFOCHANGE
+    DWORD dwClasses;
+    PM_STATUS_CLASS aClasses[PM_STATUS_MAX_CLASSES];
+} PM_STATUS_PAGE, *PPM_STATUS_PAGE;
+
+// This routine copies a consistent view of the page into pCopy.  It returns
+// FALSE if the PM kept updating it for the whole time the routine was trying.
+__inline BOOL
+PmStatusPageRead(const PM_STATUS_PAGE *pPage, PPM_STATUS_PAGE pCopy)
+{
+    int iTries;
+
+    for(iTries = 0; iTries < 100; iTries++) {
+        LONG lSequence = pPage->lSequence;
+        if((lSequence & 1) == 0) {
+            MemoryBarrier();
+            memcpy(pCopy, (const void *) pPage, sizeof(*pCopy));
+            MemoryBarrier();
+            if(pPage->lSequence == lSequence) {
+                return TRUE;
+            }
+        }
+    }
+    return FALSE;
+}
+
+// PM internal
+BOOL PowerStatusPageInit(VOID);
+VOID PowerStatusPageDeinit(VOID);
+VOID PowerStatusPagePublish(LPCTSTR pszState, DWORD dwStateFlags, PPOWER_BROADCAST_POWER_INFO ppi);
+VOID PowerStatusPageUpdateClasses(VOID);
+VOID PowerStatusPageSetPowerInfo(PPOWER_BROADCAST_POWER_INFO ppi);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
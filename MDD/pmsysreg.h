@@ -28,15 +28,28 @@ class RegKeyOrValue {
 public:
     RegKeyOrValue(HKEY hKey,LPCTSTR lpRegName,RegKeyOrValue *pNextRegKeyOrValue) : m_hParentKey (hKey),m_pNextRegKeyOrValue(pNextRegKeyOrValue) {
         m_lpRegName = NULL;
+        m_dwNameHash = 0;
         if (lpRegName) {
             m_lpRegName = new TCHAR [ _tcslen(lpRegName) +1 ];
-            if (m_lpRegName)
+            if (m_lpRegName) {
                 VERIFY(SUCCEEDED(StringCchCopy(m_lpRegName,_tcslen(lpRegName) +1,lpRegName)));
+                m_dwNameHash = HashName(m_lpRegName);
+            }
         }
         else 
             m_lpRegName = NULL;
         
     };
+    // Case-insensitive FNV-1a hash, matching the _tcsicmp() name compares.
+    static DWORD HashName(LPCTSTR lpName) {
+        DWORD dwHash = 2166136261;
+        while (*lpName) {
+            dwHash ^= (DWORD) _totlower(*lpName++);
+            dwHash *= 16777619;
+        }
+        return dwHash;
+    }
+    DWORD GetNameHash() { return m_dwNameHash; };
     virtual BOOL Init() { return m_lpRegName!=NULL; };
     virtual ~RegKeyOrValue() {
         if (m_lpRegName!=NULL)
@@ -49,12 +62,75 @@ public:
         return  pReturnPtr;
     }
     RegKeyOrValue * GetNextRegKeyOrValuePtr() { return m_pNextRegKeyOrValue; };
+    void SetParentKey(HKEY hKey) { m_hParentKey = hKey; };
 protected:
     LPTSTR m_lpRegName;
+    DWORD  m_dwNameHash;
     HKEY   m_hParentKey;
     RegKeyOrValue * m_pNextRegKeyOrValue;
 };
 
+// Index over a list of keys or values: an array in list order for
+// enumeration by position, and an open-addressed hash table on the folded
+// names for lookup.  The index doesn't own the nodes and must be rebuilt
+// whenever the list changes.
+class RegNodeIndex {
+public:
+    RegNodeIndex() : m_ppNodes(NULL), m_ppHash(NULL), m_dwCount(0), m_dwHashMask(0) {};
+    ~RegNodeIndex() { Clear(); };
+    void Clear() {
+        if (m_ppNodes)
+            delete [] m_ppNodes;
+        if (m_ppHash)
+            delete [] m_ppHash;
+        m_ppNodes = NULL;
+        m_ppHash = NULL;
+        m_dwCount = 0;
+        m_dwHashMask = 0;
+    }
+    BOOL IsBuilt() { return m_ppHash != NULL; };
+    BOOL Build(RegKeyOrValue * pList) {
+        DWORD dwCount = 0, dwHashSize = 4;
+        Clear();
+        for (RegKeyOrValue * pCur = pList; pCur; pCur = pCur->GetNextRegKeyOrValuePtr())
+            dwCount++;
+        while (dwHashSize < dwCount * 2)
+            dwHashSize <<= 1;
+        m_ppNodes = new RegKeyOrValue * [ dwCount ? dwCount : 1 ];
+        m_ppHash = new RegKeyOrValue * [ dwHashSize ];
+        if (m_ppNodes == NULL || m_ppHash == NULL) {
+            Clear(); // callers fall back to the lists
+            return FALSE;
+        }
+        memset(m_ppHash, 0, dwHashSize * sizeof(m_ppHash[0]));
+        m_dwHashMask = dwHashSize - 1;
+        for (RegKeyOrValue * pCur = pList; pCur; pCur = pCur->GetNextRegKeyOrValuePtr()) {
+            m_ppNodes[m_dwCount++] = pCur;
+            if (pCur->GetName()) {
+                DWORD dwSlot = pCur->GetNameHash() & m_dwHashMask;
+                while (m_ppHash[dwSlot])
+                    dwSlot = (dwSlot + 1) & m_dwHashMask;
+                m_ppHash[dwSlot] = pCur;
+            }
+        }
+        return TRUE;
+    }
+    RegKeyOrValue * Get(DWORD dwIndex) { return (dwIndex < m_dwCount ? m_ppNodes[dwIndex] : NULL); };
+    RegKeyOrValue * Find(LPCTSTR lpName) {
+        DWORD dwHash = RegKeyOrValue::HashName(lpName);
+        for (DWORD dwSlot = dwHash & m_dwHashMask; m_ppHash[dwSlot]; dwSlot = (dwSlot + 1) & m_dwHashMask) {
+            if (m_ppHash[dwSlot]->GetNameHash() == dwHash && _tcsicmp(m_ppHash[dwSlot]->GetName(),lpName) == 0)
+                return m_ppHash[dwSlot];
+        }
+        return NULL;
+    }
+private:
+    RegKeyOrValue ** m_ppNodes;
+    RegKeyOrValue ** m_ppHash;
+    DWORD m_dwCount;
+    DWORD m_dwHashMask;
+};
+
 class RegValue : public RegKeyOrValue{
 public:
     RegValue(HKEY hKey,LPCTSTR lpRegName,RegValue * pNextRegValue ) :  RegKeyOrValue(hKey,lpRegName,pNextRegValue) { 
@@ -67,6 +143,36 @@ public:
             delete  m_lpByteValue;
     }
     virtual BOOL Init() { return (m_dwValueSize!=NULL && m_lpByteValue!=NULL); };
+    // Re-reads the value.  Returns TRUE if its type or data changed (or it
+    // can't be read), FALSE if the cached copy is still current.
+    BOOL RefreshRegValue() {
+        BOOL fChanged = TRUE;
+        DWORD dwType, dwSize = 0;
+        if (m_lpRegName && RegQueryValueEx(m_hParentKey,m_lpRegName,NULL,&dwType,NULL,&dwSize) == ERROR_SUCCESS) {
+            BYTE abSmall[16];
+            LPBYTE lpData = (dwSize <= sizeof(abSmall) ? abSmall : new BYTE [ dwSize ]);
+            if (lpData != NULL && RegQueryValueEx(m_hParentKey,m_lpRegName,NULL,&dwType,lpData,&dwSize) == ERROR_SUCCESS) {
+                if (m_lpByteValue != NULL && dwType == m_dwValueType && dwSize == m_dwValueSize 
+                        && memcmp(lpData, m_lpByteValue, dwSize) == 0) {
+                    fChanged = FALSE;
+                }
+                else {
+                    LPBYTE lpNewValue = new BYTE [ dwSize ? dwSize : 1 ];
+                    if (lpNewValue) {
+                        memcpy(lpNewValue, lpData, dwSize);
+                        if (m_lpByteValue)
+                            delete [] m_lpByteValue;
+                        m_lpByteValue = lpNewValue;
+                        m_dwValueSize = dwSize;
+                        m_dwValueType = dwType;
+                    }
+                }
+            }
+            if (lpData != NULL && lpData != abSmall)
+                delete [] lpData;
+        }
+        return fChanged;
+    }
     virtual BOOL GetRegValue(PVOID pvData, LPDWORD pdwSize, LPDWORD pdwType)  {
         if (m_lpByteValue &&  pdwSize ) {
             if (pvData)
@@ -111,6 +217,7 @@ public:
         m_pRegValueList=NULL;
         m_pRegKeyList=NULL;
         m_RegKey = NULL;
+        m_dwGeneration = 0;
     }
     BOOL Init() {  
         RefreshAll();
@@ -153,6 +260,7 @@ public:
                 m_pRegKeyList = m_pBackupRegKeyList ;
                 fReturn = FALSE;
             }
+            RebuildIndex();
             if (!bDoNotCloseKey) {
                 RegCloseKey( m_RegKey );
                 m_RegKey = NULL;
@@ -160,7 +268,90 @@ public:
         }
         return fReturn;
     }
+    // Re-reads this key and its subkeys, keeping every node whose name still
+    // exists and re-reading only the data of values.  Nodes that appeared or
+    // disappeared are created or deleted.  Keys whose subtree changed are
+    // stamped with dwGeneration.  Returns TRUE if anything changed.
+    BOOL RefreshChanged(DWORD dwGeneration, BOOL bDoNotCloseKey = FALSE) {
+        BOOL fChanged = FALSE;
+        if(m_RegKey == NULL && RegOpenKeyEx(m_hParentKey, m_lpRegName, 0, 0, &m_RegKey ) != ERROR_SUCCESS )  {
+            m_RegKey = NULL;
+        }
+        if (m_RegKey) {
+            TCHAR regName[MAX_PATH];
+            RegValue * pNewValueList = NULL;
+            RegKey * pNewKeyList = NULL;
+            for (DWORD RegEnum = 0;;RegEnum++) {
+                DWORD ValLen = MAX_PATH;
+                LONG status = ::RegEnumValue (m_RegKey, RegEnum, regName, &ValLen, NULL, NULL, NULL, NULL);
+                if (status != ERROR_SUCCESS && status != ERROR_MORE_DATA)
+                    break;
+                regName[MAX_PATH -1] =0;
+                RegValue * pValue = (RegValue *) UnlinkByName((RegKeyOrValue **) &m_pRegValueList, regName);
+                if (pValue) {
+                    pValue->SetParentKey(m_RegKey);
+                    if (pValue->RefreshRegValue())
+                        fChanged = TRUE;
+                    pValue->SetNextRegKeyOrValuePtr(pNewValueList);
+                }
+                else {
+                    fChanged = TRUE;
+                    pValue = new RegValue(m_RegKey,regName,pNewValueList);
+                    if (pValue == NULL || !pValue->Init()) {
+                        if (pValue)
+                            delete pValue;
+                        continue;
+                    }
+                }
+                pNewValueList = pValue;
+            }
+            for (DWORD RegEnum = 0;;RegEnum++) {
+                DWORD ValLen = MAX_PATH;
+                LONG status = ::RegEnumKeyEx(m_RegKey, RegEnum, regName, &ValLen, NULL, NULL, NULL, NULL);
+                if (status != ERROR_SUCCESS && status != ERROR_MORE_DATA)
+                    break;
+                regName[MAX_PATH -1] =0;
+                RegKey * pKey = (RegKey *) UnlinkByName((RegKeyOrValue **) &m_pRegKeyList, regName);
+                if (pKey) {
+                    pKey->SetParentKey(m_RegKey);
+                    if (pKey->RefreshChanged(dwGeneration))
+                        fChanged = TRUE;
+                    pKey->SetNextRegKeyOrValuePtr(pNewKeyList);
+                }
+                else {
+                    fChanged = TRUE;
+                    pKey = new RegKey (m_RegKey,regName,0,pNewKeyList);
+                    if (pKey == NULL || !pKey->Init()) {
+                        if (pKey)
+                            delete pKey;
+                        continue;
+                    }
+                    pKey->m_dwGeneration = dwGeneration;
+                }
+                pNewKeyList = pKey;
+            }
+            // Whatever is left over has been deleted from the registry.
+            if (m_pRegValueList != NULL || m_pRegKeyList != NULL) {
+                fChanged = TRUE;
+                DeleteAll();
+            }
+            m_pRegValueList = pNewValueList;
+            m_pRegKeyList = pNewKeyList;
+            RebuildIndex();
+            if (fChanged)
+                m_dwGeneration = dwGeneration;
+            if (!bDoNotCloseKey) {
+                RegCloseKey( m_RegKey );
+                m_RegKey = NULL;
+            }
+        }
+        return fChanged;
+    }
+    // Returns the generation at which this key's subtree last changed.
+    DWORD GetGeneration() { return m_dwGeneration; };
     RegKey * RegFindKey(LPCTSTR lpKeyPath) {
+        if (m_KeyIndex.IsBuilt())
+            return (RegKey *) m_KeyIndex.Find(lpKeyPath);
         RegKey * pReturnKey =  m_pRegKeyList;
         while (pReturnKey) {
             if (_tcsicmp( pReturnKey->GetName(),lpKeyPath)==0)
@@ -171,6 +362,12 @@ public:
         return NULL;
     }
     LONG RegFindValue(LPCTSTR lpValueName, PVOID pvData, LPDWORD pdwSize, LPDWORD pdwType) {
+        if (m_ValueIndex.IsBuilt()) {
+            RegValue * pValue = (RegValue *) m_ValueIndex.Find(lpValueName);
+            if (pValue == NULL)
+                return ERROR_NO_MORE_ITEMS;
+            return (pValue->GetRegValue(pvData,pdwSize,pdwType)?ERROR_SUCCESS :ERROR_INVALID_PARAMETER);
+        }
         RegValue * pCurValue =  m_pRegValueList;
         while (pCurValue) {
             if (_tcsicmp( pCurValue->GetName(),lpValueName)==0) {
@@ -182,9 +379,11 @@ public:
         return ERROR_NO_MORE_ITEMS;
         
     }
-    LONG RegEnum(RegKeyOrValue * pList, DWORD dwReqIndex, __out_bcount(*lpcbName) PWSTR lpName, PDWORD lpcbName) {
+    LONG RegEnum(RegKeyOrValue * pList, RegNodeIndex * pIndex, DWORD dwReqIndex, __out_bcount(*lpcbName) PWSTR lpName, PDWORD lpcbName) {
         RegKeyOrValue * pReturnKey = pList;
-        for (DWORD dwIndex = 0; pReturnKey!=NULL &&  dwIndex<dwReqIndex; dwIndex++) {
+        if (pIndex->IsBuilt())
+            pReturnKey = pIndex->Get(dwReqIndex);
+        else for (DWORD dwIndex = 0; pReturnKey!=NULL &&  dwIndex<dwReqIndex; dwIndex++) {
             pReturnKey =(RegKey * )pReturnKey->GetNextRegKeyOrValuePtr();
         }
         if (pReturnKey && pReturnKey->GetName()) {
@@ -204,13 +403,31 @@ public:
             return ERROR_NO_MORE_ITEMS;
     }
     LONG RegEnumKeyEx( DWORD dwReqIndex, __out_bcount(*lpcbName) PWSTR lpName, PDWORD lpcbName) {
-        return RegEnum(m_pRegKeyList, dwReqIndex, lpName, lpcbName) ;
+        return RegEnum(m_pRegKeyList, &m_KeyIndex, dwReqIndex, lpName, lpcbName) ;
     }
     LONG RegEnumValue( DWORD dwReqIndex,__out_bcount(*lpcbValueName)LPWSTR lpValueName, LPDWORD lpcbValueName) {
-        return RegEnum(m_pRegValueList, dwReqIndex, lpValueName, lpcbValueName) ;
+        return RegEnum(m_pRegValueList, &m_ValueIndex, dwReqIndex, lpValueName, lpcbValueName) ;
     }
 
 protected:
+    // Removes the named node from a list and returns it, or returns NULL.
+    RegKeyOrValue * UnlinkByName(RegKeyOrValue ** ppList, LPCTSTR pszName) {
+        RegKeyOrValue * pPrev = NULL;
+        RegKeyOrValue * pCur = *ppList;
+        while (pCur) {
+            if (_tcsicmp(pCur->GetName(),pszName)== 0) {
+                if (pPrev)
+                    pPrev->SetNextRegKeyOrValuePtr(pCur->GetNextRegKeyOrValuePtr());
+                else
+                    *ppList = pCur->GetNextRegKeyOrValuePtr();
+                pCur->SetNextRegKeyOrValuePtr(NULL);
+                return pCur;
+            }
+            pPrev = pCur;
+            pCur = pCur->GetNextRegKeyOrValuePtr();
+        }
+        return NULL;
+    }
     RegKeyOrValue * SearchByName(RegKeyOrValue * pRegKeyOrValueList,LPCTSTR pszName) {
         while (pRegKeyOrValueList) {
             if (_tcsicmp(pRegKeyOrValueList->GetName(),pszName)== 0) // found it 
@@ -220,7 +437,13 @@ protected:
         }
         return pRegKeyOrValueList;
     }
+    void RebuildIndex() {
+        m_KeyIndex.Build(m_pRegKeyList);
+        m_ValueIndex.Build(m_pRegValueList);
+    }
     void DeleteAll() {
+        m_KeyIndex.Clear();
+        m_ValueIndex.Clear();
         while (m_pRegValueList) {
             RegValue * pNextRegValue = (RegValue * )m_pRegValueList->GetNextRegKeyOrValuePtr() ;
             delete m_pRegValueList;
@@ -285,6 +508,9 @@ protected:
     HKEY            m_RegKey;
     RegValue *      m_pRegValueList;
     RegKey *        m_pRegKeyList;
+    RegNodeIndex    m_KeyIndex;
+    RegNodeIndex    m_ValueIndex;
+    DWORD           m_dwGeneration;
     
 };
 class SystemNotifyRegKey :public RegKey,public CLockObject, public CMiniThread {
@@ -293,6 +519,7 @@ public:
         :RegKey ( hCurrentOpenKey,lpKeyPath, KEY_NOTIFY,NULL )
         ,CMiniThread(0,TRUE ){
         m_hNotifyEvent = INVALID_HANDLE_VALUE;
+        m_fPopulated = FALSE;
         m_hTerminated = CreateEvent(NULL,TRUE,FALSE,NULL);
         if(m_RegKey == NULL && RegOpenKeyEx(m_hParentKey, m_lpRegName, 0, 0, &m_RegKey ) != ERROR_SUCCESS )  {
             m_RegKey = NULL;
@@ -333,8 +560,15 @@ public:
             Lock();
             CeFindNextRegChange( m_hNotifyEvent);
             m_fUpdated = FALSE;
-            if (RefreshAll(TRUE))
-                 m_fUpdated = TRUE;
+            if (m_fPopulated) {
+                // Only re-read what changed; this bumps the generation of
+                // every key whose subtree changed, including ours.
+                RefreshChanged(m_dwGeneration + 1, TRUE);
+                m_fUpdated = (m_RegKey != NULL);
+            }
+            else if (RefreshAll(TRUE)) {
+                 m_fUpdated = m_fPopulated = TRUE;
+            }
             Unlock();
             return TRUE;
         } else
@@ -352,6 +586,7 @@ private:
     HANDLE          m_hNotifyEvent;
     HANDLE          m_hTerminated;
     BOOL            m_fUpdated; // Indicate Last update suceeded or not.
+    BOOL            m_fPopulated; // The tree has been read in full once.
     virtual DWORD       ThreadRun() {
         while ( !IsTerminated() && m_hNotifyEvent!=INVALID_HANDLE_VALUE && m_hTerminated!=NULL ) {
             HANDLE h[2] = {m_hNotifyEvent,m_hTerminated};
@@ -20,6 +20,10 @@
 #include <pmsqm.h>
 #include "PmSysReg.h"
 #include "pmexthdl.hpp"
+#include "pmatom.h"
+#include "pmsysstate.h"
+#include "pmsnapshot.h"
+#include "pmplan.h"
 
 // This routine enumerates device power restrictions in the registry
 // and adds them to the list of existing restrictions.  It returns a pointer
@@ -153,24 +157,18 @@ EXTERN_C BOOL PmUpdateSystemPowerStatesIfChanged()
 {
     return (g_pSysRegistryAccess!=NULL?g_pSysRegistryAccess->UpdateRegistryChange():FALSE);
 }
-// This routine reads a system state structure from the registry.  It 
-// also loads device power restrictions associated with the power state.
-// It returns ERROR_SUCCESS if successful or a Win32 error code otherwise.
-// Note that malformed device power values won't cause an error.  The new
-// system state information and device power restrictions will be passed
-// back via pointers.
-// If ppsps is NULL, the state keys are read but not passed back.  If ppdpr
-// is NULL, individual device power settings are not read or passed back.
-DWORD
-RegReadSystemPowerState(LPCTSTR pszName, PPSYSTEM_POWER_STATE ppsps, 
-                     PPDEVICE_POWER_RESTRICTION ppdpr)
+
+static VOID SystemPowerStateCacheFlush(VOID);
+
+// This routine makes sure that the cached copy of the system power state
+// registry keys exists, re-creating it once the system reaches boot phase 2.
+// It returns TRUE if the cache is available.
+static BOOL
+RegOpenSystemPowerStates(VOID)
 {
-    DWORD dwRetStatus = ERROR_SUCCESS;
-    DWORD dwStatus, dwLen = MAX_PATH;
     static BOOL fBootPhase2Reopen = FALSE;
-    RegKey *keyHandle;
     TCHAR szPath[MAX_PATH];
-    SETFNAME(_T("RegReadSystemPowerState"));
+    BOOL fOk;
 
     PMLOCK();
     if (!fBootPhase2Reopen) { // We need reopen the key if we migrate to Phase 2.
@@ -181,6 +179,8 @@ RegReadSystemPowerState(LPCTSTR pszName, PPSYSTEM_POWER_STATE ppsps,
                     delete g_pSysRegistryAccess;
                     g_pSysRegistryAccess = NULL;
                 }
+                // anything parsed from the old cache is suspect
+                SystemPowerStateCacheFlush();
                 fBootPhase2Reopen = TRUE;
             }
             CloseHandle(hevBootPhase2);
@@ -191,15 +191,32 @@ RegReadSystemPowerState(LPCTSTR pszName, PPSYSTEM_POWER_STATE ppsps,
     if (g_pSysRegistryAccess==NULL) {
         // format the key name
         VERIFY(SUCCEEDED(StringCbPrintf(szPath, sizeof(szPath), _T("%s\\%s"), PWRMGR_REG_KEY, _T("State"))));
-        dwLen = (_countof(szPath) - 1) - _tcslen(szPath);
         g_pSysRegistryAccess = new SystemNotifyRegKey (HKEY_LOCAL_MACHINE,szPath);
         if (g_pSysRegistryAccess && g_pSysRegistryAccess->Init()== FALSE) {
             delete g_pSysRegistryAccess;
             g_pSysRegistryAccess = NULL;
         }
     }
+    fOk = (g_pSysRegistryAccess != NULL);
     PMUNLOCK();
-    if (g_pSysRegistryAccess== NULL ) { // false to initialize the structure.
+
+    return fOk;
+}
+
+// This routine reads a system state structure from the registry, as
+// RegReadSystemPowerState() does.  If pdwGeneration is not NULL, it also
+// passes back the generation at which the state's key last changed.
+static DWORD
+RegReadSystemPowerStateEx(LPCTSTR pszName, PPSYSTEM_POWER_STATE ppsps, 
+                          PPDEVICE_POWER_RESTRICTION ppdpr, PDWORD pdwGeneration)
+{
+    DWORD dwRetStatus = ERROR_SUCCESS;
+    DWORD dwStatus;
+    RegKey *keyHandle;
+    TCHAR szPath[MAX_PATH];
+    SETFNAME(_T("RegReadSystemPowerState"));
+
+    if (!RegOpenSystemPowerStates()) { // false to initialize the structure.
         return ERROR_INVALID_PARAMETER;
     }
     g_pSysRegistryAccess->EnterLock();
@@ -220,6 +237,10 @@ RegReadSystemPowerState(LPCTSTR pszName, PPSYSTEM_POWER_STATE ppsps,
     } else {
         DWORD dwDefaultDx, dwFlags = 0, dwSize, dwType;
 
+        if (pdwGeneration != NULL) {
+            *pdwGeneration = keyHandle->GetGeneration();
+        }
+
         // read the default power state and the flags -- both values
         // must be present
         dwSize = sizeof(dwDefaultDx);
@@ -276,6 +297,286 @@ RegReadSystemPowerState(LPCTSTR pszName, PPSYSTEM_POWER_STATE ppsps,
     return dwRetStatus;
 }
 
+// This routine reads a system state structure from the registry.  It 
+// also loads device power restrictions associated with the power state.
+// It returns ERROR_SUCCESS if successful or a Win32 error code otherwise.
+// Note that malformed device power values won't cause an error.  The new
+// system state information and device power restrictions will be passed
+// back via pointers.
+// If ppsps is NULL, the state keys are read but not passed back.  If ppdpr
+// is NULL, individual device power settings are not read or passed back.
+DWORD
+RegReadSystemPowerState(LPCTSTR pszName, PPSYSTEM_POWER_STATE ppsps, 
+                     PPDEVICE_POWER_RESTRICTION ppdpr)
+{
+    return RegReadSystemPowerStateEx(pszName, ppsps, ppdpr, NULL);
+}
+
+// This routine passes back the generation at which a system power state's
+// key last changed.  It returns FALSE if the key doesn't exist.  The caller
+// must not hold the PM lock.
+static BOOL
+RegGetSystemPowerStateGeneration(LPCTSTR pszName, PDWORD pdwGeneration)
+{
+    BOOL fOk = FALSE;
+    SETFNAME(_T("RegGetSystemPowerStateGeneration"));
+
+    g_pSysRegistryAccess->EnterLock();
+    __try {
+        RegKey * pKey = g_pSysRegistryAccess->RegFindKey(pszName);
+        if (pKey != NULL) {
+            *pdwGeneration = pKey->GetGeneration();
+            fOk = TRUE;
+        }
+    }
+    __except(EXCEPTION_EXECUTE_HANDLER) {
+        PMLOGMSG(ZONE_WARN, (_T("%s: exception accessing state name\r\n"), pszFname));
+        fOk = FALSE;
+    }
+    g_pSysRegistryAccess->LeaveLock();
+
+    return fOk;
+}
+
+// ------------------------ SYSTEM POWER STATE CACHE ------------------------
+
+// Each system power state's parsed descriptor and ceiling list are read once
+// and shared by every transition into that state.  A descriptor is replaced
+// when its registry key's generation moves on, and freed when it has been
+// replaced and its last reference is released.  The cache is protected by
+// the PM lock.
+
+typedef struct _SYSTEM_STATE_DESCRIPTOR {
+    struct _SYSTEM_STATE_DESCRIPTOR *pNext;
+    DWORD dwRefCount;               // references held by callers
+    DWORD dwGeneration;             // registry cache generation it was read from
+    BOOL fStale;                    // replaced; free on last release
+    PSYSTEM_POWER_STATE psps;
+    PDEVICE_POWER_RESTRICTION pCeilingDx;
+} SYSTEM_STATE_DESCRIPTOR, *PSYSTEM_STATE_DESCRIPTOR;
+
+static PSYSTEM_STATE_DESCRIPTOR gpStateDescriptors;
+
+// This routine frees a descriptor along with its state and ceiling list.
+static VOID
+SystemStateDescriptorDestroy(PSYSTEM_STATE_DESCRIPTOR pssd)
+{
+    SystemPowerStateDestroy(pssd->psps);
+    while(pssd->pCeilingDx != NULL) {
+        PDEVICE_POWER_RESTRICTION pdpr = pssd->pCeilingDx->pNext;
+        PowerRestrictionDestroy(pssd->pCeilingDx);
+        pssd->pCeilingDx = pdpr;
+    }
+    PmFree(pssd);
+}
+
+// This routine marks a descriptor as replaced and frees it if nobody is
+// using it.  The caller must hold the PM lock.
+static VOID
+SystemStateDescriptorRetire(PSYSTEM_STATE_DESCRIPTOR pssd)
+{
+    pssd->fStale = TRUE;
+    TransitionPlanInvalidate();
+    if(pssd->dwRefCount == 0) {
+        PSYSTEM_STATE_DESCRIPTOR *ppssd = &gpStateDescriptors;
+        while(*ppssd != pssd) {
+            ppssd = &(*ppssd)->pNext;
+        }
+        *ppssd = pssd->pNext;
+        SystemStateDescriptorDestroy(pssd);
+    }
+}
+
+// This routine retires every cached descriptor.  The caller must hold the 
+// PM lock.
+static VOID
+SystemPowerStateCacheFlush(VOID)
+{
+    PSYSTEM_STATE_DESCRIPTOR pssd = gpStateDescriptors;
+
+    while(pssd != NULL) {
+        PSYSTEM_STATE_DESCRIPTOR pssdNext = pssd->pNext;
+        if(!pssd->fStale) {
+            SystemStateDescriptorRetire(pssd);
+        }
+        pssd = pssdNext;
+    }
+}
+
+// This routine returns the shared descriptor and ceiling list for a system
+// power state, reading them from the registry if they aren't cached or are
+// out of date.  It returns ERROR_SUCCESS or a Win32 error code.  Callers
+// must not modify what is passed back and must pass the state to
+// SystemPowerStateRelease() when they are done with it.
+DWORD
+SystemPowerStateAcquire(LPCTSTR pszName, PPSYSTEM_POWER_STATE ppsps, 
+                        PPDEVICE_POWER_RESTRICTION ppdpr)
+{
+    PSYSTEM_STATE_DESCRIPTOR pssd;
+    PSYSTEM_POWER_STATE psps = NULL;
+    PDEVICE_POWER_RESTRICTION pdpr = NULL;
+    DWORD dwGeneration = 0;
+    DWORD dwStatus;
+    BOOL fKnown;
+    SETFNAME(_T("SystemPowerStateAcquire"));
+
+    PREFAST_DEBUGCHK(ppsps != NULL);
+    PREFAST_DEBUGCHK(ppdpr != NULL);
+
+    if(!RegOpenSystemPowerStates()) {
+        return ERROR_INVALID_PARAMETER;
+    }
+
+    // find out when the state's key last changed -- this takes the registry
+    // cache lock, which must not be acquired while holding the PM lock
+    fKnown = RegGetSystemPowerStateGeneration(pszName, &dwGeneration);
+
+    // look for an up to date descriptor
+    PMLOCK();
+    LPCTSTR pszAtom = PmAtomFind(pszName, TRUE);
+    for(pssd = gpStateDescriptors; fKnown && pszAtom != NULL && pssd != NULL; pssd = pssd->pNext) {
+        if(!pssd->fStale && pssd->psps->pszName == pszAtom 
+        && pssd->dwGeneration == dwGeneration) {
+            pssd->dwRefCount++;
+            *ppsps = pssd->psps;
+            *ppdpr = pssd->pCeilingDx;
+            break;
+        }
+    }
+    PMUNLOCK();
+    if(pssd != NULL) {
+        PMLOGMSG(ZONE_REGISTRY, (_T("%s: using cached state '%s'\r\n"), pszFname, pszAtom));
+        return ERROR_SUCCESS;
+    }
+
+    // read a new one
+    dwStatus = RegReadSystemPowerStateEx(pszName, &psps, &pdpr, &dwGeneration);
+    if(dwStatus == ERROR_SUCCESS) {
+        pssd = (PSYSTEM_STATE_DESCRIPTOR) PmAlloc(sizeof(*pssd));
+        if(pssd == NULL) {
+            dwStatus = ERROR_OUTOFMEMORY;
+        }
+    }
+    if(dwStatus == ERROR_SUCCESS) {
+        pssd->dwRefCount = 1;
+        pssd->dwGeneration = dwGeneration;
+        pssd->fStale = FALSE;
+        pssd->psps = psps;
+        pssd->pCeilingDx = pdpr;
+
+        PMLOCK();
+        
+        // retire the descriptor this one replaces, if any
+        PSYSTEM_STATE_DESCRIPTOR pssdOld;
+        for(pssdOld = gpStateDescriptors; pssdOld != NULL; pssdOld = pssdOld->pNext) {
+            if(!pssdOld->fStale && pssdOld->psps->pszName == psps->pszName) {
+                SystemStateDescriptorRetire(pssdOld);
+                break;
+            }
+        }
+        pssd->pNext = gpStateDescriptors;
+        gpStateDescriptors = pssd;
+        PMUNLOCK();
+
+        *ppsps = psps;
+        *ppdpr = pdpr;
+    } else if(psps != NULL) {
+        // clean up after a partial read
+        SystemPowerStateDestroy(psps);
+        while(pdpr != NULL) {
+            PDEVICE_POWER_RESTRICTION pdprNext = pdpr->pNext;
+            PowerRestrictionDestroy(pdpr);
+            pdpr = pdprNext;
+        }
+    }
+
+    return dwStatus;
+}
+
+// This routine adds a reference to a state obtained with 
+// SystemPowerStateAcquire().  The caller must already hold a reference.
+VOID
+SystemPowerStateAddRef(PSYSTEM_POWER_STATE psps)
+{
+    PSYSTEM_STATE_DESCRIPTOR pssd;
+
+    PMLOCK();
+    for(pssd = gpStateDescriptors; pssd != NULL; pssd = pssd->pNext) {
+        if(pssd->psps == psps) {
+            break;
+        }
+    }
+    DEBUGCHK(pssd != NULL && pssd->dwRefCount > 0);
+    if(pssd != NULL) {
+        pssd->dwRefCount++;
+    }
+    PMUNLOCK();
+}
+
+// This routine releases a reference obtained with SystemPowerStateAcquire().
+// It does nothing if psps is NULL.
+VOID
+SystemPowerStateRelease(PSYSTEM_POWER_STATE psps)
+{
+    PSYSTEM_STATE_DESCRIPTOR pssd;
+
+    if(psps == NULL) {
+        return;
+    }
+
+    PMLOCK();
+    for(pssd = gpStateDescriptors; pssd != NULL; pssd = pssd->pNext) {
+        if(pssd->psps == psps) {
+            break;
+        }
+    }
+    DEBUGCHK(pssd != NULL && pssd->dwRefCount > 0);
+    if(pssd != NULL) {
+        pssd->dwRefCount--;
+        if(pssd->fStale) {
+            SystemStateDescriptorRetire(pssd);
+        }
+    }
+    PMUNLOCK();
+}
+
+// This routine passes back the name and flags of the dwIndex'th system power
+// state in the registry cache.  It returns ERROR_SUCCESS, ERROR_NO_MORE_ITEMS
+// once dwIndex is past the last state, or another Win32 error code if the
+// state can't be read, in which case the caller may go on to the next index.
+// The caller must not hold the PM lock.
+DWORD
+SystemPowerStateEnum(DWORD dwIndex, __out_ecount(cchName) LPTSTR pszName, DWORD cchName,
+                     PDWORD pdwFlags)
+{
+    DWORD dwStatus, dwSize, dwType;
+    SETFNAME(_T("SystemPowerStateEnum"));
+
+    PREFAST_DEBUGCHK(pszName != NULL && pdwFlags != NULL);
+
+    if(!RegOpenSystemPowerStates()) {
+        return ERROR_INVALID_PARAMETER;
+    }
+
+    g_pSysRegistryAccess->EnterLock();
+    dwSize = cchName * sizeof(pszName[0]);
+    dwStatus = g_pSysRegistryAccess->RegEnumKeyEx(dwIndex, pszName, &dwSize);
+    if(dwStatus == ERROR_SUCCESS) {
+        RegKey * pKey = g_pSysRegistryAccess->RegFindKey(pszName);
+        if(pKey == NULL) {
+            dwStatus = ERROR_FILE_NOT_FOUND;
+        } else {
+            dwSize = sizeof(*pdwFlags);
+            dwStatus = pKey->RegFindValue(_T("Flags"), pdwFlags, &dwSize, &dwType);
+        }
+    }
+    g_pSysRegistryAccess->LeaveLock();
+
+    PMLOGMSG(dwStatus != ERROR_SUCCESS && dwStatus != ERROR_NO_MORE_ITEMS && ZONE_REGISTRY,
+        (_T("%s: can't read state %u, status is %d\r\n"), pszFname, dwIndex, dwStatus));
+    return dwStatus;
+}
+
 // This routine allows applications to determine what the current system
 // power state name is.  It also passes back flag bits which provide some
 // information about the state.
@@ -288,14 +589,20 @@ PmGetSystemPowerState(__in_ecount(dwBufChars) LPWSTR pBuffer, DWORD dwBufChars,
     PMLOGMSG(ZONE_API, (_T("+%s: buf 0x%08x, size %d, pflags 0x%08x\r\n"),
         pszFname, pBuffer, dwBufChars, pdwFlags));
 
-    PMLOCK();
+    // read the published snapshot rather than taking the PM lock, so that
+    // we don't wait for a system power state transition to finish
+    DWORD dwToken;
+    PPOWER_SNAPSHOT pps = PowerSnapshotEnter(&dwToken);
 
     __try {
-        if(dwBufChars < (_tcslen(gpSystemPowerState->pszName) + 1)) {
+        PSYSTEM_POWER_STATE psps = pps->psps;
+        if(psps == NULL) {
+            dwStatus = ERROR_GEN_FAILURE;   // no state published yet
+        } else if(dwBufChars < (_tcslen(psps->pszName) + 1)) {
             dwStatus = ERROR_INSUFFICIENT_BUFFER;
         } else {
-            VERIFY(SUCCEEDED(StringCchCopy(pBuffer, dwBufChars, gpSystemPowerState->pszName)));
-            *pdwFlags = gpSystemPowerState->dwFlags;
+            VERIFY(SUCCEEDED(StringCchCopy(pBuffer, dwBufChars, psps->pszName)));
+            *pdwFlags = psps->dwFlags;
             dwStatus = ERROR_SUCCESS;
         }
     }
@@ -303,7 +610,7 @@ PmGetSystemPowerState(__in_ecount(dwBufChars) LPWSTR pBuffer, DWORD dwBufChars,
         dwStatus = ERROR_INVALID_PARAMETER;
     }
 
-    PMUNLOCK();
+    PowerSnapshotLeave(dwToken);
 
     PMLOGMSG(ZONE_API, (_T("-%s: returning %d\r\n"), pszFname, dwStatus));
 
@@ -0,0 +1,40 @@
+//
+// Copyright (c) Microsoft Corporation.  All rights reserved.
+//
+//
+// Use of this sample source code is subject to the terms of the Microsoft
+// license agreement under which you licensed this sample source code. If
+// you did not accept the terms of the license agreement, you are not
+// authorized to use this sample source code. For the terms of the license,
+// please see the license agreement between you and Microsoft or, if applicable,
+// see the LICENSE.RTF on your install media or the root of your tools installation.
+// THE SAMPLE SOURCE CODE IS PROVIDED "AS IS", WITH NO WARRANTIES OR INDEMNITIES.
+//
+
+//
+// This module declares the system power state cache.  Each state's parsed
+// descriptor and ceiling list are shared, reference counted, and re-read
+// only after the cached copy of the registry changes.
+//
+
+#ifndef __PMSYSSTATE_H
+#define __PMSYSSTATE_H
+
+#include <pmimpl.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+DWORD SystemPowerStateAcquire(LPCTSTR pszName, PPSYSTEM_POWER_STATE ppsps, 
+                              PPDEVICE_POWER_RESTRICTION ppdpr);
+VOID SystemPowerStateAddRef(PSYSTEM_POWER_STATE psps);
+VOID SystemPowerStateRelease(PSYSTEM_POWER_STATE psps);
+DWORD SystemPowerStateEnum(DWORD dwIndex, __out_ecount(cchName) LPTSTR pszName, DWORD cchName,
+                           PDWORD pdwFlags);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
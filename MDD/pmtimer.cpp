@@ -19,9 +19,183 @@
 // events that indicates activity or inactivity.  Both of these timers are reset
 // during suspend.
 //
+// Running timers are kept in a binary min-heap keyed on absolute deadlines,
+// measured on a 64-bit clock that the timer thread advances by the time it
+// spends waiting.  Finding the next expiry looks at the top of the heap.
+// A reset only moves the timer's deadline later, leaving its heap entry
+// where it is; when that entry comes due the timer is put back in at its
+// real deadline.  So neither a reset nor a wakeup has to visit every timer.
+//
 
 #include <pmimpl.h>
 #include <nkintr.h>
+#include "pmlocks.h"
+
+#define TIMER_NEVER         ((ULONGLONG) -1)
+#define TIMER_NOT_QUEUED    ((DWORD) -1)
+
+// All of this belongs to the activity timer thread; it's protected by the
+// timer lock along with the timers themselves.
+static ULONGLONG gullTimerNow;          // ms of waiting accounted for so far
+static DWORD gdwTimers;
+static DWORD gdwHeapSize;
+static PDWORD gpdwHeap;                 // timer indices, earliest key first
+static PULONGLONG gpullHeapKey;         // per timer: when its heap entry comes due
+static PULONGLONG gpullDeadline;        // per timer: when it really expires, or TIMER_NEVER
+static PDWORD gpdwHeapPos;              // per timer: where it is in the heap, or TIMER_NOT_QUEUED
+
+// This routine swaps two heap entries.
+static __inline VOID
+TimerHeapSwap(DWORD dwPos1, DWORD dwPos2)
+{
+    DWORD dwTimer = gpdwHeap[dwPos1];
+    gpdwHeap[dwPos1] = gpdwHeap[dwPos2];
+    gpdwHeap[dwPos2] = dwTimer;
+    gpdwHeapPos[gpdwHeap[dwPos1]] = dwPos1;
+    gpdwHeapPos[gpdwHeap[dwPos2]] = dwPos2;
+}
+
+// This routine moves a heap entry towards the top until its parent is due
+// no later than it is.
+static VOID
+TimerHeapSiftUp(DWORD dwPos)
+{
+    while(dwPos > 0) {
+        DWORD dwParent = (dwPos - 1) / 2;
+        if(gpullHeapKey[gpdwHeap[dwParent]] <= gpullHeapKey[gpdwHeap[dwPos]]) {
+            break;
+        }
+        TimerHeapSwap(dwPos, dwParent);
+        dwPos = dwParent;
+    }
+}
+
+// This routine moves a heap entry towards the bottom until its children are
+// due no earlier than it is.
+static VOID
+TimerHeapSiftDown(DWORD dwPos)
+{
+    for(;;) {
+        DWORD dwChild = dwPos * 2 + 1;
+        if(dwChild >= gdwHeapSize) {
+            break;
+        }
+        if(dwChild + 1 < gdwHeapSize
+        && gpullHeapKey[gpdwHeap[dwChild + 1]] < gpullHeapKey[gpdwHeap[dwChild]]) {
+            dwChild++;
+        }
+        if(gpullHeapKey[gpdwHeap[dwPos]] <= gpullHeapKey[gpdwHeap[dwChild]]) {
+            break;
+        }
+        TimerHeapSwap(dwPos, dwChild);
+        dwPos = dwChild;
+    }
+}
+
+// This routine queues a timer that isn't in the heap at its deadline.
+static VOID
+TimerHeapPush(DWORD dwTimer)
+{
+    DEBUGCHK(gpdwHeapPos[dwTimer] == TIMER_NOT_QUEUED);
+    DEBUGCHK(gpullDeadline[dwTimer] != TIMER_NEVER);
+    gpullHeapKey[dwTimer] = gpullDeadline[dwTimer];
+    gpdwHeap[gdwHeapSize] = dwTimer;
+    gpdwHeapPos[dwTimer] = gdwHeapSize;
+    gdwHeapSize++;
+    TimerHeapSiftUp(gdwHeapSize - 1);
+}
+
+// This routine removes and returns the timer at the top of the heap.
+static DWORD
+TimerHeapPop(VOID)
+{
+    DWORD dwTimer = gpdwHeap[0];
+
+    DEBUGCHK(gdwHeapSize != 0);
+    gdwHeapSize--;
+    if(gdwHeapSize != 0) {
+        TimerHeapSwap(0, gdwHeapSize);
+        TimerHeapSiftDown(0);
+    }
+    gpdwHeapPos[dwTimer] = TIMER_NOT_QUEUED;
+    return dwTimer;
+}
+
+// This routine gives a timer a new deadline, or stops it if ullDeadline is
+// TIMER_NEVER.  Moving a queued timer's deadline later costs nothing; its
+// heap entry is dealt with when it comes due.
+static VOID
+TimerScheduleSet(DWORD dwTimer, ULONGLONG ullDeadline)
+{
+    gpullDeadline[dwTimer] = ullDeadline;
+    if(ullDeadline == TIMER_NEVER) {
+        // a stopped timer's entry is dropped when it comes due
+    } else if(gpdwHeapPos[dwTimer] == TIMER_NOT_QUEUED) {
+        TimerHeapPush(dwTimer);
+    } else if(ullDeadline < gpullHeapKey[dwTimer]) {
+        gpullHeapKey[dwTimer] = ullDeadline;
+        TimerHeapSiftUp(gpdwHeapPos[dwTimer]);
+    }
+}
+
+// This routine rebuilds the heap from every timer's deadline.
+static VOID
+TimerScheduleRebuild(VOID)
+{
+    DWORD dwTimer, dwPos;
+
+    gdwHeapSize = 0;
+    for(dwTimer = 0; dwTimer < gdwTimers; dwTimer++) {
+        gpdwHeapPos[dwTimer] = TIMER_NOT_QUEUED;
+        if(gpullDeadline[dwTimer] != TIMER_NEVER) {
+            gpullHeapKey[dwTimer] = gpullDeadline[dwTimer];
+            gpdwHeapPos[dwTimer] = gdwHeapSize;
+            gpdwHeap[gdwHeapSize++] = dwTimer;
+        }
+    }
+    for(dwPos = gdwHeapSize / 2; dwPos-- > 0; ) {
+        TimerHeapSiftDown(dwPos);
+    }
+}
+
+// This routine sets up the schedule for dwTimers timers, starting each one
+// according to its dwTimeLeft.
+static BOOL
+TimerScheduleInit(DWORD dwTimers)
+{
+    DWORD dwTimer;
+    LPBYTE pb;
+
+    pb = (LPBYTE) PmAlloc(dwTimers * (2 * sizeof(ULONGLONG) + 2 * sizeof(DWORD)));
+    if(pb == NULL) {
+        return FALSE;
+    }
+    gpullHeapKey = (PULONGLONG) pb;
+    gpullDeadline = gpullHeapKey + dwTimers;
+    gpdwHeap = (PDWORD) (gpullDeadline + dwTimers);
+    gpdwHeapPos = gpdwHeap + dwTimers;
+    gdwTimers = dwTimers;
+    gullTimerNow = 0;
+
+    for(dwTimer = 0; dwTimer < dwTimers; dwTimer++) {
+        DWORD dwTimeLeft = gppActivityTimers[dwTimer]->dwTimeLeft;
+        gpullDeadline[dwTimer] = (dwTimeLeft == INFINITE ? TIMER_NEVER : dwTimeLeft);
+    }
+    TimerScheduleRebuild();
+    return TRUE;
+}
+
+// This routine frees the schedule.
+static VOID
+TimerScheduleDeinit(VOID)
+{
+    if(gpullHeapKey != NULL) {
+        PmFree(gpullHeapKey);
+    }
+    gpullHeapKey = gpullDeadline = NULL;
+    gpdwHeap = gpdwHeapPos = NULL;
+    gdwTimers = gdwHeapSize = 0;
+}
 
 
 // This routine initializes the list of activity timers.  It returns ERROR_SUCCESS 
@@ -156,9 +330,9 @@ ActivityTimerInitList(VOID)
 
     // did we succeed?
     if(dwStatus == ERROR_SUCCESS) {
-        PMLOCK();
+        TimerLock();
         gppActivityTimers = ppatList;
-        PMUNLOCK();
+        TimerUnlock();
     } else {
         DWORD dwIndex;
         if(ppatList != NULL) {
@@ -179,40 +353,30 @@ ActivityTimerInitList(VOID)
     return dwStatus;
 }
 
-// This routine calculates the next timeout interval for the various 
-// activity timers.  This routine doesn't sort timers, on the assumption
-// that a given system will have relatively few inactivity timers.
+// This routine accounts for dwElapsed ms of waiting and returns how long
+// to wait for the next timer to come due, or INFINITE if none are running.
 DWORD
 GetNextInactivityTimeout(DWORD dwElapsed)
 {
     DWORD dwTimeout = INFINITE;
-    DWORD dwIndex;
-    PACTIVITY_TIMER pat;
-
-    PMLOCK();
-    for(dwIndex = 0; (pat = gppActivityTimers[dwIndex]) != NULL; dwIndex++) {
-        DWORD dwTimeLeft = pat->dwTimeLeft;
-        if(dwTimeLeft != INFINITE) {
-            // subtract elapsed time
-            if(dwTimeLeft < dwElapsed) {
-                dwTimeLeft = 0;
-            } else {
-                dwTimeLeft -= dwElapsed;
-            }
-
-            // update the timeout value
-            if(dwTimeout == INFINITE || dwTimeLeft < dwTimeout) {
-                dwTimeout = dwTimeLeft;
-            }
 
-            // update the timer
-            pat->dwTimeLeft = dwTimeLeft;
+    TimerLock();
+    gullTimerNow += dwElapsed;
+    if(gdwHeapSize != 0) {
+        ULONGLONG ullKey = gpullHeapKey[gpdwHeap[0]];
+        if(ullKey <= gullTimerNow) {
+            dwTimeout = 0;
+        } else if(ullKey - gullTimerNow < INFINITE) {
+            dwTimeout = (DWORD) (ullKey - gullTimerNow);
+        } else {
+            dwTimeout = INFINITE - 1;
         }
     }
-    PMUNLOCK();
+    TimerUnlock();
 
     return dwTimeout;
 }
+
 // this thread handles activity timer events
 DWORD WINAPI 
 ActivityTimersThreadProc(LPVOID lpvParam)
@@ -251,19 +415,31 @@ ActivityTimersThreadProc(LPVOID lpvParam)
     dwNumEvents = 0;
     hEvents[dwNumEvents++] = ghevPmShutdown;
     hEvents[dwNumEvents++] = ghevTimerResume;
-    PMLOCK();
+    TimerLock();
     if(gppActivityTimers[0] == NULL) {
         // no activity timers defined
         PmFree(gppActivityTimers);
         gppActivityTimers = NULL;
     } else {
+        DWORD dwTimers = 0;
+
         // copy activity timer events into the event list
         while(dwNumEvents < _countof(hEvents) && gppActivityTimers[dwNumEvents - cdwTimerBaseIndex] != NULL) {
             hEvents[dwNumEvents] = gppActivityTimers[dwNumEvents - cdwTimerBaseIndex]->hevReset;
             dwNumEvents++;
         }
+
+        // start the timers
+        while(gppActivityTimers[dwTimers] != NULL) {
+            dwTimers++;
+        }
+        if(!TimerScheduleInit(dwTimers)) {
+            PMLOGMSG(ZONE_WARN, (_T("%s: couldn't allocate schedule for %u timers\r\n"),
+                pszFname, dwTimers));
+            dwNumEvents = cdwTimerBaseIndex;
+        }
     }
-    PMUNLOCK();
+    TimerUnlock();
 
     // we're up and running
     SetEvent(hevReady);
@@ -300,68 +476,80 @@ ActivityTimersThreadProc(LPVOID lpvParam)
 
             // we've resumed, so re-enable all activity timers that can be reset
             PMLOGMSG(ZONE_TIMERS, (_T("%s: resume event set\r\n"), pszFname));
-            PMLOCK();
+            TimerLock();
             for(dwIndex = 0; (pat = gppActivityTimers[dwIndex]) != NULL; dwIndex++) {
                 DWORD dwEventIndex = dwIndex + cdwTimerBaseIndex;
                 if (dwEventIndex < MAXIMUM_WAIT_OBJECTS) {
                     if(hEvents[dwEventIndex] == hevDummy) {
                         hEvents[dwEventIndex] = pat->hevReset;
                     }
-                    pat->dwTimeLeft = pat->dwTimeout + dwWaitInterval;
+                    pat->dwTimeLeft = pat->dwTimeout;
+                    gpullDeadline[dwIndex] = gullTimerNow + dwWaitInterval + pat->dwTimeout;
                 } else {
                     ASSERT(FALSE);
                 }
             }
-            PMUNLOCK();
+            TimerScheduleRebuild();
+            TimerUnlock();
         } else if(dwStatus == WAIT_TIMEOUT) {
             DWORD dwIndex;
             PACTIVITY_TIMER pat;
 
             // figure out which event(s) timed out
-            PMLOCK();
-            for(dwIndex = 0; (pat = gppActivityTimers[dwIndex]) != NULL; dwIndex++) {
-                if(pat->dwTimeLeft <= dwWaitInterval  && pat->dwTimeLeft != INFINITE) {
-                    // has the timer really expired?
-                    if(WaitForSingleObject(pat->hevReset, 0) == WAIT_OBJECT_0) {
-                        // The timer was reset while we weren't looking at it.  This means
-                        // activity occurred.
-                        ResetEvent(pat->hevInactive);
-                        SetEvent(pat->hevActive);
-                        SetEvent(pat->hevAutoReset);
-                        // we'll look at the timer again later.
-                        // Calculate the new timeout, compensating for the update
-                        // that will occur in GetNextInactivityTimeout().
-                        PMLOGMSG(ZONE_TIMERS, (_T("%s: timer '%s' reset after timeout\r\n"), pszFname,
-                            pat->pszName));
-                        pat->dwTimeLeft = pat->dwTimeout + dwWaitInterval;
-                        pat->dwResetCount++;
+            ULONGLONG ullNow = gullTimerNow + dwWaitInterval;
+            TimerLock();
+            while(gdwHeapSize != 0 && gpullHeapKey[gpdwHeap[0]] <= ullNow) {
+                dwIndex = TimerHeapPop();
+                pat = gppActivityTimers[dwIndex];
+                if(gpullDeadline[dwIndex] == TIMER_NEVER) {
+                    // stopped since it was queued
+                    continue;
+                }
+                if(gpullDeadline[dwIndex] > ullNow) {
+                    // reset since it was queued, so it isn't due yet
+                    TimerHeapPush(dwIndex);
+                    continue;
+                }
+                // has the timer really expired?
+                if(WaitForSingleObject(pat->hevReset, 0) == WAIT_OBJECT_0) {
+                    // The timer was reset while we weren't looking at it.  This means
+                    // activity occurred.
+                    ResetEvent(pat->hevInactive);
+                    SetEvent(pat->hevActive);
+                    SetEvent(pat->hevAutoReset);
+                    // we'll look at the timer again later.
+                    PMLOGMSG(ZONE_TIMERS, (_T("%s: timer '%s' reset after timeout\r\n"), pszFname,
+                        pat->pszName));
+                    pat->dwTimeLeft = pat->dwTimeout;
+                    TimerScheduleSet(dwIndex, ullNow + pat->dwTimeout);
+                    pat->dwResetCount++;
 
+                } else {
+                    // the timer has really expired, update events appropriately
+                    PMLOGMSG(ZONE_TIMERS, (_T("%s: timer '%s' has expired\r\n"), pszFname,
+                        pat->pszName));
+                    ResetEvent(pat->hevActive);
+                    SetEvent(pat->hevInactive);
+
+                    // start looking at the reset event for this timer again
+                    if (dwIndex + cdwTimerBaseIndex < _countof(hEvents)) {
+                        hEvents[dwIndex + cdwTimerBaseIndex] = pat->hevReset;
                     } else {
-                        // the timer has really expired, update events appropriately
-                        PMLOGMSG(ZONE_TIMERS, (_T("%s: timer '%s' has expired\r\n"), pszFname,
-                            pat->pszName));
-                        ResetEvent(pat->hevActive);
-                        SetEvent(pat->hevInactive);
-
-                        // start looking at the reset event for this timer again
-                        if (dwIndex + cdwTimerBaseIndex < _countof(hEvents)) {
-                            hEvents[dwIndex + cdwTimerBaseIndex] = pat->hevReset;
-                        } else {
-                            ASSERT(FALSE);
-                        }
-
-                        // update counts
-                        pat->dwTimeLeft = INFINITE;
-                        pat->dwExpiredCount++;
+                        ASSERT(FALSE);
                     }
+
+                    // update counts
+                    pat->dwTimeLeft = INFINITE;
+                    TimerScheduleSet(dwIndex, TIMER_NEVER);
+                    pat->dwExpiredCount++;
                 }
             }
-            PMUNLOCK();
+            TimerUnlock();
         } else if(dwStatus > (WAIT_OBJECT_0 + 0) && dwStatus < (WAIT_OBJECT_0 + dwNumEvents)) {
             PACTIVITY_TIMER pat;
             DWORD dwEventIndex = dwStatus - WAIT_OBJECT_0;
 
-            PMLOCK();
+            TimerLock();
             
             // get a pointer to the timer
             pat = gppActivityTimers[dwEventIndex - cdwTimerBaseIndex];
@@ -371,6 +559,7 @@ ActivityTimersThreadProc(LPVOID lpvParam)
             if(pat->dwTimeout == 0) {
                 // we're not using the event, so ignore it
                 pat->dwTimeLeft = INFINITE;
+                TimerScheduleSet(dwEventIndex - cdwTimerBaseIndex, TIMER_NEVER);
             } else {
                 PMLOGMSG(ZONE_TIMERS, (_T("%s: timer '%s' reset\r\n"), pszFname, pat->pszName));
 
@@ -382,12 +571,14 @@ ActivityTimersThreadProc(LPVOID lpvParam)
                 // don't look at this event again until it's about ready to time out
                 hEvents[dwEventIndex] = hevDummy;
 
-                // update time left on the timer, compensating for the update
-                // that will occur in GetNextInactivityTimeout().
-                pat->dwTimeLeft = pat->dwTimeout + dwWaitInterval;
+                // restart the timer, compensating for the wait that
+                // GetNextInactivityTimeout() hasn't accounted for yet
+                pat->dwTimeLeft = pat->dwTimeout;
+                TimerScheduleSet(dwEventIndex - cdwTimerBaseIndex,
+                    gullTimerNow + dwWaitInterval + pat->dwTimeout);
             }
             pat->dwResetCount++;
-            PMUNLOCK();
+            TimerUnlock();
         } else {
             PMLOGMSG(ZONE_WARN, (_T("%s: WaitForMultipleObjects() returned %d, status is %d\r\n"),
                 pszFname, dwStatus, GetLastError())); 
@@ -398,7 +589,8 @@ ActivityTimersThreadProc(LPVOID lpvParam)
 done:
     // release resources
     if(hevDummy != NULL) CloseHandle(hevDummy);
-    PMLOCK();
+    TimerLock();
+    TimerScheduleDeinit();
     if(gppActivityTimers != NULL) {
         DWORD dwIndex = 0;
         while(gppActivityTimers[dwIndex] != NULL) {
@@ -408,7 +600,7 @@ done:
         PmFree(gppActivityTimers);
         gppActivityTimers = NULL;
     }
-    PMUNLOCK();
+    TimerUnlock();
 
     PMLOGMSG(ZONE_INIT | ZONE_WARN, (_T("-%s: exiting\r\n"), pszFname));
     return 0;
@@ -19,6 +19,12 @@
 #include <pmimpl.h>
 #include <msgqueue.h>
 #include <nkintr.h>
+#include "pmdevindex.h"
+#include "pmatom.h"
+#include "pmpool.h"
+#include "pmlocks.h"
+#include "pmdxword.h"
+#include "pmplan.h"
 
 #ifdef DEBUG
 // turns on some memory garbling code -- adds overhead but hopefully helps catch bugs
@@ -90,6 +96,7 @@ GetPMThreadPriority(LPCTSTR pszValue, LPINT piThreadPriority)
 VOID
 PmLock(VOID)
 {
+    PmLockNoteAcquire(PM_LOCK_RANK_GLOBAL);
     EnterCriticalSection(&gcsPowerManager);
 }
 
@@ -98,20 +105,32 @@ VOID
 PmUnlock(VOID)
 {
     LeaveCriticalSection(&gcsPowerManager);
+    PmLockNoteRelease(PM_LOCK_RANK_GLOBAL);
 }
 
 // serialize access to appliation APIs that cause device updates
 VOID
 PmEnterUpdate(VOID)
 {
+    // a driver called on behalf of the lock's owner already has it
+    if(PmUpdatePassEnter()) {
+        return;
+    }
+    PmLockNoteAcquire(PM_LOCK_RANK_UPDATE);
     EnterCriticalSection(&gcsDeviceUpdateAPIs);
+    PmUpdateNoteAcquired();
 }
 
 // release synchronization objects obtained with PmEnterUpdate()
 VOID
 PmLeaveUpdate(VOID)
 {
+    if(PmUpdatePassLeave()) {
+        return;
+    }
+    PmUpdateNoteReleased();
     LeaveCriticalSection(&gcsDeviceUpdateAPIs);
+    PmLockNoteRelease(PM_LOCK_RANK_UPDATE);
 }
 
 // ------------------------ MEMORY STATE MANAGEMENT ------------------------
@@ -125,7 +144,7 @@ LONG glTotalObjects = 0;
 #endif  // DEBUG
 
 // this routine allocates memory and returns a pointer to it, or returns
-// NULL.
+// NULL.  Small allocations come from the PM pools (see pmpool.cpp).
 PVOID
 PmAlloc(DWORD dwSize)
 {
@@ -138,9 +157,9 @@ PmAlloc(DWORD dwSize)
     dwSize += HEAPHEADERSIZE;
 #endif  // DEBUGALLOC
 
-    PVOID pvRet = HeapAlloc(ghPmHeap, 0, dwSize);
+    PVOID pvRet = PmPoolAlloc(dwSize);
     if(pvRet == NULL) {
-        PMLOGMSG(ZONE_WARN, (_T("%s: HeapAlloc(%d) failed %d\r\n"), pszFname,
+        PMLOGMSG(ZONE_WARN, (_T("%s: PmPoolAlloc(%d) failed %d\r\n"), pszFname,
             dwSize, GetLastError()));
     }
 #ifdef DEBUG
@@ -190,9 +209,9 @@ PmFree(PVOID pvMemory)
     }
 #endif  // DEBUGALLOCl
 
-    BOOL fOk = HeapFree(ghPmHeap, 0, pvMemory);
+    BOOL fOk = PmPoolFree(pvMemory);
     if(!fOk) {
-        PMLOGMSG(ZONE_WARN, (_T("%s: HeapFree(0x%08x) failed %d\r\n"), pszFname,
+        PMLOGMSG(ZONE_WARN, (_T("%s: PmPoolFree(0x%08x) failed %d\r\n"), pszFname,
             pvMemory, GetLastError()));
     }
 #ifdef DEBUG
@@ -204,6 +223,283 @@ PmFree(PVOID pvMemory)
     return fOk;
 }
 
+// ------------------------ DEVICE INDEX ------------------------
+
+// Every device on a class list is also linked into three hash chains, so that
+// lookups by class and name, by name alone and by pointer don't have to walk
+// the class lists.  Entries are added and removed by DeviceStateAddList() and
+// DeviceStateRemList().  The index is protected by the PM lock.
+//
+// Each entry also caches the floor and ceiling that GetNewDeviceStateInfo()
+// resolved for the device against the current system power state and global
+// restriction lists.  A cached value is valid while the entry's epoch matches
+// gdwRestrictionEpoch; the epoch advances when the system power state changes,
+// and adding or removing a restriction invalidates only the devices it names.
+
+#define DEVINDEX_BUCKETS        128             // must be a power of two
+
+typedef struct _DEVICE_INDEX_ENTRY {
+    PDEVICE_STATE pds;
+    DWORD dwNameHash;
+    struct _DEVICE_INDEX_ENTRY *pNextByKey;     // same (class, name) bucket
+    struct _DEVICE_INDEX_ENTRY *pNextByName;    // same name bucket
+    struct _DEVICE_INDEX_ENTRY *pNextByPtr;     // same pointer bucket
+    DWORD dwEpoch;                              // cache is valid if current
+    CEDEVICE_POWER_STATE floorDx;               // cached floor
+    CEDEVICE_POWER_STATE ceilingDx;             // cached ceiling
+    DWORD dwGraphMark;                          // graph the device is in
+    DWORD dwGraphNode;                          // its node in that graph
+} DEVICE_INDEX_ENTRY, *PDEVICE_INDEX_ENTRY;
+
+static PDEVICE_INDEX_ENTRY gpDeviceIndexByKey[DEVINDEX_BUCKETS];
+static PDEVICE_INDEX_ENTRY gpDeviceIndexByName[DEVINDEX_BUCKETS];
+static PDEVICE_INDEX_ENTRY gpDeviceIndexByPtr[DEVINDEX_BUCKETS];
+static DWORD gdwRestrictionEpoch = 1;
+
+// FNV-1a hash of a (case sensitive) device name
+static DWORD
+DeviceIndexHashName(LPCTSTR pszName)
+{
+    DWORD dwHash = 2166136261;
+
+    while(*pszName != 0) {
+        dwHash ^= (DWORD) *pszName++;
+        dwHash *= 16777619;
+    }
+    return dwHash;
+}
+
+static DWORD
+DeviceIndexKeyBucket(LPCGUID pGuid, DWORD dwNameHash)
+{
+    DWORD dwHash = dwNameHash ^ pGuid->Data1;
+
+    dwHash = (dwHash ^ ((pGuid->Data2 << 16) | pGuid->Data3)) * 16777619;
+    dwHash ^= dwHash >> 15;
+    return dwHash & (DEVINDEX_BUCKETS - 1);
+}
+
+static DWORD
+DeviceIndexPtrBucket(PDEVICE_STATE pds)
+{
+    DWORD dwHash = (DWORD) pds;
+
+    return ((dwHash >> 4) ^ (dwHash >> 11)) & (DEVINDEX_BUCKETS - 1);
+}
+
+// This routine links a preallocated index entry for a device that has just
+// been placed on a class list.  The caller must hold the PM lock.
+static VOID
+DeviceIndexInsert(PDEVICE_INDEX_ENTRY pdie, PDEVICE_STATE pds)
+{
+    DWORD dwBucket;
+
+    PREFAST_DEBUGCHK(pdie != NULL);
+    PREFAST_DEBUGCHK(pds != NULL && pds->pListHead != NULL);
+
+    pdie->pds = pds;
+    pdie->dwNameHash = DeviceIndexHashName(pds->pszName);
+    pdie->dwEpoch = gdwRestrictionEpoch - 1;
+    pdie->dwGraphMark = 0;
+
+    dwBucket = DeviceIndexKeyBucket(pds->pListHead->pGuid, pdie->dwNameHash);
+    pdie->pNextByKey = gpDeviceIndexByKey[dwBucket];
+    gpDeviceIndexByKey[dwBucket] = pdie;
+
+    dwBucket = pdie->dwNameHash & (DEVINDEX_BUCKETS - 1);
+    pdie->pNextByName = gpDeviceIndexByName[dwBucket];
+    gpDeviceIndexByName[dwBucket] = pdie;
+
+    dwBucket = DeviceIndexPtrBucket(pds);
+    pdie->pNextByPtr = gpDeviceIndexByPtr[dwBucket];
+    gpDeviceIndexByPtr[dwBucket] = pdie;
+}
+
+// This routine unlinks a device's index entry and returns it so the caller
+// can free it, or returns NULL if the device isn't indexed.  The device must
+// still be on its class list.  The caller must hold the PM lock.
+static PDEVICE_INDEX_ENTRY
+DeviceIndexRemove(PDEVICE_STATE pds)
+{
+    PDEVICE_INDEX_ENTRY pdie, *ppdie;
+
+    PREFAST_DEBUGCHK(pds != NULL && pds->pListHead != NULL);
+
+    // find the entry through the pointer chain
+    for(ppdie = &gpDeviceIndexByPtr[DeviceIndexPtrBucket(pds)]; *ppdie != NULL;
+    ppdie = &(*ppdie)->pNextByPtr) {
+        if((*ppdie)->pds == pds) {
+            break;
+        }
+    }
+    pdie = *ppdie;
+    if(pdie != NULL) {
+        *ppdie = pdie->pNextByPtr;
+
+        ppdie = &gpDeviceIndexByKey[DeviceIndexKeyBucket(pds->pListHead->pGuid, pdie->dwNameHash)];
+        while(*ppdie != pdie) {
+            ppdie = &(*ppdie)->pNextByKey;
+        }
+        *ppdie = pdie->pNextByKey;
+
+        ppdie = &gpDeviceIndexByName[pdie->dwNameHash & (DEVINDEX_BUCKETS - 1)];
+        while(*ppdie != pdie) {
+            ppdie = &(*ppdie)->pNextByName;
+        }
+        *ppdie = pdie->pNextByName;
+    }
+
+    return pdie;
+}
+
+// This routine looks up a device by class list and name.  It does not touch
+// the reference count.  The caller must hold the PM lock.
+static PDEVICE_STATE
+DeviceIndexFind(PDEVICE_LIST pdl, LPCTSTR pszName)
+{
+    PDEVICE_INDEX_ENTRY pdie;
+    DWORD dwNameHash = DeviceIndexHashName(pszName);
+
+    for(pdie = gpDeviceIndexByKey[DeviceIndexKeyBucket(pdl->pGuid, dwNameHash)];
+    pdie != NULL; pdie = pdie->pNextByKey) {
+        if(pdie->dwNameHash == dwNameHash && pdie->pds->pListHead == pdl
+        && _tcscmp(pdie->pds->pszName, pszName) == 0) {
+            return pdie->pds;
+        }
+    }
+    return NULL;
+}
+
+// This routine returns a device's index entry, or NULL if the device isn't
+// on a class list.  The caller must hold the PM lock.
+static PDEVICE_INDEX_ENTRY
+DeviceIndexLookup(PDEVICE_STATE pds)
+{
+    PDEVICE_INDEX_ENTRY pdie;
+
+    for(pdie = gpDeviceIndexByPtr[DeviceIndexPtrBucket(pds)]; pdie != NULL;
+    pdie = pdie->pNextByPtr) {
+        if(pdie->pds == pds) {
+            break;
+        }
+    }
+    return pdie;
+}
+
+// This routine returns TRUE if a device pointer is currently on one of the
+// class lists.  The caller must hold the PM lock.
+BOOL
+DeviceIndexContains(PDEVICE_STATE pds)
+{
+    return DeviceIndexLookup(pds) != NULL;
+}
+
+// This routine returns a device's cached floor and ceiling, if they are
+// still valid.  The caller must hold the PM lock.
+BOOL
+DeviceIndexGetRestrictions(PDEVICE_STATE pds, PCEDEVICE_POWER_STATE pFloorDx,
+                           PCEDEVICE_POWER_STATE pCeilingDx)
+{
+    PDEVICE_INDEX_ENTRY pdie = DeviceIndexLookup(pds);
+
+    if(pdie == NULL || pdie->dwEpoch != gdwRestrictionEpoch) {
+        return FALSE;
+    }
+    *pFloorDx = pdie->floorDx;
+    *pCeilingDx = pdie->ceilingDx;
+    return TRUE;
+}
+
+// This routine caches a device's floor and ceiling as resolved against the
+// current system power state and global restriction lists.  The caller must
+// hold the PM lock.
+VOID
+DeviceIndexSetRestrictions(PDEVICE_STATE pds, CEDEVICE_POWER_STATE floorDx,
+                           CEDEVICE_POWER_STATE ceilingDx)
+{
+    PDEVICE_INDEX_ENTRY pdie = DeviceIndexLookup(pds);
+
+    if(pdie != NULL) {
+        pdie->floorDx = floorDx;
+        pdie->ceilingDx = ceilingDx;
+        pdie->dwEpoch = gdwRestrictionEpoch;
+    }
+}
+
+// This routine records which node of the graph stamped dwMark a device
+// occupies (see pmdepgraph.cpp).  The caller must hold the PM lock.
+VOID
+DeviceIndexSetGraphNode(PDEVICE_STATE pds, DWORD dwMark, DWORD dwNode)
+{
+    PDEVICE_INDEX_ENTRY pdie = DeviceIndexLookup(pds);
+
+    if(pdie != NULL) {
+        pdie->dwGraphMark = dwMark;
+        pdie->dwGraphNode = dwNode;
+    }
+}
+
+// This routine passes back a device's node in the graph stamped dwMark.  It
+// returns FALSE if the device isn't in that graph.  The caller must hold the
+// PM lock.
+BOOL
+DeviceIndexGetGraphNode(PDEVICE_STATE pds, DWORD dwMark, PDWORD pdwNode)
+{
+    PDEVICE_INDEX_ENTRY pdie = DeviceIndexLookup(pds);
+
+    if(pdie == NULL || pdie->dwGraphMark != dwMark) {
+        return FALSE;
+    }
+    *pdwNode = pdie->dwGraphNode;
+    return TRUE;
+}
+
+// This routine invalidates every cached floor and ceiling.  It should be
+// called whenever gpSystemPowerState or gpCeilingDx is replaced.  The caller
+// must hold the PM lock.
+VOID
+DeviceIndexFlushRestrictions(VOID)
+{
+    gdwRestrictionEpoch++;
+}
+
+// This routine invalidates the cached floor and ceiling of every device that
+// a restriction on pDeviceId could apply to.  The caller must hold the PM lock.
+static VOID
+DeviceIndexInvalidateRestrictions(PDEVICEID pDeviceId)
+{
+    PDEVICE_INDEX_ENTRY pdie;
+    DWORD dwBucket;
+
+    if(pDeviceId == NULL || pDeviceId->pGuid == NULL) {
+        // can't tell who this applies to
+        DeviceIndexFlushRestrictions();
+        TransitionPlanInvalidate();
+    } else if(pDeviceId->pszName != NULL) {
+        // a restriction on a single device
+        DWORD dwNameHash = DeviceIndexHashName(pDeviceId->pszName);
+        dwBucket = DeviceIndexKeyBucket(pDeviceId->pGuid, dwNameHash);
+        for(pdie = gpDeviceIndexByKey[dwBucket]; pdie != NULL; pdie = pdie->pNextByKey) {
+            if(pdie->dwNameHash == dwNameHash 
+            && *pdie->pds->pListHead->pGuid == *pDeviceId->pGuid
+            && _tcscmp(pdie->pds->pszName, pDeviceId->pszName) == 0) {
+                pdie->dwEpoch = gdwRestrictionEpoch - 1;
+                TransitionPlanTouchDevice(pdie->pds);
+            }
+        }
+    } else {
+        // a restriction on a whole class
+        for(dwBucket = 0; dwBucket < DEVINDEX_BUCKETS; dwBucket++) {
+            for(pdie = gpDeviceIndexByPtr[dwBucket]; pdie != NULL; pdie = pdie->pNextByPtr) {
+                if(*pdie->pds->pListHead->pGuid == *pDeviceId->pGuid) {
+                    pdie->dwEpoch = gdwRestrictionEpoch - 1;
+                    TransitionPlanTouchDevice(pdie->pds);
+                }
+            }
+        }
+    }
+}
+
 // ------------------------ DEVICE ID MANAGEMENT ------------------------
 
 static BOOL 
@@ -461,7 +757,7 @@ DeviceIdClone(PDEVICEID pId)
 static BOOL
 GetClassFromName(LPCTSTR pszName, LPGUID guidDevClass )
 {
-    PDEVICE_LIST pdl;
+    PDEVICE_INDEX_ENTRY pdie;
     PDEVICE_LIST pdlFound = NULL; // The class list the device was found in.
     DWORD cFound = 0;
     BOOL fRet = TRUE;
@@ -475,32 +771,30 @@ GetClassFromName(LPCTSTR pszName, LPGUID guidDevClass )
     __try {
         memset(guidDevClass, 0, sizeof(*guidDevClass));  // Default to returning a NULL GUID
     
-        // Iterate through the lists of classes
-        for(pdl = gpDeviceLists; pdl != NULL; pdl = pdl->pNext) {
-
-            PDEVICE_STATE pds = NULL;
-
-            PMLOCK();
+        // Look up every class that has a device with a matching name.  A
+        // class list never holds two devices with the same name.
+        PMLOCK();
 
-            __try {
-                // Iterate through the devices in this class looking for a matching name
-                for(pds = pdl->pList; pds != NULL; pds = pds->pNext) {
-                    if(_tcscmp(pds->pszName, pszName) == 0) {
-                        pdlFound = pdl;
-                        cFound++;
-                        break;
-                    }
+        __try {
+            DWORD dwNameHash = DeviceIndexHashName(pszName);
+            for(pdie = gpDeviceIndexByName[dwNameHash & (DEVINDEX_BUCKETS - 1)]; pdie != NULL;
+            pdie = pdie->pNextByName) {
+                if(pdie->dwNameHash == dwNameHash && _tcscmp(pdie->pds->pszName, pszName) == 0) {
+                    pdlFound = pdie->pds->pListHead;
+                    cFound++;
                 }
             }
-            __except(EXCEPTION_EXECUTE_HANDLER) {
-                PMLOGMSG(ZONE_WARN, (_T("%s: exception searching list\r\n"), 
-                    pszFname));
-                fRet = FALSE;  // Indicate an error occured
-                goto Exit;
-            }
+        }
+        __except(EXCEPTION_EXECUTE_HANDLER) {
+            PMLOGMSG(ZONE_WARN, (_T("%s: exception searching index\r\n"), 
+                pszFname));
+            fRet = FALSE;  // Indicate an error occured
+        }
 
-            PMUNLOCK();
+        PMUNLOCK();
 
+        if(!fRet) {
+            goto Exit;
         }
 
         // If the device was found exactly once. If it was found more than once then the
@@ -715,11 +1009,12 @@ DeviceStateCreate(LPCTSTR pszName)
     PREFAST_DEBUGCHK(pszName != NULL);
 
     __try {
-        DWORD dwSize = sizeof(*pds) + ((_tcslen(pszName) + 1) * sizeof(pszName[0]));
+        // the device's Dx word lives just past the DEVICE_STATE
+        DWORD dwSize = sizeof(DEVICE_STATE_EX) + ((_tcslen(pszName) + 1) * sizeof(pszName[0]));
         pds = (PDEVICE_STATE) PmAlloc(dwSize);
         if(pds != NULL) {
-            LPTSTR pszNameCopy = (LPTSTR) ((LPBYTE) pds + sizeof(*pds));
-            memset(pds, 0, sizeof(*pds));
+            LPTSTR pszNameCopy = (LPTSTR) ((LPBYTE) pds + sizeof(DEVICE_STATE_EX));
+            memset(pds, 0, sizeof(DEVICE_STATE_EX));
             VERIFY(SUCCEEDED(StringCchCopy(pszNameCopy, _tcslen(pszName) + 1, pszName)));
             pds->pszName = pszNameCopy;
             pds->curDx = D0;
@@ -730,6 +1025,7 @@ DeviceStateCreate(LPCTSTR pszName)
             pds->actualDx = D0;
             pds->pendingDx = PwrDeviceUnspecified;
             pds->dwNumPending = 0;
+            ((PDEVICE_STATE_EX) pds)->lDxWord = DxWordMake(D0, D0, PwrDeviceUnspecified, 0, 0);
             pds->pParent = NULL;
             pds->dwRefCount = 1;
             pds->hDevice = INVALID_HANDLE_VALUE;
@@ -772,6 +1068,9 @@ DeviceStateDestroy(PDEVICE_STATE pds)
             PREFAST_DEBUGCHK(pds->pInterface != NULL);
             pds->pInterface->pfnCloseDevice(pds->hDevice);
         }
+        if(((PDEVICE_STATE_EX) pds)->hevLease != NULL) {
+            CloseHandle(((PDEVICE_STATE_EX) pds)->hevLease);
+        }
         PmFree(pds);
     }
 
@@ -786,11 +1085,10 @@ DeviceStateAddRef(PDEVICE_STATE pds)
 
     PREFAST_DEBUGCHK(pds != NULL);
 
-    PMLOCK();
-    pds->dwRefCount++;
+    // the caller holds a reference or the PM lock, so the count can't be zero
+    LONG lRefCount = InterlockedIncrement((PLONG) &pds->dwRefCount);
     PMLOGMSG(ZONE_REFCNT, (_T("%s: refcnt for 0x%08x set to %d\r\n"), pszFname,
-        pds, pds->dwRefCount));
-    PMUNLOCK();
+        pds, lRefCount));
 }
 
 // this routine decrements a device's reference count and frees the device's
@@ -803,16 +1101,15 @@ DeviceStateDecRef(PDEVICE_STATE pds)
 
     PREFAST_DEBUGCHK(pds != NULL);
 
-    PMLOCK();
     DEBUGCHK(pds->dwRefCount > 0);
-    pds->dwRefCount--;
+    LONG lRefCount = InterlockedDecrement((PLONG) &pds->dwRefCount);
     PMLOGMSG(ZONE_REFCNT, (_T("%s: refcnt for 0x%08x set to %d\r\n"), pszFname,
-        pds, pds->dwRefCount));
-    if(pds->dwRefCount == 0) {
+        pds, lRefCount));
+    if(lRefCount == 0) {
+        // the list held a reference, so nobody can find the device any more
         DEBUGCHK(pds->pListHead == NULL && pds->pNext == NULL && pds->pPrev == NULL);
         fDestroy = TRUE;
     }
-    PMUNLOCK();
 
     // is it time to get rid of the device?
     if(fDestroy) {
@@ -838,22 +1135,35 @@ DeviceStateAddList(PDEVICE_LIST pdl, PDEVICE_STATE pdsDevice)
         (_T("%s: adding 0x%08x ('%s') to list 0x%08x\r\n"),
         pszFname, pdsDevice, pdsDevice->pszName, pdl));
 
-    // put the new device at the head of the list
-    PMLOCK();
-    pdsDevice->pListHead = pdl;
-    pdsDevice->pNext = pdl->pList;
-    pdsDevice->pPrev = NULL;
-    if(pdl->pList != NULL) {
-        pdl->pList->pPrev = pdsDevice;
-    }
-    pdl->pList = pdsDevice;
+    // allocate the device's index entry up front so we can't fail later
+    PDEVICE_INDEX_ENTRY pdie = (PDEVICE_INDEX_ENTRY) PmAlloc(sizeof(*pdie));
+    if(pdie == NULL) {
+        PMLOGMSG(ZONE_WARN, (_T("%s: couldn't allocate index entry for '%s'\r\n"),
+            pszFname, pdsDevice->pszName));
+        fOk = FALSE;
+    } else {
+        // put the new device at the head of the list
+        PMLOCK();
+        pdsDevice->pListHead = pdl;
+        pdsDevice->pNext = pdl->pList;
+        pdsDevice->pPrev = NULL;
+        if(pdl->pList != NULL) {
+            pdl->pList->pPrev = pdsDevice;
+        }
+        pdl->pList = pdsDevice;
 
-    // copy interface method pointers from the device class
-    DEBUGCHK(pdl->pInterface != NULL);
-    pdsDevice->pInterface = pdl->pInterface;
+        // copy interface method pointers from the device class
+        DEBUGCHK(pdl->pInterface != NULL);
+        pdsDevice->pInterface = pdl->pInterface;
 
-    DeviceStateAddRef(pdsDevice);
-    PMUNLOCK();
+        // make the device visible to index lookups, and to transition plans
+        // built before it arrived
+        DeviceIndexInsert(pdie, pdsDevice);
+        TransitionPlanTouchDevice(pdsDevice);
+
+        DeviceStateAddRef(pdsDevice);
+        PMUNLOCK();
+    }
 
     return fOk;
 }
@@ -874,6 +1184,10 @@ DeviceStateRemList(PDEVICE_STATE pds)
 
     PMLOCK();
 
+    // remove the device from the index while we still know its class
+    PDEVICE_INDEX_ENTRY pdie = DeviceIndexRemove(pds);
+    DEBUGCHK(pdie != NULL);
+
     // are we at the head of the list?
     if(pds->pPrev != NULL) {
         pds->pPrev->pNext = pds->pNext;
@@ -906,6 +1220,10 @@ DeviceStateRemList(PDEVICE_STATE pds)
         
     PMUNLOCK();
 
+    if(pdie != NULL) {
+        PmFree(pdie);
+    }
+
     return fOk;
 }
 
@@ -923,12 +1241,10 @@ DeviceStateFindList(PDEVICE_LIST pdl, LPCTSTR pszName)
 
     __try {
         // look for a match
-        for(pds = pdl->pList; pds != NULL; pds = pds->pNext) {
-            if(_tcscmp(pds->pszName, pszName) == 0) { 
-                // increment the reference count and exit
-                DeviceStateAddRef(pds);
-                break;
-            }
+        pds = DeviceIndexFind(pdl, pszName);
+        if(pds != NULL) {
+            // increment the reference count
+            DeviceStateAddRef(pds);
         }
     }
     __except(EXCEPTION_EXECUTE_HANDLER) {
@@ -945,60 +1261,64 @@ DeviceStateFindList(PDEVICE_LIST pdl, LPCTSTR pszName)
 // ------------------------ DEVICE POWER RESTRICTION MANAGEMENT ----------
 
 // this routine creates a data structure describing a device.  Its initial
-// reference count is one.
+// reference count is one.  The device name and system power state name are
+// stored as atoms, so that PowerRestrictionFindList() can match them by
+// pointer.
 PDEVICE_POWER_RESTRICTION
 PowerRestrictionCreate(PDEVICEID pDeviceId, HANDLE hOwner, CEDEVICE_POWER_STATE Dx, 
                        LPCTSTR pszSystemState, DWORD dwFlags)
 {
     PDEVICE_POWER_RESTRICTION pdpr = NULL;
+    LPCTSTR pszSystemStateAtom = NULL;
+    LPCTSTR pszDeviceNameAtom = NULL;
     BOOL fOk = TRUE;
     SETFNAME(_T("PowerRestrictionCreate"));
 
     __try {
-        LPTSTR pszSystemStateCopy = NULL;
         PDEVICEID pDeviceIdCopy = NULL;
-        DWORD dwDeviceIdSize = DeviceIdSize(pDeviceId);
-        DWORD cchSystemState = NULL;
-
-        // allocate resources
-        DWORD dwSize = sizeof(*pdpr) + dwDeviceIdSize;
-        if(pszSystemState != NULL) {
-            cchSystemState = _tcslen(pszSystemState);
-            dwSize += ((cchSystemState + 1) * sizeof(pszSystemState[0]));
+        DWORD dwDeviceIdSize = 0;
+
+        // intern the names.  Convert the system state to lowercase so that
+        // we avoid doing localized comparisons when accessing the requirement
+        // data.
+        if(pDeviceId != NULL && pDeviceId->pszName != NULL) {
+            pszDeviceNameAtom = PmAtomAdd(pDeviceId->pszName, FALSE);
+            if(pszDeviceNameAtom == NULL) {
+                fOk = FALSE;
+            }
         }
-        pdpr = (PDEVICE_POWER_RESTRICTION) PmAlloc(dwSize);
-        if(pdpr == NULL) {
-            fOk = FALSE;
+        if(fOk && pszSystemState != NULL) {
+            pszSystemStateAtom = PmAtomAdd(pszSystemState, TRUE);
+            if(pszSystemStateAtom == NULL) {
+                fOk = FALSE;
+            }
         }
 
+        // allocate resources -- only the device ID and its class are copied
         if(fOk) {
-            // copy the device ID
             if(pDeviceId != NULL) {
-                pDeviceIdCopy = (PDEVICEID) ((LPBYTE) pdpr + sizeof(*pdpr));
-                pDeviceIdCopy = DeviceIdCloneIntoBuffer(pDeviceId, pDeviceIdCopy, dwDeviceIdSize);
-                if(pDeviceIdCopy == NULL) {
-                    fOk = FALSE;
+                dwDeviceIdSize = sizeof(DEVICEID);
+                if(pDeviceId->pGuid != NULL) {
+                    dwDeviceIdSize += sizeof(GUID);
                 }
             }
+            pdpr = (PDEVICE_POWER_RESTRICTION) PmAlloc(sizeof(*pdpr) + dwDeviceIdSize);
+            if(pdpr == NULL) {
+                fOk = FALSE;
+            }
         }
 
         if(fOk) {
-            // copy the system power state name, if it's present
-            if(pszSystemState != NULL) {
-                // get a pointer to the aggregated buffer we just allocated
-                PREFAST_SUPPRESS(12009,"The Size has been pre-calculated");
-                pszSystemStateCopy = (LPTSTR) ((LPBYTE) pdpr + sizeof(*pdpr) + dwDeviceIdSize);
-                
-                // Do the copy here because once it's assigned to the structure
-                // our allocated buffer will be treated as const.  Convert to lowercase
-                // so that we avoid doing localized comparisons when accessing the requirement
-                // data.
-                for (DWORD dwIndex = 0; dwIndex < cchSystemState; dwIndex++) {
-                    pszSystemStateCopy[dwIndex] = _totlower(pszSystemState[dwIndex]);
+            // copy the device ID
+            if(pDeviceId != NULL) {
+                pDeviceIdCopy = (PDEVICEID) ((LPBYTE) pdpr + sizeof(*pdpr));
+                pDeviceIdCopy->pGuid = NULL;
+                if(pDeviceId->pGuid != NULL) {
+                    LPGUID pGuid = (LPGUID) ((LPBYTE) pDeviceIdCopy + sizeof(*pDeviceIdCopy));
+                    *pGuid = *pDeviceId->pGuid;
+                    pDeviceIdCopy->pGuid = pGuid;
                 }
-                pszSystemStateCopy[cchSystemState] = 0;
-            } else {
-                pszSystemStateCopy = NULL;
+                pDeviceIdCopy->pszName = pszDeviceNameAtom;
             }
         }
         
@@ -1008,7 +1328,7 @@ PowerRestrictionCreate(PDEVICEID pDeviceId, HANDLE hOwner, CEDEVICE_POWER_STATE
             pdpr->pDeviceId = pDeviceIdCopy;
             pdpr->hOwner = hOwner;
             pdpr->devDx = Dx;
-            pdpr->pszSystemState = pszSystemStateCopy;
+            pdpr->pszSystemState = pszSystemStateAtom;
             pdpr->dwFlags = dwFlags;
             pdpr->pNext = NULL;
             pdpr->pPrev = NULL;
@@ -1027,6 +1347,8 @@ PowerRestrictionCreate(PDEVICEID pDeviceId, HANDLE hOwner, CEDEVICE_POWER_STATE
             PmFree(pdpr);
             pdpr = NULL;
         }
+        PmAtomRelease(pszDeviceNameAtom);
+        PmAtomRelease(pszSystemStateAtom);
     }
 
     PMLOGMSG(pdpr == NULL && ZONE_WARN, (_T("%s: couldn't create structure for '%s'\r\n"),
@@ -1042,6 +1364,10 @@ PowerRestrictionDestroy(PDEVICE_POWER_RESTRICTION pdpr)
     BOOL fOk = TRUE;
 
     if(pdpr != NULL) {
+        if(pdpr->pDeviceId != NULL) {
+            PmAtomRelease(pdpr->pDeviceId->pszName);
+        }
+        PmAtomRelease(pdpr->pszSystemState);
         PmFree(pdpr);
     }
 
@@ -1068,6 +1394,9 @@ PowerRestrictionAddList(PPDEVICE_POWER_RESTRICTION ppListHead, PDEVICE_POWER_RES
         (*ppListHead)->pPrev = pdpr;
     }
     *ppListHead = pdpr;
+
+    // affected devices must re-resolve their floor and ceiling
+    DeviceIndexInvalidateRestrictions(pdpr->pDeviceId);
     PMUNLOCK();
 
     return fOk;
@@ -1110,6 +1439,9 @@ PowerRestrictionRemList(PPDEVICE_POWER_RESTRICTION ppListHead, PDEVICE_POWER_RES
     pdpr->pNext = NULL;
     pdpr->pPrev = NULL;
 
+    // affected devices must re-resolve their floor and ceiling
+    DeviceIndexInvalidateRestrictions(pdpr->pDeviceId);
+
     // delete the entry
     PMUNLOCK();
 
@@ -1120,23 +1452,32 @@ PowerRestrictionRemList(PPDEVICE_POWER_RESTRICTION ppListHead, PDEVICE_POWER_RES
 // increments its reference counter and returns a pointer to it.  The caller
 // should decrement the reference counter when it is done with the pointer.  The system
 // power state name is expected to be lower-case, to avoid doing localized string comparisons.
+// Names are resolved to atoms once, so matching each entry costs pointer compares.
 PDEVICE_POWER_RESTRICTION
 PowerRestrictionFindList(PDEVICE_POWER_RESTRICTION pList, 
                          PDEVICEID pDeviceId, LPCTSTR pszSystemState)
 {
-    PDEVICE_POWER_RESTRICTION pdpr;
+    PDEVICE_POWER_RESTRICTION pdpr = NULL;
     SETFNAME(_T("PowerRestrictionFindList"));
 
     PMLOCK();
 
     __try {
-        // look for a match
-        for(pdpr = pList; pdpr != NULL; pdpr = pdpr->pNext) {
-            if(DeviceIdsAreEqual(pdpr->pDeviceId, pDeviceId)
-                && (pszSystemState == NULL && pdpr->pszSystemState == NULL
-                || (pszSystemState != NULL && pdpr->pszSystemState != NULL 
-                    && _tcscmp(pszSystemState, pdpr->pszSystemState) == 0))) {
-                break;
+        LPCTSTR pszNameAtom = PmAtomFind(pDeviceId->pszName, FALSE);
+        LPCTSTR pszStateAtom = PmAtomFind(pszSystemState, FALSE);
+
+        // if either name was never interned, nothing on the list can match it
+        if((pDeviceId->pszName == NULL || pszNameAtom != NULL)
+        && (pszSystemState == NULL || pszStateAtom != NULL)) {
+            // look for a match
+            for(pdpr = pList; pdpr != NULL; pdpr = pdpr->pNext) {
+                PDEVICEID pId = pdpr->pDeviceId;
+                if(pId != NULL && pdpr->pszSystemState == pszStateAtom 
+                && pId->pszName == pszNameAtom
+                && (pId->pGuid == NULL ? pDeviceId->pGuid == NULL 
+                    : pDeviceId->pGuid != NULL && *pId->pGuid == *pDeviceId->pGuid)) {
+                    break;
+                }
             }
         }
     }
@@ -1247,14 +1588,14 @@ PowerNotificationAddList(PPPOWER_NOTIFICATION ppListHead, PPOWER_NOTIFICATION pp
     DEBUGCHK(ppListHead != NULL);
 
     // put the new device at the head of the list
-    PMLOCK();
+    NotifyLock();
     ppn->pNext = *ppListHead;
     ppn->pPrev = NULL;
     if(*ppListHead != NULL) {
         (*ppListHead)->pPrev = ppn;
     }
     *ppListHead = ppn;
-    PMUNLOCK();
+    NotifyUnlock();
 
     return fOk;
 }
@@ -1273,7 +1614,7 @@ PowerNotificationRemList(PPPOWER_NOTIFICATION ppListHead, PPOWER_NOTIFICATION pp
 
     PREFAST_DEBUGCHK(ppListHead != NULL);
 
-    PMLOCK();
+    NotifyLock();
     // We have to check that ppn is in the ppListHead before we can delete it.
     PPOWER_NOTIFICATION pCurNotification = *ppListHead;
     
@@ -1317,7 +1658,7 @@ PowerNotificationRemList(PPPOWER_NOTIFICATION ppListHead, PPOWER_NOTIFICATION pp
     else
         fOk = FALSE ;
     
-    PMUNLOCK();
+    NotifyUnlock();
 
     return fOk;
 }
@@ -1439,41 +1780,25 @@ PSYSTEM_POWER_STATE
 SystemPowerStateCreate(LPCTSTR pszName)
 {
     PSYSTEM_POWER_STATE psps;
+    LPCTSTR pszNameAtom;
     SETFNAME(_T("SystemPowerStateCreate"));
 
     PREFAST_DEBUGCHK(pszName != NULL);
 
-    DWORD cchName = 0;
-
-    __try {
-        cchName = _tcslen(pszName);
-        DWORD dwSize = sizeof(*psps) + ((cchName + 1) * sizeof(pszName[0]));
-        psps = (PSYSTEM_POWER_STATE) PmAlloc(dwSize);
-    }
-    __except(EXCEPTION_EXECUTE_HANDLER) {
-        PMLOGMSG(ZONE_WARN, (_T("%s: exception calculating size\r\n"), pszFname));
-        psps = NULL;
-    }
-
-    if(psps != NULL) {
-        memset(psps, 0, sizeof(*psps));
-        __try {
-            LPTSTR pszNameCopy = (LPTSTR) ((LPBYTE) psps + sizeof(*psps));
-            // Copy the name, converting to lower case.  We want to avoid doing
-            // case-sensitive comparisons in the platform code while file system
-            // access may be disabled.
-            for (DWORD dwIndex = 0; dwIndex < cchName; dwIndex++) {
-                pszNameCopy[dwIndex] = _totlower(pszName[dwIndex]);
-            }
-            pszNameCopy[cchName] = 0;
-            psps->pszName = pszNameCopy;
-        }
-        __except(EXCEPTION_EXECUTE_HANDLER) {
-            PMLOGMSG(ZONE_WARN, (_T("%s: exception copying name\r\n"),
-                pszFname));
-            PmFree(psps);
-            psps = NULL;
+    // Intern the name, converting to lower case.  We want to avoid doing
+    // case-sensitive comparisons in the platform code while file system
+    // access may be disabled.
+    pszNameAtom = PmAtomAdd(pszName, TRUE);
+    if(pszNameAtom != NULL) {
+        psps = (PSYSTEM_POWER_STATE) PmAlloc(sizeof(*psps));
+        if(psps != NULL) {
+            memset(psps, 0, sizeof(*psps));
+            psps->pszName = pszNameAtom;
+        } else {
+            PmAtomRelease(pszNameAtom);
         }
+    } else {
+        psps = NULL;
     }
 
     PMLOGMSG(psps == NULL && ZONE_WARN, 
@@ -1489,6 +1814,7 @@ SystemPowerStateDestroy(PSYSTEM_POWER_STATE psps)
     BOOL fOk = TRUE;
 
     if(psps != NULL) {
+        PmAtomRelease(psps->pszName);
         PmFree(psps);
     }
 
@@ -1650,7 +1976,7 @@ ActivityTimerFindByName(LPCTSTR pszName)
     PACTIVITY_TIMER pat = NULL;
     SETFNAME(_T("ActivityTimerFindByName"));
 
-    PMLOCK();
+    TimerLock();
     if(gppActivityTimers != NULL) {
         DWORD dwTimerIndex = 0;
         while((pat = gppActivityTimers[dwTimerIndex]) != NULL) {
@@ -1660,7 +1986,7 @@ ActivityTimerFindByName(LPCTSTR pszName)
             dwTimerIndex++;
         }
     }
-    PMUNLOCK();
+    TimerUnlock();
 
     PMLOGMSG(ZONE_TIMERS, (_T("%s: search for '%s' returning 0x%08x\r\n"), pszFname,
         pszName, pat));
@@ -1678,7 +2004,7 @@ ActivityTimerFindByWakeSource(DWORD dwWakeSource)
     BOOL fDone = FALSE;
     SETFNAME(_T("ActivityTimerFindByWakeSource"));
 
-    PMLOCK();
+    TimerLock();
     if(gppActivityTimers != NULL) {
         DWORD dwTimerIndex = 0;
         while(!fDone && (pat = gppActivityTimers[dwTimerIndex]) != NULL) {
@@ -1693,7 +2019,7 @@ ActivityTimerFindByWakeSource(DWORD dwWakeSource)
             dwTimerIndex++;
         }
     }
-    PMUNLOCK();
+    TimerUnlock();
 
     PMLOGMSG(ZONE_TIMERS, (_T("%s: search for %d (0x%x) returning 0x%08x\r\n"), pszFname,
         dwWakeSource, dwWakeSource, pat));
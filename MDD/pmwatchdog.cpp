@@ -0,0 +1,523 @@
+//
+// Copyright (c) Microsoft Corporation.  All rights reserved.
+//
+//
+// Use of this sample source code is subject to the terms of the Microsoft
+// license agreement under which you licensed this sample source code. If
+// you did not accept the terms of the license agreement, you are not
+// authorized to use this sample source code. For the terms of the license,
+// please see the license agreement between you and Microsoft or, if applicable,
+// see the LICENSE.RTF on your install media or the root of your tools installation.
+// THE SAMPLE SOURCE CODE IS PROVIDED "AS IS", WITH NO WARRANTIES OR INDEMNITIES.
+//
+
+//
+// This module implements the device IOCTL watchdog.  A request block owns
+// copies of the caller's buffers and a reference on the device, so a helper
+// that's stuck in a driver never touches memory the caller has given up.
+// Whichever of the caller and the helper finishes with a block last frees
+// it and, if asked, closes the device handle.
+//
+
+#include <pmimpl.h>
+#include "pmwatchdog.h"
+#include "pmdxword.h"
+#include "pmfanout.h"
+#include "pmlease.h"
+#include "pmlocks.h"
+
+typedef struct _WATCHDOG_DEADLINE {
+    struct _WATCHDOG_DEADLINE *pNext;
+    DWORD dwDeadlineMs;
+    LPTSTR pszDevice;                   // points past the structure
+} WATCHDOG_DEADLINE, *PWATCHDOG_DEADLINE;
+
+typedef struct _WATCHDOG_CLASS {
+    GUID guidClass;
+    DWORD dwDeadlineMs;
+} WATCHDOG_CLASS, *PWATCHDOG_CLASS;
+
+typedef struct _WATCHDOG_REQUEST {
+    struct _WATCHDOG_REQUEST *pNext;
+    volatile LONG lRefCount;            // the caller and the helper
+    PDEVICE_STATE pds;                  // referenced until the block is freed
+    DEVICE_INTERFACE *pInterface;
+    HANDLE hDevice;
+    DWORD dwLease;                      // returned when the block is freed
+    LONG lUpdateLend;                   // the caller's update lock, lent to the helper
+    volatile LONG lState;               // WATCHDOG_xxx
+    HANDLE hevDone;
+    DWORD dwRequest;
+    DWORD dwInSize;
+    DWORD dwOutSize;
+    DWORD dwBytesRet;
+    BOOL fOk;
+    DWORD dwStatus;
+    LPBYTE pbIn;                        // copies, past the structure
+    LPBYTE pbOut;
+} WATCHDOG_REQUEST, *PWATCHDOG_REQUEST;
+
+#define WATCHDOG_RUNNING        0
+#define WATCHDOG_DONE           1
+#define WATCHDOG_ABANDONED      2
+
+static CRITICAL_SECTION gcsWatchdog;    // protects the queue and helper counts
+static BOOL gfWatchdogInitialized = FALSE;
+static HANDLE ghsemWatchdogWork;
+static PWATCHDOG_REQUEST gpWatchdogHead;
+static PWATCHDOG_REQUEST gpWatchdogTail;
+static DWORD gdwWatchdogHelpers;
+static DWORD gdwWatchdogIdle;           // helpers that can take a request now
+static DWORD gdwWatchdogQueued;
+static HANDLE ghtWatchdog[PM_WATCHDOG_MAX_HELPERS];
+
+static DWORD gdwDefaultDeadlineMs;
+static WATCHDOG_CLASS gClassDeadlines[PM_WATCHDOG_MAX_CLASSES];
+static DWORD gdwClassDeadlines;
+static PWATCHDOG_DEADLINE gpDeviceDeadlines;
+
+static volatile LONG glWatchdogTransition;
+static volatile LONG glWatchdogOverruns;
+
+static BOOL gfBudget = FALSE;           // set by DeviceWatchdogSetBudget()
+static DWORD gdwBudgetEnd;              // tick count when the budget runs out
+static volatile LONG glBudgetSkips;
+
+// This routine drops a reference on a request block, freeing it and
+// returning its handle lease once neither the caller nor the helper needs it.
+static VOID
+WatchdogRequestRelease(PWATCHDOG_REQUEST pwr)
+{
+    if(InterlockedDecrement(&pwr->lRefCount) == 0) {
+        DeviceLeaseRelease(pwr->pds, pwr->hDevice, pwr->dwLease);
+        if(pwr->hevDone != NULL) CloseHandle(pwr->hevDone);
+        DeviceStateDecRef(pwr->pds);
+        PmFree(pwr);
+    }
+}
+
+// this thread issues IOCTLs on behalf of callers with a deadline
+static DWORD WINAPI
+WatchdogThreadProc(LPVOID pvParam)
+{
+    HANDLE hEvents[2] = { ghevPmShutdown, ghsemWatchdogWork };
+    PWATCHDOG_REQUEST pwr;
+    SETFNAME(_T("WatchdogThreadProc"));
+
+    UNREFERENCED_PARAMETER(pvParam);
+
+    while(WaitForMultipleObjects(_countof(hEvents), hEvents, FALSE, INFINITE) == (WAIT_OBJECT_0 + 1)) {
+        EnterCriticalSection(&gcsWatchdog);
+        pwr = gpWatchdogHead;
+        DEBUGCHK(pwr != NULL);
+        gpWatchdogHead = pwr->pNext;
+        if(gpWatchdogHead == NULL) {
+            gpWatchdogTail = NULL;
+        }
+        gdwWatchdogQueued--;
+        gdwWatchdogIdle--;
+        LeaveCriticalSection(&gcsWatchdog);
+
+        // the driver may call back into the PM on this thread, and must get
+        // the same access it would have had on the caller's
+        if(pwr->dwLease == DEVICE_LEASE_EXCLUSIVE) {
+            ((PDEVICE_STATE_EX) pwr->pds)->dwLeaseOwner = GetCurrentThreadId();
+        }
+        PmUpdateBorrow(pwr->lUpdateLend);
+
+        __try {
+            pwr->fOk = pwr->pInterface->pfnRequestDevice(pwr->hDevice, pwr->dwRequest,
+                pwr->pbIn, pwr->dwInSize, pwr->pbOut, pwr->dwOutSize, &pwr->dwBytesRet);
+            pwr->dwStatus = pwr->fOk ? ERROR_SUCCESS : GetLastError();
+        }
+        __except(EXCEPTION_EXECUTE_HANDLER) {
+            pwr->fOk = FALSE;
+            pwr->dwStatus = ERROR_GEN_FAILURE;
+        }
+        PmUpdateBorrow(0);
+        // if the caller gave up on this one, the device can be used again
+        if(InterlockedCompareExchange(&pwr->lState, WATCHDOG_DONE, WATCHDOG_RUNNING) == WATCHDOG_ABANDONED) {
+            PMLOGMSG(ZONE_WARN, (_T("%s: abandoned IOCTL %d to '%s' finally returned\r\n"),
+                pszFname, pwr->dwRequest, pwr->pds->pszName));
+            InterlockedDecrement(&((PDEVICE_STATE_EX) pwr->pds)->lWatchdogStuck);
+        }
+        SetEvent(pwr->hevDone);
+        WatchdogRequestRelease(pwr);
+
+        EnterCriticalSection(&gcsWatchdog);
+        gdwWatchdogIdle++;
+        LeaveCriticalSection(&gcsWatchdog);
+    }
+
+    return 0;
+}
+
+// This routine looks up a device's deadline, caching it once the device's
+// class is known and the deadlines have been read.
+static DWORD
+WatchdogGetDeadline(PDEVICE_STATE pds)
+{
+    PDEVICE_STATE_EX pdsx = (PDEVICE_STATE_EX) pds;
+    PWATCHDOG_DEADLINE pwd;
+    PDEVICE_LIST pdl;
+    DWORD dwIndex, dwDeadlineMs;
+
+    if(pdsx->fDeadlineKnown) {
+        return pdsx->dwDeadlineMs;
+    }
+
+    for(pwd = gpDeviceDeadlines; pwd != NULL; pwd = pwd->pNext) {
+        if(_tcsicmp(pwd->pszDevice, pds->pszName) == 0) {
+            break;
+        }
+    }
+    pdl = pds->pListHead;
+    if(pwd != NULL) {
+        dwDeadlineMs = pwd->dwDeadlineMs;
+    } else {
+        dwDeadlineMs = gdwDefaultDeadlineMs;
+        if(pdl != NULL) {
+            for(dwIndex = 0; dwIndex < gdwClassDeadlines; dwIndex++) {
+                if(*pdl->pGuid == gClassDeadlines[dwIndex].guidClass) {
+                    dwDeadlineMs = gClassDeadlines[dwIndex].dwDeadlineMs;
+                    break;
+                }
+            }
+        }
+    }
+
+    if(gfWatchdogInitialized && (pwd != NULL || pdl != NULL)) {
+        pdsx->dwDeadlineMs = dwDeadlineMs;
+        pdsx->fDeadlineKnown = TRUE;
+    }
+    return dwDeadlineMs;
+}
+
+// This routine hands a request to an idle helper, starting a new helper if
+// there's room.  It returns FALSE if every helper is busy.
+static BOOL
+WatchdogQueue(PWATCHDOG_REQUEST pwr)
+{
+    BOOL fQueued = FALSE;
+    SETFNAME(_T("WatchdogQueue"));
+
+    EnterCriticalSection(&gcsWatchdog);
+    if(gdwWatchdogIdle <= gdwWatchdogQueued && gdwWatchdogHelpers < PM_WATCHDOG_MAX_HELPERS) {
+        HANDLE ht = CreateThread(NULL, 0, WatchdogThreadProc, NULL, 0, NULL);
+        if(ht == NULL) {
+            PMLOGMSG(ZONE_WARN, (_T("%s: CreateThread() failed %d\r\n"), pszFname,
+                GetLastError()));
+        } else {
+            CeSetThreadPriority(ht, CeGetThreadPriority(GetCurrentThread()));
+            ghtWatchdog[gdwWatchdogHelpers++] = ht;
+            gdwWatchdogIdle++;
+        }
+    }
+    if(gdwWatchdogIdle > gdwWatchdogQueued) {
+        if(gpWatchdogTail == NULL) {
+            gpWatchdogHead = pwr;
+        } else {
+            gpWatchdogTail->pNext = pwr;
+        }
+        gpWatchdogTail = pwr;
+        gdwWatchdogQueued++;
+        fQueued = TRUE;
+    }
+    LeaveCriticalSection(&gcsWatchdog);
+
+    if(fQueued) {
+        ReleaseSemaphore(ghsemWatchdogWork, 1, NULL);
+    }
+    return fQueued;
+}
+
+// This routine skips an IOCTL because the transition budget doesn't leave
+// time for it.  It returns FALSE with the last error set to ERROR_TIMEOUT,
+// as an overrun would.
+static BOOL
+WatchdogBudgetSkip(PDEVICE_STATE pds, HANDLE hDevice, DWORD dwLease, DWORD dwRequest,
+                   LONG lRemaining)
+{
+    SETFNAME(_T("WatchdogBudgetSkip"));
+
+    PMLOGMSG(ZONE_WARN, (_T("%s: %d ms left in transition budget, not sending IOCTL %d to '%s'\r\n"),
+        pszFname, lRemaining > 0 ? lRemaining : 0, dwRequest, pds->pszName));
+    InterlockedIncrement(&glBudgetSkips);
+    DeviceLeaseRelease(pds, hDevice, dwLease);
+    SetLastError(ERROR_TIMEOUT);
+    return FALSE;
+}
+
+// This routine sends a power IOCTL to a device, giving up after the device's
+// deadline.  It returns TRUE or FALSE like pfnRequestDevice and sets the last
+// error; on an overrun the error is ERROR_TIMEOUT.  hDevice's lease is
+// released once the driver is done with it, which may be after this routine
+// returns.
+BOOL
+DeviceWatchdogRequest(PDEVICE_STATE pds, HANDLE hDevice, DWORD dwLease,
+                      DWORD dwRequest, LPVOID pInBuf, DWORD dwInSize, 
+                      LPVOID pOutBuf, DWORD dwOutSize, LPDWORD pdwBytesRet)
+{
+    PDEVICE_STATE_EX pdsx = (PDEVICE_STATE_EX) pds;
+    PWATCHDOG_REQUEST pwr = NULL;
+    DWORD dwDeadlineMs, dwConfiguredMs;
+    LONG lRemaining = 0;
+    BOOL fBudget, fHelpers, fOk;
+    SETFNAME(_T("DeviceWatchdogRequest"));
+
+    PREFAST_DEBUGCHK(pds != NULL);
+    DEBUGCHK(pds->pInterface->pfnRequestDevice != NULL);
+
+    // Drivers may only be called from this thread while the platform is
+    // suspending or resuming, so helpers can't be used then.
+    fHelpers = gfWatchdogInitialized && !DeviceFanoutIsInline();
+
+    // Under a budget, a call that can't be abandoned is only made if the
+    // device's deadline says it will finish in time.  Devices without a
+    // deadline are assumed to be quick.
+    dwDeadlineMs = dwConfiguredMs = WatchdogGetDeadline(pds);
+    fBudget = gfBudget;
+    if(fBudget) {
+        lRemaining = (LONG) (gdwBudgetEnd - GetTickCount());
+        if(lRemaining <= 0 || (!fHelpers && dwConfiguredMs > (DWORD) lRemaining)) {
+            return WatchdogBudgetSkip(pds, hDevice, dwLease, dwRequest, lRemaining);
+        }
+        if(dwDeadlineMs == 0 || dwDeadlineMs > (DWORD) lRemaining) {
+            dwDeadlineMs = (DWORD) lRemaining;
+        }
+    }
+    if(fHelpers && dwDeadlineMs != 0) {
+        pwr = (PWATCHDOG_REQUEST) PmAlloc(sizeof(*pwr) + dwInSize + dwOutSize);
+        if(pwr != NULL) {
+            memset(pwr, 0, sizeof(*pwr));
+            pwr->hevDone = CreateEvent(NULL, TRUE, FALSE, NULL);
+            if(pwr->hevDone == NULL) {
+                PmFree(pwr);
+                pwr = NULL;
+            }
+        }
+    }
+
+    if(pwr != NULL) {
+        pwr->lRefCount = 2;
+        pwr->pds = pds;
+        DeviceStateAddRef(pds);
+        pwr->pInterface = pds->pInterface;
+        pwr->hDevice = hDevice;
+        pwr->dwLease = dwLease;
+        pwr->dwRequest = dwRequest;
+        pwr->dwInSize = dwInSize;
+        pwr->dwOutSize = dwOutSize;
+        pwr->pbIn = (LPBYTE) (pwr + 1);
+        pwr->pbOut = pwr->pbIn + dwInSize;
+        if(dwInSize != 0) memcpy(pwr->pbIn, pInBuf, dwInSize);
+        if(dwOutSize != 0) memcpy(pwr->pbOut, pOutBuf, dwOutSize);
+        pwr->lUpdateLend = PmUpdateLend();
+
+        if(!WatchdogQueue(pwr)) {
+            // every helper is busy, or stuck; call the driver directly
+            PmUpdateRevoke(pwr->lUpdateLend);
+            pwr->dwLease = DEVICE_LEASE_SHARED;
+            pwr->lRefCount = 1;
+            WatchdogRequestRelease(pwr);
+            pwr = NULL;
+        }
+    }
+
+    if(pwr == NULL) {
+        if(fBudget && fHelpers && dwConfiguredMs > (DWORD) lRemaining) {
+            // no helper could take the request, so it couldn't be abandoned
+            return WatchdogBudgetSkip(pds, hDevice, dwLease, dwRequest, lRemaining);
+        }
+        fOk = pds->pInterface->pfnRequestDevice(hDevice, dwRequest, pInBuf, dwInSize,
+            pOutBuf, dwOutSize, pdwBytesRet);
+        DeviceLeaseRelease(pds, hDevice, dwLease);
+    } else {
+        DWORD dwStatus;
+        if(WaitForSingleObject(pwr->hevDone, dwDeadlineMs) != WAIT_OBJECT_0) {
+            // Count the device as stuck before telling the helper, so the
+            // helper's decrement can't get there first.
+            InterlockedIncrement(&pdsx->lWatchdogStuck);
+            if(InterlockedCompareExchange(&pwr->lState, WATCHDOG_ABANDONED, WATCHDOG_RUNNING) != WATCHDOG_RUNNING) {
+                // it finished just as we gave up
+                InterlockedDecrement(&pdsx->lWatchdogStuck);
+                WaitForSingleObject(pwr->hevDone, INFINITE);
+            }
+        }
+
+        // end our part of the lend; once the lender is done too, an abandoned
+        // driver that calls back into the PM waits for the update lock like
+        // anybody else
+        PmUpdateRevoke(pwr->lUpdateLend);
+
+        if(pwr->lState != WATCHDOG_ABANDONED) {
+            fOk = pwr->fOk;
+            dwStatus = pwr->dwStatus;
+            *pdwBytesRet = pwr->dwBytesRet;
+            if(dwOutSize != 0) memcpy(pOutBuf, pwr->pbOut, dwOutSize);
+        } else {
+            // The driver is wedged.  Leave the request with the helper and keep
+            // everybody else away from the device until the IOCTL comes back.
+            InterlockedIncrement(&pdsx->lWatchdogOverruns);
+            InterlockedIncrement(&glWatchdogOverruns);
+            pdsx->dwWatchdogTransition = (DWORD) glWatchdogTransition;
+            PMLOGMSG(ZONE_WARN, (_T("%s: '%s' didn't answer IOCTL %d within %u ms, marking it degraded (%d overruns)\r\n"),
+                pszFname, pds->pszName, dwRequest, dwDeadlineMs, pdsx->lWatchdogOverruns));
+            fOk = FALSE;
+            dwStatus = ERROR_TIMEOUT;
+        }
+        WatchdogRequestRelease(pwr);
+        SetLastError(dwStatus);
+    }
+
+    return fOk;
+}
+
+// This routine returns TRUE if a device should be left alone: an IOCTL the
+// watchdog gave up on is still stuck in its driver, or it overran its
+// deadline earlier in the current transition.
+BOOL
+DeviceWatchdogShouldSkip(PDEVICE_STATE pds)
+{
+    PDEVICE_STATE_EX pdsx = (PDEVICE_STATE_EX) pds;
+
+    return pdsx->lWatchdogStuck != 0
+        || (pdsx->lWatchdogOverruns != 0 
+            && pdsx->dwWatchdogTransition == (DWORD) glWatchdogTransition);
+}
+
+// This routine starts a new transition, so that devices that overran during
+// the last one get another chance.
+VOID
+DeviceWatchdogBeginTransition(VOID)
+{
+    InterlockedIncrement(&glWatchdogTransition);
+}
+
+// This routine returns the number of IOCTLs the watchdog has given up on.
+DWORD
+DeviceWatchdogGetOverruns(VOID)
+{
+    return (DWORD) glWatchdogOverruns;
+}
+
+// This routine starts a budget of dwBudgetMs for all device IOCTLs from now
+// on, or removes the budget if dwBudgetMs is zero.  It also resets the count
+// of IOCTLs skipped because a budget ran out.
+VOID
+DeviceWatchdogSetBudget(DWORD dwBudgetMs)
+{
+    if(dwBudgetMs == 0) {
+        gfBudget = FALSE;
+    } else {
+        glBudgetSkips = 0;
+        gdwBudgetEnd = GetTickCount() + dwBudgetMs;
+        gfBudget = TRUE;
+    }
+}
+
+// This routine returns the number of IOCTLs that weren't sent because the
+// current or last budget ran out.
+DWORD
+DeviceWatchdogGetBudgetSkips(VOID)
+{
+    return (DWORD) glBudgetSkips;
+}
+
+// This routine reads the deadlines from the registry.  Helper threads are
+// started as they're needed.
+BOOL
+DeviceWatchdogInit(VOID)
+{
+    HKEY hk;
+    TCHAR szBuf[MAX_PATH];
+    SETFNAME(_T("DeviceWatchdogInit"));
+
+    DEBUGCHK(!gfWatchdogInitialized);
+
+    gdwDefaultDeadlineMs = 0;
+    gdwClassDeadlines = 0;
+    gpDeviceDeadlines = NULL;
+    VERIFY(SUCCEEDED(StringCchPrintf(szBuf, _countof(szBuf), _T("%s\\%s"),
+        PWRMGR_REG_KEY, PM_IOCTL_TIMEOUTS_KEY)));
+    if(RegOpenKeyEx(HKEY_LOCAL_MACHINE, szBuf, 0, 0, &hk) == ERROR_SUCCESS) {
+        DWORD dwIndex = 0;
+        DWORD dwStatus;
+        do {
+            DWORD cchValueName = _countof(szBuf), dwType, dwDeadlineMs;
+            DWORD dwSize = sizeof(dwDeadlineMs);
+            GUID idClass;
+
+            dwStatus = RegEnumValue(hk, dwIndex, szBuf, &cchValueName, NULL,
+                &dwType, (LPBYTE) &dwDeadlineMs, &dwSize);
+            if(dwStatus == ERROR_SUCCESS) {
+                if(dwType != REG_DWORD) {
+                    PMLOGMSG(ZONE_WARN, (_T("%s: invalid type for value '%s'\r\n"),
+                        pszFname, szBuf));
+                } else if(_tcsicmp(szBuf, PM_IOCTL_TIMEOUT_DEFAULT_VALUE) == 0) {
+                    gdwDefaultDeadlineMs = dwDeadlineMs;
+                } else if(ConvertStringToGuid(szBuf, &idClass)) {
+                    if(gdwClassDeadlines < _countof(gClassDeadlines)) {
+                        gClassDeadlines[gdwClassDeadlines].guidClass = idClass;
+                        gClassDeadlines[gdwClassDeadlines].dwDeadlineMs = dwDeadlineMs;
+                        gdwClassDeadlines++;
+                    } else {
+                        PMLOGMSG(ZONE_WARN, (_T("%s: too many class deadlines, ignoring '%s'\r\n"),
+                            pszFname, szBuf));
+                    }
+                } else {
+                    DWORD cchName = _tcslen(szBuf) + 1;
+                    PWATCHDOG_DEADLINE pwd = (PWATCHDOG_DEADLINE) PmAlloc(sizeof(*pwd) + (cchName * sizeof(TCHAR)));
+                    if(pwd != NULL) {
+                        pwd->pszDevice = (LPTSTR) (pwd + 1);
+                        VERIFY(SUCCEEDED(StringCchCopy(pwd->pszDevice, cchName, szBuf)));
+                        pwd->dwDeadlineMs = dwDeadlineMs;
+                        pwd->pNext = gpDeviceDeadlines;
+                        gpDeviceDeadlines = pwd;
+                    }
+                }
+                dwIndex++;
+            }
+        } while(dwStatus == ERROR_SUCCESS);
+        RegCloseKey(hk);
+    }
+
+    InitializeCriticalSection(&gcsWatchdog);
+    gpWatchdogHead = gpWatchdogTail = NULL;
+    gdwWatchdogHelpers = gdwWatchdogIdle = gdwWatchdogQueued = 0;
+    ghsemWatchdogWork = CreateSemaphore(NULL, 0, MAXLONG, NULL);
+    if(ghsemWatchdogWork == NULL) {
+        PMLOGMSG(ZONE_WARN, (_T("%s: couldn't create work semaphore, no deadlines\r\n"), pszFname));
+        DeleteCriticalSection(&gcsWatchdog);
+    } else {
+        gfWatchdogInitialized = TRUE;
+    }
+
+    PMLOGMSG(ZONE_INIT, (_T("%s: default deadline %u ms, %u class deadlines\r\n"), pszFname,
+        gdwDefaultDeadlineMs, gdwClassDeadlines));
+    return TRUE;
+}
+
+// This routine releases the helper threads.  The caller must have signaled
+// ghevPmShutdown; idle helpers see it and exit, and one that's stuck in a
+// driver is simply left behind, so the critical section and semaphore are
+// never freed.
+VOID
+DeviceWatchdogDeinit(VOID)
+{
+    DWORD dwIndex;
+
+    if(gfWatchdogInitialized) {
+        gfWatchdogInitialized = FALSE;
+        for(dwIndex = 0; dwIndex < gdwWatchdogHelpers; dwIndex++) {
+            CloseHandle(ghtWatchdog[dwIndex]);
+            ghtWatchdog[dwIndex] = NULL;
+        }
+        gdwWatchdogHelpers = 0;
+    }
+    while(gpDeviceDeadlines != NULL) {
+        PWATCHDOG_DEADLINE pwd = gpDeviceDeadlines;
+        gpDeviceDeadlines = pwd->pNext;
+        PmFree(pwd);
+    }
+}
@@ -0,0 +1,69 @@
+//
+// Copyright (c) Microsoft Corporation.  All rights reserved.
+//
+//
+// Use of this sample source code is subject to the terms of the Microsoft
+// license agreement under which you licensed this sample source code. If
+// you did not accept the terms of the license agreement, you are not
+// authorized to use this sample source code. For the terms of the license,
+// please see the license agreement between you and Microsoft or, if applicable,
+// see the LICENSE.RTF on your install media or the root of your tools installation.
+// THE SAMPLE SOURCE CODE IS PROVIDED "AS IS", WITH NO WARRANTIES OR INDEMNITIES.
+//
+
+//
+// This module declares the device IOCTL watchdog.  Power IOCTLs to devices
+// with a deadline run on a helper thread while the caller waits.  If the
+// driver doesn't answer in time the caller gives up with ERROR_TIMEOUT, the
+// device is marked degraded, and it is skipped for the rest of the system
+// power state transition and for as long as the abandoned IOCTL is still
+// stuck in the driver.
+//
+// Deadlines come from DWORD values, in milliseconds, under
+// PWRMGR_REG_KEY\IoctlTimeouts.  A value may be named after a device, after
+// a device class GUID, or "Default"; the most specific one wins.  Zero means
+// no deadline, which is also the default.
+//
+// A driver called on a helper thread may call the device update APIs while
+// the caller is waiting, since the caller's update lock is lent to the
+// helper.  Once the deadline passes the lend is revoked, and a driver that
+// calls back then waits for the lock until the transition ends -- so
+// deadlines must not be configured for drivers that call back into the PM
+// from their power handlers, or they will overrun and be marked degraded.
+//
+// The platform code can also impose a budget on a whole transition.  While
+// a budget is set every IOCTL gets at most the time that's left of it, even
+// on devices without a deadline, and once it's spent devices aren't called
+// at all.
+//
+
+#ifndef __PMWATCHDOG_H
+#define __PMWATCHDOG_H
+
+#include <pmimpl.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PM_IOCTL_TIMEOUTS_KEY           _T("IoctlTimeouts")
+#define PM_IOCTL_TIMEOUT_DEFAULT_VALUE  _T("Default")
+#define PM_WATCHDOG_MAX_CLASSES         16
+#define PM_WATCHDOG_MAX_HELPERS         8
+
+BOOL DeviceWatchdogInit(VOID);
+VOID DeviceWatchdogDeinit(VOID);
+BOOL DeviceWatchdogRequest(PDEVICE_STATE pds, HANDLE hDevice, DWORD dwLease,
+    DWORD dwRequest, LPVOID pInBuf, DWORD dwInSize, LPVOID pOutBuf, DWORD dwOutSize,
+    LPDWORD pdwBytesRet);
+BOOL DeviceWatchdogShouldSkip(PDEVICE_STATE pds);
+VOID DeviceWatchdogBeginTransition(VOID);
+DWORD DeviceWatchdogGetOverruns(VOID);
+VOID DeviceWatchdogSetBudget(DWORD dwBudgetMs);
+DWORD DeviceWatchdogGetBudgetSkips(VOID);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -57,6 +57,16 @@
 #include <extfile.h>
 #include <pmpolicy.h>
 #include <PmSysReg.h>
+#include <pmfanout.h>
+#include <pmdepgraph.h>
+#include <pmdevindex.h>
+#include <pmpool.h>
+#include <pmsysstate.h>
+#include <pmsnapshot.h>
+#include <pmwatchdog.h>
+#include <pmpreresume.h>
+#include <pmplan.h>
+#include <pmstatuspage.h>
 
 #include "pwstates.h"
 #include "pwstatemgr.h"
@@ -95,6 +105,8 @@ DWORD gdwUnattendedModeRequests;
 
 BOOL gfSupportPowerButtonRelease = FALSE;
 BOOL gfPageOutAllModules = FALSE;
+DWORD gdwCriticalSuspendBudget = 500;       // ms for a critical suspend's device updates, 0 for none
+DWORD gdwLastCriticalSuspendMs;             // how long the last critical suspend took to get to PowerOffSystem()
 
 PowerStateManager *g_pPowerStateManager = NULL;
 
@@ -162,6 +174,9 @@ PlatformValidatePMRegistry (VOID)
 			gfPageOutAllModules = TRUE;
 		else
 			gfPageOutAllModules = FALSE;
+		dwSize = sizeof (dwValue);
+		if (RegQueryTypedValue (hkPM, L"CriticalSuspendBudget", &dwValue, &dwSize, REG_DWORD) == ERROR_SUCCESS)
+			gdwCriticalSuspendBudget = dwValue;
 	}
 
 	// Verify interface GUIDs:
@@ -303,6 +318,13 @@ PlatformDeviceListInit (PDEVICE_LIST pdl)
 		pInterface = &gStreamInterface;
 	}
 
+	// Block devices are powered up before, and powered down after, all other
+	// classes.  The registry can override this rank.
+	if (*pdl->pGuid == idBlockDevices)
+	{
+		DeviceGraphSetClassRank (pdl->pGuid, DEVGRAPH_RANK_FIRST);
+	}
+
 	// Try to initialize the interface:
 	if (pInterface != NULL)
 	{
@@ -461,22 +483,25 @@ PlatformSetSystemPowerState (LPCTSTR pszName, BOOL fForce, BOOL fInternal)
 	PDEVICE_POWER_RESTRICTION pNewCeilingDx = NULL;
 	BOOL fDoTransition = FALSE;
 	INT iPreSuspendPriority = 0;
+	DWORD dwStartTicks = GetTickCount ();
 	static BOOL fFirstCall = TRUE;
 
 	SETFNAME (_T ("PlatformSetSystemPowerState"));
 
-	// Read system power state variables and construct new lists:
+	// Get the (shared) system power state variables and ceiling list:
 
 	if (gfFileSystemsAvailable)
 		PmUpdateSystemPowerStatesIfChanged ();
-	dwStatus = RegReadSystemPowerState (pszName, &pNewSystemPowerState, &pNewCeilingDx);
+	dwStatus = SystemPowerStateAcquire (pszName, &pNewSystemPowerState, &pNewCeilingDx);
 
 	// Did we get registry information about the new power state?
 
 	if (dwStatus == ERROR_SUCCESS)
 	{
 		BOOL fSuspendSystem = FALSE;
+		BOOL fCritical = FALSE;
 		static BOOL fWantStartupScreen = FALSE;
+		static BOOL fGwesPoweredDown = FALSE;
 		DWORD dwNewStateFlags = pNewSystemPowerState->dwFlags;
 
 		// Assume we will update the system power state:
@@ -493,8 +518,15 @@ PlatformSetSystemPowerState (LPCTSTR pszName, BOOL fForce, BOOL fInternal)
 		// to suspend really quickly.  Depending on the platform, OEMs may be able
 		// to bypass driver notification entirely and rely on xxx_PowerDown() notifications
 		// to suspend gracefully.  Or they may be able to implement a critical suspend
-		// kernel ioctl.  This sample implementation is very generic and simply sets the
-		// POWER_FORCE flag, which is not used.
+		// kernel ioctl.  This sample implementation skips the application notifications,
+		// GWES and the optional presuspend work, and gives the device updates a fixed
+		// budget (gdwCriticalSuspendBudget) after which drivers are no longer called.
+		// The file system is still flushed.
+
+		if ((dwNewStateFlags & POWER_STATE_CRITICAL) != 0)
+		{
+			fCritical = TRUE;
+		}
 
 		if (dwNewStateFlags & (POWER_STATE_CRITICAL | POWER_STATE_OFF | POWER_STATE_RESET))
 		{
@@ -522,7 +554,10 @@ PlatformSetSystemPowerState (LPCTSTR pszName, BOOL fForce, BOOL fInternal)
 			_tcsncpy_s (pbb.SystemPowerState, _countof (pbb.SystemPowerState),
 						pNewSystemPowerState->pszName, pbb.Length);
 			pbb.Length *= sizeof (pbb.SystemPowerState[0]);	           // Convert to byte count
-			GenerateNotifications ((PPOWER_BROADCAST) & pbb);
+			if (!fCritical)
+			{
+				GenerateNotifications ((PPOWER_BROADCAST) & pbb);
+			}
 
 			// Is GWES ready?
 			if (!gfGwesReady)
@@ -533,13 +568,14 @@ PlatformSetSystemPowerState (LPCTSTR pszName, BOOL fForce, BOOL fInternal)
 				}
 			}
 
-			// Are we suspending?
-			if (fSuspendSystem && gpfnGwesPowerDown != NULL)
+			// Are we suspending?  A critical suspend leaves GWES alone.
+			if (fSuspendSystem && !fCritical && gpfnGwesPowerDown != NULL)
 			{
 				// Start the process of suspending GWES:
 				if (gfGwesReady)
 				{
 					fWantStartupScreen = gpfnGwesPowerDown ();
+					fGwesPoweredDown = TRUE;
 				}
 			}
 
@@ -557,8 +593,18 @@ PlatformSetSystemPowerState (LPCTSTR pszName, BOOL fForce, BOOL fInternal)
 			}
 			gpSystemPowerState = pNewSystemPowerState;
 			gpCeilingDx = pNewCeilingDx;
+			DeviceIndexFlushRestrictions ();
 			PMUNLOCK ();
 
+			// Let lock-free readers in the PM and applications see the new
+			// state at the same time:
+			PowerSnapshotPublish (pNewSystemPowerState, pNewCeilingDx);
+			PowerStatusPagePublish (pNewSystemPowerState->pszName, pNewSystemPowerState->dwFlags,
+									&gSystemPowerStatus);
+
+			// Start timing the device updates for this transition:
+			DeviceFanoutBeginTransition (pOldSystemPowerState, pNewSystemPowerState);
+
 			// Are we suspending, resuming, or neither?
 			if (fSuspendSystem)
 			{
@@ -567,13 +613,26 @@ PlatformSetSystemPowerState (LPCTSTR pszName, BOOL fForce, BOOL fInternal)
 				// We're suspending: update all devices other than block devices,
 				// in case any of them need to access the registry or write files.
 
+				// A critical suspend gets a fixed budget, counted from when we
+				// started, for all of its device updates:
+				if (fCritical && gdwCriticalSuspendBudget != 0)
+				{
+					DWORD dwElapsed = GetTickCount () - dwStartTicks;
+
+					DeviceWatchdogSetBudget (dwElapsed < gdwCriticalSuspendBudget ?
+											 gdwCriticalSuspendBudget - dwElapsed : 1);
+				}
+
 				PMLOGMSG (ZONE_PLATFORM || ZONE_RESUME,
 						  (_T ("%s: suspending - notifying non-block drivers\r\n"), pszFname));
-				for (pdl = gpDeviceLists; pdl != NULL; pdl = pdl->pNext)
+				if (!DeviceFanoutUpdateClasses (NULL, &idBlockDevices))
 				{
-					if (*pdl->pGuid != idBlockDevices)
+					for (pdl = gpDeviceLists; pdl != NULL; pdl = pdl->pNext)
 					{
-						UpdateClassDeviceStates (pdl);
+						if (*pdl->pGuid != idBlockDevices)
+						{
+							UpdateClassDeviceStates (pdl);
+						}
 					}
 				}
 
@@ -589,7 +648,7 @@ PlatformSetSystemPowerState (LPCTSTR pszName, BOOL fForce, BOOL fInternal)
 				KernelIoControl (IOCTL_HAL_PRESUSPEND, NULL, 0, NULL, 0, NULL);
 				iCurrentPriority = CeGetThreadPriority (GetCurrentThread ());
 				DEBUGCHK (iCurrentPriority != THREAD_PRIORITY_ERROR_RETURN);
-				if (iCurrentPriority != THREAD_PRIORITY_ERROR_RETURN)
+				if (iCurrentPriority != THREAD_PRIORITY_ERROR_RETURN && !fCritical)
 				{
 					CeSetThreadPriority (GetCurrentThread (), giPreSuspendPriority);
 					Sleep (0);
@@ -624,7 +683,7 @@ PlatformSetSystemPowerState (LPCTSTR pszName, BOOL fForce, BOOL fInternal)
                 // PageOutMode before FileSys Shutdown. Otherwise, it cause dead lock
                 // between filesystem and loader.
 
-				if (gfPageOutAllModules)
+				if (gfPageOutAllModules && !fCritical)
 				{
 					ForcePageout ();
 				}
@@ -633,6 +692,10 @@ PlatformSetSystemPowerState (LPCTSTR pszName, BOOL fForce, BOOL fInternal)
 					g_pSysRegistryAccess->EnterLock ();
 				gfFileSystemsAvailable = FALSE;
 
+				// Only this thread may call drivers from here on, so stop using
+				// the device update worker threads:
+				DeviceFanoutSetInline (TRUE);
+
 				if ((dwNewStateFlags & POWER_STATE_RESET) != 0)
 				{
 					// Is this to be a cold boot?
@@ -653,6 +716,17 @@ PlatformSetSystemPowerState (LPCTSTR pszName, BOOL fForce, BOOL fInternal)
 					UpdateClassDeviceStates (pdl);
 				}
 
+				if (fCritical)
+				{
+					DeviceWatchdogSetBudget (0);
+					gdwLastCriticalSuspendMs = GetTickCount () - dwStartTicks;
+					PMLOGMSG (gdwLastCriticalSuspendMs > gdwCriticalSuspendBudget ? ZONE_WARN :
+							  (ZONE_PLATFORM || ZONE_RESUME),
+							  (_T ("%s: critical suspend took %u ms (budget %u ms), %u device IOCTLs skipped\r\n"),
+							   pszFname, gdwLastCriticalSuspendMs, gdwCriticalSuspendBudget,
+							   DeviceWatchdogGetBudgetSkips ()));
+				}
+
 				// Handle resets and shutdowns here, after flushing files.  Since Windows CE does
 				// not define a standard mechanism for handling shutdown (via POWER_STATE_OFF),
 				// OEMs will need to fill in the appropriate code here.  Similarly, if an OEM does
@@ -686,6 +760,7 @@ PlatformSetSystemPowerState (LPCTSTR pszName, BOOL fForce, BOOL fInternal)
 
 				FileSystemPowerFunction (FSNOTIFY_POWER_ON);
 				gfFileSystemsAvailable = TRUE;
+				DeviceFanoutSetInline (FALSE);
 				if (g_pSysRegistryAccess)
 					g_pSysRegistryAccess->LeaveLock ();
 
@@ -693,19 +768,23 @@ PlatformSetSystemPowerState (LPCTSTR pszName, BOOL fForce, BOOL fInternal)
 
 				PMLOGMSG (ZONE_PLATFORM || ZONE_RESUME,
 						  (_T ("%s: resuming - notifying block drivers\r\n"), pszFname));
-				for (pdl = gpDeviceLists; pdl != NULL; pdl = pdl->pNext)
+				if (!DeviceFanoutUpdateClasses (NULL, &idBlockDevices))
 				{
-					if (*pdl->pGuid != idBlockDevices)
+					for (pdl = gpDeviceLists; pdl != NULL; pdl = pdl->pNext)
 					{
-						UpdateClassDeviceStates (pdl);
+						if (*pdl->pGuid != idBlockDevices)
+						{
+							UpdateClassDeviceStates (pdl);
+						}
 					}
 				}
 
 				// Tell GWES to wake up:
-				if (gpfnGwesPowerUp != NULL && gfGwesReady)
+				if (gpfnGwesPowerUp != NULL && gfGwesReady && fGwesPoweredDown)
 				{
 					gpfnGwesPowerUp (fWantStartupScreen);
 					fWantStartupScreen = FALSE;
+					fGwesPoweredDown = FALSE;
 				}
 
 				// Send out resume notification:
@@ -717,18 +796,28 @@ PlatformSetSystemPowerState (LPCTSTR pszName, BOOL fForce, BOOL fInternal)
 			}
 			else
 			{
-				// Update all devices without any particular ordering:
+				// Update all devices in dependency order:
 				UpdateAllDeviceStates ();
 			}
 
-			// Release the old state information:
-			SystemPowerStateDestroy (pOldSystemPowerState);
-			while (pOldCeilingDx != NULL)
+			DeviceFanoutEndTransition ();
+
+			// Let applications see where the devices ended up:
+			PowerStatusPageUpdateClasses ();
+
+			// Release the old state information, which owns the old ceiling list.
+			// A suspend keeps it for the pre-resume pass:
+			if (!fSuspendSystem)
 			{
-				PDEVICE_POWER_RESTRICTION pdpr = pOldCeilingDx->pNext;
+				SystemPowerStateRelease (pOldSystemPowerState);
+			}
+			PmPoolLogStats ();
 
-				PowerRestrictionDestroy (pOldCeilingDx);
-				pOldCeilingDx = pdpr;
+			// Have the device plans for a critical suspend from the new state
+			// ready, since there won't be time to work them out then:
+			if (!fSuspendSystem && gfFileSystemsAvailable)
+			{
+				TransitionPlanPrepareCritical ();
 			}
 
 			// Are we suspending?
@@ -746,19 +835,19 @@ PlatformSetSystemPowerState (LPCTSTR pszName, BOOL fForce, BOOL fInternal)
 
 				// Clear the suspend flag:
 				gfSystemSuspended = FALSE;
+
+				// We're still the only thread that may call drivers, so start
+				// waking block devices for the state we suspended from rather than
+				// waiting for the resume transition:
+				DevicePreResumeWake (GetDeviceListFromClass (&idBlockDevices),
+									 pOldSystemPowerState, pOldCeilingDx);
+				SystemPowerStateRelease (pOldSystemPowerState);
 			}
 		}
 		else
 		{
 			// Release the unused new state information:
-			SystemPowerStateDestroy (pNewSystemPowerState);
-			while (pNewCeilingDx != NULL)
-			{
-				PDEVICE_POWER_RESTRICTION pdpr = pNewCeilingDx->pNext;
-
-				PowerRestrictionDestroy (pNewCeilingDx);
-				pNewCeilingDx = pdpr;
-			}
+			SystemPowerStateRelease (pNewSystemPowerState);
 		}
 	}
 
@@ -1008,8 +1097,9 @@ PlatformResumeSystem (void)
 		PMLOGMSG (ZONE_WARN || ZONE_RESUME, (_T ("%s: WARNING: unexpected resume!\r\n"), pszFname));
 
 		// Go into the new state.  OEMs that choose to support unexpected resumes may want to
-		// lock PM variables with PMLOCK(), then set the curDx and actualDx values for all
-		// devices to PwrDeviceUnspecified before calling PmSetSystemPowerState_I().  This will
+		// walk the device lists under PMLOCK(), then set the current and actual Dx of all
+		// devices to PwrDeviceUnspecified with DxWordUpdate() before calling
+		// PmSetSystemPowerState_I().  This will
 		// force an update IOCTL to all devices.
 
 		DEBUGCHK (ghevRestartTimers != NULL);
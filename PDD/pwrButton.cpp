@@ -18,6 +18,7 @@
 #include <ceddk.h>
 #include "pwstatemgr.h"
 #include "pwstates.h"
+#include <pmsnapshot.h>
 #pragma warning(pop)
 #include "C:\WINCE800\platform\rrm_ppc_windows\SRC\INC\bsp.h"
 
@@ -198,6 +199,9 @@ static DWORD WINAPI PwrBtnThread (LPVOID lpParam)
     UINT32 pinVal;
     WCHAR szState[MAX_PATH];
     DWORD dwStateFlags = 0;
+    DWORD dwToken;
+    PPOWER_SNAPSHOT pSnapshot;
+    BOOL fHaveState;
 
     // Remove-W4: Warning C4100 workaround
     UNREFERENCED_PARAMETER(lpParam);
@@ -209,8 +213,20 @@ static DWORD WINAPI PwrBtnThread (LPVOID lpParam)
         start = GetTickCount();
 
         // Query current system power state to determine if we are resuming
-        // from suspend
-        GetSystemPowerState(szState, MAX_PATH, &dwStateFlags);
+        // from suspend.  We run inside the PM, so read its published snapshot
+        // rather than the status page, which other processes can write to.
+        fHaveState = FALSE;
+        pSnapshot = PowerSnapshotEnter(&dwToken);
+        if (pSnapshot->psps != NULL)
+        {
+            dwStateFlags = pSnapshot->psps->dwFlags;
+            fHaveState = TRUE;
+        }
+        PowerSnapshotLeave(dwToken);
+        if (!fHaveState)
+        {
+            GetSystemPowerState(szState, MAX_PATH, &dwStateFlags);
+        }
 
         // Avoid requesting power state transition if the system is resuming from
         // suspend.  In such cases the POWER_STATE_SUSPEND flag will be set.
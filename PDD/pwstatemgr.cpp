@@ -57,6 +57,8 @@
 #include <extfile.h>
 #include <pmpolicy.h>
 #include <pmexthdl.hpp>
+#include <pmatom.h>
+#include <pmnotify.h>
 #include "pwstates.h"
 #include "pwstatemgr.h"
 
@@ -380,11 +382,17 @@ PowerStateManager::SystemStateToActivityState (LPCTSTR lpState)
 {
 	if (lpState == NULL)
 		return UnknownState;
+
+	// Every state's name is interned by PowerState::Init(), so a name
+	// that isn't an atom can't match any of them.
+	LPCTSTR pszAtom = PmAtomFind (lpState, TRUE);
+	if (pszAtom == NULL)
+		return UnknownState;
 	PowerState *curState = m_pPowerStateList;
 
 	while (curState)
 	{
-		if (_tcsicmp (curState->GetStateString (), lpState) == 0)
+		if (curState->GetStateAtom () == pszAtom)
 			return curState->GetState ();
 		else
 			curState = curState->GetNextPowerState ();
@@ -743,6 +751,9 @@ PowerStateManager::SetSystemState (PowerState * pCurPowerState)
 		PLATFORM_ACTIVITY_STATE curState = pCurPowerState->GetState ();
 		PLATFORM_ACTIVITY_STATE newState = curState;
 
+		// Subscribers that only want settled states hear about the state we
+		// end up in, not the ones we pass through on the way:
+		NotifyTransitionChainBegin ();
 		do
 		{	// Switch to new stable state.
 			newState = pCurPowerState->GetLastNewState ();
@@ -774,6 +785,7 @@ PowerStateManager::SetSystemState (PowerState * pCurPowerState)
 					newState = curState;
 			}
 		} while (newState != curState);	    // Change to stable state.
+		NotifyTransitionChainEnd ();
 
 		ASSERT (pCurPowerState != NULL);
 	}
@@ -57,6 +57,7 @@
 #include <extfile.h>
 #include <pmpolicy.h>
 #include <pmexthdl.hpp>
+#include <pmatom.h>
 #include "pwstates.h"
 #include "pwstatemgr.h"
 
@@ -99,6 +100,7 @@ PowerState::PowerState (PowerStateManager *pPwrStateMgr, PowerState * pNextPower
 {
 	memset (m_dwEventArray, 0, sizeof (m_dwEventArray));
 	m_hUnsignaledHandle = CreateEvent (NULL, FALSE, FALSE, NULL);
+	m_pszStateAtom = NULL;
 	PREFAST_ASSERT (pPwrStateMgr != NULL);
 
 	m_dwNumOfEvent = PM_BASE_TOTAL_EVENT;
@@ -112,6 +114,24 @@ PowerState::~PowerState ()
 {
 	if (m_hUnsignaledHandle != NULL)
 		CloseHandle (m_hUnsignaledHandle);
+	PmAtomRelease (m_pszStateAtom);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// PowerState GetStateAtom() 
+//
+// Returns the interned, lowercase form of GetStateString(), or NULL if it
+// can't be created.  Two states' names match if their atoms are equal.
+//
+//////////////////////////////////////////////////////////////////////////////
+
+LPCTSTR
+PowerState::GetStateAtom ()
+{
+	if (m_pszStateAtom == NULL)
+		m_pszStateAtom = PmAtomAdd (GetStateString (), TRUE);
+	return m_pszStateAtom;
 }
 
 //////////////////////////////////////////////////////////////////////////////
@@ -136,6 +156,7 @@ PowerState::Init ()
 				return FALSE;
 			}
 		m_LastNewState = GetState ();	// Point to itself
+		GetStateAtom ();	// Intern the name for SystemStateToActivityState()
 		DWORD dwReturn = StateValidateRegistry ();
 
 		if (dwReturn != ERROR_SUCCESS)
@@ -168,6 +168,7 @@ class PowerState
 	{
 		return m_pNextPowerState;
 	};
+	LPCTSTR GetStateAtom ();
 	virtual BOOL AppsCanRequestState ()
 	{
 		return FALSE;
@@ -182,6 +183,7 @@ class PowerState
 	DWORD m_dwNumOfEvent;
 	PowerState *const m_pNextPowerState;
 	HANDLE m_dwEventArray[MAX_EVENT_ARRAY];
+	LPCTSTR m_pszStateAtom;
 };
 /////////////////////////////////////////////////////////////////////////////////////////////
 //